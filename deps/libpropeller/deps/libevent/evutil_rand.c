@@ -172,8 +172,12 @@ evutil_secure_rng_get_bytes(void *buf, size_t n)
 void
 evutil_secure_rng_add_bytes(const char *buf, size_t n)
 {
+	/* glibc provides arc4random (2.36 and later) without arc4random_addrandom,
+	 * its generator is seeded by the kernel only. */
+#ifndef __GLIBC__
 	arc4random_addrandom((unsigned char*)buf,
 	    n>(size_t)INT_MAX ? INT_MAX : (int)n);
+#endif
 }
 
 void
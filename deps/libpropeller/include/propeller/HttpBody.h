@@ -0,0 +1,123 @@
+/*
+ * File:   HttpBody.h
+ *
+ * HTTP request body storage
+ */
+
+#ifndef HTTPBODY_H
+#define	HTTPBODY_H
+
+#include "common.h"
+#include "event.h"
+
+namespace propeller
+{
+    namespace http
+    {
+        /**
+         * Request body. Small bodies are kept in memory, bodies larger than spill threshold are moved to unlinked
+         * temporary file as they arrive and are mapped to memory only if contiguous access is requested. Requests with
+         * bodies larger than maximum length are rejected before the body is stored
+         */
+        class Body
+        {
+        public:
+            enum
+            {
+                DefaultSpillThreshold = 1048576,
+                DefaultMaxLength = 268435456
+            };
+
+            Body( );
+            ~Body( );
+
+            /**
+             * Prepare storage for body of known length
+             * @param length expected body length
+             * @return false if temporary file could not be created
+             */
+            bool reserve( unsigned int length );
+
+            /**
+             * Move connection input to the body
+             * @param connection connection to read from
+             * @param length maximum number of bytes to move (limited by available input)
+             * @return false if body could not be stored
+             */
+            bool receive( libevent::Connection& connection, unsigned int length );
+
+            /**
+             * Get body length
+             * @return number of bytes received
+             */
+            unsigned int length( ) const
+            {
+                return m_length;
+            }
+
+            /**
+             * Get contiguous body. Spilled body is mapped to memory on first call
+             * @return pointer to body or NULL if body is empty or could not be mapped. In memory body is zero terminated
+             */
+            const char* data( ) const;
+
+            /**
+             * Copy part of the body
+             * @param offset offset from the beginning of the body
+             * @param buffer destination buffer
+             * @param length size of destination buffer
+             * @return number of bytes copied
+             */
+            unsigned int read( unsigned int offset, char* buffer, unsigned int length ) const;
+
+            /**
+             * Check if body has been moved to temporary file
+             * @return true if body is stored in file
+             */
+            bool spilled( ) const
+            {
+                return m_fd != -1;
+            }
+
+            static void setSpillThreshold( unsigned int threshold )
+            {
+                s_spillThreshold = threshold;
+            }
+
+            static unsigned int spillThreshold( )
+            {
+                return s_spillThreshold;
+            }
+
+            /**
+             * Set maximum body length, requests with larger bodies are answered with 413
+             * @param length maximum number of bytes (less than 4 GB)
+             */
+            static void setMaxLength( unsigned int length )
+            {
+                s_maxLength = length;
+            }
+
+            static unsigned int maxLength( )
+            {
+                return s_maxLength;
+            }
+
+        private:
+            bool spill( );
+            void grow( unsigned int length );
+
+        private:
+            char* m_data;
+            unsigned int m_capacity;
+            unsigned int m_length;
+            int m_fd;
+            mutable void* m_map;
+
+            static unsigned int s_spillThreshold;
+            static unsigned int s_maxLength;
+        };
+    }
+}
+
+#endif	/* HTTPBODY_H */
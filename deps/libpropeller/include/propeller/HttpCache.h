@@ -0,0 +1,141 @@
+/*
+ * File:   HttpCache.h
+ *
+ * In-process cache of complete responses
+ */
+
+#ifndef HTTPCACHE_H
+#define	HTTPCACHE_H
+
+#include "common.h"
+#include "system.h"
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+struct evbuffer;
+
+namespace propeller
+{
+    namespace http
+    {
+        class Request;
+
+        /**
+         * Cache of serialized responses keyed by method, URI and values of request headers the response varies on.
+         * Cached bytes are shared by all connections: hit adds reference to the same block to the connection output,
+         * block is released when the last writer and the cache are done with it. Least recently used entries are evicted
+         * once the size of cached responses exceeds the budget. Cache is thread safe
+         */
+        class Cache
+        {
+        public:
+            enum
+            {
+                DefaultBudget = 64 * 1024 * 1024
+            };
+
+            Cache( size_t budget = DefaultBudget );
+            ~Cache( );
+
+            /**
+             * Set maximum size of cached responses
+             * @param budget size in bytes, 0 disables the cache
+             */
+            void setBudget( size_t budget );
+
+            /**
+             * Add cached response for the request to the buffer
+             * @param request GET or HEAD request
+             * @param buffer output buffer, receives reference to cached bytes
+             * @return true if request was served from the cache
+             */
+            bool serve( const Request& request, evbuffer* buffer );
+
+            /**
+             * Store response
+             * @param request request the response was produced for
+             * @param vary names of request headers the response depends on
+             * @param ttl time to live in milliseconds
+             * @param response serialized response (not drained)
+             */
+            void store( const Request& request, const std::vector< std::string >& vary, unsigned int ttl, evbuffer* response );
+
+            /**
+             * Remove all entries
+             */
+            void clear( );
+
+            /**
+             * Get counters
+             * @param hits number of requests served from the cache
+             * @param misses number of GET and HEAD requests passed to the handler
+             * @param entries number of cached responses
+             * @param size size of cached responses in bytes
+             */
+            void getMetrics( unsigned int& hits, unsigned int& misses, unsigned int& entries, size_t& size );
+
+        private:
+            //
+            //  shared response bytes
+            //
+            struct Block
+            {
+                unsigned int refs;
+                size_t length;
+                char data[ 1 ];
+            };
+
+            struct Entry
+            {
+                std::string resource;
+                std::string variant;
+                Block* block;
+                unsigned int expires;
+                size_t size;
+                std::list< Entry* >::iterator lru;
+            };
+
+            //
+            //  responses for method and URI, one per combination of vary header values
+            //
+            struct Resource
+            {
+                std::vector< std::string > vary;
+                std::map< std::string, Entry* > variants;
+            };
+
+            typedef std::map< std::string, Resource > Resources;
+
+            static void key( const Request& request, std::string& resource );
+            static void variant( const Request& request, const std::vector< std::string >& vary, std::string& variant );
+            static void release( Block* block );
+            static void onReleaseStatic( const void* data, size_t length, void* arg );
+
+            void remove( Entry* entry );
+
+        private:
+            sys::Lock m_lock;
+            Resources m_resources;
+
+            //
+            //  most recently used entries first
+            //
+            std::list< Entry* > m_lru;
+
+            size_t m_budget;
+            size_t m_size;
+
+            //
+            //  entry count is read without lock to skip lookups while the cache is empty
+            //
+            volatile unsigned int m_entries;
+            unsigned int m_hits;
+            unsigned int m_misses;
+        };
+    }
+}
+
+#endif	/* HTTPCACHE_H */
@@ -0,0 +1,182 @@
+/*
+ * File:   HttpClient.h
+ *
+ * Asynchronous outbound HTTP client
+ */
+
+#ifndef HTTPCLIENT_H
+#define	HTTPCLIENT_H
+
+#include "common.h"
+#include "event.h"
+
+#include <map>
+#include <string>
+
+struct evhttp_connection;
+struct evhttp_request;
+struct evdns_base;
+
+namespace propeller
+{
+    namespace http
+    {
+        /**
+         * HTTP client bound to event base. Host names are resolved asynchronously with evdns, connections are kept alive
+         * and reused for requests to the same host and port. Client is not thread safe, it must be used in the thread that
+         * runs the event base
+         */
+        class Client
+        {
+        public:
+            enum
+            {
+                DefaultTimeout = 30,
+                DefaultMaxIdleConnections = 16
+            };
+
+            typedef std::list< std::pair< std::string, std::string > > Headers;
+
+            /**
+             * Outbound request. Result is reported with onComplete() in event base thread
+             */
+            class Request
+            {
+                friend class Client;
+
+            public:
+                Request( );
+                virtual ~Request( );
+
+                void setMethod( const std::string& method )
+                {
+                    m_method = method;
+                }
+
+                /**
+                 * Set request url
+                 * @param url absolute http url
+                 */
+                void setUrl( const std::string& url )
+                {
+                    m_url = url;
+                }
+
+                void addHeader( const std::string& name, const std::string& value )
+                {
+                    m_headers.push_back( std::make_pair( name, value ) );
+                }
+
+                void setBody( const char* body, unsigned int length )
+                {
+                    m_body.assign( body, length );
+                }
+
+                /**
+                 * Set timeout of connecting, sending request and receiving response
+                 * @param timeout timeout in seconds
+                 */
+                void setTimeout( double timeout )
+                {
+                    m_timeout = timeout;
+                }
+
+                /**
+                 * Get response status
+                 * @return HTTP status or 0 if request failed
+                 */
+                int status( ) const
+                {
+                    return m_status;
+                }
+
+                const Headers& headers( ) const
+                {
+                    return m_responseHeaders;
+                }
+
+                const std::string& body( ) const
+                {
+                    return m_responseBody;
+                }
+
+                /**
+                 * Get error message
+                 * @return description of failure if status is 0
+                 */
+                const std::string& error( ) const
+                {
+                    return m_error;
+                }
+
+                /**
+                 * Called when response is received or request fails, request may delete itself
+                 */
+                virtual void onComplete( ) = 0;
+
+            private:
+                void fail( const char* error );
+
+            private:
+                std::string m_method;
+                std::string m_url;
+                Headers m_headers;
+                std::string m_body;
+                double m_timeout;
+
+                int m_status;
+                Headers m_responseHeaders;
+                std::string m_responseBody;
+                std::string m_error;
+
+                //
+                //  client and connection that process the request
+                //
+                Client* m_client;
+                evhttp_connection* m_connection;
+                std::string m_key;
+            };
+
+            Client( const libevent::Base& base );
+            ~Client( );
+
+            /**
+             * Send request, completion (or failure) is reported with request's onComplete() called later from event loop
+             * @param request request to send, owned by caller
+             */
+            void send( Request* request );
+
+            /**
+             * Set number of idle connections kept for each host
+             * @param maxIdleConnections maximum number of idle connections per host and port
+             */
+            void setMaxIdleConnections( unsigned int maxIdleConnections )
+            {
+                m_maxIdleConnections = maxIdleConnections;
+            }
+
+        private:
+            //
+            //  take idle connection to host or create new one
+            //
+            evhttp_connection* acquire( const std::string& key, const char* host, int port );
+
+            //
+            //  return connection to idle pool, connection is closed if request failed or pool is full
+            //
+            void release( const std::string& key, evhttp_connection* connection, bool reuse );
+
+            static void onResponseStatic( evhttp_request* response, void* arg );
+            static void onCompleteStatic( evutil_socket_t fd, short what, void* arg );
+            static void onFreeStatic( evutil_socket_t fd, short what, void* arg );
+
+        private:
+            const libevent::Base& m_base;
+            evdns_base* m_dns;
+            std::map< std::string, std::list< evhttp_connection* > > m_idle;
+            unsigned int m_maxIdleConnections;
+        };
+    }
+}
+
+#endif	/* HTTPCLIENT_H */
@@ -0,0 +1,138 @@
+/*
+ * File:   HttpCompression.h
+ *
+ * Response body compression
+ */
+
+#ifndef HTTPCOMPRESSION_H
+#define	HTTPCOMPRESSION_H
+
+#include "common.h"
+#include "system.h"
+
+struct evbuffer;
+
+namespace propeller
+{
+    namespace http
+    {
+        /**
+         * Compresses response bodies with content coding accepted by the client. Every thread keeps its own zlib streams
+         * which are reset, not initialized, for each response. Settings are expected to be changed at startup only,
+         * counters are shared by all threads
+         */
+        class Compression
+        {
+        public:
+            enum Encoding
+            {
+                Identity = 0,
+                Gzip = 1,
+                Deflate = 2
+            };
+
+            enum
+            {
+                DefaultLevel = 6,
+                DefaultMinLength = 1024
+            };
+
+            /**
+             * Parse Accept-Encoding header
+             * @param header header value, NULL if request has none
+             * @return mask of accepted encodings (Gzip, Deflate)
+             */
+            static unsigned int accepted( const char* header );
+
+            /**
+             * Choose encoding for response body
+             * @param accepted mask returned by accepted()
+             * @return preferred encoding or Identity if client accepts none
+             */
+            static Encoding choose( unsigned int accepted );
+
+            /**
+             * Check if content type is worth compressing: text, JSON, JavaScript, XML and SVG
+             * @param type Content-Type header value
+             * @return true if compressible
+             */
+            static bool compressible( const char* type );
+
+            /**
+             * Compress body with stream of calling thread
+             * @param encoding Gzip or Deflate
+             * @param data body
+             * @param length body length
+             * @return buffer of calling thread holding compressed body, caller must drain it. NULL if compression
+             *         failed or did not make body smaller
+             */
+            static evbuffer* compress( Encoding encoding, const char* data, unsigned int length );
+
+            /**
+             * Get content coding name
+             * @param encoding encoding
+             * @return name used in Content-Encoding header
+             */
+            static const char* name( Encoding encoding );
+
+            /**
+             * Count response sent compressed without compressing its body, e.g. precompressed file
+             * @param length original length
+             * @param compressed compressed length
+             */
+            static void account( unsigned int length, unsigned int compressed );
+
+            /**
+             * Set compression level
+             * @param level 1 (fastest) to 9 (smallest), 0 disables compression
+             */
+            static void setLevel( int level )
+            {
+                s_level = level < 0 ? 0 : level > 9 ? 9 : level;
+            }
+
+            static int level( )
+            {
+                return s_level;
+            }
+
+            /**
+             * Set minimum body length, shorter bodies are sent as is
+             * @param length length in bytes
+             */
+            static void setMinLength( unsigned int length )
+            {
+                s_minLength = length;
+            }
+
+            static unsigned int minLength( )
+            {
+                return s_minLength;
+            }
+
+            /**
+             * Get counters
+             * @param responses number of compressed responses
+             * @param input bytes before compression
+             * @param output bytes after compression
+             * @param time CPU time spent compressing, microseconds
+             */
+            static void getMetrics( unsigned int& responses, unsigned int& input, unsigned int& output, unsigned int& time );
+
+        private:
+            struct Streams;
+
+            static THREAD_LOCAL Streams* s_streams;
+
+            static int s_level;
+            static unsigned int s_minLength;
+
+            static unsigned int s_responses;
+            static unsigned int s_input;
+            static unsigned int s_output;
+            static unsigned int s_time;
+        };
+    }
+}
+
+#endif	/* HTTPCOMPRESSION_H */
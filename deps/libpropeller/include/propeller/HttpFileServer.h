@@ -0,0 +1,155 @@
+/*
+ * File:   HttpFileServer.h
+ *
+ * Static file serving in connection threads
+ */
+
+#ifndef HTTPFILESERVER_H
+#define	HTTPFILESERVER_H
+
+#include "common.h"
+#include "system.h"
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+struct evbuffer;
+struct evbuffer_file_segment;
+
+namespace propeller
+{
+    namespace http
+    {
+        class Request;
+
+        /**
+         * Serves files below mounted URL prefixes. Open files and their attributes are cached per connection thread and
+         * revalidated with stat() at most once per revalidation interval. File data is sent with sendfile on plain HTTP/1.x
+         * connections, TLS and HTTP/2 connections send a copy read into memory once per open file. Supports single byte ranges, If-Modified-Since and HEAD.
+         * File with precompressed sibling (same name with .gz appended) is sent gzip encoded to clients that accept it.
+         * Mounts can be added from any thread, files are served by connection threads
+         */
+        class FileServer
+        {
+        public:
+            enum
+            {
+                RevalidateInterval = 1000,
+                MaxOpenFiles = 256
+            };
+
+            FileServer( );
+            ~FileServer( );
+
+            /**
+             * Serve files below URL prefix. File path is root followed by request path (prefix included)
+             * @param prefix URL path prefix, matches itself and paths below it
+             * @param root directory files are looked up in
+             */
+            void addPath( const std::string& prefix, const std::string& root );
+
+            /**
+             * Remove all mounts
+             */
+            void clear( );
+
+            /**
+             * Serialize response to GET or HEAD request for existing file below one of the mounts
+             * @param request request
+             * @param buffer receives status line, headers and reference to file data, sent with sendfile if the buffer has
+             *        EVBUFFER_FLAG_DRAINS_TO_FD set (its data is only moved to the socket output)
+             * @return true if request has been served, false if it is not for a file (request is passed to handler)
+             */
+            bool serve( const Request& request, evbuffer* buffer );
+
+            /**
+             * Guess MIME type from file name extension
+             * @param path file name
+             * @return MIME type or NULL if extension is not known
+             */
+            static const char* mimeType( const char* path );
+
+        private:
+            struct Mount
+            {
+                std::string prefix;
+                std::string root;
+            };
+
+            typedef std::vector< Mount > Mounts;
+
+            //
+            //  open file, its segment is shared by all responses that send it
+            //
+            struct File
+            {
+                std::string path;
+                evbuffer_file_segment* segment;
+                off_t size;
+                time_t modified;
+                ino_t inode;
+                std::string lastModified;
+                const char* mime;
+                unsigned int checked;
+                std::list< File* >::iterator lru;
+
+                //
+                //  precompressed sibling, NULL segment if there is none
+                //
+                evbuffer_file_segment* gzip;
+                off_t gzipSize;
+                time_t gzipModified;
+                ino_t gzipInode;
+            };
+
+            //
+            //  files opened by connection thread
+            //
+            struct Files
+            {
+                Files( )
+                : version( 0 )
+                {
+                }
+
+                ~Files( );
+
+                std::map< std::string, File* > files;
+                std::list< File* > lru;
+
+                //
+                //  copy of mounts, refreshed when mounts change
+                //
+                Mounts mounts;
+                unsigned int version;
+            };
+
+            enum Range
+            {
+                WholeFile,
+                Satisfiable,
+                NotSatisfiable
+            };
+
+            File* open( Files& files, const std::string& path );
+            static evbuffer_file_segment* segment( const std::string& path, struct stat& info );
+            static bool changed( const File& file );
+            static void close( Files& files, File* file );
+            static Range range( const char* header, off_t size, off_t& start, off_t& end );
+
+        private:
+            sys::Lock m_lock;
+            Mounts m_mounts;
+            volatile unsigned int m_version;
+
+            static THREAD_LOCAL Files* s_files;
+        };
+    }
+}
+
+#endif	/* HTTPFILESERVER_H */
@@ -0,0 +1,134 @@
+/*
+ * File:   HttpHpack.h
+ *
+ * HPACK header compression for HTTP/2
+ */
+
+#ifndef HTTPHPACK_H
+#define	HTTPHPACK_H
+
+#include "common.h"
+
+#include <deque>
+
+namespace propeller
+{
+    namespace http
+    {
+        /**
+         * HPACK header compression (RFC 7541). Decoder and encoder each keep the dynamic table of one direction of one
+         * HTTP/2 connection, they are used by connection thread only
+         */
+        class Hpack
+        {
+        public:
+            enum
+            {
+                DefaultTableSize = 4096,
+
+                //
+                //  decoded header list is limited, so references to dynamic table can not inflate it without bound
+                //
+                MaxListSize = 65536
+            };
+
+            typedef std::vector< std::pair< std::string, std::string > > Headers;
+
+            /**
+             * Build Huffman decoding tables, called once before any connection is accepted
+             */
+            static void initialize( );
+
+            /**
+             * Header block decoder
+             */
+            class Decoder
+            {
+            public:
+                Decoder( );
+
+                /**
+                 * Decode complete header block
+                 * @param data header block (concatenated HEADERS and CONTINUATION fragments)
+                 * @param length header block length
+                 * @param headers decoded headers are appended here
+                 * @return false if block is malformed, dynamic table is then out of sync and connection has to be closed
+                 */
+                bool decode( const unsigned char* data, unsigned int length, Headers& headers );
+
+            private:
+                bool integer( const unsigned char*& current, const unsigned char* end, unsigned int prefix, unsigned int& value );
+                bool string( const unsigned char*& current, const unsigned char* end, std::string& value );
+                bool entry( unsigned int index, std::pair< std::string, std::string >& header ) const;
+
+            private:
+                std::deque< std::pair< std::string, std::string > > m_table;
+                unsigned int m_size;
+                unsigned int m_maxSize;
+            };
+
+            /**
+             * Header block encoder
+             */
+            class Encoder
+            {
+            public:
+                Encoder( );
+
+                /**
+                 * Limit dynamic table size to value announced by the peer, takes effect with the next header block
+                 * @param size maximum table size in bytes
+                 */
+                void setMaxSize( unsigned int size );
+
+                /**
+                 * Start header block
+                 * @param block header block
+                 */
+                void begin( std::string& block );
+
+                /**
+                 * Append header to header block. Header is indexed if it is likely to be repeated in following responses
+                 * @param name lowercase header name
+                 * @param value header value
+                 * @param block header block
+                 */
+                void encode( const char* name, const char* value, std::string& block );
+
+            private:
+                void add( const char* name, const char* value );
+
+            private:
+                std::deque< std::pair< std::string, std::string > > m_table;
+                unsigned int m_size;
+                unsigned int m_maxSize;
+                bool m_resized;
+            };
+
+        private:
+            static void integer( unsigned int value, unsigned int prefix, unsigned char flags, std::string& output );
+            static void string( const char* value, unsigned int length, std::string& output );
+            static bool huffman( const unsigned char* data, unsigned int length, std::string& output );
+            static void evict( std::deque< std::pair< std::string, std::string > >& table, unsigned int& size, unsigned int maxSize );
+
+            enum
+            {
+                StaticTableSize = 61
+            };
+
+            static const char* s_static[ StaticTableSize ][ 2 ];
+            static const unsigned int s_codes[ 257 ];
+            static const unsigned char s_lengths[ 257 ];
+
+            //
+            //  canonical Huffman decoding tables: symbols ordered by code, first code and its position for every code length
+            //
+            static unsigned short s_symbols[ 257 ];
+            static unsigned int s_first[ 32 ];
+            static unsigned int s_count[ 32 ];
+            static unsigned int s_offset[ 32 ];
+        };
+    }
+}
+
+#endif	/* HTTPHPACK_H */
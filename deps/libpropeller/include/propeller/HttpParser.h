@@ -0,0 +1,137 @@
+/*
+ * File:   HttpParser.h
+ *
+ * Incremental HTTP/1.1 request head parser
+ */
+
+#ifndef HTTPPARSER_H
+#define	HTTPPARSER_H
+
+#include "common.h"
+
+namespace propeller
+{
+    namespace http
+    {
+        /**
+         * Resumable HTTP request head parser. Works on contiguous memory, does not allocate.
+         * Request line and headers are stored as offset/length pairs relative to the beginning of the head
+         */
+        class Parser
+        {
+        public:
+            enum Status
+            {
+                Complete,
+                Incomplete,
+                Error,
+                TooLarge
+            };
+
+            enum
+            {
+                MaxHeaders = 64,
+                MaxHeadLength = 16384
+            };
+
+            /**
+             * Position of token inside request head
+             */
+            struct Token
+            {
+                unsigned short offset;
+                unsigned short length;
+            };
+
+            struct Header
+            {
+                Token name;
+                Token value;
+            };
+
+            Parser( );
+
+            /**
+             * Reset parser state
+             */
+            void reset( );
+
+            /**
+             * Look for the end of request head. Subsequent calls with the same (grown) data continue from the position where previous call stopped
+             * @param data pointer to the beginning of request head
+             * @param length number of bytes available
+             * @return Complete if end of head has been found, Incomplete if more data is needed and TooLarge if head is longer
+             *         than MaxHeadLength
+             */
+            Status scan( const char* data, unsigned int length );
+
+            /**
+             * Get length of request head including terminating empty line (valid after scan returned Complete)
+             * @return length of request head
+             */
+            unsigned int headLength( ) const
+            {
+                return m_headLength;
+            }
+
+            /**
+             * Parse request head in place. Tokens are zero terminated and header names are lowercased. Lines end with CRLF
+             * or bare LF, obsolete line folding (header line starting with space or tab) is rejected
+             * @param head writable copy of request head
+             * @param length length of request head as returned by headLength()
+             * @return Complete if head was parsed, TooLarge if it has more than MaxHeaders headers or Error if head is malformed
+             */
+            Status parse( char* head, unsigned int length );
+
+            const Token& method( ) const
+            {
+                return m_method;
+            }
+
+            const Token& uri( ) const
+            {
+                return m_uri;
+            }
+
+            const Token& protocol( ) const
+            {
+                return m_protocol;
+            }
+
+            unsigned int headerCount( ) const
+            {
+                return m_headerCount;
+            }
+
+            const Header& header( unsigned int index ) const
+            {
+                return m_headers[ index ];
+            }
+
+            /**
+             * Find header
+             * @param head head passed to parse()
+             * @param name header name (case insensitive)
+             * @return header value or NULL if header is not found
+             */
+            const char* find( const char* head, const char* name ) const;
+
+            /**
+             * Find first occurence of any of two characters
+             * @return pointer to found character or NULL
+             */
+            static const char* find( const char* begin, const char* end, char first, char second );
+
+        private:
+            unsigned int m_scanned;
+            unsigned int m_headLength;
+            Token m_method;
+            Token m_uri;
+            Token m_protocol;
+            unsigned int m_headerCount;
+            Header m_headers[ MaxHeaders ];
+        };
+    }
+}
+
+#endif	/* HTTPPARSER_H */
@@ -0,0 +1,115 @@
+/*
+ * File:   HttpRouter.h
+ *
+ * Radix tree request router
+ */
+
+#ifndef HTTPROUTER_H
+#define	HTTPROUTER_H
+
+#include "common.h"
+
+#include <string>
+#include <vector>
+
+namespace propeller
+{
+    namespace http
+    {
+        /**
+         * Request router. Routes (method and path pattern with ":name" segments) and prefix handlers (path that matches
+         * itself and everything below it) are kept in one radix tree, request path is matched in one pass.
+         * Exact routes take precedence over prefix handlers, static segments over parameters. Router is not thread safe
+         */
+        class Router
+        {
+        public:
+            /**
+             * Captured parameter, value points to matched path
+             */
+            struct Param
+            {
+                const std::string* name;
+                const char* value;
+                unsigned int length;
+            };
+
+            typedef std::vector< Param > Params;
+
+            Router( );
+            ~Router( );
+
+            /**
+             * Add route
+             * @param method HTTP method
+             * @param pattern path pattern, segment starting with ':' matches any non empty segment and is captured
+             * @param value value returned by match()
+             */
+            void addRoute( const std::string& method, const std::string& pattern, int value );
+
+            /**
+             * Add prefix handler
+             * @param path path that is matched along with all paths below it
+             * @param value value returned by match()
+             */
+            void addPrefix( const std::string& path, int value );
+
+            /**
+             * Match request
+             * @param method HTTP method
+             * @param path request path (without query)
+             * @param length path length
+             * @param params receives captured parameters of matched route
+             * @return value of matched route or prefix handler, -1 if nothing matched
+             */
+            int match( const char* method, const char* path, unsigned int length, Params& params ) const;
+
+            /**
+             * Remove all routes
+             */
+            void clear( );
+
+        private:
+            struct Endpoint
+            {
+                std::string method;
+                int value;
+                std::vector< std::string > names;
+            };
+
+            struct Node
+            {
+                Node( const std::string& _label )
+                : label( _label ), param( NULL ), prefix( -1 )
+                {
+                }
+
+                ~Node( );
+
+                //
+                //  static part of the path and static children indexed by first character of their label
+                //
+                std::string label;
+                std::string indices;
+                std::vector< Node* > children;
+
+                //
+                //  child matching parameter segment
+                //
+                Node* param;
+
+                std::vector< Endpoint > endpoints;
+                int prefix;
+            };
+
+            Node* insert( Node* node, const char* path, unsigned int length );
+
+            const Endpoint* matchRoute( const Node* node, const char* method, const char* path, unsigned int position, unsigned int length, Params& params ) const;
+
+        private:
+            Node* m_root;
+        };
+    }
+}
+
+#endif	/* HTTPROUTER_H */
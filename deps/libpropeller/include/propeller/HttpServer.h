@@ -10,6 +10,13 @@
 
 #include "Server.h"
 #include "HttpProtocol.h"
+#include "HttpParser.h"
+#include "HttpBody.h"
+#include "HttpCache.h"
+#include "HttpFileServer.h"
+#include "HttpCompression.h"
+#include "HttpSession.h"
+#include "HttpWebSocket.h"
 
 namespace propeller
 {
@@ -23,6 +30,7 @@ namespace propeller
         class Request : public propeller::Request
         {
             friend class Connection;
+            friend class Session;
             
         public:
             /**
@@ -31,7 +39,7 @@ namespace propeller
              */
             const char* method( ) const
             {
-                return m_method;
+                return m_head + m_parser.method( ).offset;
             }
 
             /**
@@ -40,7 +48,7 @@ namespace propeller
              */
             const char* uri( ) const
             {
-                return m_uri;
+                return m_head + m_parser.uri( ).offset;
             }
     
             /**
@@ -49,42 +57,134 @@ namespace propeller
              */
             const char* protocol( ) const
             {
-                return m_protocol;
+                return m_head + m_parser.protocol( ).offset;
             }
 
             /**
              * Get header value
-             * @param name header name
-             * @return header value
+             * @param name header name (case insensitive)
+             * @return header value or NULL if there is no such header
              */
-            const char* header( const char* name ) const;
-
-            typedef std::map< std::string, std::string > HeaderMap;
+            const char* header( const char* name ) const
+            {
+                return m_parser.find( m_head, name );
+            }
 
             /**
-             * Get all request headers
-             * @return HeaderMap with headers
+             * Get number of request headers
+             * @return number of headers
+             */
+            unsigned int headerCount( ) const
+            {
+                return m_parser.headerCount( );
+            }
+            
+            /**
+             * Get header name 
+             * @param index header index
+             * @return lowercased header name
+             */
+            const char* headerName( unsigned int index ) const
+            {
+                return m_head + m_parser.header( index ).name.offset;
+            }
+            
+            /**
+             * Get header value
+             * @param index header index
+             * @return header value
+             */
+            const char* headerValue( unsigned int index ) const
+            {
+                return m_head + m_parser.header( index ).value.offset;
+            }
+            
+            /**
+             * Get request body
+             * @return pointer to contiguous body (spilled body is mapped to memory) or NULL if there is no body
+             */
+            const char* body( ) const
+            {
+                return m_content.data( );
+            }
+            
+            /**
+             * Get request body length
+             * @return body length in bytes
+             */
+            unsigned int bodyLength( ) const
+            {
+                return m_content.length( );
+            }
+            
+            /**
+             * Copy part of request body without mapping it to memory
+             * @param offset offset from the beginning of the body
+             * @param buffer destination buffer
+             * @param length size of destination buffer
+             * @return number of bytes copied
              */
-            const HeaderMap& headers( ) const
+            unsigned int readBody( unsigned int offset, char* buffer, unsigned int length ) const
             {
-                return m_headers;
+                return m_content.read( offset, buffer, length );
             }
             
+            virtual ~Request( );
+            
         private:
             Request( Connection& connection );
             virtual void parse( );
+            
+            enum BodyState
+            {
+                BodyUnknown,
+                BodyLength,
+                ChunkSize,
+                ChunkData,
+                ChunkEnd,
+                ChunkTrailer,
+                BodyComplete
+            };
+            
+            BodyState bodyState( );
+            void receive( unsigned int length );
+            const char* readChunkLine( );
 
-        private:
-            char m_method[64];
-            char m_uri[128];
-            char m_protocol[64];
-            char m_header[2048];
+            /**
+             * Set complete request head (HTTP/2 request), body is received separately. Head is taken over without copying
+             * @param head request head, left empty
+             * @return false if head is malformed or announced body is too large
+             */
+            bool assign( std::string& head );
 
-            HeaderMap m_headers;
-            unsigned int m_length;
+        private:
+            enum
+            {
+                InlineHeadLength = 2048,
+                MaxChunkLineLength = 256
+            };
+            
+            //
+            //  request head, parsed in place and tokens point into it. HTTP/1.1 head is copied out of connection input since
+            //  the input is drained while the request is handled, to inline buffer unless it is too large. HTTP/2 head is
+            //  built by the session and taken over
+            //
+            char* m_head;
+            char m_inlineHead[ InlineHeadLength ];
+            std::string m_headData;
+            
+            Parser m_parser;
+            
+            Body m_content;
             unsigned int m_bodyLength;
-            bool m_parsedHeader;
-            unsigned int m_read;
+            BodyState m_bodyState;
+            
+            //
+            //  chunked body decoding state
+            //
+            unsigned int m_chunkRemaining;
+            unsigned int m_chunkLineLength;
+            char m_chunkLine[ MaxChunkLineLength + 1 ];
         };
 
         /**
@@ -121,11 +221,99 @@ namespace propeller
              */
             void addHeader( const char* name, const char* value );
             /**
-             * Set body
+             * Set body. Body of compressible Content-Type that is not shorter than Compression::minLength() is compressed
+             * with encoding accepted by the client unless handler has set Content-Encoding
              * @param body pointer to buffer 
              * @param length if length is 0 then body is assumed to be zero terminated string otherwise length of buffer passed as first parameter
              */
             void setBody( const char* body = NULL, unsigned int length = 0 );
+            
+            /**
+             * Write part of the body. First call sends status and headers with Transfer-Encoding: chunked,
+             * every call appends a chunk which is sent on flush() or when enough data is buffered.
+             * Response is completed by setBody()
+             * @param data pointer to buffer
+             * @param length length of buffer, if 0 then data is assumed to be zero terminated string
+             */
+            void write( const char* data, unsigned int length = 0 );
+            
+            /**
+             * Send chunks written so far to the connection
+             */
+            void flush( );
+            
+            /**
+             * Terminate streamed response without the last chunk and close the connection, so client can tell the body is incomplete
+             */
+            void abort( );
+            
+            /**
+             * Check if response body is sent in chunks
+             * @return true if write() has been called
+             */
+            bool chunked( ) const
+            {
+                return m_chunked;
+            }
+            
+            /**
+             * Store response in cache when it is completed by setBody(). Only complete (not streamed) 200 responses are stored
+             * @param cache response cache
+             * @param request request this response is produced for
+             * @param ttl time to live in milliseconds
+             * @param vary names of request headers the response depends on
+             */
+            void setCache( Cache& cache, const Request& request, unsigned int ttl, const std::vector< std::string >& vary )
+            {
+                m_cache = &cache;
+                m_cacheRequest = &request;
+                m_cacheTtl = ttl;
+                m_cacheVary = vary;
+            }
+            
+            /**
+             * Switch connection to WebSocket once this response is written. Response has to be completed with status
+             * 101 and handshake headers (see WebSocket::handshake()), socket events are then passed to the handler
+             * @param handler socket event handler
+             * @param endpoint name of the endpoint, e.g. request path
+             * @param data arbitrary data available to the handler as WebSocket::data()
+             * @return false if connection can not be upgraded (HTTP/2 or other requests are pending on it)
+             */
+            bool upgrade( WebSocket::Handler& handler, const std::string& endpoint, void* data );
+            
+            /**
+             * Keep connection open as Server-Sent Events stream once the handler returns. Response with status 200 is sent
+             * with Transfer-Encoding: chunked (body passed to setBody() is the first chunk) and is never completed, events
+             * published to the topics (see event()) are then written to it by connection thread.
+             * HTTP/1.1 request has to accept text/event-stream
+             * @param topics names of broadcast channels to subscribe the stream to
+             * @return false if connection can not be kept for the stream (other requests are pending on it)
+             */
+            bool eventStream( const std::vector< std::string >& topics );
+            
+            /**
+             * Build event for streams opened with eventStream(), used to write the same event to many streams.
+             * Data containing line breaks is sent in several data fields, line breaks are removed from name and id
+             * @param data event data
+             * @param length data length
+             * @param name event type, NULL for default (message)
+             * @param id event id, NULL if not set
+             * @return event framed as a chunk (caller holds a reference)
+             */
+            static libevent::SharedBuffer* event( const char* data, unsigned int length, const char* name = NULL, const char* id = NULL );
+            
+            enum
+            {
+                //
+                //  written chunks are flushed when this many bytes are buffered
+                //
+                FlushThreshold = 65536
+            };
+            
+            virtual ~Response( );
+
+        protected:
+            virtual void complete( );
 
         private:
             Response( Connection& connection, unsigned int status = HttpProtocol::Ok );
@@ -134,7 +322,41 @@ namespace propeller
         private:
             unsigned int m_status;
             bool m_init;
+            bool m_chunked;
+            
+            //
+            //  response is serialized here and written to connection at once
+            //
+            evbuffer* m_buffer;
+            
+            //
+            //  where to store the response once it is complete
+            //
+            Cache* m_cache;
+            const Request* m_cacheRequest;
+            unsigned int m_cacheTtl;
+            std::vector< std::string > m_cacheVary;
             
+            //
+            //  encodings accepted by the client, whether body may be compressed
+            //
+            unsigned int m_accepted;
+            bool m_compressible;
+            bool m_encoded;
+            
+            //
+            //  request may switch protocols, connection does not read further requests till this response is complete
+            //
+            bool m_switching;
+            WebSocket::Handler* m_upgrade;
+            std::string m_endpoint;
+            void* m_upgradeData;
+            
+            //
+            //  topics of event stream response
+            //
+            bool m_eventStream;
+            std::vector< std::string > m_topics;
         };  
 
         /**
@@ -144,14 +366,18 @@ namespace propeller
         {
             friend class Request;
             friend class Response;
+            friend class Session;
+            friend class WebSocket;
 
         public:
-            Connection( Server::ConnectionThread& thread, sys::Socket* socket )
-            : propeller::Connection( thread, socket )
+            Connection( Server::ConnectionThread& thread, sys::Socket* socket, ssl_st* ssl = NULL )
+            : propeller::Connection( thread, socket, ssl ), m_session( NULL ), m_detected( false ), m_webSocket( NULL ), m_eventStream( false )
             {
                 
             }
             
+            virtual ~Connection( );
+            
             class Exception : public propeller::Connection::Exception
             {
             public:
@@ -169,6 +395,39 @@ namespace propeller
             virtual propeller::Response* createResponse( const propeller::Connection::Exception* exception = NULL );
             virtual propeller::Request* createRequest( );
             virtual void process( propeller::Request* request, propeller::Response* response );
+            
+            /**
+             * Read requests, HTTP/2 is detected by ALPN or client preface on first read and frames are then handled by the session.
+             * Upgraded connection passes input to its WebSocket, input of event stream is discarded
+             */
+            virtual void onRead( );
+            virtual void onWrite( );
+            virtual void onClose( );
+            virtual void commit( unsigned int sequence, evbuffer* buffer, bool close = false, bool complete = true );
+            virtual void onBroadcast( libevent::SharedBuffer& message, const std::string& channel );
+            
+            /**
+             * Get counters
+             * @param eventStreams number of event streams opened
+             */
+            static void getMetrics( unsigned int& eventStreams );
+            
+        private:
+            void upgrade( WebSocket::Handler& handler, const std::string& endpoint, void* data );
+            void openEventStream( unsigned int sequence, const std::vector< std::string >& topics );
+            
+        private:
+            Session* m_session;
+            bool m_detected;
+            WebSocket* m_webSocket;
+            
+            //
+            //  HTTP/1.1 connection carries a single event stream, HTTP/2 streams (by sequence) are looked up by topic
+            //
+            bool m_eventStream;
+            std::multimap< std::string, unsigned int > m_eventStreams;
+            
+            static unsigned int s_eventStreams;
         };
         
         /**
@@ -184,16 +443,57 @@ namespace propeller
              * @param eventHandler EventHandler instance. References to propeller::http::Request and propeller::http::Response objects will be passed to propeller::Server::EventHandler::onRequest method
              */
             Server( unsigned int port, EventHandler& eventHandler )
-            : propeller::Server( port, eventHandler )
+            : propeller::Server( port, eventHandler ), m_http2( true )
             {
-                
+                HttpProtocol::initialize( );
+                Hpack::initialize( );
+            }
+            
+            /**
+             * Enable HTTP/2, negotiated with ALPN on secure port (if Tls offers h2) or started with client preface (prior knowledge)
+             * on plain port. Enabled by default
+             * @param enabled false to serve HTTP/1.x only
+             */
+            void setHttp2( bool enabled )
+            {
+                m_http2 = enabled;
+            }
+            
+            /**
+             * @return true if HTTP/2 is enabled
+             */
+            bool http2( ) const
+            {
+                return m_http2;
+            }
+            
+            /**
+             * Get response cache. GET and HEAD requests with cached responses are served by connection threads and
+             * are not passed to the event handler
+             * @return response cache
+             */
+            Cache& cache( )
+            {
+                return m_cache;
+            }
+            
+            /**
+             * Get static file server. GET and HEAD requests for existing files below its mounts are served by
+             * connection threads and are not passed to the event handler
+             * @return file server
+             */
+            FileServer& files( )
+            {
+                return m_files;
             }
             
         protected:
-                virtual propeller::Connection* newConnection( ConnectionThread& thread, sys::Socket* socket );
+                virtual propeller::Connection* newConnection( ConnectionThread& thread, sys::Socket* socket, ssl_st* ssl );
             
         private:
-
+            Cache m_cache;
+            FileServer m_files;
+            bool m_http2;
         };
 
     }
@@ -0,0 +1,245 @@
+/*
+ * File:   HttpSession.h
+ *
+ * HTTP/2 session of a connection
+ */
+
+#ifndef HTTPSESSION_H
+#define	HTTPSESSION_H
+
+#include "common.h"
+#include "event.h"
+#include "HttpHpack.h"
+
+namespace propeller
+{
+    namespace http
+    {
+        class Connection;
+        class Request;
+
+        /**
+         * HTTP/2 framing layer (RFC 7540) of a connection that negotiated h2 with ALPN or started with the client preface
+         * (h2c with prior knowledge). Every stream carries one request that is dispatched to the pool as soon as it is
+         * received, so streams of the same connection are processed by different workers at the same time. Responses are
+         * produced as for HTTP/1.1 and are translated to HEADERS and DATA frames when they are committed; DATA frames of all
+         * streams are sent round robin within flow control windows. Session is used by connection thread only
+         */
+        class Session
+        {
+        public:
+            enum
+            {
+                MaxConcurrentStreams = 128,
+                InitialWindowSize = 1048576,
+                DefaultWindowSize = 65535,
+                DefaultFrameSize = 16384,
+                PrefaceLength = 24,
+
+                //
+                //  DATA frames are not queued to connection output beyond this, rest is sent as output drains
+                //
+                OutputThreshold = 262144
+            };
+
+            Session( Connection& connection );
+            ~Session( );
+
+            /**
+             * Check if connection input starts with client connection preface
+             * @param data connection input
+             * @param length input length
+             * @return 1 if preface is complete, 0 if input is a part of preface and -1 if input is not HTTP/2
+             */
+            static int preface( const char* data, unsigned int length );
+
+            /**
+             * Process frames available in connection input
+             */
+            void onRead( );
+
+            /**
+             * Send DATA frames held because connection output was full
+             */
+            void onWrite( );
+
+            /**
+             * Translate response (or its part) serialized as HTTP/1.1 to frames of the stream it belongs to
+             * @param sequence response sequence number
+             * @param buffer serialized response (drained), may be NULL
+             * @param complete false if more parts will follow
+             * @return false if the stream has been reset or closed and nobody is waiting for the response
+             */
+            bool commit( unsigned int sequence, evbuffer* buffer, bool complete );
+
+            /**
+             * Get counters
+             * @param sessions number of HTTP/2 connections
+             * @param streams number of requests received on HTTP/2 connections
+             */
+            static void getMetrics( unsigned int& sessions, unsigned int& streams );
+
+        private:
+            enum FrameType
+            {
+                Data = 0,
+                Headers = 1,
+                Priority = 2,
+                ResetStream = 3,
+                Settings = 4,
+                PushPromise = 5,
+                Ping = 6,
+                GoAway = 7,
+                WindowUpdate = 8,
+                Continuation = 9
+            };
+
+            enum Flag
+            {
+                EndStream = 0x1,
+                Ack = 0x1,
+                EndHeaders = 0x4,
+                Padded = 0x8,
+                PriorityFlag = 0x20
+            };
+
+            enum Error
+            {
+                NoError = 0,
+                ProtocolError = 1,
+                InternalError = 2,
+                FlowControlError = 3,
+                StreamClosed = 5,
+                FrameSizeError = 6,
+                RefusedStream = 7,
+                Cancel = 8,
+                CompressionError = 9
+            };
+
+            enum Setting
+            {
+                HeaderTableSize = 1,
+                EnablePush = 2,
+                MaxConcurrentStreamsSetting = 3,
+                InitialWindowSizeSetting = 4,
+                MaxFrameSize = 5,
+                MaxHeaderListSize = 6
+            };
+
+            struct Stream
+            {
+                enum State
+                {
+                    //
+                    //  request headers and body are being received
+                    //
+                    Receiving,
+
+                    //
+                    //  request has been dispatched, response is being sent
+                    //
+                    Processing,
+
+                    //
+                    //  reset by either side, response is discarded as it arrives
+                    //
+                    Reset
+                };
+
+                enum Body
+                {
+                    Plain,
+                    ChunkSize,
+                    ChunkData,
+                    ChunkEnd,
+                    ChunkTrailer,
+                    ChunksDone
+                };
+
+                Stream( unsigned int _id, int window );
+                ~Stream( );
+
+                unsigned int id;
+                State state;
+                Request* request;
+                unsigned int sequence;
+                bool head;
+
+                int sendWindow;
+                unsigned int received;
+
+                //
+                //  serialized response not translated yet and DATA payload waiting for flow control window
+                //
+                evbuffer* input;
+                evbuffer* output;
+                bool headersSent;
+                Body body;
+                unsigned int chunkRemaining;
+                bool complete;
+                bool ended;
+            };
+
+        private:
+            bool frame( unsigned int type, unsigned int flags, unsigned int id, unsigned int length );
+            bool onData( unsigned int flags, unsigned int id, unsigned int length );
+            bool onHeaders( unsigned int flags, unsigned int id, unsigned int length );
+            bool onBlock( );
+            bool onSettings( unsigned int flags, unsigned int length );
+            void onReset( Stream* stream );
+
+            bool request( Stream* stream, const Hpack::Headers& headers );
+            void dispatch( Stream* stream );
+            bool translate( Stream* stream );
+            bool decodeChunks( Stream* stream );
+            void pump( );
+
+            void writeHeader( unsigned int type, unsigned int flags, unsigned int id, unsigned int length );
+            void writeSettings( );
+            void writeWindowUpdate( unsigned int id, unsigned int increment );
+            void reset( Stream* stream, Error error );
+            void reset( unsigned int id, Error error );
+            void goAway( Error error );
+            void remove( Stream* stream );
+            void flush( );
+
+        private:
+            Connection& m_connection;
+            bool m_preface;
+            bool m_closed;
+
+            std::map< unsigned int, Stream* > m_streams;
+            std::map< unsigned int, Stream* > m_sequences;
+            unsigned int m_lastStream;
+
+            //
+            //  header block spread over HEADERS and CONTINUATION frames
+            //
+            std::string m_block;
+            unsigned int m_blockStream;
+            unsigned int m_blockFlags;
+            Hpack::Headers m_headers;
+
+            Hpack::Decoder m_decoder;
+            Hpack::Encoder m_encoder;
+
+            //
+            //  peer settings and flow control windows
+            //
+            int m_sendWindow;
+            int m_initialWindow;
+            unsigned int m_maxFrameSize;
+            unsigned int m_received;
+
+            //
+            //  frames are collected here and written to connection at once
+            //
+            evbuffer* m_frames;
+
+            static unsigned int s_sessions;
+            static unsigned int s_streams;
+        };
+    }
+}
+
+#endif	/* HTTPSESSION_H */
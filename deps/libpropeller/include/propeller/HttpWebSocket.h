@@ -0,0 +1,238 @@
+/*
+ * File:   HttpWebSocket.h
+ *
+ * WebSocket connection upgraded from HTTP/1.1 request
+ */
+
+#ifndef HTTPWEBSOCKET_H
+#define	HTTPWEBSOCKET_H
+
+#include "common.h"
+#include "event.h"
+
+namespace propeller
+{
+    namespace http
+    {
+        class Connection;
+        class Request;
+
+        /**
+         * WebSocket (RFC 6455) that took over a connection after 101 Switching Protocols response. Frames are parsed in
+         * connection thread, complete messages are passed to the handler. Socket is reference counted: handler that passes
+         * events to other threads holds a reference till the event is processed, so socket can be used from there even if
+         * the connection has been closed meanwhile
+         */
+        class WebSocket
+        {
+        public:
+            enum
+            {
+                //
+                //  larger messages (reassembled fragments included) close the socket with 1009
+                //
+                MaxMessageSize = 1048576
+            };
+
+            enum Opcode
+            {
+                Continuation = 0,
+                Text = 1,
+                Binary = 2,
+                Close = 8,
+                Ping = 9,
+                Pong = 10
+            };
+
+            enum State
+            {
+                Open,
+
+                //
+                //  close frame has been sent, connection is closed once it is written
+                //
+                Closing,
+                Closed
+            };
+
+            /**
+             * Socket events, called in connection thread
+             */
+            class Handler
+            {
+            public:
+                virtual ~Handler( )
+                {
+                }
+
+                virtual void onOpen( WebSocket& socket ) = 0;
+
+                /**
+                 * Complete message received
+                 * @param socket socket
+                 * @param message message, handler may take its contents with swap()
+                 * @param binary true for binary message, false for text (valid UTF-8)
+                 */
+                virtual void onMessage( WebSocket& socket, std::string& message, bool binary ) = 0;
+
+                /**
+                 * Socket closed by either side or connection lost, called once
+                 * @param socket socket
+                 */
+                virtual void onClose( WebSocket& socket ) = 0;
+            };
+
+            /**
+             * Check WebSocket opening handshake
+             * @param request upgrade request
+             * @param accept value of Sec-WebSocket-Accept response header
+             * @return true if request is a valid handshake
+             */
+            static bool handshake( const Request& request, std::string& accept );
+
+            /**
+             * Build unmasked server frame, used to write the same message to many sockets
+             * @param data message
+             * @param length message length
+             * @param binary true for binary message, false for text
+             * @return frame (caller holds a reference)
+             */
+            static libevent::SharedBuffer* frame( const char* data, unsigned int length, bool binary );
+
+            const std::string& endpoint( ) const
+            {
+                return m_endpoint;
+            }
+
+            void* data( ) const
+            {
+                return m_data;
+            }
+
+            State state( ) const
+            {
+                return m_state;
+            }
+
+            /**
+             * Add reference (called in connection thread)
+             */
+            void ref( )
+            {
+                m_ref++;
+            }
+
+            /**
+             * Drop reference, can be called from any thread
+             */
+            void deref( );
+
+            /**
+             * Send message, can be called from any thread
+             * @param data message
+             * @param length message length
+             * @param binary true for binary message, false for text
+             */
+            void send( const char* data, unsigned int length, bool binary = false );
+
+            /**
+             * Receive messages broadcast to the channel (Server::broadcast()), can be called from any thread
+             * @param channel channel name
+             */
+            void subscribe( const std::string& channel );
+
+            /**
+             * Stop receiving messages broadcast to the channel, can be called from any thread
+             * @param channel channel name
+             */
+            void unsubscribe( const std::string& channel );
+
+            /**
+             * Start closing handshake, can be called from any thread
+             * @param code status code sent in close frame
+             */
+            void close( unsigned int code = 1000 );
+
+            /**
+             * Get counters
+             * @param sockets number of sockets opened
+             * @param messages number of messages received
+             */
+            static void getMetrics( unsigned int& sockets, unsigned int& messages );
+
+        private:
+            friend class Connection;
+
+            WebSocket( Connection& connection, Handler& handler, const std::string& endpoint, void* data );
+            ~WebSocket( );
+
+            //
+            //  called by connection
+            //
+            void onOpen( );
+            void onRead( );
+            void onDisconnect( );
+
+            bool parse( );
+            bool onFrame( unsigned int opcode, bool fin, const char* payload, unsigned int length );
+            void writeFrame( unsigned int opcode, const char* payload, unsigned int length, bool close = false );
+            void notify( );
+
+            //
+            //  operation requested outside connection thread
+            //
+            struct Operation : public libevent::Mailbox::Message
+            {
+                enum Type
+                {
+                    Send,
+                    Subscribe,
+                    Unsubscribe,
+                    CloseSocket,
+                    Deref
+                };
+
+                Operation( WebSocket& _socket, Type _type, unsigned int _code = 0 )
+                : socket( _socket ), type( _type ), code( _code ), binary( false )
+                {
+                }
+
+                virtual void deliver( );
+
+                WebSocket& socket;
+                Type type;
+                unsigned int code;
+
+                //
+                //  message or channel name
+                //
+                std::string data;
+                bool binary;
+            };
+
+            bool current( ) const;
+            void post( Operation* operation );
+
+        private:
+            Connection& m_connection;
+            Handler& m_handler;
+            std::string m_endpoint;
+            void* m_data;
+
+            State m_state;
+            unsigned int m_ref;
+            bool m_notified;
+
+            //
+            //  fragmented message being reassembled, opcode of its first frame
+            //
+            std::string m_message;
+            unsigned int m_opcode;
+
+            static unsigned int s_sockets;
+            static unsigned int s_messages;
+        };
+    }
+}
+
+#endif	/* HTTPWEBSOCKET_H */
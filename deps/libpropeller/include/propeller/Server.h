@@ -23,6 +23,7 @@ limitations under the License.
 namespace propeller
 {
     class Connection;
+    class Tls;
 
     /**
      * Simple message struct
@@ -43,7 +44,7 @@ namespace propeller
     /**
      * Generic request class
      */
-    class Request
+    class Request : public sys::Pooled
     {
     public:
 
@@ -69,6 +70,15 @@ namespace propeller
             return m_timestamp;
         }
         
+        /**
+         * Get connection request was received on
+         * @return connection
+         */
+        Connection& connection( ) const
+        {
+            return m_connection;
+        }
+        
     protected:
         Request( Connection& connection );
         virtual void parse( );
@@ -85,9 +95,10 @@ namespace propeller
     /**
      * Generic response class
      */
-    class Response
+    class Response : public sys::Pooled
     {
         friend class Connection;
+        friend class Server;
 
     public:
 
@@ -99,12 +110,94 @@ namespace propeller
         void write( const char* body = NULL, unsigned int length = 0 );
         
         virtual ~Response( );
+        
+        /**
+         * Sets flag to close the connection after this response is sent
+         */
+        void setClose( )
+        {
+            m_close = true;
+        }
+        
+        /**
+         * Get close flag
+         * @return true if connection is closed after this response
+         */
+        bool getClose( ) const
+        {
+            return m_close;
+        }
+        
+        /**
+         * Keep request and response after request handler returns, for handlers that complete the response later (for example
+         * after waiting for timer or other I/O). Handler has to call finish() once the response is complete
+         */
+        void detach( )
+        {
+            m_detached = true;
+        }
+        
+        /**
+         * Check if response has been detached from request handler
+         * @return true if detached
+         */
+        bool detached( ) const
+        {
+            return m_detached;
+        }
+        
+        /**
+         * Finish detached response (can be called from any thread after request handler returned). Request and response are
+         * deleted in connection thread, they must not be used after this call
+         */
+        void finish( );
+
+        /**
+         * Get position of the response on the connection
+         * @return sequence number
+         */
+        unsigned int sequence( ) const
+        {
+            return m_sequence;
+        }
 
     protected:
         Response( Connection& connection );
+        
+        /**
+         * Pass serialized response (or its part) to the connection. In connection thread it is written immediately,
+         * otherwise parts are posted to connection thread and complete response is written when the response is returned there
+         * @param buffer serialized response (drained)
+         * @param complete false if more parts will follow
+         */
+        void commit( evbuffer* buffer, bool complete = true );
+
+        //
+        //  called in connection thread after request has been processed
+        //
+        virtual void complete( );
 
     protected:
         Connection& m_connection;
+        
+        //
+        //  position of the response on the connection, responses are written in the order requests were received
+        //
+        unsigned int m_sequence;
+        bool m_close;
+        
+    private:
+        //
+        //  complete response waiting to be written in connection thread
+        //
+        evbuffer* m_deferred;
+        bool m_completed;
+        
+        //
+        //  detached response is finished by returning its processing task to connection thread
+        //
+        bool m_detached;
+        libevent::Mailbox::Message* m_task;
     };
     
         
@@ -194,6 +287,14 @@ namespace propeller
          */
         void broadcast( const Message& message );
         
+        /**
+         * Send message to connections subscribed to the channel (see Connection::subscribe()), can be called from any
+         * thread. Message is queued once per connection thread and is written there by reference, it is not copied per connection
+         * @param channel channel name
+         * @param message message to send
+         */
+        void broadcast( const std::string& channel, libevent::SharedBuffer& message );
+        
         /**
          * Connection thread
          */
@@ -208,30 +309,139 @@ namespace propeller
                 return m_server;
             }
             
+            /**
+             * Post message to connection thread
+             * @param message message delivered in connection thread
+             */
+            void post( libevent::Mailbox::Message* message )
+            {
+                m_mailbox.post( message );
+            }
+            
+            /**
+             * Check if caller runs in this connection thread
+             * @return true if called from this thread
+             */
+            bool current( ) const
+            {
+                return s_current == this;
+            }
+            
+            /**
+             * Get event base of this thread (events added from other threads are dispatched in this thread)
+             * @return event base
+             */
+            const libevent::Base& base( ) const
+            {
+                return m_base;
+            }
+            
         private:
             ConnectionThread( Server& server );
             virtual ~ConnectionThread( );
             
             void add( Connection* connection );
             void remove( Connection* connection, bool needDelete = false );
-            void broadcast( const Message& message );
+            /**
+             * Queue message for connections of this thread
+             * @param message shared message
+             * @param channel channel name, empty to send to all stored connections
+             */
+            void broadcast( libevent::SharedBuffer& message, const std::string& channel );
+            void subscribe( const std::string& channel, Connection* connection );
+            void unsubscribe( const std::string& channel, Connection* connection );
+            void listen( );
             
+            /**
+             * Pick worker for request received by this thread (work stealing queue). Each connection thread feeds its own
+             * subset of workers, so requests from the same connections are processed by the same workers
+             * @return worker index
+             */
+            unsigned int nextWorker( );
             
-
-            const libevent::Base& base( ) const
+            /**
+             * Accepted socket passed to connection thread, connection is created there
+             */
+            class Accept : public libevent::Mailbox::Message, public sys::Pooled
             {
-                return m_base;
-            }
+            public:
+                Accept( ConnectionThread& thread, sys::Socket* socket, bool secure )
+                : m_thread( thread ), m_socket( socket ), m_secure( secure )
+                {
+                }
+                
+                virtual void deliver( );
+                
+            private:
+                ConnectionThread& m_thread;
+                sys::Socket* m_socket;
+                bool m_secure;
+            };
             
+            /**
+             * Broadcast message passed to connection thread
+             */
+            class Broadcast : public libevent::Mailbox::Message
+            {
+            public:
+                Broadcast( ConnectionThread& thread, libevent::SharedBuffer& message, const std::string& channel );
+                virtual void deliver( );
+                
+            private:
+                ConnectionThread& m_thread;
+                libevent::SharedBuffer& m_message;
+                std::string m_channel;
+            };
+            
+            /**
+             * Listener owned by connection thread (used when port is shared by connection threads)
+             */
+            class Listener : public libevent::Listener
+            {
+            public:
+                Listener( ConnectionThread& thread, unsigned int port, bool secure );
+                virtual void onAccept( );
+                
+            private:
+                ConnectionThread& m_thread;
+                bool m_secure;
+            };
+
         protected:
             virtual void routine( );
 
         private:
             libevent::Base m_base;
+            
+            //
+            //  responses and messages from other threads are delivered through this mailbox
+            //
+            libevent::Mailbox m_mailbox;
             Server& m_server;
             std::map< intptr_t, Connection* > m_connections;
             sys::Lock m_lock;
-
+            
+            //
+            //  subscribers of broadcast channels, used by this thread only
+            //
+            std::map< std::string, std::set< Connection* > > m_channels;
+            Listener* m_listener;
+            Listener* m_secureListener;
+            
+            //
+            //  requests, responses, tasks and connections created by this thread are recycled here
+            //
+            sys::Allocator* m_allocator;
+            
+            unsigned int m_index;
+            unsigned int m_workerCursor;
+            
+            //
+            //  worker that processes requests in this thread if pool has no threads (inline mode)
+            //
+            sys::ThreadPool::Worker* m_worker;
+            
+            static THREAD_LOCAL ConnectionThread* s_current;
         };
 
         /**
@@ -254,7 +464,8 @@ namespace propeller
         
         /**
          * Set number of threads in the pool 
-         * @param poolThreadCount number of threads in the pool that processes requests (set to 0 to process requests synchronously, i.e in connection threads)
+         * @param poolThreadCount number of threads in the pool that processes requests (set to 0 to process requests synchronously, i.e in connection threads).
+         * In synchronous mode each connection thread has its own worker, all connection threads are started with the server
          */
         void setPoolThreadCount( unsigned int poolThreadCount )
         {
@@ -306,6 +517,86 @@ namespace propeller
             return m_connectionWriteTimeout;
         }
         
+        /**
+         * Set whether each connection thread accepts connections on its own socket bound with SO_REUSEPORT (kernel distributes connections between threads). 
+         * Falls back to single listener if SO_REUSEPORT is not supported
+         * @param reusePort flag to use per connection thread listeners (default false)
+         */
+        void setReusePort( bool reusePort )
+        {
+            m_reusePort = reusePort;
+        }
+        
+        /**
+         * Get reuse port setting
+         * @return reuse port setting
+         */
+        bool getReusePort( ) const
+        {
+            return m_reusePort;
+        }
+        
+        /**
+         * Accept TLS connections on another port. Must be called before the server is started
+         * @param port secure port
+         * @param tls TLS context with loaded certificate, must outlive the server
+         */
+        void setTls( unsigned int port, Tls& tls )
+        {
+            m_securePort = port;
+            m_tls = &tls;
+        }
+        
+        /**
+         * Get TLS context
+         * @return TLS context or NULL if there is no secure port
+         */
+        Tls* tls( ) const
+        {
+            return m_tls;
+        }
+        
+        /**
+         * Get secure port
+         * @return secure port or 0 if TLS is not enabled
+         */
+        unsigned int securePort( ) const
+        {
+            return m_tls ? m_securePort : 0;
+        }
+        
+        /**
+         * Set maximum number of connections accepted per listener wakeup (listener socket is drained until there are no pending connections or limit is reached)
+         * @param acceptBatchSize maximum number of connections to accept per wakeup (default 64)
+         */
+        void setAcceptBatchSize( unsigned int acceptBatchSize )
+        {
+            m_acceptBatchSize = acceptBatchSize ? acceptBatchSize : 1;
+        }
+        
+        /**
+         * Get maximum number of connections accepted per listener wakeup
+         * @return accept batch size
+         */
+        unsigned int getAcceptBatchSize( ) const
+        {
+            return m_acceptBatchSize;
+        }
+        
+        /**
+         * Get accept statistics collected since last call
+         * @param wakeups number of listener wakeups
+         * @param accepted number of accepted connections
+         */
+        void getAcceptMetrics( unsigned int& wakeups, unsigned int& accepted );
+        
+        /**
+         * Get object allocation statistics of connection threads (totals since server start)
+         * @param hits number of objects taken from connection thread free lists
+         * @param misses number of objects allocated from the heap
+         */
+        void getAllocatorMetrics( unsigned int& hits, unsigned int& misses );
+        
         /**
          * Sets whether to keep the references to all connections (this may affect perfomance for large n umber of connections)
          * @param storeConnections flag to store connections (default false)
@@ -340,12 +631,29 @@ namespace propeller
          */
         void process( Request* request, Response* response );
         
+        /**
+         * Work item processed by pool worker
+         */
+        struct Job : public sys::ThreadPool::Task
+        {
+            /**
+             * Called in worker thread, job deletes itself (or passes itself on) when done
+             * @param worker worker processing the job
+             */
+            virtual void run( sys::ThreadPool::Worker& worker ) = 0;
+        };
+        
     protected:
         
-        struct Task : public sys::ThreadPool::Task
+        /**
+         * Request processing task. Once processed it is returned to connection thread, where response is written and task is deleted
+         */
+        struct Task : public Job, public libevent::Mailbox::Message, public sys::Pooled
         {
             Task( Request* request, Response * response );
             virtual ~Task( );
+            virtual void deliver( );
+            virtual void run( sys::ThreadPool::Worker& worker );
             Request* request;
             Response* response;
         };
@@ -356,9 +664,40 @@ namespace propeller
         virtual void onTaskProcess( sys::ThreadPool::Task* task, sys::ThreadPool::Worker& thread );
         virtual void onThreadStart( sys::ThreadPool::Worker& thread );
      
-        virtual Connection* newConnection( ConnectionThread& thread, sys::Socket* socket ); 
+        /**
+         * Create connection for accepted socket
+         * @param thread connection thread
+         * @param socket accepted socket
+         * @param ssl TLS session if socket was accepted on secure port
+         * @return new connection
+         */
+        virtual Connection* newConnection( ConnectionThread& thread, sys::Socket* socket, ssl_st* ssl ); 
         
     private:
+        //
+        //  create connection for accepted socket and assign it to connection thread
+        //
+        void addConnection( ConnectionThread& thread, sys::Socket* socket, bool secure );
+        
+        //
+        //  accept pending connections on listening socket (up to accept batch size), if thread is NULL connections are distributed between connection threads
+        //
+        void acceptConnections( sys::Socket& listener, bool secure, ConnectionThread* thread = NULL );
+        
+        //
+        //  listener of secure port (used when connection threads do not listen themselves)
+        //
+        class SecureListener : public libevent::Listener
+        {
+        public:
+            SecureListener( Server& server );
+            virtual void onAccept( );
+            
+        private:
+            Server& m_server;
+        };
+        
+
         //
         //  libevent::Listener method implementation
         //
@@ -389,19 +728,38 @@ namespace propeller
         unsigned int m_connectionReadTimeout;
         unsigned int m_connectionWriteTimeout;
         unsigned int m_poolThreadCount;
+        unsigned int m_acceptBatchSize;
+        unsigned int m_acceptWakeups;
+        unsigned int m_accepted;
+        
+        //
+        //  number of connection threads created, used as index of the next one
+        //
+        unsigned int m_connectionThreadIndex;
         
         EventHandler& m_eventHandler;
         bool m_storeConnections;
+        bool m_reusePort;
         sys::Lock m_lock;
+        
+        Tls* m_tls;
+        unsigned int m_securePort;
+        SecureListener* m_secureListener;
+        
+        //
+        //  allocator of the listener thread (sockets and connections are created there)
+        //
+        sys::Allocator* m_allocator;
     };
     
     /**
      * Class that represent the client connection
      */
-    class Connection : public libevent::Connection
+    class Connection : public libevent::Connection, public sys::Pooled
     { 
        friend class Request;
        friend class Response;
+       friend class Server;
        
     public:
         
@@ -432,7 +790,15 @@ namespace propeller
             Type m_type;
         };
         
-        Connection( Server::ConnectionThread& thread, sys::Socket* socket );
+        enum
+        {
+            //
+            //  pipelined requests processed at once, connection stops reading till some of their responses are written
+            //
+            MaxOutstanding = 32
+        };
+        
+        Connection( Server::ConnectionThread& thread, sys::Socket* socket, ssl_st* ssl = NULL );
         virtual ~Connection( );
         virtual void onRead( );
         virtual void onClose( );
@@ -454,34 +820,132 @@ namespace propeller
         {
             return m_needClose;
         }
+        
+        /**
+         * Get connection thread that owns this connection
+         * @return connection thread
+         */
+        Server::ConnectionThread& thread( ) const
+        {
+            return m_thread;
+        }
 
         virtual Response* createResponse( const Exception* exception = NULL );
         virtual Request* createRequest( );
         virtual void process( Request* request, Response* response );
         
-    private:
-        void checkDelete( );
+        /**
+         * Write serialized response (called in connection thread). Responses are written strictly in the order requests were received,
+         * response that completes before the ones preceding it is held till they are written
+         * @param sequence response sequence number
+         * @param buffer buffer containing serialized response (drained), NULL if there is nothing to write
+         * @param close close connection after the response is sent
+         * @param complete false if buffer holds a part of streamed response and more parts will follow
+         */
+        virtual void commit( unsigned int sequence, evbuffer* buffer, bool close = false, bool complete = true );
         
+        /**
+         * Receive messages broadcast to the channel (called in connection thread). Subscriptions are dropped when connection is deleted
+         * @param channel channel name
+         */
+        void subscribe( const std::string& channel );
+        
+        /**
+         * Stop receiving messages broadcast to the channel (called in connection thread)
+         * @param channel channel name
+         */
+        void unsubscribe( const std::string& channel );
+        
+        /**
+         * Write message broadcast to a channel the connection is subscribed to (called in connection thread)
+         * @param message shared message
+         * @param channel channel the message was broadcast to
+         */
+        virtual void onBroadcast( libevent::SharedBuffer& message, const std::string& channel )
+        {
+            write( message );
+        }
+        
+    private:
         //
-        //  increase reference count
+        //  part of streamed response posted to connection thread
         //
-
-        void ref( );
+        class Commit : public libevent::Mailbox::Message
+        {
+        public:
+            Commit( Connection& connection, unsigned int sequence, evbuffer* buffer, bool close );
+            virtual ~Commit( );
+            virtual void deliver( );
+            
+        private:
+            Connection& m_connection;
+            unsigned int m_sequence;
+            evbuffer* m_buffer;
+            bool m_close;
+        };
         
+    protected:
         //
-        //  decrease reference count
+        //  reference counting is done in connection thread only, every dispatched request holds a reference
         //
-        void deref( bool threadsafe = false );
+        void ref( )
+        {
+            m_ref++;
+        }
+        
+        void deref( );
+        
+        /**
+         * Stop parsing pipelined requests (e.g. while request that may switch protocols is processed), input is kept
+         */
+        void suspend( )
+        {
+            m_suspended = true;
+        }
+        
+        /**
+         * Continue parsing requests, input received meanwhile is processed at once
+         */
+        void resume( );
+        
+        /**
+         * @return number of responses created and not completely written yet
+         */
+        unsigned int outstanding( ) const
+        {
+            return m_sequence - m_written;
+        }
         
-    protected:
         Request* m_request;
         Server::ConnectionThread& m_thread;
 
     private:
         
         bool m_needClose;
+        bool m_suspended;
+        bool m_paused;
         bool m_initialized;
         unsigned int m_ref;
+        
+        struct Pending
+        {
+            evbuffer* buffer;
+            bool close;
+            bool complete;
+        };
+        
+        //
+        //  sequence number of the next response to create and to write
+        //
+        unsigned int m_sequence;
+        unsigned int m_written;
+        bool m_closing;
+        std::map< unsigned int, Pending > m_pending;
+        
+        //
+        //  broadcast channels the connection is subscribed to
+        //
+        std::set< std::string > m_channels;
     };
 
 }
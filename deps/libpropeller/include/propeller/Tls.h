@@ -0,0 +1,111 @@
+/*
+ * File:   Tls.h
+ *
+ * TLS settings of secure listener
+ */
+
+#ifndef TLS_H
+#define	TLS_H
+
+#include "common.h"
+#include "system.h"
+
+struct ssl_st;
+struct ssl_ctx_st;
+struct evp_cipher_ctx_st;
+struct evp_mac_ctx_st;
+
+namespace propeller
+{
+    /**
+     * Server side TLS context shared by all connections accepted on secure port. Sessions are kept in context wide cache
+     * and issued as tickets, so returning clients resume them without full handshake. Ticket keys are generated at startup
+     * and rotated once per session timeout, tickets sealed with previous key are still accepted (and reissued).
+     * Where kernel and OpenSSL support it, record framing and encryption are offloaded to the kernel (kTLS). Response
+     * data is still copied from user space by SSL_write, file data is read into memory first (sendfile is used on plain
+     * connections only). Context is thread safe
+     */
+    class PROPELLER_API Tls
+    {
+    public:
+        enum
+        {
+            DefaultSessionCacheSize = 20480,
+            DefaultSessionTimeout = 3600
+        };
+
+        Tls( );
+        ~Tls( );
+
+        /**
+         * Load certificate chain and private key
+         * @param certificate path to PEM file with server certificate followed by intermediates
+         * @param key path to PEM file with private key
+         * @return false if files could not be loaded or key does not match certificate
+         */
+        bool load( const char* certificate, const char* key );
+
+        /**
+         * Set session lifetime, also the interval ticket keys are rotated at
+         * @param seconds lifetime in seconds
+         */
+        void setSessionTimeout( unsigned int seconds );
+
+        /**
+         * Set application protocols offered to clients during handshake (ALPN), in order of preference. Client that does
+         * not support any of them is still accepted, without protocol selected
+         * @param protocols comma separated list, e.g. "h2,http/1.1"
+         */
+        void setProtocols( const char* protocols );
+
+        /**
+         * Create session for accepted connection
+         * @return session, owned by the connection
+         */
+        ssl_st* accept( );
+
+        /**
+         * Get counters
+         * @param handshakes number of completed handshakes
+         * @param resumed number of handshakes that resumed session from the cache or ticket
+         * @param kernel number of connections with encryption offloaded to the kernel
+         */
+        void getMetrics( unsigned int& handshakes, unsigned int& resumed, unsigned int& kernel );
+
+    private:
+        //
+        //  ticket encryption and authentication keys
+        //
+        struct TicketKey
+        {
+            unsigned char name[ 16 ];
+            unsigned char aes[ 32 ];
+            unsigned char hmac[ 32 ];
+            unsigned int created;
+        };
+
+        bool rotate( );
+        static void onInfoStatic( const ssl_st* ssl, int where, int result );
+        static int onSelectStatic( ssl_st* ssl, const unsigned char** selected, unsigned char* selectedLength, const unsigned char* offered, unsigned int offeredLength, void* arg );
+        static int onTicketStatic( ssl_st* ssl, unsigned char* name, unsigned char* iv, evp_cipher_ctx_st* cipher, evp_mac_ctx_st* mac, int encrypt );
+
+    private:
+        ssl_ctx_st* m_context;
+        unsigned int m_sessionTimeout;
+
+        //
+        //  supported protocols in ALPN wire format (length prefixed names)
+        //
+        std::string m_protocols;
+
+        sys::Lock m_lock;
+        TicketKey m_current;
+        TicketKey m_previous;
+
+        unsigned int m_handshakes;
+        unsigned int m_resumed;
+        unsigned int m_kernel;
+    };
+}
+
+#endif	/* TLS_H */
@@ -29,7 +29,9 @@ limitations under the License.
 //
 #include <string>
 #include <list>
+#include <vector>
 #include <map>
+#include <set>
 #include <algorithm>
 
 //
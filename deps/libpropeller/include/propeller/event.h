@@ -29,6 +29,8 @@ limitations under the License.
 #include "system.h"
 #include "common.h"
 
+struct ssl_st;
+
 //
 //  libevent wrappers
 //
@@ -83,7 +85,12 @@ namespace libevent
     {
     public:
         Listener( unsigned  int port );
-        void listen( const Base& base );
+        void listen( const Base& base, bool reusePort = false );
+        
+        unsigned int port() const
+        {
+            return m_port;
+        }
         
         virtual void onAccept() = 0;
         virtual ~Listener();
@@ -126,11 +133,147 @@ namespace libevent
         std::list< event* > m_timers;
     };
 
+    /**
+     * Multiple producer, single consumer queue of messages delivered in event loop thread.
+     * Any thread can post a message, event loop is woken up through eventfd (socket pair on platforms without eventfd)
+     */
+    class Mailbox
+    {
+    public:
+        /**
+         * Message base class. Message is not copied, it is linked into the queue and passed to deliver() in event loop thread
+         */
+        class Message
+        {
+            friend class Mailbox;
+            
+        public:
+            Message( )
+            : m_next( NULL )
+            {
+            }
+            
+            virtual ~Message( )
+            {
+            }
+            
+            /**
+             * Called in event loop thread, message may delete itself
+             */
+            virtual void deliver( ) = 0;
+            
+        private:
+            Message* m_next;
+        };
+        
+        Mailbox( const Base& base );
+        ~Mailbox( );
+        
+        /**
+         * Post message, can be called from any thread
+         * @param message message to deliver
+         */
+        void post( Message* message );
+        
+    private:
+        static void onWakeStatic( evutil_socket_t fd, short what, void *arg );
+        void onWake( );
+        
+    private:
+        Message* m_head;
+        evutil_socket_t m_fd[ 2 ];
+        event* m_event;
+    };
+    
+    /**
+     * Reference counted immutable buffer written to many connections without copying (e.g. broadcast message). Every
+     * connection output holds a reference till the data is sent, the buffer is released by whichever thread drops the last one
+     */
+    class SharedBuffer
+    {
+    public:
+        /**
+         * Allocate buffer, caller holds the first reference and fills the data before buffer is shared
+         * @param length buffer length
+         */
+        SharedBuffer( unsigned int length )
+        : m_data( new char[ length ] ), m_length( length ), m_ref( 1 )
+        {
+        }
+
+        char* data( )
+        {
+            return m_data;
+        }
+
+        unsigned int length( ) const
+        {
+            return m_length;
+        }
+
+        void ref( )
+        {
+            sys::General::interlockedIncrement( &m_ref );
+        }
+
+        void deref( )
+        {
+            if ( sys::General::interlockedAdd( &m_ref, ( unsigned int ) -1 ) == 1 )
+            {
+                delete this;
+            }
+        }
+
+        /**
+         * Append data to the buffer by reference (without copying)
+         * @param buffer destination buffer, holds a reference till the data is drained or the buffer is freed
+         */
+        void append( evbuffer* buffer );
+
+        /**
+         * Cleanup callback of evbuffer_add_reference(), drops reference held by connection output
+         */
+        static void onReleaseStatic( const void* data, size_t length, void* arg );
+
+    private:
+        ~SharedBuffer( )
+        {
+            delete[] m_data;
+        }
+
+    private:
+        char* m_data;
+        unsigned int m_length;
+        unsigned int m_ref;
+    };
+
     class Connection
     {
     public:
-        Connection( sys::Socket* socket, const Base& base );
+        /**
+         * Constructor
+         * @param socket connected socket, owned by the connection
+         * @param base event base of the thread that uses the connection
+         * @param ssl TLS session (owned by the connection) if connection is secure, server handshake is performed before
+         *        any data is read
+         */
+        Connection( sys::Socket* socket, const Base& base, ssl_st* ssl = NULL );
         virtual ~Connection();
+        
+        /**
+         * @return true if connection is secure
+         */
+        bool secure( ) const
+        {
+            return m_ssl != NULL;
+        }
+
+        /**
+         * Check application protocol selected during TLS handshake (ALPN)
+         * @param protocol protocol name, e.g. h2
+         * @return true if connection is secure and the protocol was selected
+         */
+        bool negotiated( const char* protocol ) const;
 
         void enable( );
         virtual void onRead()
@@ -146,9 +289,27 @@ namespace libevent
         virtual void onError( short error );
 
         unsigned int read( char* data, unsigned int length );
+        /**
+         * Move input to file without copying it to intermediate buffer
+         * @param fd file descriptor
+         * @param length number of bytes to move
+         * @return number of bytes written or -1 on error
+         */
+        int readToFile( int fd, unsigned int length );
         
 
         void write( const char* data, unsigned int length, bool close = false );
+        /**
+         * Move contents of the buffer to connection output
+         * @param buffer buffer to write (drained)
+         * @param close close connection after buffer is sent
+         */
+        void write( evbuffer* buffer, bool close = false );
+        /**
+         * Append shared buffer to connection output by reference, close flag is left as is
+         * @param buffer buffer to write, referenced till it is sent
+         */
+        void write( SharedBuffer& buffer );
         void writeFormat( const char* format, ... );
         void send();
         void close();
@@ -160,17 +321,42 @@ namespace libevent
         
         char* readLine();
         unsigned int inputLength();
+        /**
+         * @return number of bytes queued for writing
+         */
+        unsigned int outputLength();
+        /**
+         * Make first bytes of input contiguous
+         * @param length number of bytes 
+         * @return pointer to contiguous input data
+         */
+        const char* pullInput( unsigned int length );
+        /**
+         * Remove bytes from the beginning of input
+         * @param length number of bytes
+         */
+        void drainInput( unsigned int length );
         unsigned int searchInput( const char* what, unsigned int length );
 
         void setReadTimeout( unsigned int value );
         void setWriteTimeout( unsigned int value );
-        
-        void scheduleDelete();
+
         bool enabled();
         void disable();
         
+        /**
+         * Stop reading from the socket, input received so far stays buffered
+         */
+        void pauseRead( );
+        
+        /**
+         * Read from the socket again after pauseRead()
+         */
+        void resumeRead( );
+        
         void flush();
 
+
         intptr_t id() const
         {
             return m_id;
@@ -187,15 +373,13 @@ namespace libevent
         static void onReadStatic( bufferevent* bev, void* ctx );
         static void onWriteStatic( bufferevent* bev, void* ctx );
         static void onErrorStatic( bufferevent* bev, short error, void* ctx );
-        static void onDeleteStatic( evutil_socket_t fd, short what, void *arg );
-        void onDelete();
         
                 
     private:
         bufferevent* m_handle;
         sys::Socket* m_socket;
+        ssl_st* m_ssl;
         intptr_t m_id;
-        event* m_deleteEvent;
         const Base& m_base;
     };
 
@@ -58,6 +58,7 @@ namespace sys
 #define THREAD_HANDLE HANDLE
 #define SEMAPHORE_HANDLE HANDLE
 #define PIPE_HANDLE HANDLE
+#define THREAD_LOCAL __declspec( thread )
 #define API_CALL __stdcall
 #define MAX_SEMAPHORE_COUNT 10000
 #else
@@ -70,6 +71,7 @@ namespace sys
 #endif
 
 #define PIPE_HANDLE int
+#define THREAD_LOCAL __thread
 #define API_CALL
 #define INVALID_SOCKET -1
 #define SOCKET_ERROR -1
@@ -103,6 +105,14 @@ namespace sys
          * @return old value of target
          */
         static void* interlockedExchangePointer( void** target, void* value );
+        /**
+         * Atomic compare and exchange of pointers
+         * @param target pointer to target pointer
+         * @param value pointer to store if target equals comparand
+         * @param comparand expected value of target
+         * @return old value of target
+         */
+        static void* interlockedCompareExchangePointer( void** target, void* value, void* comparand );
         /**
          * Atomic increment
          * @param target pointer to value that has be incremented
@@ -113,6 +123,40 @@ namespace sys
          * @param target pointer to value that has be decremented
          */
         static unsigned int interlockedDecrement( unsigned int* target );
+        /**
+         * Atomic add
+         * @param target pointer to value that has to be increased
+         * @param value value to add
+         * @return old value of target
+         */
+        static unsigned int interlockedAdd( unsigned int* target, unsigned int value );
+        /**
+         * Atomic exchange
+         * @param target pointer to target value
+         * @param value value to exchange with
+         * @return old value of target
+         */
+        static unsigned int interlockedExchange( unsigned int* target, unsigned int value );
+        /**
+         * Atomic compare and exchange
+         * @param target pointer to target value
+         * @param value value to store if target equals comparand
+         * @param comparand expected value of target
+         * @return old value of target
+         */
+        static unsigned int interlockedCompareExchange( unsigned int* target, unsigned int value, unsigned int comparand );
+        /**
+         * Full memory barrier
+         */
+        static void memoryBarrier( );
+        /**
+         * Hint processor that thread is spinning
+         */
+        static void pause( );
+        /**
+         * Yield processor to other threads
+         */
+        static void yield( );
         /**
          * Sleep current thread
          * @param seconds interval in seconds
@@ -217,6 +261,111 @@ namespace sys
     };
 
 
+#ifndef WIN32
+#define HAVE_EVENT_COUNT
+    /**
+     * Event count, lets threads wait for a condition checked without locks (for example lock free queue becoming non empty).
+     * Waiter calls prepareWait(), checks the condition and then either calls cancelWait() or wait(). Notifier changes the condition
+     * and calls notify(), which does not make system calls if no thread is waiting (futex based on Linux)
+     */
+    class EventCount
+    {
+    public:
+        EventCount( );
+        ~EventCount( );
+
+        /**
+         * Register waiter
+         * @return key to pass to wait()
+         */
+        unsigned int prepareWait( );
+
+        /**
+         * Unregister waiter (condition became true after prepareWait())
+         */
+        void cancelWait( );
+
+        /**
+         * Wait for notification (returns immediately if notify() was called after prepareWait())
+         * @param key key returned by prepareWait()
+         */
+        void wait( unsigned int key );
+
+        /**
+         * Wake waiting threads
+         * @param all wake all waiters if true, one waiter otherwise
+         */
+        void notify( bool all = false );
+
+        /**
+         * Check if some thread waits
+         * @return true if there are registered waiters
+         */
+        bool waiting( ) const
+        {
+            return m_waiters != 0;
+        }
+
+    private:
+        unsigned int m_epoch;
+        unsigned int m_waiters;
+#ifndef __linux__
+        pthread_mutex_t m_lock;
+        pthread_cond_t m_condition;
+#endif
+    };
+#endif
+
+    /**
+     * Bounded lock free multiple producer multiple consumer queue of pointers (array based, each cell has sequence number)
+     */
+    class RingQueue
+    {
+    public:
+        /**
+         * @param capacity queue capacity, rounded up to power of two
+         */
+        RingQueue( unsigned int capacity );
+        ~RingQueue( );
+
+        /**
+         * Add item
+         * @param item pointer to add
+         * @return false if queue is full
+         */
+        bool push( void* item );
+
+        /**
+         * Remove item
+         * @return item or NULL if queue is empty
+         */
+        void* pop( );
+
+    private:
+        struct Cell
+        {
+            volatile unsigned int sequence;
+            void* item;
+        };
+
+        enum
+        {
+            CacheLine = 64
+        };
+
+        Cell* m_cells;
+        unsigned int m_mask;
+
+        //
+        //  producer and consumer positions are kept on separate cache lines
+        //
+        char m_padding0[ CacheLine ];
+        volatile unsigned int m_enqueue;
+        char m_padding1[ CacheLine ];
+        volatile unsigned int m_dequeue;
+        char m_padding2[ CacheLine ];
+    };
+
     /**
      * Platform independent thread class
      */
@@ -282,10 +431,119 @@ namespace sys
     };
 
     
+    /**
+     * Per thread allocator for small objects created and destroyed at high rate (connections, requests, responses).
+     * Freed blocks are cached in size class free lists of the allocator that created them. Blocks released by other threads
+     * are pushed to lock free lists and picked up by the owner thread once its local list is empty
+     */
+    class Allocator
+    {
+    public:
+        enum
+        {
+            Granularity = 64,
+            MaxBlockSize = 4096,
+            SizeClasses = MaxBlockSize / Granularity,
+            HeaderSize = 16
+        };
+
+        Allocator( );
+
+        /**
+         * Make allocator current for calling thread, objects allocated by this thread are taken from its free lists
+         */
+        void attach( );
+
+        /**
+         * Free cached blocks, blocks released later are returned to the heap. Allocator deletes itself when the last block
+         * that refers to it is released (or here if there is none), it must not be used after this call
+         */
+        void retire( );
+
+        /**
+         * Get allocation counters
+         * @param hits number of allocations served from free lists
+         * @param misses number of allocations served from the heap
+         */
+        void getMetrics( unsigned int& hits, unsigned int& misses ) const
+        {
+            hits = m_hits;
+            misses = m_misses;
+        }
+
+        /**
+         * Allocate block using allocator of calling thread (or heap if thread has no allocator or block is too large)
+         * @param size block size
+         * @return pointer to allocated block
+         */
+        static void* allocate( size_t size );
+
+        /**
+         * Return block to its allocator, can be called from any thread
+         * @param block block returned by allocate()
+         */
+        static void release( void* block );
+
+    private:
+        ~Allocator( )
+        {
+        }
+
+        struct Header
+        {
+            Allocator* owner;
+            unsigned int sizeClass;
+        };
+
+        struct Node
+        {
+            Node* next;
+        };
+
+        void* get( unsigned int sizeClass );
+        void put( Node* node, unsigned int sizeClass );
+        void unref( unsigned int count );
+
+    private:
+        Node* m_free[ SizeClasses ];
+        Node* m_remote[ SizeClasses ];
+        unsigned int m_hits;
+        unsigned int m_misses;
+
+        //
+        //  blocks taken from the heap and not returned yet, plus one till the allocator is retired
+        //
+        unsigned int m_blocks;
+
+        static THREAD_LOCAL Allocator* s_current;
+
+        //
+        //  marks remote lists of retired allocator, blocks can not be pushed there anymore
+        //
+        static Node s_retired;
+    };
+
+    /**
+     * Base class for objects allocated by per thread allocator
+     */
+    class Pooled
+    {
+    public:
+        static void* operator new( size_t size )
+        {
+            return Allocator::allocate( size );
+        }
+
+        static void operator delete( void* block )
+        {
+            Allocator::release( block );
+        }
+    };
+
     /**
      * platform independent socket wrapper class
      */
-    class Socket
+    class Socket : public Pooled
     {
         friend class SocketSet;
 
@@ -309,20 +567,39 @@ namespace sys
         Status receive( char* buffer, unsigned int bufferSize, unsigned int& bytesReceived );
         Status send( const char* buffer, unsigned int length, unsigned int& bytesSent );
         Status listen( );
-        Socket* accept( );
-        Status bind( unsigned int port );
+        /**
+         * Accept connection
+         * @param nonBlocking create accepted socket in non blocking mode (uses accept4 where available)
+         * @return accepted socket or NULL if there are no pending connections or error occured
+         */
+        Socket* accept( bool nonBlocking = false );
+        Status bind( unsigned int port, bool reusePort = false );
 
         Status shutdown( );
 
         static unsigned int getLastError( );
 
         SOCKET s( );
+        
+        /**
+         * @return true if socket has been switched to non blocking mode
+         */
+        bool nonBlocking( ) const
+        {
+            return m_nonBlocking;
+        }
+        
+        void setNonBlocking( )
+        {
+            m_nonBlocking = true;
+        }
 
     private:
 
 
     private:
         SOCKET m_socket;
+        bool m_nonBlocking;
     };
 
     /**
@@ -335,9 +612,13 @@ namespace sys
     public:
         ThreadPool( );
         virtual ~ThreadPool( );
+        class Worker;
         struct Task
         {
+            friend class ThreadPool;
+            
             Task( )
+            : m_next( NULL )
             {
                 
             }
@@ -345,19 +626,106 @@ namespace sys
             virtual ~Task( )
             {
             }
+            
+        private:
+            //
+            //  link in list of tasks pinned to worker
+            //
+            Task* m_next;
         };
         
         void queue( Task* task );
 
+        /**
+         * Queue task to particular worker (work stealing queue only, other queues ignore worker index)
+         * @param task task to queue
+         * @param worker index of preferred worker, other workers take the task only if they are idle
+         */
+        void queue( Task* task, unsigned int worker );
+
+        /**
+         * Queue task that has to be processed by particular worker (for example to continue work that uses worker's state).
+         * Worker takes pinned tasks before other tasks, other workers never take them.
+         * Attached workers do not take tasks from the pool, their owners run such work themselves
+         * @param task task to queue
+         * @param worker worker to process the task
+         */
+        void queue( Task* task, Worker& worker );
+
+        enum QueueType
+        {
+            //
+            //  list protected by lock, idle workers sleep on their own semaphore
+            //
+            LockedQueue,
+            //
+            //  bounded lock free ring, workers spin briefly and then sleep on event count
+            //
+            LockFreeQueue,
+            //
+            //  lock free ring per worker, idle workers steal from others
+            //
+            WorkStealingQueue
+        };
+
+        /**
+         * Set task queue implementation (before start), locked queue is used by default
+         * @param type queue type, lock free queues are not available on Windows
+         */
+        void setQueueType( QueueType type )
+        {
+            m_queueType = type;
+        }
+
+        QueueType getQueueType( ) const
+        {
+            return m_queueType;
+        }
+
+        /**
+         * Set capacity of lock free queue (before start), for work stealing queue capacity of each worker queue.
+         * Producers wait briefly for free space when queue is full, then the task is put to locked overflow list
+         * @param capacity maximum number of queued tasks
+         */
+        void setQueueCapacity( unsigned int capacity )
+        {
+            m_queueCapacity = capacity;
+        }
         
         void start( unsigned int threads );
         void stop( );
 
+        /**
+         * Register worker that is not started by the pool, its owner calls onTaskProcess() (or processes work otherwise) in its own thread.
+         * Worker is initialized with onThreadStart() and listed in threads(), but it is not deleted by the pool.
+         * Workers must be attached before threads() are enumerated by other threads
+         * @param worker worker to register
+         */
+        void attachWorker( Worker* worker );
+
+        /**
+         * Get number of started workers
+         * @return number of workers
+         */
+        unsigned int workerCount( ) const
+        {
+            return m_workers.size( );
+        }
+
+        /**
+         * Get work stealing statistics (totals since start)
+         * @param localHits number of tasks taken by worker from its own queue
+         * @param steals number of tasks taken from queues of other workers
+         */
+        void getSchedulerMetrics( unsigned int& localHits, unsigned int& steals );
+
         /**
          * Thread pool worker thread 
          */
         class Worker : public sys::Thread
         {
+            friend class ThreadPool;
+            
         public:
             Worker( ThreadPool& pool );
             virtual ~Worker( );
@@ -378,10 +746,57 @@ namespace sys
                 return m_lock;
             }
 
+            /**
+             * Get worker index
+             * @return index of worker in the pool
+             */
+            unsigned int index( ) const
+            {
+                return m_index;
+            }
+
+            /**
+             * Check if worker has been attached to the pool (runs in thread not started by the pool)
+             * @return true if worker is attached
+             */
+            bool attached( ) const
+            {
+                return m_attached;
+            }
+
         private:
             ThreadPool& m_pool;
             void* m_data;
             sys::Lock m_lock;
+            unsigned int m_index;
+            bool m_attached;
+            
+            //
+            //  tasks pinned to this worker (pushed by any thread, taken by worker in one exchange)
+            //
+            Task* m_pinned;
+            
+            //
+            //  pinned tasks taken from the list in order they were queued, used by worker only
+            //
+            Task* m_taken;
+            
+            //
+            //  work stealing queue state, counters are updated by worker only
+            //
+            RingQueue* m_local;
+            unsigned int m_localHits;
+            unsigned int m_steals;
+
+            //
+            //  wake primitives of this worker only, so a pinned task does not wake other workers. Semaphore is used
+            //  with locked queue, m_idle is protected by pool lock
+            //
+            Semaphore m_semaphore;
+            bool m_idle;
+#ifdef HAVE_EVENT_COUNT
+            EventCount m_eventCount;
+#endif
         };
         
         virtual void onTaskProcess( Task* task, Worker& thread ) = 0;
@@ -399,7 +814,7 @@ namespace sys
 
     private:
 
-        Task* get( );
+        Task* get( Worker& worker );
 
         bool needStop( ) const
         {
@@ -409,12 +824,44 @@ namespace sys
         }
 
 
+        Task* getLockFree( Worker& worker );
+        Task* getOverflow( );
+        Task* getPinned( Worker& worker );
+        Task* getStealing( Worker& worker );
+        Task* steal( Worker& worker );
+        void push( RingQueue* ring, Task* task );
+        void wakeIdle( );
+
+        enum
+        {
+            //
+            //  number of attempts to get a task before worker goes to sleep
+            //
+            SpinCount = 200,
+            //
+            //  number of times producer yields to workers when lock free queue is full
+            //
+            PushAttempts = 16
+        };
+
     private:
         std::list< Task* > m_queue;
         WorkerList m_threads;
+        std::vector< Worker* > m_workers;
         Lock m_lock;
-        Semaphore m_semaphore;
+        std::vector< Worker* > m_idle;
         bool m_stop;
+        
+        QueueType m_queueType;
+        unsigned int m_queueCapacity;
+        unsigned int m_spinCount;
+        RingQueue* m_ring;
+        unsigned int m_nextWorker;
+
+        //
+        //  tasks that did not fit full lock free queue are kept in locked list, workers check the count without lock
+        //
+        unsigned int m_overflow;
     };
 }
 
@@ -0,0 +1,220 @@
+/*
+ * File:   HttpBody.cpp
+ *
+ * HTTP request body storage
+ */
+
+#include "HttpBody.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <string>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+//
+//	Trace function
+//
+#include "trace.h"
+
+namespace propeller
+{
+    namespace http
+    {
+        unsigned int Body::s_spillThreshold = Body::DefaultSpillThreshold;
+        unsigned int Body::s_maxLength = Body::DefaultMaxLength;
+
+        Body::Body( )
+        : m_data( NULL ), m_capacity( 0 ), m_length( 0 ), m_fd( -1 ), m_map( NULL )
+        {
+        }
+
+        Body::~Body( )
+        {
+#ifndef WIN32
+            if ( m_map )
+            {
+                munmap( m_map, m_length );
+            }
+
+            if ( m_fd != -1 )
+            {
+                ::close( m_fd );
+            }
+#endif
+            if ( m_data )
+            {
+                delete[] m_data;
+            }
+        }
+
+        bool Body::reserve( unsigned int length )
+        {
+            if ( length > s_spillThreshold )
+            {
+                return spill( );
+            }
+
+            grow( length );
+
+            return true;
+        }
+
+        void Body::grow( unsigned int length )
+        {
+            if ( length < m_capacity )
+            {
+                return;
+            }
+
+            //
+            //  reserve space for terminating zero, grow geometrically when length is not known in advance
+            //
+            unsigned int capacity = m_capacity * 2 > length + 1 ? m_capacity * 2 : length + 1;
+            char* data = new char[ capacity ];
+
+            if ( m_data )
+            {
+                memcpy( data, m_data, m_length );
+                delete[] m_data;
+            }
+
+            m_data = data;
+            m_data[ m_length ] = 0;
+            m_capacity = capacity;
+        }
+
+        bool Body::spill( )
+        {
+            if ( m_fd != -1 )
+            {
+                return true;
+            }
+#ifndef WIN32
+            const char* directory = getenv( "TMPDIR" );
+            std::string path = directory && *directory ? directory : "/tmp";
+            path.append( "/propellerXXXXXX" );
+
+            m_fd = mkstemp( &path[0] );
+
+            if ( m_fd == -1 )
+            {
+                TRACE_ERROR( "failed to create temporary file %s, errno %d", path.c_str( ), errno );
+                return false;
+            }
+
+            //
+            //  file is removed once closed
+            //
+            unlink( path.c_str( ) );
+
+            if ( m_length && ::write( m_fd, m_data, m_length ) != ( ssize_t ) m_length )
+            {
+                TRACE_ERROR( "failed to write temporary file, errno %d", errno );
+                return false;
+            }
+
+            if ( m_data )
+            {
+                delete[] m_data;
+                m_data = NULL;
+                m_capacity = 0;
+            }
+#endif
+            return true;
+        }
+
+        bool Body::receive( libevent::Connection& connection, unsigned int length )
+        {
+            unsigned int available = connection.inputLength( );
+
+            if ( length > available )
+            {
+                length = available;
+            }
+
+            if ( !length )
+            {
+                return true;
+            }
+
+            if ( m_fd == -1 && m_length + length > s_spillThreshold && !spill( ) )
+            {
+                return false;
+            }
+
+            if ( m_fd != -1 )
+            {
+                if ( connection.readToFile( m_fd, length ) != ( int ) length )
+                {
+                    TRACE_ERROR( "failed to write temporary file, errno %d", errno );
+                    return false;
+                }
+            }
+            else
+            {
+                grow( m_length + length );
+                connection.read( m_data + m_length, length );
+                m_data[ m_length + length ] = 0;
+            }
+
+            m_length += length;
+
+            return true;
+        }
+
+        const char* Body::data( ) const
+        {
+            if ( m_fd == -1 )
+            {
+                return m_data;
+            }
+#ifndef WIN32
+            if ( !m_map && m_length )
+            {
+                void* map = mmap( NULL, m_length, PROT_READ, MAP_PRIVATE, m_fd, 0 );
+
+                if ( map == MAP_FAILED )
+                {
+                    TRACE_ERROR( "failed to map temporary file, errno %d", errno );
+                    return NULL;
+                }
+
+                m_map = map;
+            }
+#endif
+            return ( const char* ) m_map;
+        }
+
+        unsigned int Body::read( unsigned int offset, char* buffer, unsigned int length ) const
+        {
+            if ( offset >= m_length )
+            {
+                return 0;
+            }
+
+            if ( length > m_length - offset )
+            {
+                length = m_length - offset;
+            }
+
+            if ( m_fd == -1 || m_map )
+            {
+                memcpy( buffer, data( ) + offset, length );
+                return length;
+            }
+#ifndef WIN32
+            ssize_t result = pread( m_fd, buffer, length, offset );
+
+            return result > 0 ? result : 0;
+#else
+            return 0;
+#endif
+        }
+    }
+}
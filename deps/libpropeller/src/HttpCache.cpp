@@ -0,0 +1,274 @@
+/*
+ * File:   HttpCache.cpp
+ *
+ * In-process cache of complete responses
+ */
+
+#include "HttpCache.h"
+#include "HttpServer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+namespace propeller
+{
+    namespace http
+    {
+        Cache::Cache( size_t budget )
+        : m_budget( budget ), m_size( 0 ), m_entries( 0 ), m_hits( 0 ), m_misses( 0 )
+        {
+        }
+
+        Cache::~Cache( )
+        {
+            clear( );
+        }
+
+        void Cache::setBudget( size_t budget )
+        {
+            sys::LockEnterLeave lock( m_lock );
+
+            m_budget = budget;
+
+            while ( m_size > m_budget )
+            {
+                remove( m_lru.back( ) );
+            }
+        }
+
+        void Cache::key( const Request& request, std::string& resource )
+        {
+            resource = request.method( );
+            resource += ' ';
+            resource += request.uri( );
+        }
+
+        void Cache::variant( const Request& request, const std::vector< std::string >& vary, std::string& variant )
+        {
+            variant.clear( );
+
+            for ( std::vector< std::string >::const_iterator i = vary.begin( ); i != vary.end( ); i++ )
+            {
+                const char* value = request.header( i->c_str( ) );
+
+                if ( value )
+                {
+                    variant += value;
+                }
+
+                variant += '\n';
+            }
+        }
+
+        bool Cache::serve( const Request& request, evbuffer* buffer )
+        {
+            const char* method = request.method( );
+
+            if ( strcmp( method, "GET" ) && strcmp( method, "HEAD" ) )
+            {
+                return false;
+            }
+
+            if ( !m_entries )
+            {
+                sys::General::interlockedIncrement( &m_misses );
+                return false;
+            }
+
+            std::string resource;
+            key( request, resource );
+
+            Block* block = NULL;
+
+            {
+                sys::LockEnterLeave lock( m_lock );
+
+                Resources::iterator found = m_resources.find( resource );
+
+                if ( found != m_resources.end( ) )
+                {
+                    std::string values;
+                    variant( request, found->second.vary, values );
+
+                    std::map< std::string, Entry* >::iterator cached = found->second.variants.find( values );
+
+                    if ( cached != found->second.variants.end( ) )
+                    {
+                        Entry* entry = cached->second;
+
+                        if ( ( int ) ( entry->expires - sys::General::getMillisecondTimestamp( ) ) > 0 )
+                        {
+                            m_lru.splice( m_lru.begin( ), m_lru, entry->lru );
+
+                            block = entry->block;
+                            sys::General::interlockedIncrement( &block->refs );
+                        }
+                        else
+                        {
+                            remove( entry );
+                        }
+                    }
+                }
+            }
+
+            if ( !block )
+            {
+                sys::General::interlockedIncrement( &m_misses );
+                return false;
+            }
+
+            sys::General::interlockedIncrement( &m_hits );
+
+            //
+            //  connection writes cached bytes without copying them, reference is dropped once they are sent
+            //
+            evbuffer_add_reference( buffer, block->data, block->length, onReleaseStatic, block );
+
+            return true;
+        }
+
+        void Cache::store( const Request& request, const std::vector< std::string >& vary, unsigned int ttl, evbuffer* response )
+        {
+            size_t length = evbuffer_get_length( response );
+
+            Entry* entry = new Entry( );
+            key( request, entry->resource );
+
+            std::vector< std::string > names;
+
+            for ( std::vector< std::string >::const_iterator i = vary.begin( ); i != vary.end( ); i++ )
+            {
+                std::string name = *i;
+
+                for ( std::string::iterator c = name.begin( ); c != name.end( ); c++ )
+                {
+                    *c = tolower( *c );
+                }
+
+                names.push_back( name );
+            }
+
+            variant( request, names, entry->variant );
+            entry->size = length + entry->resource.size( ) + entry->variant.size( ) + sizeof( Entry );
+            entry->expires = sys::General::getMillisecondTimestamp( ) + ttl;
+
+            sys::LockEnterLeave lock( m_lock );
+
+            if ( entry->size > m_budget )
+            {
+                delete entry;
+                return;
+            }
+
+            //
+            //  copy response bytes, cache holds one reference
+            //
+            entry->block = ( Block* ) malloc( sizeof( Block ) + length );
+            entry->block->refs = 1;
+            entry->block->length = length;
+            evbuffer_copyout( response, entry->block->data, length );
+
+            Resource& resource = m_resources[ entry->resource ];
+
+            if ( resource.vary != names )
+            {
+                //
+                //  response now varies on different headers, variants stored before can not be matched anymore
+                //
+                while ( !resource.variants.empty( ) )
+                {
+                    Entry* previous = resource.variants.begin( )->second;
+                    resource.variants.erase( resource.variants.begin( ) );
+                    previous->resource.clear( );
+                    remove( previous );
+                }
+
+                resource.vary = names;
+            }
+
+            std::map< std::string, Entry* >::iterator previous = resource.variants.find( entry->variant );
+
+            if ( previous != resource.variants.end( ) )
+            {
+                Entry* replaced = previous->second;
+                resource.variants.erase( previous );
+                replaced->resource.clear( );
+                remove( replaced );
+            }
+
+            resource.variants[ entry->variant ] = entry;
+
+            m_lru.push_front( entry );
+            entry->lru = m_lru.begin( );
+            m_size += entry->size;
+            m_entries++;
+
+            while ( m_size > m_budget )
+            {
+                remove( m_lru.back( ) );
+            }
+        }
+
+        void Cache::remove( Entry* entry )
+        {
+            //
+            //  entry with empty resource has been detached from its resource by the caller
+            //
+            if ( !entry->resource.empty( ) )
+            {
+                Resources::iterator found = m_resources.find( entry->resource );
+
+                found->second.variants.erase( entry->variant );
+
+                if ( found->second.variants.empty( ) )
+                {
+                    m_resources.erase( found );
+                }
+            }
+
+            m_lru.erase( entry->lru );
+            m_size -= entry->size;
+            m_entries--;
+
+            release( entry->block );
+            delete entry;
+        }
+
+        void Cache::clear( )
+        {
+            sys::LockEnterLeave lock( m_lock );
+
+            while ( !m_lru.empty( ) )
+            {
+                remove( m_lru.back( ) );
+            }
+        }
+
+        void Cache::getMetrics( unsigned int& hits, unsigned int& misses, unsigned int& entries, size_t& size )
+        {
+            sys::LockEnterLeave lock( m_lock );
+
+            hits = m_hits;
+            misses = m_misses;
+            entries = m_entries;
+            size = m_size;
+        }
+
+        void Cache::release( Block* block )
+        {
+            //
+            //  interlockedAdd returns previous value on all platforms
+            //
+            if ( sys::General::interlockedAdd( &block->refs, ( unsigned int ) -1 ) == 1 )
+            {
+                free( block );
+            }
+        }
+
+        void Cache::onReleaseStatic( const void* data, size_t length, void* arg )
+        {
+            release( ( Block* ) arg );
+        }
+    }
+}
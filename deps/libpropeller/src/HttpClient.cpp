@@ -0,0 +1,283 @@
+/*
+ * File:   HttpClient.cpp
+ *
+ * Asynchronous outbound HTTP client
+ */
+
+#include "HttpClient.h"
+
+#include <event2/http.h>
+#include <event2/dns.h>
+#include <event2/keyvalq_struct.h>
+#include <string.h>
+#include <stdio.h>
+
+//
+//	Trace function
+//
+#include "trace.h"
+
+namespace propeller
+{
+    namespace http
+    {
+        static const struct
+        {
+            const char* name;
+            evhttp_cmd_type type;
+        } methods[] =
+        {
+            { "GET", EVHTTP_REQ_GET },
+            { "POST", EVHTTP_REQ_POST },
+            { "HEAD", EVHTTP_REQ_HEAD },
+            { "PUT", EVHTTP_REQ_PUT },
+            { "DELETE", EVHTTP_REQ_DELETE },
+            { "OPTIONS", EVHTTP_REQ_OPTIONS },
+            { "PATCH", EVHTTP_REQ_PATCH }
+        };
+
+        Client::Request::Request( )
+        : m_method( "GET" ), m_timeout( DefaultTimeout ), m_status( 0 ), m_client( NULL ), m_connection( NULL )
+        {
+        }
+
+        Client::Request::~Request( )
+        {
+        }
+
+        void Client::Request::fail( const char* error )
+        {
+            m_status = 0;
+            m_error = error;
+        }
+
+        Client::Client( const libevent::Base& base )
+        : m_base( base ), m_maxIdleConnections( DefaultMaxIdleConnections )
+        {
+            //
+            //  name servers and hosts file are read from system configuration
+            //
+            m_dns = evdns_base_new( m_base, 1 );
+
+            if ( !m_dns )
+            {
+                TRACE_ERROR( "%s", "failed to read resolver configuration, using default name server" );
+                m_dns = evdns_base_new( m_base, 0 );
+                evdns_base_nameserver_ip_add( m_dns, "127.0.0.1" );
+            }
+        }
+
+        Client::~Client( )
+        {
+            for ( std::map< std::string, std::list< evhttp_connection* > >::iterator i = m_idle.begin( ); i != m_idle.end( ); i++ )
+            {
+                for ( std::list< evhttp_connection* >::iterator connection = i->second.begin( ); connection != i->second.end( ); connection++ )
+                {
+                    evhttp_connection_free( *connection );
+                }
+            }
+
+            evdns_base_free( m_dns, 0 );
+        }
+
+        void Client::send( Request* request )
+        {
+            TRACE_ENTERLEAVE( );
+
+            request->m_client = this;
+
+            timeval now = { 0, 0 };
+
+            evhttp_uri* uri = evhttp_uri_parse( request->m_url.c_str( ) );
+
+            if ( !uri || !evhttp_uri_get_host( uri ) || !evhttp_uri_get_scheme( uri ) || strcmp( evhttp_uri_get_scheme( uri ), "http" ) )
+            {
+                if ( uri )
+                {
+                    evhttp_uri_free( uri );
+                }
+
+                //
+                //  completion is always reported from event loop
+                //
+                request->fail( "invalid url (only http urls are supported)" );
+                event_base_once( m_base, -1, EV_TIMEOUT, onCompleteStatic, request, &now );
+                return;
+            }
+
+            evhttp_cmd_type type = EVHTTP_REQ_GET;
+            bool found = false;
+
+            for ( unsigned int i = 0; i < sizeof( methods ) / sizeof( methods[0] ); i++ )
+            {
+                if ( request->m_method == methods[i].name )
+                {
+                    type = methods[i].type;
+                    found = true;
+                    break;
+                }
+            }
+
+            if ( !found )
+            {
+                evhttp_uri_free( uri );
+                request->fail( "unsupported method" );
+                event_base_once( m_base, -1, EV_TIMEOUT, onCompleteStatic, request, &now );
+                return;
+            }
+
+            const char* host = evhttp_uri_get_host( uri );
+            int port = evhttp_uri_get_port( uri );
+
+            if ( port == -1 )
+            {
+                port = 80;
+            }
+
+            char hostHeader[ 512 ];
+            snprintf( hostHeader, sizeof( hostHeader ), port == 80 ? "%s" : "%s:%d", host, port );
+
+            std::string path = evhttp_uri_get_path( uri ) && *evhttp_uri_get_path( uri ) ? evhttp_uri_get_path( uri ) : "/";
+
+            if ( evhttp_uri_get_query( uri ) )
+            {
+                path.append( "?" );
+                path.append( evhttp_uri_get_query( uri ) );
+            }
+
+            //
+            //  connections are pooled by host and port
+            //
+            char key[ 512 ];
+            snprintf( key, sizeof( key ), "%s:%d", host, port );
+            request->m_key = key;
+            request->m_connection = acquire( request->m_key, host, port );
+
+            evhttp_uri_free( uri );
+
+            timeval timeout;
+            timeout.tv_sec = ( long ) request->m_timeout;
+            timeout.tv_usec = ( long ) ( ( request->m_timeout - timeout.tv_sec ) * 1000000 );
+            evhttp_connection_set_timeout_tv( request->m_connection, &timeout );
+
+            evhttp_request* outbound = evhttp_request_new( onResponseStatic, request );
+
+            evkeyvalq* headers = evhttp_request_get_output_headers( outbound );
+            bool hasHost = false;
+
+            for ( Headers::const_iterator i = request->m_headers.begin( ); i != request->m_headers.end( ); i++ )
+            {
+                if ( !evutil_ascii_strcasecmp( i->first.c_str( ), "Host" ) )
+                {
+                    hasHost = true;
+                }
+
+                evhttp_add_header( headers, i->first.c_str( ), i->second.c_str( ) );
+            }
+
+            if ( !hasHost )
+            {
+                evhttp_add_header( headers, "Host", hostHeader );
+            }
+
+            if ( request->m_body.size( ) )
+            {
+                evbuffer_add( evhttp_request_get_output_buffer( outbound ), request->m_body.data( ), request->m_body.size( ) );
+            }
+
+            if ( evhttp_make_request( request->m_connection, outbound, type, path.c_str( ) ) == -1 )
+            {
+                //
+                //  request is freed by libevent on failure
+                //
+                release( request->m_key, request->m_connection, false );
+                request->m_connection = NULL;
+                request->fail( "failed to send request" );
+                event_base_once( m_base, -1, EV_TIMEOUT, onCompleteStatic, request, &now );
+            }
+        }
+
+        evhttp_connection* Client::acquire( const std::string& key, const char* host, int port )
+        {
+            std::map< std::string, std::list< evhttp_connection* > >::iterator i = m_idle.find( key );
+
+            if ( i != m_idle.end( ) && !i->second.empty( ) )
+            {
+                //
+                //  most recently used connection is least likely to be closed by server
+                //
+                evhttp_connection* connection = i->second.back( );
+                i->second.pop_back( );
+                return connection;
+            }
+
+            return evhttp_connection_base_new( m_base, m_dns, host, port );
+        }
+
+        void Client::release( const std::string& key, evhttp_connection* connection, bool reuse )
+        {
+            std::list< evhttp_connection* >& idle = m_idle[ key ];
+
+            if ( reuse && idle.size( ) < m_maxIdleConnections )
+            {
+                idle.push_back( connection );
+                return;
+            }
+
+            //
+            //  connection can not be freed from its own callback
+            //
+            timeval now = { 0, 0 };
+            event_base_once( m_base, -1, EV_TIMEOUT, onFreeStatic, connection, &now );
+        }
+
+        void Client::onResponseStatic( evhttp_request* response, void* arg )
+        {
+            Request* request = ( Request* ) arg;
+
+            if ( !response || !evhttp_request_get_response_code( response ) )
+            {
+                //
+                //  connection, timeout or protocol error
+                //
+                request->fail( "request failed or timed out" );
+                request->m_client->release( request->m_key, request->m_connection, false );
+            }
+            else
+            {
+                request->m_status = evhttp_request_get_response_code( response );
+
+                evkeyvalq* headers = evhttp_request_get_input_headers( response );
+
+                for ( evkeyval* header = headers->tqh_first; header; header = header->next.tqe_next )
+                {
+                    request->m_responseHeaders.push_back( std::make_pair( header->key, header->value ) );
+                }
+
+                evbuffer* body = evhttp_request_get_input_buffer( response );
+                size_t length = evbuffer_get_length( body );
+
+                if ( length )
+                {
+                    request->m_responseBody.resize( length );
+                    evbuffer_copyout( body, &request->m_responseBody[ 0 ], length );
+                }
+
+                request->m_client->release( request->m_key, request->m_connection, true );
+            }
+
+            request->m_connection = NULL;
+            request->onComplete( );
+        }
+
+        void Client::onCompleteStatic( evutil_socket_t fd, short what, void* arg )
+        {
+            ( ( Request* ) arg )->onComplete( );
+        }
+
+        void Client::onFreeStatic( evutil_socket_t fd, short what, void* arg )
+        {
+            evhttp_connection_free( ( evhttp_connection* ) arg );
+        }
+    }
+}
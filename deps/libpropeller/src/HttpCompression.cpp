@@ -0,0 +1,330 @@
+/*
+ * File:   HttpCompression.cpp
+ *
+ * Response body compression
+ */
+
+#include "HttpCompression.h"
+#include "event.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <zlib.h>
+
+#ifndef WIN32
+#include <strings.h>
+#endif
+
+//
+//	Trace function
+//
+#include "trace.h"
+
+namespace propeller
+{
+    namespace http
+    {
+        //
+        //  zlib streams of one thread, initialized on first use and reset after every body
+        //
+        struct Compression::Streams
+        {
+            Streams( )
+            : gzipLevel( -1 ), deflateLevel( -1 )
+            {
+                output = evbuffer_new( );
+            }
+
+            z_stream gzip;
+            z_stream deflate;
+            int gzipLevel;
+            int deflateLevel;
+
+            //
+            //  compressed body, its chains are moved to the response buffer
+            //
+            evbuffer* output;
+        };
+
+        THREAD_LOCAL Compression::Streams* Compression::s_streams = NULL;
+
+        int Compression::s_level = Compression::DefaultLevel;
+        unsigned int Compression::s_minLength = Compression::DefaultMinLength;
+
+        unsigned int Compression::s_responses = 0;
+        unsigned int Compression::s_input = 0;
+        unsigned int Compression::s_output = 0;
+        unsigned int Compression::s_time = 0;
+
+        //
+        //  CPU time of calling thread in microseconds
+        //
+        static unsigned int cpuTime( )
+        {
+#ifdef WIN32
+            FILETIME creation, exit, kernel, user;
+            GetThreadTimes( GetCurrentThread( ), &creation, &exit, &kernel, &user );
+
+            ULARGE_INTEGER time;
+            time.LowPart = user.dwLowDateTime;
+            time.HighPart = user.dwHighDateTime;
+
+            return ( unsigned int ) ( time.QuadPart / 10 );
+#else
+            timespec time;
+            clock_gettime( CLOCK_THREAD_CPUTIME_ID, &time );
+
+            return ( unsigned int ) ( time.tv_sec * 1000000ULL + time.tv_nsec / 1000 );
+#endif
+        }
+
+        unsigned int Compression::accepted( const char* header )
+        {
+            if ( !header )
+            {
+                return 0;
+            }
+
+            unsigned int accepted = 0;
+            unsigned int refused = 0;
+            unsigned int any = 0;
+
+            const char* current = header;
+
+            while ( *current )
+            {
+                while ( *current == ' ' || *current == '\t' || *current == ',' )
+                {
+                    current++;
+                }
+
+                const char* coding = current;
+
+                while ( *current && *current != ',' && *current != ';' && *current != ' ' && *current != '\t' )
+                {
+                    current++;
+                }
+
+                size_t length = current - coding;
+                double quality = 1;
+
+                //
+                //  parameters, only q is of interest
+                //
+                while ( *current && *current != ',' )
+                {
+                    if ( *current == ';' )
+                    {
+                        current++;
+
+                        while ( *current == ' ' || *current == '\t' )
+                        {
+                            current++;
+                        }
+
+                        if ( ( *current == 'q' || *current == 'Q' ) && current[ 1 ] == '=' )
+                        {
+                            char* end = NULL;
+                            double value = strtod( current + 2, &end );
+
+                            if ( end != current + 2 )
+                            {
+                                quality = value;
+                                current = end;
+                            }
+                        }
+
+                        continue;
+                    }
+
+                    current++;
+                }
+
+                unsigned int mask = 0;
+
+                if ( ( length == 4 && !strncasecmp( coding, "gzip", 4 ) ) || ( length == 6 && !strncasecmp( coding, "x-gzip", 6 ) ) )
+                {
+                    mask = Gzip;
+                }
+                else if ( length == 7 && !strncasecmp( coding, "deflate", 7 ) )
+                {
+                    mask = Deflate;
+                }
+                else if ( length == 1 && *coding == '*' )
+                {
+                    any = quality > 0 ? Gzip | Deflate : 0;
+                    continue;
+                }
+
+                if ( quality > 0 )
+                {
+                    accepted |= mask;
+                }
+                else
+                {
+                    refused |= mask;
+                }
+            }
+
+            //
+            //  "*" stands for codings not listed explicitly
+            //
+            return accepted | ( any & ~refused );
+        }
+
+        Compression::Encoding Compression::choose( unsigned int accepted )
+        {
+            if ( accepted & Gzip )
+            {
+                return Gzip;
+            }
+
+            if ( accepted & Deflate )
+            {
+                return Deflate;
+            }
+
+            return Identity;
+        }
+
+        bool Compression::compressible( const char* type )
+        {
+            if ( !strncasecmp( type, "text/", 5 ) )
+            {
+                return true;
+            }
+
+            static const char* types[] =
+            {
+                "application/json",
+                "application/javascript",
+                "application/x-javascript",
+                "application/xml",
+                "application/xhtml+xml",
+                "application/rss+xml",
+                "application/atom+xml",
+                "image/svg+xml"
+            };
+
+            for ( unsigned int i = 0; i < sizeof( types ) / sizeof( types[0] ); i++ )
+            {
+                size_t length = strlen( types[ i ] );
+
+                //
+                //  type may be followed by parameters
+                //
+                if ( !strncasecmp( type, types[ i ], length ) && ( !type[ length ] || type[ length ] == ';' || type[ length ] == ' ' ) )
+                {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        evbuffer* Compression::compress( Encoding encoding, const char* data, unsigned int length )
+        {
+            if ( !s_streams )
+            {
+                s_streams = new Streams( );
+            }
+
+            z_stream& stream = encoding == Gzip ? s_streams->gzip : s_streams->deflate;
+            int& level = encoding == Gzip ? s_streams->gzipLevel : s_streams->deflateLevel;
+
+            if ( level != s_level )
+            {
+                if ( level != -1 )
+                {
+                    deflateEnd( &stream );
+                }
+
+                memset( &stream, 0, sizeof( stream ) );
+
+                //
+                //  window bits above 15 make zlib write gzip header and trailer
+                //
+                if ( deflateInit2( &stream, s_level, Z_DEFLATED, encoding == Gzip ? 31 : 15, 8, Z_DEFAULT_STRATEGY ) != Z_OK )
+                {
+                    level = -1;
+                    return NULL;
+                }
+
+                level = s_level;
+            }
+            else
+            {
+                deflateReset( &stream );
+            }
+
+            uLong bound = deflateBound( &stream, length );
+
+            evbuffer_iovec space;
+
+            if ( evbuffer_reserve_space( s_streams->output, bound, &space, 1 ) != 1 )
+            {
+                return NULL;
+            }
+
+            stream.next_in = ( Bytef* ) data;
+            stream.avail_in = length;
+            stream.next_out = ( Bytef* ) space.iov_base;
+            stream.avail_out = space.iov_len;
+
+            unsigned int start = cpuTime( );
+            int result = deflate( &stream, Z_FINISH );
+            unsigned int time = cpuTime( ) - start;
+
+            sys::General::interlockedAdd( &s_time, time );
+
+            if ( result != Z_STREAM_END || stream.total_out >= length )
+            {
+                TRACE( "compression result %d, %u -> %lu", result, length, stream.total_out );
+
+                space.iov_len = 0;
+                evbuffer_commit_space( s_streams->output, &space, 1 );
+
+                return NULL;
+            }
+
+            space.iov_len = stream.total_out;
+            evbuffer_commit_space( s_streams->output, &space, 1 );
+
+            account( length, stream.total_out );
+
+            return s_streams->output;
+        }
+
+        const char* Compression::name( Encoding encoding )
+        {
+            switch ( encoding )
+            {
+                case Gzip:
+                    return "gzip";
+
+                case Deflate:
+                    return "deflate";
+
+                default:
+                    return "identity";
+            }
+        }
+
+        void Compression::account( unsigned int length, unsigned int compressed )
+        {
+            sys::General::interlockedIncrement( &s_responses );
+            sys::General::interlockedAdd( &s_input, length );
+            sys::General::interlockedAdd( &s_output, compressed );
+        }
+
+        void Compression::getMetrics( unsigned int& responses, unsigned int& input, unsigned int& output, unsigned int& time )
+        {
+            responses = s_responses;
+            input = s_input;
+            output = s_output;
+            time = s_time;
+        }
+    }
+}
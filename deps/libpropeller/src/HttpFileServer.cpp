@@ -0,0 +1,735 @@
+/*
+ * File:   HttpFileServer.cpp
+ *
+ * Static file serving in connection threads
+ */
+
+#include "HttpFileServer.h"
+#include "HttpServer.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <strings.h>
+#endif
+
+//
+//	Trace function
+//
+#include "trace.h"
+
+namespace propeller
+{
+    namespace http
+    {
+        THREAD_LOCAL FileServer::Files* FileServer::s_files = NULL;
+
+        //
+        //  extension to MIME type, sorted by extension
+        //
+        static const struct
+        {
+            const char* extension;
+            const char* type;
+        } s_mimeTypes[] =
+        {
+            { "a", "application/octet-stream" },
+            { "ai", "application/postscript" },
+            { "aif", "audio/x-aiff" },
+            { "aifc", "audio/x-aiff" },
+            { "aiff", "audio/x-aiff" },
+            { "asc", "application/pgp-signature" },
+            { "asm", "text/x-asm" },
+            { "atom", "application/atom+xml" },
+            { "au", "audio/basic" },
+            { "avi", "video/x-msvideo" },
+            { "bat", "text/plain" },
+            { "bcpio", "application/x-bcpio" },
+            { "bin", "application/octet-stream" },
+            { "bmp", "image/x-ms-bmp" },
+            { "bz2", "application/x-bzip2" },
+            { "c", "text/x-c" },
+            { "cab", "application/vnd.ms-cab-compressed" },
+            { "cc", "text/x-c" },
+            { "cdf", "application/x-netcdf" },
+            { "chm", "application/vnd.ms-htmlhelp" },
+            { "class", "application/octet-stream" },
+            { "conf", "text/plain" },
+            { "cpio", "application/x-cpio" },
+            { "cpp", "text/x-c" },
+            { "csh", "application/x-csh" },
+            { "css", "text/css" },
+            { "csv", "text/csv" },
+            { "deb", "application/x-deb" },
+            { "diff", "text/x-diff" },
+            { "djv", "image/vnd.djvu" },
+            { "djvu", "image/vnd.djvu" },
+            { "dll", "application/octet-stream" },
+            { "dmg", "application/x-apple-diskimage" },
+            { "doc", "application/msword" },
+            { "docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document" },
+            { "dot", "application/msword" },
+            { "dvi", "application/x-dvi" },
+            { "eml", "message/rfc822" },
+            { "eps", "application/postscript" },
+            { "etx", "text/x-setext" },
+            { "exe", "application/octet-stream" },
+            { "flac", "audio/x-flac" },
+            { "flv", "video/x-flv" },
+            { "gemspec", "text/x-ruby" },
+            { "gif", "image/gif" },
+            { "gtar", "application/x-gtar" },
+            { "gz", "application/x-gzip" },
+            { "h", "text/x-c" },
+            { "hdf", "application/x-hdf" },
+            { "hh", "text/x-c" },
+            { "hqx", "application/mac-binhex40" },
+            { "htm", "text/html" },
+            { "html", "text/html" },
+            { "ico", "image/vnd.microsoft.icon" },
+            { "ics", "text/calendar" },
+            { "ief", "image/ief" },
+            { "iso", "application/octet-stream" },
+            { "jar", "application/java-archive" },
+            { "java", "text/x-java" },
+            { "jpe", "image/jpeg" },
+            { "jpeg", "image/jpeg" },
+            { "jpg", "image/jpeg" },
+            { "js", "application/javascript" },
+            { "json", "application/json" },
+            { "ksh", "text/plain" },
+            { "latex", "application/x-latex" },
+            { "lua", "text/x-lua" },
+            { "m1v", "video/mpeg" },
+            { "m3u", "audio/x-mpegurl" },
+            { "man", "application/x-troff-man" },
+            { "manifest", "text/cache-manifest" },
+            { "map", "application/json" },
+            { "md", "text/x-markdown" },
+            { "me", "application/x-troff-me" },
+            { "mht", "message/rfc822" },
+            { "mhtml", "message/rfc822" },
+            { "mid", "audio/midi" },
+            { "midi", "audio/midi" },
+            { "mif", "application/x-mif" },
+            { "mjs", "application/javascript" },
+            { "mng", "video/x-mng" },
+            { "mov", "video/quicktime" },
+            { "movie", "video/x-sgi-movie" },
+            { "mp2", "audio/mpeg" },
+            { "mp3", "audio/mpeg" },
+            { "mp4", "video/mp4" },
+            { "mpa", "video/mpeg" },
+            { "mpe", "video/mpeg" },
+            { "mpeg", "video/mpeg" },
+            { "mpg", "video/mpeg" },
+            { "ms", "application/x-troff-ms" },
+            { "nc", "application/x-netcdf" },
+            { "nws", "message/rfc822" },
+            { "o", "application/octet-stream" },
+            { "obj", "application/octet-stream" },
+            { "oda", "application/oda" },
+            { "odg", "application/vnd.oasis.opendocument.graphics" },
+            { "odp", "application/vnd.oasis.opendocument.presentation" },
+            { "ods", "application/vnd.oasis.opendocument.spreadsheet" },
+            { "odt", "application/vnd.oasis.opendocument.text" },
+            { "oga", "audio/ogg" },
+            { "ogg", "audio/ogg" },
+            { "ogv", "video/ogg" },
+            { "p", "text/x-pascal" },
+            { "p12", "application/x-pkcs12" },
+            { "p7c", "application/pkcs7-mime" },
+            { "pas", "text/x-pascal" },
+            { "pbm", "image/x-portable-bitmap" },
+            { "pdf", "application/pdf" },
+            { "pfx", "application/x-pkcs12" },
+            { "pgm", "image/x-portable-graymap" },
+            { "pgp", "application/pgp-encrypted" },
+            { "pl", "text/x-perl" },
+            { "pm", "text/x-perl" },
+            { "png", "image/png" },
+            { "pnm", "image/x-portable-anymap" },
+            { "pot", "application/vnd.ms-powerpoint" },
+            { "ppa", "application/vnd.ms-powerpoint" },
+            { "ppm", "image/x-portable-pixmap" },
+            { "pps", "application/vnd.ms-powerpoint" },
+            { "ppt", "application/vnd.ms-powerpoint" },
+            { "pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation" },
+            { "ps", "application/postscript" },
+            { "psd", "image/vnd.adobe.photoshop" },
+            { "pwz", "application/vnd.ms-powerpoint" },
+            { "py", "text/x-python" },
+            { "pyc", "application/x-python-code" },
+            { "pyo", "application/x-python-code" },
+            { "qt", "video/quicktime" },
+            { "ra", "audio/x-pn-realaudio" },
+            { "ram", "application/x-pn-realaudio" },
+            { "rar", "application/x-rar-compressed" },
+            { "ras", "image/x-cmu-raster" },
+            { "rb", "text/x-ruby" },
+            { "rdf", "application/rdf+xml" },
+            { "rgb", "image/x-rgb" },
+            { "rockspec", "text/x-lua" },
+            { "roff", "application/x-troff" },
+            { "rpm", "application/x-redhat-package-manager" },
+            { "rss", "application/rss+xml" },
+            { "rtf", "application/rtf" },
+            { "rtx", "text/richtext" },
+            { "ru", "text/x-ruby" },
+            { "s", "text/x-asm" },
+            { "sgm", "text/x-sgml" },
+            { "sgml", "text/x-sgml" },
+            { "sh", "application/x-sh" },
+            { "shar", "application/x-shar" },
+            { "sig", "application/pgp-signature" },
+            { "sit", "application/x-stuffit" },
+            { "smil", "application/smil+xml" },
+            { "snd", "audio/basic" },
+            { "so", "application/octet-stream" },
+            { "src", "application/x-wais-source" },
+            { "sv4cpio", "application/x-sv4cpio" },
+            { "sv4crc", "application/x-sv4crc" },
+            { "svg", "image/svg+xml" },
+            { "svgz", "image/svg+xml" },
+            { "swf", "application/x-shockwave-flash" },
+            { "t", "application/x-troff" },
+            { "tar", "application/x-tar" },
+            { "tcl", "application/x-tcl" },
+            { "tex", "application/x-tex" },
+            { "texi", "application/x-texinfo" },
+            { "texinfo", "application/x-texinfo" },
+            { "text", "text/plain" },
+            { "tif", "image/tiff" },
+            { "tiff", "image/tiff" },
+            { "torrent", "application/x-bittorrent" },
+            { "tr", "application/x-troff" },
+            { "tsv", "text/tab-separated-values" },
+            { "txt", "text/plain" },
+            { "ustar", "application/x-ustar" },
+            { "vcf", "text/x-vcard" },
+            { "vcs", "text/x-vcalendar" },
+            { "vrml", "model/vrml" },
+            { "wasm", "application/wasm" },
+            { "wav", "audio/x-wav" },
+            { "webm", "video/webm" },
+            { "webp", "image/webp" },
+            { "wiz", "application/msword" },
+            { "woff", "font/woff" },
+            { "woff2", "font/woff2" },
+            { "wsdl", "application/wsdl+xml" },
+            { "xbm", "image/x-xbitmap" },
+            { "xht", "application/xhtml+xml" },
+            { "xhtml", "application/xhtml+xml" },
+            { "xlb", "application/vnd.ms-excel" },
+            { "xls", "application/vnd.ms-excel" },
+            { "xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet" },
+            { "xml", "text/xml" },
+            { "xpdl", "application/xml" },
+            { "xpm", "image/x-xpixmap" },
+            { "xsl", "application/xml" },
+            { "xul", "application/vnd.mozilla.xul+xml" },
+            { "xwd", "image/x-xwindowdump" },
+            { "yaml", "text/yaml" },
+            { "yml", "text/yml" },
+            { "zip", "application/zip" },
+        };
+
+        static void formatDate( time_t time, std::string& date )
+        {
+            struct tm parts;
+            char buffer[ 64 ];
+
+#ifdef WIN32
+            gmtime_s( &parts, &time );
+#else
+            gmtime_r( &time, &parts );
+#endif
+            strftime( buffer, sizeof( buffer ), "%a, %d %b %Y %H:%M:%S GMT", &parts );
+            date = buffer;
+        }
+
+        static bool parseDate( const char* date, time_t& time )
+        {
+#ifdef WIN32
+            return false;
+#else
+            struct tm parts;
+            memset( &parts, 0, sizeof( parts ) );
+
+            if ( !strptime( date, "%a, %d %b %Y %H:%M:%S GMT", &parts ) )
+            {
+                return false;
+            }
+
+            time = timegm( &parts );
+            return true;
+#endif
+        }
+
+        FileServer::FileServer( )
+        : m_version( 0 )
+        {
+        }
+
+        FileServer::~FileServer( )
+        {
+        }
+
+        FileServer::Files::~Files( )
+        {
+            while ( !lru.empty( ) )
+            {
+                close( *this, lru.back( ) );
+            }
+        }
+
+        void FileServer::addPath( const std::string& prefix, const std::string& root )
+        {
+            sys::LockEnterLeave lock( m_lock );
+
+            for ( Mounts::iterator i = m_mounts.begin( ); i != m_mounts.end( ); i++ )
+            {
+                if ( i->prefix == prefix )
+                {
+                    if ( i->root != root )
+                    {
+                        i->root = root;
+                        m_version++;
+                    }
+
+                    return;
+                }
+            }
+
+            Mount mount;
+            mount.prefix = prefix;
+            mount.root = root;
+
+            m_mounts.push_back( mount );
+            m_version++;
+        }
+
+        void FileServer::clear( )
+        {
+            sys::LockEnterLeave lock( m_lock );
+
+            if ( !m_mounts.empty( ) )
+            {
+                m_mounts.clear( );
+                m_version++;
+            }
+        }
+
+        const char* FileServer::mimeType( const char* path )
+        {
+            const char* slash = strrchr( path, '/' );
+            const char* dot = strrchr( slash ? slash : path, '.' );
+
+            if ( !dot || !dot[1] )
+            {
+                return NULL;
+            }
+
+            int low = 0;
+            int high = sizeof( s_mimeTypes ) / sizeof( s_mimeTypes[0] ) - 1;
+
+            while ( low <= high )
+            {
+                int middle = ( low + high ) / 2;
+                int compare = strcasecmp( dot + 1, s_mimeTypes[ middle ].extension );
+
+                if ( !compare )
+                {
+                    return s_mimeTypes[ middle ].type;
+                }
+
+                if ( compare < 0 )
+                {
+                    high = middle - 1;
+                }
+                else
+                {
+                    low = middle + 1;
+                }
+            }
+
+            return NULL;
+        }
+
+        evbuffer_file_segment* FileServer::segment( const std::string& path, struct stat& info )
+        {
+#ifdef WIN32
+            return NULL;
+#else
+            int fd = ::open( path.c_str( ), O_RDONLY );
+
+            if ( fd == -1 )
+            {
+                return NULL;
+            }
+
+            if ( fstat( fd, &info ) != 0 || !S_ISREG( info.st_mode ) )
+            {
+                ::close( fd );
+                return NULL;
+            }
+
+            //
+            //  segment owns the descriptor, it is closed when the file is evicted and the last response using it is sent.
+            //  Buffers that drain to a socket send it with sendfile, other buffers (TLS, HTTP/2) get a copy read once
+            //  into memory instead of a mapping, so file truncated while it is being sent can not fault the process
+            //
+            evbuffer_file_segment* segment = evbuffer_file_segment_new( fd, 0, info.st_size, EVBUF_FS_CLOSE_ON_FREE | EVBUF_FS_DISABLE_LOCKING | EVBUF_FS_DISABLE_MMAP );
+
+            if ( !segment )
+            {
+                ::close( fd );
+            }
+
+            return segment;
+#endif
+        }
+
+        FileServer::File* FileServer::open( Files& files, const std::string& path )
+        {
+            struct stat info;
+            evbuffer_file_segment* data = segment( path, info );
+
+            if ( !data )
+            {
+                return NULL;
+            }
+
+            if ( files.files.size( ) >= MaxOpenFiles )
+            {
+                close( files, files.lru.back( ) );
+            }
+
+            File* file = new File( );
+            file->path = path;
+            file->segment = data;
+            file->size = info.st_size;
+            file->modified = info.st_mtime;
+            file->inode = info.st_ino;
+            file->mime = mimeType( path.c_str( ) );
+            file->checked = sys::General::getMillisecondTimestamp( );
+            formatDate( info.st_mtime, file->lastModified );
+
+            file->gzip = segment( path + ".gz", info );
+
+            if ( file->gzip )
+            {
+                file->gzipSize = info.st_size;
+                file->gzipModified = info.st_mtime;
+                file->gzipInode = info.st_ino;
+            }
+
+            files.lru.push_front( file );
+            file->lru = files.lru.begin( );
+            files.files[ path ] = file;
+
+            return file;
+        }
+
+        bool FileServer::changed( const File& file )
+        {
+            struct stat info;
+
+            if ( stat( file.path.c_str( ), &info ) != 0 || info.st_mtime != file.modified || info.st_size != file.size || info.st_ino != file.inode )
+            {
+                return true;
+            }
+
+            //
+            //  precompressed sibling that has appeared, disappeared or changed
+            //
+            if ( stat( ( file.path + ".gz" ).c_str( ), &info ) != 0 )
+            {
+                return file.gzip != NULL;
+            }
+
+            return !file.gzip || info.st_mtime != file.gzipModified || info.st_size != file.gzipSize || info.st_ino != file.gzipInode;
+        }
+
+        void FileServer::close( Files& files, File* file )
+        {
+            files.files.erase( file->path );
+            files.lru.erase( file->lru );
+
+            evbuffer_file_segment_free( file->segment );
+
+            if ( file->gzip )
+            {
+                evbuffer_file_segment_free( file->gzip );
+            }
+
+            delete file;
+        }
+
+        FileServer::Range FileServer::range( const char* header, off_t size, off_t& start, off_t& end )
+        {
+            //
+            //  single range "bytes=first-last", "bytes=first-" or "bytes=-suffix", other forms are ignored
+            //
+            if ( strncasecmp( header, "bytes=", 6 ) || strchr( header, ',' ) )
+            {
+                return WholeFile;
+            }
+
+            const char* value = header + 6;
+            char* next = NULL;
+
+            if ( *value == '-' )
+            {
+                long long suffix = strtoll( value + 1, &next, 10 );
+
+                if ( next == value + 1 || *next || suffix < 0 )
+                {
+                    return WholeFile;
+                }
+
+                if ( !suffix || !size )
+                {
+                    return NotSatisfiable;
+                }
+
+                start = suffix < size ? size - suffix : 0;
+                end = size - 1;
+
+                return Satisfiable;
+            }
+
+            long long first = strtoll( value, &next, 10 );
+
+            if ( next == value || *next != '-' || first < 0 )
+            {
+                return WholeFile;
+            }
+
+            value = next + 1;
+            long long last = size - 1;
+
+            if ( *value )
+            {
+                last = strtoll( value, &next, 10 );
+
+                if ( *next || last < first )
+                {
+                    return WholeFile;
+                }
+            }
+
+            if ( first >= size )
+            {
+                return NotSatisfiable;
+            }
+
+            start = first;
+            end = last < size ? last : size - 1;
+
+            return Satisfiable;
+        }
+
+        bool FileServer::serve( const Request& request, evbuffer* buffer )
+        {
+            if ( !m_version )
+            {
+                return false;
+            }
+
+            const char* method = request.method( );
+            bool head = !strcmp( method, "HEAD" );
+
+            if ( !head && strcmp( method, "GET" ) )
+            {
+                return false;
+            }
+
+            if ( !s_files )
+            {
+                s_files = new Files( );
+            }
+
+            Files& files = *s_files;
+
+            if ( files.version != m_version )
+            {
+                sys::LockEnterLeave lock( m_lock );
+
+                files.mounts = m_mounts;
+                files.version = m_version;
+            }
+
+            //
+            //  longest mount prefix that ends at segment boundary
+            //
+            const char* uri = request.uri( );
+            size_t length = strcspn( uri, "?#" );
+            const Mount* mount = NULL;
+
+            for ( Mounts::const_iterator i = files.mounts.begin( ); i != files.mounts.end( ); i++ )
+            {
+                size_t prefix = i->prefix.size( );
+
+                if ( prefix <= length && !memcmp( uri, i->prefix.data( ), prefix ) &&
+                     ( prefix == length || uri[ prefix ] == '/' || i->prefix[ prefix - 1 ] == '/' ) &&
+                     ( !mount || prefix > mount->prefix.size( ) ) )
+                {
+                    mount = &( *i );
+                }
+            }
+
+            if ( !mount )
+            {
+                return false;
+            }
+
+            std::string path = mount->root;
+            path.append( uri, length );
+
+            if ( path.find( "/../" ) != std::string::npos || ( path.size( ) >= 3 && !path.compare( path.size( ) - 3, 3, "/.." ) ) )
+            {
+                return false;
+            }
+
+            unsigned int now = sys::General::getMillisecondTimestamp( );
+            File* file = NULL;
+
+            std::map< std::string, File* >::iterator found = files.files.find( path );
+
+            if ( found != files.files.end( ) )
+            {
+                file = found->second;
+
+                if ( now - file->checked >= RevalidateInterval )
+                {
+                    //
+                    //  reopen file that has been replaced or modified, forget removed one
+                    //
+                    if ( changed( *file ) )
+                    {
+                        close( files, file );
+                        file = NULL;
+                    }
+                    else
+                    {
+                        file->checked = now;
+                    }
+                }
+            }
+
+            if ( !file )
+            {
+                file = open( files, path );
+
+                if ( !file )
+                {
+                    //
+                    //  handler responds to missing files
+                    //
+                    return false;
+                }
+            }
+
+            files.lru.splice( files.lru.begin( ), files.lru, file->lru );
+
+            unsigned int status = HttpProtocol::Ok;
+            off_t start = 0;
+            off_t end = file->size - 1;
+
+            const char* since = request.header( "if-modified-since" );
+            time_t time = 0;
+            bool gzip = false;
+
+            if ( since && parseDate( since, time ) && file->modified <= time )
+            {
+                status = HttpProtocol::NotModified;
+            }
+            else
+            {
+                const char* ranges = request.header( "range" );
+                const char* condition = request.header( "if-range" );
+
+                if ( ranges && ( !condition || file->lastModified == condition ) )
+                {
+                    switch ( range( ranges, file->size, start, end ) )
+                    {
+                        case Satisfiable:
+                            status = HttpProtocol::PartialContent;
+                            break;
+
+                        case NotSatisfiable:
+                            status = HttpProtocol::RequestedRangeNotSatisfiable;
+                            break;
+
+                        default:
+                            break;
+                    }
+                }
+
+                //
+                //  ranges always refer to the file itself
+                //
+                gzip = file->gzip && status == HttpProtocol::Ok && ( Compression::accepted( request.header( "accept-encoding" ) ) & Compression::Gzip );
+            }
+
+            TRACE( "%s %u", path.c_str( ), status );
+
+            evbuffer_add_printf( buffer, "HTTP/1.1 %u %s\r\nServer: %s/%s\r\nLast-Modified: %s\r\nAccept-Ranges: bytes\r\n",
+                status, HttpProtocol::reason( status ).c_str( ), PROPELLER_NAME, PROPELLER_VERSION, file->lastModified.c_str( ) );
+
+            if ( file->gzip )
+            {
+                evbuffer_add( buffer, "Vary: Accept-Encoding\r\n", 23 );
+            }
+
+            if ( status == HttpProtocol::NotModified )
+            {
+                evbuffer_add( buffer, "\r\n", 2 );
+                return true;
+            }
+
+            if ( status == HttpProtocol::RequestedRangeNotSatisfiable )
+            {
+                evbuffer_add_printf( buffer, "Content-Range: bytes */%lld\r\nContent-Length: 0\r\n\r\n", ( long long ) file->size );
+                return true;
+            }
+
+            if ( status == HttpProtocol::PartialContent )
+            {
+                evbuffer_add_printf( buffer, "Content-Range: bytes %lld-%lld/%lld\r\n", ( long long ) start, ( long long ) end, ( long long ) file->size );
+            }
+
+            const char* type = file->mime ? file->mime : "application/octet-stream";
+
+            if ( gzip )
+            {
+                evbuffer_add_printf( buffer, "Content-Type: %s\r\nContent-Encoding: gzip\r\nContent-Length: %lld\r\n\r\n", type, ( long long ) file->gzipSize );
+
+                if ( !head )
+                {
+                    evbuffer_add_file_segment( buffer, file->gzip, 0, file->gzipSize );
+                    Compression::account( ( unsigned int ) file->size, ( unsigned int ) file->gzipSize );
+                }
+
+                return true;
+            }
+
+            off_t count = file->size ? end - start + 1 : 0;
+
+            evbuffer_add_printf( buffer, "Content-Type: %s\r\nContent-Length: %lld\r\n\r\n", type, ( long long ) count );
+
+            if ( !head && count )
+            {
+                evbuffer_add_file_segment( buffer, file->segment, start, count );
+            }
+
+            return true;
+        }
+    }
+}
@@ -0,0 +1,638 @@
+/*
+ * File:   HttpHpack.cpp
+ *
+ * HPACK header compression for HTTP/2
+ */
+
+#include "HttpHpack.h"
+
+#include <string.h>
+
+//
+//	Trace function
+//
+#include "trace.h"
+
+namespace propeller
+{
+    namespace http
+    {
+        //
+        //  static table, RFC 7541 appendix A
+        //
+        const char* Hpack::s_static[ Hpack::StaticTableSize ][ 2 ] =
+        {
+            { ":authority", "" },
+            { ":method", "GET" },
+            { ":method", "POST" },
+            { ":path", "/" },
+            { ":path", "/index.html" },
+            { ":scheme", "http" },
+            { ":scheme", "https" },
+            { ":status", "200" },
+            { ":status", "204" },
+            { ":status", "206" },
+            { ":status", "304" },
+            { ":status", "400" },
+            { ":status", "404" },
+            { ":status", "500" },
+            { "accept-charset", "" },
+            { "accept-encoding", "gzip, deflate" },
+            { "accept-language", "" },
+            { "accept-ranges", "" },
+            { "accept", "" },
+            { "access-control-allow-origin", "" },
+            { "age", "" },
+            { "allow", "" },
+            { "authorization", "" },
+            { "cache-control", "" },
+            { "content-disposition", "" },
+            { "content-encoding", "" },
+            { "content-language", "" },
+            { "content-length", "" },
+            { "content-location", "" },
+            { "content-range", "" },
+            { "content-type", "" },
+            { "cookie", "" },
+            { "date", "" },
+            { "etag", "" },
+            { "expect", "" },
+            { "expires", "" },
+            { "from", "" },
+            { "host", "" },
+            { "if-match", "" },
+            { "if-modified-since", "" },
+            { "if-none-match", "" },
+            { "if-range", "" },
+            { "if-unmodified-since", "" },
+            { "last-modified", "" },
+            { "link", "" },
+            { "location", "" },
+            { "max-forwards", "" },
+            { "proxy-authenticate", "" },
+            { "proxy-authorization", "" },
+            { "range", "" },
+            { "referer", "" },
+            { "refresh", "" },
+            { "retry-after", "" },
+            { "server", "" },
+            { "set-cookie", "" },
+            { "strict-transport-security", "" },
+            { "transfer-encoding", "" },
+            { "user-agent", "" },
+            { "vary", "" },
+            { "via", "" },
+            { "www-authenticate", "" }
+        };
+
+        //
+        //  Huffman code of every symbol (256 is end of string), RFC 7541 appendix B
+        //
+        const unsigned int Hpack::s_codes[ 257 ] =
+        {
+            0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+            0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+            0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+            0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+            0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+            0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+            0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+            0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+            0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+            0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+            0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+            0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+            0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+            0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+            0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+            0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+            0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+            0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+            0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+            0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+            0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+            0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+            0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+            0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+            0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+            0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+            0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+            0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+            0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+            0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+            0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+            0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+            0x3fffffff
+        };
+
+        const unsigned char Hpack::s_lengths[ 257 ] =
+        {
+            13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+            28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+            6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+            5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+            13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+            7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+            15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+            6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+            20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+            24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+            22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+            21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+            26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+            19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+            20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+            26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+            30
+        };
+
+        unsigned short Hpack::s_symbols[ 257 ];
+        unsigned int Hpack::s_first[ 32 ];
+        unsigned int Hpack::s_count[ 32 ];
+        unsigned int Hpack::s_offset[ 32 ];
+
+        void Hpack::initialize( )
+        {
+            //
+            //  code is canonical: codes of the same length are consecutive and follow symbol order
+            //
+            unsigned int position = 0;
+
+            for ( unsigned int length = 1; length < 32; length++ )
+            {
+                s_offset[ length ] = position;
+                s_count[ length ] = 0;
+
+                for ( unsigned int symbol = 0; symbol < 257; symbol++ )
+                {
+                    if ( s_lengths[ symbol ] != length )
+                    {
+                        continue;
+                    }
+
+                    if ( !s_count[ length ] )
+                    {
+                        s_first[ length ] = s_codes[ symbol ];
+                    }
+
+                    s_symbols[ position++ ] = symbol;
+                    s_count[ length ]++;
+                }
+            }
+        }
+
+        void Hpack::integer( unsigned int value, unsigned int prefix, unsigned char flags, std::string& output )
+        {
+            unsigned int max = ( 1 << prefix ) - 1;
+
+            if ( value < max )
+            {
+                output.push_back( flags | value );
+                return;
+            }
+
+            output.push_back( flags | max );
+            value -= max;
+
+            while ( value >= 128 )
+            {
+                output.push_back( ( value & 127 ) | 128 );
+                value >>= 7;
+            }
+
+            output.push_back( value );
+        }
+
+        void Hpack::string( const char* value, unsigned int length, std::string& output )
+        {
+            unsigned int bits = 0;
+
+            for ( unsigned int i = 0; i < length; i++ )
+            {
+                bits += s_lengths[ ( unsigned char ) value[ i ] ];
+            }
+
+            unsigned int encoded = ( bits + 7 ) / 8;
+
+            if ( encoded >= length )
+            {
+                integer( length, 7, 0, output );
+                output.append( value, length );
+                return;
+            }
+
+            integer( encoded, 7, 0x80, output );
+
+            //
+            //  codes are at most 30 bits long, accumulator never holds more than 37 bits
+            //
+            unsigned long long accumulator = 0;
+            unsigned int pending = 0;
+
+            for ( unsigned int i = 0; i < length; i++ )
+            {
+                unsigned char symbol = value[ i ];
+
+                accumulator = ( accumulator << s_lengths[ symbol ] ) | s_codes[ symbol ];
+                pending += s_lengths[ symbol ];
+
+                while ( pending >= 8 )
+                {
+                    pending -= 8;
+                    output.push_back( ( char ) ( accumulator >> pending ) );
+                }
+            }
+
+            if ( pending )
+            {
+                //
+                //  pad with most significant bits of end of string code (all ones)
+                //
+                output.push_back( ( char ) ( ( accumulator << ( 8 - pending ) ) | ( 0xff >> pending ) ) );
+            }
+        }
+
+        bool Hpack::huffman( const unsigned char* data, unsigned int length, std::string& output )
+        {
+            unsigned int code = 0;
+            unsigned int bits = 0;
+
+            for ( unsigned int i = 0; i < length; i++ )
+            {
+                for ( int bit = 7; bit >= 0; bit-- )
+                {
+                    code = ( code << 1 ) | ( ( data[ i ] >> bit ) & 1 );
+                    bits++;
+
+                    if ( bits > 30 )
+                    {
+                        return false;
+                    }
+
+                    if ( code - s_first[ bits ] < s_count[ bits ] )
+                    {
+                        unsigned int symbol = s_symbols[ s_offset[ bits ] + code - s_first[ bits ] ];
+
+                        if ( symbol == 256 )
+                        {
+                            return false;
+                        }
+
+                        output.push_back( ( char ) symbol );
+                        code = 0;
+                        bits = 0;
+                    }
+                }
+            }
+
+            //
+            //  padding is shorter than a byte and consists of ones
+            //
+            return bits < 8 && code == ( 1u << bits ) - 1;
+        }
+
+        void Hpack::evict( std::deque< std::pair< std::string, std::string > >& table, unsigned int& size, unsigned int maxSize )
+        {
+            while ( size > maxSize && !table.empty( ) )
+            {
+                size -= table.back( ).first.size( ) + table.back( ).second.size( ) + 32;
+                table.pop_back( );
+            }
+        }
+
+        Hpack::Decoder::Decoder( )
+        : m_size( 0 ), m_maxSize( DefaultTableSize )
+        {
+        }
+
+        bool Hpack::Decoder::integer( const unsigned char*& current, const unsigned char* end, unsigned int prefix, unsigned int& value )
+        {
+            if ( current == end )
+            {
+                return false;
+            }
+
+            unsigned int max = ( 1 << prefix ) - 1;
+            value = *current++ & max;
+
+            if ( value < max )
+            {
+                return true;
+            }
+
+            for ( unsigned int shift = 0; ; shift += 7 )
+            {
+                if ( current == end || shift > 21 )
+                {
+                    return false;
+                }
+
+                unsigned char byte = *current++;
+                value += ( byte & 127 ) << shift;
+
+                if ( !( byte & 128 ) )
+                {
+                    return true;
+                }
+            }
+        }
+
+        bool Hpack::Decoder::string( const unsigned char*& current, const unsigned char* end, std::string& value )
+        {
+            if ( current == end )
+            {
+                return false;
+            }
+
+            bool encoded = *current & 0x80;
+            unsigned int length = 0;
+
+            if ( !integer( current, end, 7, length ) || length > ( unsigned int ) ( end - current ) )
+            {
+                return false;
+            }
+
+            value.clear( );
+
+            if ( encoded )
+            {
+                if ( !huffman( current, length, value ) )
+                {
+                    return false;
+                }
+            }
+            else
+            {
+                value.assign( ( const char* ) current, length );
+            }
+
+            current += length;
+
+            return true;
+        }
+
+        bool Hpack::Decoder::entry( unsigned int index, std::pair< std::string, std::string >& header ) const
+        {
+            if ( !index )
+            {
+                return false;
+            }
+
+            if ( index <= StaticTableSize )
+            {
+                header.first = s_static[ index - 1 ][ 0 ];
+                header.second = s_static[ index - 1 ][ 1 ];
+                return true;
+            }
+
+            index -= StaticTableSize + 1;
+
+            if ( index >= m_table.size( ) )
+            {
+                return false;
+            }
+
+            header = m_table[ index ];
+
+            return true;
+        }
+
+        bool Hpack::Decoder::decode( const unsigned char* data, unsigned int length, Headers& headers )
+        {
+            const unsigned char* current = data;
+            const unsigned char* end = data + length;
+            unsigned int listSize = 0;
+            size_t first = headers.size( );
+
+            while ( current < end )
+            {
+                unsigned char byte = *current;
+                unsigned int index = 0;
+
+                if ( byte & 0x80 )
+                {
+                    //
+                    //  indexed header field
+                    //
+                    headers.push_back( std::pair< std::string, std::string >( ) );
+
+                    if ( !integer( current, end, 7, index ) || !entry( index, headers.back( ) ) )
+                    {
+                        return false;
+                    }
+                }
+                else if ( ( byte & 0xe0 ) == 0x20 )
+                {
+                    //
+                    //  dynamic table size update, allowed at the beginning of the block only
+                    //
+                    if ( headers.size( ) != first || !integer( current, end, 5, index ) || index > DefaultTableSize )
+                    {
+                        return false;
+                    }
+
+                    m_maxSize = index;
+                    evict( m_table, m_size, m_maxSize );
+
+                    continue;
+                }
+                else
+                {
+                    //
+                    //  literal header field with incremental indexing, without indexing or never indexed
+                    //
+                    bool indexing = byte & 0x40;
+
+                    headers.push_back( std::pair< std::string, std::string >( ) );
+                    std::pair< std::string, std::string >& header = headers.back( );
+
+                    if ( !integer( current, end, indexing ? 6 : 4, index ) )
+                    {
+                        return false;
+                    }
+
+                    if ( index ? !entry( index, header ) : !string( current, end, header.first ) )
+                    {
+                        return false;
+                    }
+
+                    if ( !string( current, end, header.second ) )
+                    {
+                        return false;
+                    }
+
+                    if ( indexing )
+                    {
+                        unsigned int size = header.first.size( ) + header.second.size( ) + 32;
+
+                        if ( size > m_maxSize )
+                        {
+                            //
+                            //  entry larger than the table empties it
+                            //
+                            m_table.clear( );
+                            m_size = 0;
+                        }
+                        else
+                        {
+                            m_table.push_front( header );
+                            m_size += size;
+                            evict( m_table, m_size, m_maxSize );
+                        }
+                    }
+                }
+
+                listSize += headers.back( ).first.size( ) + headers.back( ).second.size( ) + 32;
+
+                if ( listSize > MaxListSize )
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        Hpack::Encoder::Encoder( )
+        : m_size( 0 ), m_maxSize( DefaultTableSize ), m_resized( false )
+        {
+        }
+
+        void Hpack::Encoder::setMaxSize( unsigned int size )
+        {
+            if ( size > DefaultTableSize )
+            {
+                size = DefaultTableSize;
+            }
+
+            if ( size == m_maxSize )
+            {
+                return;
+            }
+
+            m_maxSize = size;
+            evict( m_table, m_size, m_maxSize );
+
+            //
+            //  decoder learns about new size from the next header block
+            //
+            m_resized = true;
+        }
+
+        void Hpack::Encoder::begin( std::string& block )
+        {
+            if ( m_resized )
+            {
+                Hpack::integer( m_maxSize, 5, 0x20, block );
+                m_resized = false;
+            }
+        }
+
+        void Hpack::Encoder::add( const char* name, const char* value )
+        {
+            unsigned int size = strlen( name ) + strlen( value ) + 32;
+
+            if ( size > m_maxSize )
+            {
+                m_table.clear( );
+                m_size = 0;
+                return;
+            }
+
+            m_table.push_front( std::make_pair( std::string( name ), std::string( value ) ) );
+            m_size += size;
+            evict( m_table, m_size, m_maxSize );
+        }
+
+        void Hpack::Encoder::encode( const char* name, const char* value, std::string& block )
+        {
+            unsigned int nameIndex = 0;
+
+            for ( unsigned int i = 0; i < StaticTableSize; i++ )
+            {
+                if ( strcmp( s_static[ i ][ 0 ], name ) )
+                {
+                    continue;
+                }
+
+                if ( !strcmp( s_static[ i ][ 1 ], value ) )
+                {
+                    Hpack::integer( i + 1, 7, 0x80, block );
+                    return;
+                }
+
+                if ( !nameIndex )
+                {
+                    nameIndex = i + 1;
+                }
+            }
+
+            for ( unsigned int i = 0; i < m_table.size( ); i++ )
+            {
+                if ( m_table[ i ].first != name )
+                {
+                    continue;
+                }
+
+                if ( m_table[ i ].second == value )
+                {
+                    Hpack::integer( StaticTableSize + 1 + i, 7, 0x80, block );
+                    return;
+                }
+
+                if ( !nameIndex )
+                {
+                    nameIndex = StaticTableSize + 1 + i;
+                }
+            }
+
+            //
+            //  values that change with every response would only push useful entries out of the table,
+            //  cookies are never indexed, so intermediaries do not index them either
+            //
+            static const char* volatileNames[] =
+            {
+                "content-length",
+                "date",
+                "etag",
+                "last-modified",
+                "expires",
+                "age",
+                "content-range"
+            };
+
+            bool indexing = true;
+
+            for ( unsigned int i = 0; i < sizeof( volatileNames ) / sizeof( volatileNames[ 0 ] ); i++ )
+            {
+                if ( !strcmp( volatileNames[ i ], name ) )
+                {
+                    indexing = false;
+                    break;
+                }
+            }
+
+            if ( !strcmp( name, "set-cookie" ) )
+            {
+                Hpack::integer( nameIndex, 4, 0x10, block );
+                indexing = false;
+            }
+            else
+            {
+                Hpack::integer( nameIndex, indexing ? 6 : 4, indexing ? 0x40 : 0, block );
+            }
+
+            if ( !nameIndex )
+            {
+                Hpack::string( name, strlen( name ), block );
+            }
+
+            Hpack::string( value, strlen( value ), block );
+
+            if ( indexing )
+            {
+                add( name, value );
+            }
+        }
+    }
+}
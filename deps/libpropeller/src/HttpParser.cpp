@@ -0,0 +1,280 @@
+/*
+ * File:   HttpParser.cpp
+ *
+ * Incremental HTTP/1.1 request head parser
+ */
+
+#include "HttpParser.h"
+
+#include <string.h>
+
+#if defined( __SSE2__ ) || defined( _M_X64 )
+#include <emmintrin.h>
+#define PARSER_SSE2
+#endif
+
+#ifdef WIN32
+#define strncasecmp _strnicmp
+#endif
+
+//
+//	Trace function
+//
+#include "trace.h"
+
+namespace propeller
+{
+    namespace http
+    {
+#ifdef PARSER_SSE2
+        static inline unsigned int firstBit( unsigned int mask )
+        {
+#ifdef _MSC_VER
+            unsigned long index;
+            _BitScanForward( &index, mask );
+            return index;
+#else
+            return __builtin_ctz( mask );
+#endif
+        }
+#endif
+
+        const char* Parser::find( const char* begin, const char* end, char first, char second )
+        {
+            const char* current = begin;
+
+#ifdef PARSER_SSE2
+            //
+            //  compare 16 bytes at a time
+            //
+            const __m128i firstMask = _mm_set1_epi8( first );
+            const __m128i secondMask = _mm_set1_epi8( second );
+
+            while ( current + 16 <= end )
+            {
+                __m128i chunk = _mm_loadu_si128( ( const __m128i* ) current );
+                unsigned int mask = _mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( chunk, firstMask ), _mm_cmpeq_epi8( chunk, secondMask ) ) );
+
+                if ( mask )
+                {
+                    return current + firstBit( mask );
+                }
+
+                current += 16;
+            }
+#endif
+            for ( ; current < end; current++ )
+            {
+                if ( *current == first || *current == second )
+                {
+                    return current;
+                }
+            }
+
+            return NULL;
+        }
+
+        Parser::Parser( )
+        {
+            reset( );
+        }
+
+        void Parser::reset( )
+        {
+            m_scanned = 0;
+            m_headLength = 0;
+            m_headerCount = 0;
+            memset( &m_method, 0, sizeof( m_method ) );
+            memset( &m_uri, 0, sizeof( m_uri ) );
+            memset( &m_protocol, 0, sizeof( m_protocol ) );
+        }
+
+        Parser::Status Parser::scan( const char* data, unsigned int length )
+        {
+            if ( length > MaxHeadLength )
+            {
+                length = MaxHeadLength;
+            }
+
+            //
+            //  resume where previous scan stopped (terminator may be split between reads)
+            //
+            const char* current = data + ( m_scanned > 2 ? m_scanned - 2 : 0 );
+            const char* end = data + length;
+
+            while ( ( current = find( current, end, '\n', '\n' ) ) )
+            {
+                //
+                //  head ends with empty line, line terminator is CRLF or LF
+                //
+                if ( current + 1 < end && current[1] == '\n' )
+                {
+                    m_headLength = current + 2 - data;
+                    return Complete;
+                }
+
+                if ( current + 2 < end && current[1] == '\r' && current[2] == '\n' )
+                {
+                    m_headLength = current + 3 - data;
+                    return Complete;
+                }
+
+                current++;
+            }
+
+            m_scanned = length;
+
+            return length == MaxHeadLength ? TooLarge : Incomplete;
+        }
+
+        Parser::Status Parser::parse( char* head, unsigned int length )
+        {
+            char* end = head + length;
+
+            //
+            //  request line
+            //
+            char* lineEnd = ( char* ) find( head, end, '\n', '\n' );
+
+            if ( !lineEnd )
+            {
+                return Error;
+            }
+
+            char* lineLast = ( lineEnd > head && lineEnd[-1] == '\r' ) ? lineEnd - 1 : lineEnd;
+
+            char* space = ( char* ) find( head, lineLast, ' ', ' ' );
+
+            if ( !space || space == head )
+            {
+                return Error;
+            }
+
+            m_method.offset = 0;
+            m_method.length = space - head;
+            *space = 0;
+
+            char* uri = space + 1;
+            space = ( char* ) find( uri, lineLast, ' ', ' ' );
+
+            if ( !space || space == uri )
+            {
+                return Error;
+            }
+
+            m_uri.offset = uri - head;
+            m_uri.length = space - uri;
+            *space = 0;
+
+            char* protocol = space + 1;
+
+            if ( lineLast - protocol < 5 || strncmp( protocol, "HTTP/", 5 ) != 0 )
+            {
+                return Error;
+            }
+
+            m_protocol.offset = protocol - head;
+            m_protocol.length = lineLast - protocol;
+            *lineLast = 0;
+
+            //
+            //  headers
+            //
+            m_headerCount = 0;
+
+            for ( char* line = lineEnd + 1; line < end; line = lineEnd + 1 )
+            {
+                lineEnd = ( char* ) find( line, end, '\n', '\n' );
+
+                if ( !lineEnd )
+                {
+                    return Error;
+                }
+
+                lineLast = ( lineEnd > line && lineEnd[-1] == '\r' ) ? lineEnd - 1 : lineEnd;
+
+                if ( lineLast == line )
+                {
+                    //
+                    //  empty line terminates head
+                    //
+                    break;
+                }
+
+                if ( *line == ' ' || *line == '\t' )
+                {
+                    //
+                    //  obsolete line folding, continuation line would otherwise be taken for a header
+                    //
+                    return Error;
+                }
+
+                char* separator = ( char* ) find( line, lineLast, ':', ':' );
+
+                if ( !separator || separator == line )
+                {
+                    return Error;
+                }
+
+                if ( m_headerCount == MaxHeaders )
+                {
+                    return TooLarge;
+                }
+
+                Header& header = m_headers[ m_headerCount++ ];
+
+                //
+                //  header names are case insensitive, store them lowercased
+                //
+                for ( char* i = line; i < separator; i++ )
+                {
+                    if ( *i >= 'A' && *i <= 'Z' )
+                    {
+                        *i += 'a' - 'A';
+                    }
+                }
+
+                header.name.offset = line - head;
+                header.name.length = separator - line;
+                *separator = 0;
+
+                char* value = separator + 1;
+
+                while ( value < lineLast && ( *value == ' ' || *value == '\t' ) )
+                {
+                    value++;
+                }
+
+                char* valueEnd = lineLast;
+
+                while ( valueEnd > value && ( valueEnd[-1] == ' ' || valueEnd[-1] == '\t' ) )
+                {
+                    valueEnd--;
+                }
+
+                header.value.offset = value - head;
+                header.value.length = valueEnd - value;
+                *valueEnd = 0;
+            }
+
+            return Complete;
+        }
+
+        const char* Parser::find( const char* head, const char* name ) const
+        {
+            size_t length = strlen( name );
+
+            for ( unsigned int i = 0; i < m_headerCount; i++ )
+            {
+                const Header& header = m_headers[i];
+
+                if ( header.name.length == length && strncasecmp( head + header.name.offset, name, length ) == 0 )
+                {
+                    return head + header.value.offset;
+                }
+            }
+
+            return NULL;
+        }
+    }
+}
@@ -0,0 +1,277 @@
+/*
+ * File:   HttpRouter.cpp
+ *
+ * Radix tree request router
+ */
+
+#include "HttpRouter.h"
+
+#include <string.h>
+
+namespace propeller
+{
+    namespace http
+    {
+        Router::Node::~Node( )
+        {
+            for ( std::vector< Node* >::iterator i = children.begin( ); i != children.end( ); i++ )
+            {
+                delete *i;
+            }
+
+            delete param;
+        }
+
+        Router::Router( )
+        : m_root( new Node( "" ) )
+        {
+        }
+
+        Router::~Router( )
+        {
+            delete m_root;
+        }
+
+        void Router::clear( )
+        {
+            delete m_root;
+            m_root = new Node( "" );
+        }
+
+        Router::Node* Router::insert( Node* node, const char* path, unsigned int length )
+        {
+            while ( length )
+            {
+                std::string::size_type index = node->indices.find( *path );
+
+                if ( index == std::string::npos )
+                {
+                    Node* child = new Node( std::string( path, length ) );
+                    node->indices.push_back( *path );
+                    node->children.push_back( child );
+
+                    return child;
+                }
+
+                Node* child = node->children[ index ];
+
+                //
+                //  length of common prefix
+                //
+                unsigned int common = 0;
+
+                while ( common < length && common < child->label.size( ) && child->label[ common ] == path[ common ] )
+                {
+                    common++;
+                }
+
+                if ( common < child->label.size( ) )
+                {
+                    //
+                    //  split child, common part becomes new node
+                    //
+                    Node* split = new Node( child->label.substr( 0, common ) );
+                    child->label.erase( 0, common );
+
+                    split->indices.push_back( child->label[ 0 ] );
+                    split->children.push_back( child );
+
+                    node->children[ index ] = split;
+                    child = split;
+                }
+
+                node = child;
+                path += common;
+                length -= common;
+            }
+
+            return node;
+        }
+
+        void Router::addRoute( const std::string& method, const std::string& pattern, int value )
+        {
+            Node* node = m_root;
+            Endpoint endpoint;
+            endpoint.method = method;
+            endpoint.value = value;
+
+            std::string::size_type position = 0;
+
+            while ( position < pattern.size( ) )
+            {
+                //
+                //  parameter starts segment
+                //
+                std::string::size_type parameter = pattern.find( "/:", position );
+                std::string::size_type end = parameter == std::string::npos ? pattern.size( ) : parameter + 1;
+
+                node = insert( node, pattern.data( ) + position, end - position );
+
+                if ( parameter == std::string::npos )
+                {
+                    break;
+                }
+
+                std::string::size_type nameEnd = pattern.find( '/', end );
+
+                if ( nameEnd == std::string::npos )
+                {
+                    nameEnd = pattern.size( );
+                }
+
+                endpoint.names.push_back( pattern.substr( end + 1, nameEnd - end - 1 ) );
+
+                if ( !node->param )
+                {
+                    node->param = new Node( "" );
+                }
+
+                node = node->param;
+                position = nameEnd;
+            }
+
+            //
+            //  route added later for the same method and pattern replaces the previous one
+            //
+            for ( std::vector< Endpoint >::iterator i = node->endpoints.begin( ); i != node->endpoints.end( ); i++ )
+            {
+                if ( i->method == method )
+                {
+                    *i = endpoint;
+                    return;
+                }
+            }
+
+            node->endpoints.push_back( endpoint );
+        }
+
+        void Router::addPrefix( const std::string& path, int value )
+        {
+            insert( m_root, path.data( ), path.size( ) )->prefix = value;
+        }
+
+        const Router::Endpoint* Router::matchRoute( const Node* node, const char* method, const char* path, unsigned int position, unsigned int length, Params& params ) const
+        {
+            if ( position == length )
+            {
+                for ( std::vector< Endpoint >::const_iterator i = node->endpoints.begin( ); i != node->endpoints.end( ); i++ )
+                {
+                    if ( i->method == method )
+                    {
+                        return &( *i );
+                    }
+                }
+
+                return NULL;
+            }
+
+            //
+            //  static children first
+            //
+            const char* found = ( const char* ) memchr( node->indices.data( ), path[ position ], node->indices.size( ) );
+
+            if ( found )
+            {
+                const Node* child = node->children[ found - node->indices.data( ) ];
+
+                if ( length - position >= child->label.size( ) && !memcmp( path + position, child->label.data( ), child->label.size( ) ) )
+                {
+                    const Endpoint* endpoint = matchRoute( child, method, path, position + child->label.size( ), length, params );
+
+                    if ( endpoint )
+                    {
+                        return endpoint;
+                    }
+                }
+            }
+
+            if ( node->param )
+            {
+                unsigned int end = position;
+
+                while ( end < length && path[ end ] != '/' )
+                {
+                    end++;
+                }
+
+                if ( end > position )
+                {
+                    Param param;
+                    param.name = NULL;
+                    param.value = path + position;
+                    param.length = end - position;
+                    params.push_back( param );
+
+                    const Endpoint* endpoint = matchRoute( node->param, method, path, end, length, params );
+
+                    if ( endpoint )
+                    {
+                        return endpoint;
+                    }
+
+                    params.pop_back( );
+                }
+            }
+
+            return NULL;
+        }
+
+        int Router::match( const char* method, const char* path, unsigned int length, Params& params ) const
+        {
+            params.clear( );
+
+            const Endpoint* endpoint = matchRoute( m_root, method, path, 0, length, params );
+
+            if ( endpoint )
+            {
+                for ( unsigned int i = 0; i < params.size( ); i++ )
+                {
+                    params[ i ].name = &endpoint->names[ i ];
+                }
+
+                return endpoint->value;
+            }
+
+            params.clear( );
+
+            //
+            //  longest prefix handler that ends at segment boundary
+            //
+            int value = -1;
+            const Node* node = m_root;
+            unsigned int position = 0;
+
+            for ( ; ; )
+            {
+                if ( node->prefix != -1 && ( position == length || path[ position ] == '/' || ( position && path[ position - 1 ] == '/' ) ) )
+                {
+                    value = node->prefix;
+                }
+
+                if ( position == length )
+                {
+                    break;
+                }
+
+                const char* found = ( const char* ) memchr( node->indices.data( ), path[ position ], node->indices.size( ) );
+
+                if ( !found )
+                {
+                    break;
+                }
+
+                const Node* child = node->children[ found - node->indices.data( ) ];
+
+                if ( length - position < child->label.size( ) || memcmp( path + position, child->label.data( ), child->label.size( ) ) )
+                {
+                    break;
+                }
+
+                node = child;
+                position += child->label.size( );
+            }
+
+            return value;
+        }
+    }
+}
@@ -7,6 +7,9 @@
 
 #include "HttpServer.h"
 
+#include <algorithm>
+#include <limits.h>
+
 //
 //	Trace function
 //
@@ -18,10 +21,11 @@ namespace propeller
     
     namespace http
     {
+        unsigned int Connection::s_eventStreams = 0;
 
-        propeller::Connection* Server::newConnection( ConnectionThread& thread, sys::Socket* socket )
+        propeller::Connection* Server::newConnection( ConnectionThread& thread, sys::Socket* socket, ssl_st* ssl )
         {
-            return new http::Connection( thread, socket );
+            return new http::Connection( thread, socket, ssl );
         }
 
         Connection::Exception::Exception( HttpProtocol::Status status )
@@ -30,6 +34,213 @@ namespace propeller
 
         }
 
+        Connection::~Connection( )
+        {
+            if ( m_session )
+            {
+                delete m_session;
+            }
+        }
+
+        void Connection::onRead( )
+        {
+            TRACE_ENTERLEAVE( );
+
+            if ( m_webSocket )
+            {
+                m_webSocket->onRead( );
+                return;
+            }
+
+            if ( m_eventStream )
+            {
+                //
+                //  client does not send anything on event stream
+                //
+                drainInput( inputLength( ) );
+                return;
+            }
+
+            if ( m_session )
+            {
+                m_session->onRead( );
+                return;
+            }
+
+            if ( !m_detected )
+            {
+                if ( ( ( Server& ) m_thread.server( ) ).http2( ) )
+                {
+                    unsigned int length = inputLength( );
+
+                    if ( length > Session::PrefaceLength )
+                    {
+                        length = Session::PrefaceLength;
+                    }
+
+                    int preface = secure( ) && negotiated( "h2" ) ? 1 : Session::preface( pullInput( length ), length );
+
+                    if ( !preface )
+                    {
+                        //
+                        //  wait for the rest of client preface
+                        //
+                        return;
+                    }
+
+                    if ( preface == 1 )
+                    {
+                        m_detected = true;
+                        m_session = new Session( *this );
+                        m_session->onRead( );
+
+                        return;
+                    }
+                }
+
+                m_detected = true;
+            }
+
+            propeller::Connection::onRead( );
+        }
+
+        void Connection::onWrite( )
+        {
+            if ( m_session )
+            {
+                m_session->onWrite( );
+            }
+
+            propeller::Connection::onWrite( );
+        }
+
+        void Connection::onClose( )
+        {
+            if ( m_webSocket )
+            {
+                //
+                //  socket may outlive the connection if it is still referenced
+                //
+                WebSocket* webSocket = m_webSocket;
+                m_webSocket = NULL;
+
+                webSocket->onDisconnect( );
+                webSocket->deref( );
+            }
+
+            propeller::Connection::onClose( );
+        }
+
+        void Connection::onBroadcast( libevent::SharedBuffer& message, const std::string& channel )
+        {
+            if ( m_webSocket && m_webSocket->state( ) != WebSocket::Open )
+            {
+                //
+                //  nothing is sent after close frame
+                //
+                return;
+            }
+
+            if ( m_session )
+            {
+                //
+                //  event is translated to DATA frame of every stream subscribed to the topic
+                //
+                std::multimap< std::string, unsigned int >::iterator i = m_eventStreams.lower_bound( channel );
+
+                while ( i != m_eventStreams.end( ) && i->first == channel )
+                {
+                    evbuffer* buffer = evbuffer_new( );
+                    message.append( buffer );
+
+                    bool open = m_session->commit( i->second, buffer, false );
+                    evbuffer_free( buffer );
+
+                    if ( open )
+                    {
+                        i++;
+                        continue;
+                    }
+
+                    //
+                    //  stream has been reset by the client, it is released once it is complete
+                    //
+                    m_session->commit( i->second, NULL, true );
+                    m_eventStreams.erase( i++ );
+                }
+
+                if ( m_eventStreams.find( channel ) == m_eventStreams.end( ) )
+                {
+                    unsubscribe( channel );
+                }
+
+                return;
+            }
+
+            propeller::Connection::onBroadcast( message, channel );
+        }
+
+        void Connection::getMetrics( unsigned int& eventStreams )
+        {
+            eventStreams = s_eventStreams;
+        }
+
+        void Connection::upgrade( WebSocket::Handler& handler, const std::string& endpoint, void* data )
+        {
+            TRACE_ENTERLEAVE( );
+
+            m_webSocket = new WebSocket( *this, handler, endpoint, data );
+            m_webSocket->onOpen( );
+
+            //
+            //  client may have sent frames right after the handshake
+            //
+            if ( m_webSocket && inputLength( ) )
+            {
+                m_webSocket->onRead( );
+            }
+        }
+
+        void Connection::openEventStream( unsigned int sequence, const std::vector< std::string >& topics )
+        {
+            TRACE_ENTERLEAVE( );
+
+            sys::General::interlockedIncrement( &s_eventStreams );
+
+            if ( !m_session )
+            {
+                //
+                //  connection stays suspended, whatever client sends from now on is discarded
+                //
+                m_eventStream = true;
+                drainInput( inputLength( ) );
+            }
+
+            for ( std::vector< std::string >::const_iterator i = topics.begin( ); i != topics.end( ); i++ )
+            {
+                if ( m_session )
+                {
+                    m_eventStreams.insert( std::make_pair( *i, sequence ) );
+                }
+
+                subscribe( *i );
+            }
+        }
+
+        void Connection::commit( unsigned int sequence, evbuffer* buffer, bool close, bool complete )
+        {
+            if ( m_session )
+            {
+                //
+                //  responses are sent as frames of their streams in whatever order they complete
+                //
+                m_session->commit( sequence, buffer, complete );
+                return;
+            }
+
+            propeller::Connection::commit( sequence, buffer, close, complete );
+        }
+
         propeller::Response* Connection::createResponse( const propeller::Connection::Exception* exception )
         {
             TRACE_ENTERLEAVE();
@@ -46,6 +257,7 @@ namespace propeller
             Response* response = new Response( *this, status );
             if ( status != HttpProtocol::Ok )
             {
+                response->setClose( );
                 response->setBody( );
             }
             
@@ -64,180 +276,425 @@ namespace propeller
             TRACE_ENTERLEAVE( );
 
             const char* header = ( ( Request* ) request )->header( "connection" );
-            if ( header && strcmp( header, "close" ) == 0 )
+            if ( header && strcasecmp( header, "close" ) == 0 )
             {
+                //
+                //  stop reading pipelined requests, close after this response
+                //
                 setClose( );
+                response->setClose( );
             }
 
-            m_thread.server().process( request, response );
-        }
+            Server& server = ( Server& ) m_thread.server( );
+            Response* httpResponse = ( Response* ) response;
 
-        const char* Request::header( const char* name ) const
-        {
-            std::string lowercaseName = name;
-            std::transform( lowercaseName.begin( ), lowercaseName.end( ), lowercaseName.begin( ), ::tolower );
+            const char* accept = ( ( Request* ) request )->header( "accept" );
 
-            HeaderMap::const_iterator i = m_headers.find( lowercaseName );
+            if ( !m_session && outstanding( ) == 1 && ( ( ( Request* ) request )->header( "upgrade" ) || ( accept && strstr( accept, "text/event-stream" ) ) ) )
+            {
+                //
+                //  following input may belong to another protocol (or response may stay open as event stream), it is not
+                //  parsed till the response is complete
+                //
+                suspend( );
+                httpResponse->m_switching = true;
+            }
 
-            if ( i != m_headers.end( ) )
+            if ( !m_session && !secure( ) )
             {
-                return i->second.c_str( );
+                //
+                //  response is moved to the socket output as is, file data can be sent with sendfile
+                //
+                evbuffer_set_flags( httpResponse->m_buffer, EVBUFFER_FLAG_DRAINS_TO_FD );
             }
 
-            return NULL;
-        }
+            if ( server.cache( ).serve( *( Request* ) request, httpResponse->m_buffer ) || server.files( ).serve( *( Request* ) request, httpResponse->m_buffer ) )
+            {
+                //
+                //  cached response or file is written right away, request is not passed to the handler
+                //
+                httpResponse->commit( httpResponse->m_buffer );
 
-        void Request::parse( )
-        {
+                delete request;
+                delete response;
 
-            //
-            //	try to parse out buffer
-            //
+                return;
+            }
 
-            if ( !strlen( m_method ) )
+            if ( Compression::level( ) )
             {
-                //
-                //	check request line
-                //
-                char* requestLine;
+                httpResponse->m_accepted = Compression::accepted( ( ( Request* ) request )->header( "accept-encoding" ) );
+            }
 
-                requestLine = m_connection.readLine( );
+            m_thread.server().process( request, response );
+        }
 
-                if ( !requestLine )
-                {
-                    free( requestLine );
-                    throw Connection::Exception( HttpProtocol::BadRequest );
-                }
+        //
+        //  parse Content-Length or chunk size. strtoul would wrap on LP64 when stored to unsigned int and it accepts sign,
+        //  white space and 0x prefix, so digits are converted here and overflow is detected
+        //
+        static bool parseLength( const char* text, unsigned int base, unsigned long long& value, const char*& end )
+        {
+            value = 0;
 
-                int read = sscanf( requestLine, "%s %s %s", m_method, m_uri, m_protocol );
+            for ( end = text; ; end++ )
+            {
+                unsigned int digit;
 
-                if ( read != 3 )
+                if ( *end >= '0' && *end <= '9' )
                 {
-                    free( requestLine );
-                    throw Connection::Exception( HttpProtocol::BadRequest );
+                    digit = *end - '0';
+                }
+                else if ( base == 16 && ( *end | 0x20 ) >= 'a' && ( *end | 0x20 ) <= 'f' )
+                {
+                    digit = ( *end | 0x20 ) - 'a' + 10;
+                }
+                else
+                {
+                    break;
                 }
 
-                TRACE( "%s", requestLine );
+                if ( value > ( ULLONG_MAX - digit ) / base )
+                {
+                    return false;
+                }
 
-                free( requestLine );
+                value = value * base + digit;
             }
 
-            if ( !m_parsedHeader )
+            return end != text;
+        }
+
+        void Request::parse( )
+        {
+            if ( !m_head )
             {
                 //
-                //  see if we have all headers
+                //  look for the end of request head in contiguous input
                 //
-                if ( m_connection.searchInput( "\r\n\r\n", 4 ) == -1 )
+                unsigned int length = m_connection.inputLength( );
+
+                if ( length > Parser::MaxHeadLength )
+                {
+                    length = Parser::MaxHeadLength;
+                }
+
+                const char* data = length ? m_connection.pullInput( length ) : NULL;
+
+                Parser::Status status = data ? m_parser.scan( data, length ) : Parser::Incomplete;
+
+                if ( status == Parser::TooLarge )
                 {
+                    throw Connection::Exception( HttpProtocol::RequestEntityTooLarge );
+                }
+
+                if ( status == Parser::Incomplete )
+                {
+                    //
+                    //  wait for more data
+                    //
                     throw Connection::Exception( HttpProtocol::Ok );
                 }
 
                 //
-                //	parse headers
+                //  copy head once and parse it in place, pulled up input can not be kept since the connection drains it
                 //
-                for (;; )
+                unsigned int headLength = m_parser.headLength( );
+
+                if ( headLength < InlineHeadLength )
+                {
+                    m_head = m_inlineHead;
+                    memcpy( m_head, data, headLength );
+                    m_head[ headLength ] = 0;
+                }
+                else
                 {
+                    m_headData.assign( data, headLength );
+                    m_head = &m_headData[ 0 ];
+                }
+
+                m_connection.drainInput( headLength );
 
-                    char* line;
+                status = m_parser.parse( m_head, headLength );
 
-                    line = m_connection.readLine( );
+                if ( status != Parser::Complete )
+                {
+                    throw Connection::Exception( status == Parser::TooLarge ? HttpProtocol::RequestEntityTooLarge : HttpProtocol::BadRequest );
+                }
+
+                TRACE( "%s %s", method( ), uri( ) );
+            }
+
+            if ( m_bodyState == BodyUnknown )
+            {
+                m_bodyState = bodyState( );
+            }
 
-                    if ( !line )
+            while ( m_bodyState != BodyComplete )
+            {
+                switch ( m_bodyState )
+                {
+                    case BodyLength:
+                        receive( m_bodyLength - m_content.length( ) );
+
+                        if ( m_content.length( ) != m_bodyLength )
+                        {
+                            //
+                            //  wait for more data
+                            //
+                            throw Connection::Exception( HttpProtocol::Ok );
+                        }
+
+                        m_bodyState = BodyComplete;
+                        break;
+
+                    case ChunkSize:
                     {
-                        free( line );
-                        throw Connection::Exception( HttpProtocol::BadRequest );
-                    }
+                        const char* line = readChunkLine( );
+                        const char* end = NULL;
+                        unsigned long long size = 0;
 
-                    const char* separator = strstr( line, ": " );
+                        if ( !parseLength( line, 16, size, end ) )
+                        {
+                            throw Connection::Exception( end == line ? HttpProtocol::BadRequest : HttpProtocol::RequestEntityTooLarge );
+                        }
 
-                    if ( !separator )
+                        if ( *end && *end != ';' && *end != ' ' && *end != '\t' )
+                        {
+                            throw Connection::Exception( HttpProtocol::BadRequest );
+                        }
+
+                        //
+                        //  limit applies to the total of chunks, so the body length can not wrap either
+                        //
+                        if ( size > Body::maxLength( ) - m_content.length( ) )
+                        {
+                            throw Connection::Exception( HttpProtocol::RequestEntityTooLarge );
+                        }
+
+                        m_chunkRemaining = size;
+
+                        m_connection.drainInput( m_chunkLineLength );
+                        m_bodyState = m_chunkRemaining ? ChunkData : ChunkTrailer;
+                        break;
+                    }
+
+                    case ChunkData:
                     {
-                        free( line );
+                        unsigned int length = m_content.length( );
+                        receive( m_chunkRemaining );
+                        m_chunkRemaining -= m_content.length( ) - length;
+
+                        if ( m_chunkRemaining )
+                        {
+                            throw Connection::Exception( HttpProtocol::Ok );
+                        }
+
+                        m_bodyState = ChunkEnd;
                         break;
                     }
 
-                    std::string name;
-                    unsigned long nameLength = separator - line;
-                    name.append( line, nameLength );
-                    const char* end = line + strlen( line );
-                    unsigned int separatorLength = 2;
-                    std::string value;
-                    unsigned long valueLength = end - ( separator + separatorLength );
-                    value.append( separator + separatorLength, valueLength );
+                    case ChunkEnd:
+                        if ( *readChunkLine( ) )
+                        {
+                            throw Connection::Exception( HttpProtocol::BadRequest );
+                        }
 
-                    //
-                    //  lowercase
-                    //
-                    std::transform( name.begin( ), name.end( ), name.begin( ), ::tolower );
-                    std::transform( value.begin( ), value.end( ), value.begin( ), ::tolower );
+                        m_connection.drainInput( m_chunkLineLength );
+                        m_bodyState = ChunkSize;
+                        break;
 
-                    m_headers[ name ] = value;
-                    free( line );
-                    TRACE( "%s: %s", name.c_str( ), value.c_str( ) );
+                    case ChunkTrailer:
+                    {
+                        //
+                        //  trailer fields are ignored, empty line terminates the body
+                        //
+                        bool last = !*readChunkLine( );
+                        m_connection.drainInput( m_chunkLineLength );
+
+                        if ( last )
+                        {
+                            m_bodyState = BodyComplete;
+                        }
+
+                        break;
+                    }
+
+                    default:
+                        m_bodyState = BodyComplete;
+                        break;
                 }
             }
+        }
 
-            m_parsedHeader = true;
+        Request::BodyState Request::bodyState( )
+        {
+            const char* encoding = header( "transfer-encoding" );
 
-            //	body is required for PUT and POST method requests
-            //
-            bool needBody = m_method[0] == 'P';
+            if ( encoding && strcasecmp( encoding, "identity" ) != 0 )
+            {
+                if ( strcasecmp( encoding, "chunked" ) != 0 )
+                {
+                    throw Connection::Exception( HttpProtocol::NotImplemented );
+                }
 
-            //
-            //	check request headers
-            //
-            if ( needBody )
+                return ChunkSize;
+            }
+
+            const char* length = header( "content-length" );
+
+            if ( length )
             {
-                const char* length = header( "content-length" );
+                const char* end = NULL;
+                unsigned long long value = 0;
 
-                if ( length )
+                if ( !parseLength( length, 10, value, end ) )
                 {
-                    //
-                    //	Get body length
-                    //
-                    sscanf( length, "%d", &m_bodyLength );
+                    throw Connection::Exception( end == length ? HttpProtocol::BadRequest : HttpProtocol::RequestEntityTooLarge );
                 }
-                else
+
+                if ( *end )
                 {
-                    //
-                    //	Aways require content length
-                    //
-                    throw Connection::Exception( HttpProtocol::LengthRequired );
+                    throw Connection::Exception( HttpProtocol::BadRequest );
                 }
 
-                if ( !m_body )
+                if ( value > Body::maxLength( ) )
                 {
-                    m_body = new char[ m_bodyLength + 1];
-                    m_body[ m_bodyLength ] = 0;
+                    throw Connection::Exception( HttpProtocol::RequestEntityTooLarge );
                 }
 
-                m_read += m_connection.read( m_body + m_read, m_bodyLength - m_read );
+                m_bodyLength = value;
 
-                if ( m_read != m_bodyLength )
+                if ( !m_content.reserve( m_bodyLength ) )
                 {
-                    //
-                    //  wait for more data
-                    //
-                    throw Connection::Exception( HttpProtocol::Ok );
+                    throw Connection::Exception( HttpProtocol::InternalServerError );
                 }
+
+                return BodyLength;
+            }
+
+            //
+            //	body is required for PUT and POST method requests
+            //
+            if ( method( )[0] == 'P' )
+            {
+                throw Connection::Exception( HttpProtocol::LengthRequired );
+            }
+
+            return BodyComplete;
+        }
+
+        void Request::receive( unsigned int length )
+        {
+            if ( !m_content.receive( m_connection, length ) )
+            {
+                throw Connection::Exception( HttpProtocol::InternalServerError );
             }
         }
 
+        const char* Request::readChunkLine( )
+        {
+            unsigned int length = m_connection.inputLength( );
+
+            if ( length > MaxChunkLineLength )
+            {
+                length = MaxChunkLineLength;
+            }
+
+            const char* data = length ? m_connection.pullInput( length ) : NULL;
+            const char* end = data ? ( const char* ) memchr( data, '\n', length ) : NULL;
+
+            if ( !end )
+            {
+                if ( length == MaxChunkLineLength )
+                {
+                    throw Connection::Exception( HttpProtocol::BadRequest );
+                }
+
+                //
+                //  wait for more data
+                //
+                throw Connection::Exception( HttpProtocol::Ok );
+            }
+
+            m_chunkLineLength = end + 1 - data;
+
+            //
+            //  copy line without terminator
+            //
+            unsigned int lineLength = end - data;
+
+            if ( lineLength && data[ lineLength - 1 ] == '\r' )
+            {
+                lineLength--;
+            }
+
+            memcpy( m_chunkLine, data, lineLength );
+            m_chunkLine[ lineLength ] = 0;
+
+            return m_chunkLine;
+        }
+
+        bool Request::assign( std::string& head )
+        {
+            m_headData.swap( head );
+            m_head = &m_headData[ 0 ];
+
+            if ( m_parser.parse( m_head, m_headData.size( ) ) != Parser::Complete )
+            {
+                return false;
+            }
+
+            TRACE( "%s %s", method( ), uri( ) );
+
+            const char* contentLength = header( "content-length" );
+
+            if ( contentLength )
+            {
+                const char* end = NULL;
+                unsigned long long value = 0;
+
+                if ( !parseLength( contentLength, 10, value, end ) || *end || value > Body::maxLength( ) || !m_content.reserve( value ) )
+                {
+                    return false;
+                }
+            }
+
+            m_bodyState = BodyComplete;
+
+            return true;
+        }
+
         Request::Request( Connection& connection )
-        : m_bodyLength( 0 ),  m_parsedHeader( false ), m_read( 0 ), propeller::Request( connection )
+        : propeller::Request( connection ), m_head( NULL ), m_bodyLength( 0 ), m_bodyState( BodyUnknown ), m_chunkRemaining( 0 ), m_chunkLineLength( 0 )
         {
             TRACE_ENTERLEAVE( );
-
-            m_method[0] = 0;
-            m_uri[0] = 0;
-            m_protocol[0] = 0;
-            m_header[0] = 0;
+        }
+        
+        Request::~Request( )
+        {
         }
 
         Response::Response( Connection& connection, unsigned int status )
-        : m_status( status ), propeller::Response( connection ), m_init( false )
+        : propeller::Response( connection ), m_status( status ), m_init( false ), m_chunked( false ), m_buffer( NULL ), m_cache( NULL ), m_cacheRequest( NULL ), m_cacheTtl( 0 ), m_accepted( 0 ), m_compressible( false ), m_encoded( false ),
+          m_switching( false ), m_upgrade( NULL ), m_upgradeData( NULL ), m_eventStream( false )
         {
             TRACE_ENTERLEAVE( );
+            
+            //
+            //  buffer is private to this response and is not locked
+            //
+            m_buffer = evbuffer_new( );
+        }
+        
+        Response::~Response( )
+        {
+            TRACE_ENTERLEAVE( );
+            
+            if ( m_buffer )
+            {
+                evbuffer_free( m_buffer );
+            }
         }
 
         void Response::init( )
@@ -251,51 +708,334 @@ namespace propeller
 
             TRACE_ENTERLEAVE( );
 
-            char responseLine[64] = "0";
-
-            sprintf( responseLine, "HTTP/1.1 %u %s\r\n", m_status, HttpProtocol::reason( m_status ).c_str( ) );
-            TRACE( "%s", responseLine );
-
-            m_connection.write( responseLine, strlen( responseLine ) );
-
-            char serverVersion[32] = "\0";
-            sprintf( serverVersion, "%s/%s", PROPELLER_NAME, PROPELLER_VERSION );
-            addHeader( "Server", serverVersion );
+            evbuffer_add_printf( m_buffer, "HTTP/1.1 %u %s\r\nServer: %s/%s\r\n", m_status, HttpProtocol::reason( m_status ).c_str( ), PROPELLER_NAME, PROPELLER_VERSION );
         }
 
         void Response::addHeader( const char* name, const char* value )
         {
             init( );
 
-            m_connection.write( name, strlen( name ) );
-            m_connection.write( ": ", 2 );
-            m_connection.write( value, strlen( value ) );
-            m_connection.write( "\r\n", 2 );
+            evbuffer_add( m_buffer, name, strlen( name ) );
+            evbuffer_add( m_buffer, ": ", 2 );
+            evbuffer_add( m_buffer, value, strlen( value ) );
+            evbuffer_add( m_buffer, "\r\n", 2 );
+
+            if ( !strcasecmp( name, "content-type" ) )
+            {
+                m_compressible = Compression::compressible( value );
+            }
+            else if ( !strcasecmp( name, "content-encoding" ) )
+            {
+                m_encoded = true;
+            }
         }
 
         void Response::setBody( const char* body, unsigned int length )
         {
+            if ( m_eventStream && m_status == HttpProtocol::Ok )
+            {
+                //
+                //  head and initial events are sent, response stays open for published events
+                //
+                write( body ? body : "", length );
+                commit( m_buffer, false );
+
+                return;
+            }
+
+            m_eventStream = false;
+
+            if ( m_chunked )
+            {
+                //
+                //  last part of streamed response
+                //
+                if ( body )
+                {
+                    write( body, length );
+                }
+                
+                evbuffer_add( m_buffer, "0\r\n\r\n", 5 );
+                commit( m_buffer );
+                
+                return;
+            }
+            
             init( );
 
+            if ( m_status == HttpProtocol::SwitchingProtocols )
+            {
+                //
+                //  head is followed by the protocol response switches to
+                //
+                evbuffer_add( m_buffer, "\r\n", 2 );
+                commit( m_buffer );
+
+                return;
+            }
+
             if ( m_status > 400 )
             {
-                m_connection.setClose( );
+                setClose( );
             }
 
             if ( !body )
             {
-                addHeader( "Content-Length", "0" );
-                m_connection.write( "\r\n", 2, m_connection.getClose( ) );
+                evbuffer_add( m_buffer, "Content-Length: 0\r\n\r\n", 21 );
+            }
+            else
+            {
+                if ( !length )
+                {
+                    length = strlen( body );
+                }
+                
+                evbuffer* compressed = NULL;
+                
+                if ( m_compressible && !m_encoded && length >= Compression::minLength( ) && Compression::level( ) &&
+                     m_status != HttpProtocol::NoContent && m_status != HttpProtocol::NotModified )
+                {
+                    //
+                    //  representation depends on Accept-Encoding, for shared caches as well as for the response cache
+                    //
+                    evbuffer_add( m_buffer, "Vary: Accept-Encoding\r\n", 23 );
+                    
+                    if ( m_cache && std::find( m_cacheVary.begin( ), m_cacheVary.end( ), "accept-encoding" ) == m_cacheVary.end( ) )
+                    {
+                        m_cacheVary.push_back( "accept-encoding" );
+                    }
+                    
+                    Compression::Encoding encoding = Compression::choose( m_accepted );
+                    
+                    if ( encoding != Compression::Identity )
+                    {
+                        compressed = Compression::compress( encoding, body, length );
+                    }
+                    
+                    if ( compressed )
+                    {
+                        evbuffer_add_printf( m_buffer, "Content-Encoding: %s\r\n", Compression::name( encoding ) );
+                    }
+                }
+                
+                if ( compressed )
+                {
+                    //
+                    //  compressed chains are moved, not copied
+                    //
+                    evbuffer_add_printf( m_buffer, "Content-Length: %u\r\n\r\n", ( unsigned int ) evbuffer_get_length( compressed ) );
+                    evbuffer_add_buffer( m_buffer, compressed );
+                }
+                else
+                {
+                    evbuffer_add_printf( m_buffer, "Content-Length: %u\r\n\r\n", length );
+                    evbuffer_add( m_buffer, body, length );
+                }
+            }
+
+            if ( m_cache && m_status == HttpProtocol::Ok )
+            {
+                m_cache->store( *m_cacheRequest, m_cacheVary, m_cacheTtl, m_buffer );
+            }
 
+            //
+            //  commit the whole response to the connection at once
+            //
+            commit( m_buffer );
+        }
+        
+        void Response::write( const char* data, unsigned int length )
+        {
+            if ( !m_chunked )
+            {
+                init( );
+                
+                if ( m_status > 400 )
+                {
+                    setClose( );
+                }
+                
+                evbuffer_add( m_buffer, "Transfer-Encoding: chunked\r\n\r\n", 30 );
+                m_chunked = true;
+            }
+            
+            if ( !length )
+            {
+                length = strlen( data );
+            }
+            
+            if ( !length )
+            {
+                //
+                //  empty chunk would terminate the body
+                //
                 return;
             }
+            
+            evbuffer_add_printf( m_buffer, "%x\r\n", length );
+            evbuffer_add( m_buffer, data, length );
+            evbuffer_add( m_buffer, "\r\n", 2 );
+            
+            if ( evbuffer_get_length( m_buffer ) >= FlushThreshold )
+            {
+                flush( );
+            }
+        }
+        
+        void Response::flush( )
+        {
+            if ( !m_chunked || !evbuffer_get_length( m_buffer ) )
+            {
+                return;
+            }
+            
+            commit( m_buffer, false );
+        }
+        
+        void Response::abort( )
+        {
+            setClose( );
+            commit( m_buffer );
+        }
+
+        bool Response::upgrade( WebSocket::Handler& handler, const std::string& endpoint, void* data )
+        {
+            if ( !m_switching )
+            {
+                return false;
+            }
+
+            m_upgrade = &handler;
+            m_endpoint = endpoint;
+            m_upgradeData = data;
+
+            return true;
+        }
+
+        //
+        //  append single line field, line breaks in the value would start new fields (or events) in every stream
+        //  and are dropped
+        //
+        static void appendField( std::string& fields, const char* name, const char* value )
+        {
+            fields.append( name );
+
+            for ( ; *value; value++ )
+            {
+                if ( *value != '\r' && *value != '\n' )
+                {
+                    fields.push_back( *value );
+                }
+            }
+
+            fields.push_back( '\n' );
+        }
 
-            char buffer[16];
-            sprintf( buffer, "%u", length ? length : ( unsigned int ) strlen( body ) );
-            addHeader( "Content-Length", buffer );
-            m_connection.write( "\r\n", 2 );
-            m_connection.write( body, length ? length : strlen( body ), m_connection.getClose( ) );
+        bool Response::eventStream( const std::vector< std::string >& topics )
+        {
+            if ( !m_switching && !( ( Connection& ) m_connection ).m_session )
+            {
+                return false;
+            }
+
+            m_eventStream = true;
+            m_topics = topics;
+
+            return true;
+        }
+
+        libevent::SharedBuffer* Response::event( const char* data, unsigned int length, const char* name, const char* id )
+        {
+            std::string fields;
+
+            if ( name )
+            {
+                appendField( fields, "event: ", name );
+            }
+
+            if ( id )
+            {
+                appendField( fields, "id: ", id );
+            }
+
+            //
+            //  every line of data is a separate field, client joins them with line breaks
+            //
+            const char* line = data;
+            const char* end = data + length;
+
+            for ( ; ; )
+            {
+                const char* next = ( const char* ) memchr( line, '\n', end - line );
+                unsigned int lineLength = ( next ? next : end ) - line;
+
+                if ( lineLength && line[ lineLength - 1 ] == '\r' )
+                {
+                    lineLength--;
+                }
+
+                fields.append( "data: " ).append( line, lineLength ).append( "\n" );
+
+                if ( !next )
+                {
+                    break;
+                }
+
+                line = next + 1;
+            }
+
+            fields.append( "\n" );
+
+            //
+            //  event is framed as a chunk of the stream response, HTTP/2 streams decode it as any other chunk
+            //
+            char size[ 16 ];
+            int sizeLength = snprintf( size, sizeof( size ), "%x\r\n", ( unsigned int ) fields.size( ) );
+
+            libevent::SharedBuffer* frame = new libevent::SharedBuffer( sizeLength + fields.size( ) + 2 );
+
+            memcpy( frame->data( ), size, sizeLength );
+            memcpy( frame->data( ) + sizeLength, fields.data( ), fields.size( ) );
+            memcpy( frame->data( ) + sizeLength + fields.size( ), "\r\n", 2 );
+
+            return frame;
+        }
+
+        void Response::complete( )
+        {
+            Connection& connection = ( Connection& ) m_connection;
+
+            if ( m_eventStream )
+            {
+                //
+                //  response is never completed, connection does not read further requests
+                //
+                m_switching = false;
+
+                if ( !connection.getClose( ) )
+                {
+                    connection.openEventStream( sequence( ), m_topics );
+                }
+
+                return;
+            }
+
+            propeller::Response::complete( );
+
+            if ( !m_switching )
+            {
+                return;
+            }
+
+            m_switching = false;
+
+            if ( m_upgrade && m_status == HttpProtocol::SwitchingProtocols && !connection.getClose( ) )
+            {
+                connection.upgrade( *m_upgrade, m_endpoint, m_upgradeData );
+                return;
+            }
 
+            connection.resume( );
         }
     }
 
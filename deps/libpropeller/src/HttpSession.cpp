@@ -0,0 +1,1335 @@
+/*
+ * File:   HttpSession.cpp
+ *
+ * HTTP/2 session of a connection
+ */
+
+#include "HttpSession.h"
+#include "HttpServer.h"
+
+#include <string.h>
+
+//
+//	Trace function
+//
+#include "trace.h"
+
+namespace propeller
+{
+    namespace http
+    {
+        static const char s_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+        enum
+        {
+            FrameHeaderLength = 9,
+            MaxWindowSize = 0x7fffffff,
+            MaxFrameSizeLimit = 16777215
+        };
+
+        unsigned int Session::s_sessions = 0;
+        unsigned int Session::s_streams = 0;
+
+        //
+        //  read 31 bit value in network byte order, reserved bit is ignored
+        //
+        static unsigned int readUint31( const unsigned char* data )
+        {
+            return ( ( data[ 0 ] & 0x7f ) << 24 ) | ( data[ 1 ] << 16 ) | ( data[ 2 ] << 8 ) | data[ 3 ];
+        }
+
+        static void writeUint32( unsigned char* data, unsigned int value )
+        {
+            data[ 0 ] = value >> 24;
+            data[ 1 ] = value >> 16;
+            data[ 2 ] = value >> 8;
+            data[ 3 ] = value;
+        }
+
+        Session::Stream::Stream( unsigned int _id, int window )
+        : id( _id ), state( Receiving ), request( NULL ), sequence( 0 ), head( false ), sendWindow( window ), received( 0 ),
+          headersSent( false ), body( Plain ), chunkRemaining( 0 ), complete( false ), ended( false )
+        {
+            input = evbuffer_new( );
+            output = evbuffer_new( );
+        }
+
+        Session::Stream::~Stream( )
+        {
+            if ( request )
+            {
+                delete request;
+            }
+
+            evbuffer_free( input );
+            evbuffer_free( output );
+        }
+
+        Session::Session( Connection& connection )
+        : m_connection( connection ), m_preface( false ), m_closed( false ), m_lastStream( 0 ), m_blockStream( 0 ), m_blockFlags( 0 ),
+          m_sendWindow( DefaultWindowSize ), m_initialWindow( DefaultWindowSize ), m_maxFrameSize( DefaultFrameSize ), m_received( 0 )
+        {
+            TRACE_ENTERLEAVE( );
+
+            m_frames = evbuffer_new( );
+
+            sys::General::interlockedIncrement( &s_sessions );
+
+            //
+            //  server preface, connection window is enlarged to match stream window
+            //
+            writeSettings( );
+            writeWindowUpdate( 0, InitialWindowSize - DefaultWindowSize );
+            flush( );
+        }
+
+        Session::~Session( )
+        {
+            TRACE_ENTERLEAVE( );
+
+            for ( std::map< unsigned int, Stream* >::iterator i = m_streams.begin( ); i != m_streams.end( ); i++ )
+            {
+                delete i->second;
+            }
+
+            evbuffer_free( m_frames );
+        }
+
+        int Session::preface( const char* data, unsigned int length )
+        {
+            if ( memcmp( data, s_preface, length < PrefaceLength ? length : ( unsigned int ) PrefaceLength ) )
+            {
+                return -1;
+            }
+
+            return length >= PrefaceLength ? 1 : 0;
+        }
+
+        void Session::onRead( )
+        {
+            TRACE_ENTERLEAVE( );
+
+            if ( m_closed )
+            {
+                //
+                //  GOAWAY has been sent, connection is closed once it is written
+                //
+                m_connection.drainInput( m_connection.inputLength( ) );
+                return;
+            }
+
+            if ( !m_preface )
+            {
+                if ( m_connection.inputLength( ) < PrefaceLength )
+                {
+                    return;
+                }
+
+                if ( preface( m_connection.pullInput( PrefaceLength ), PrefaceLength ) != 1 )
+                {
+                    goAway( ProtocolError );
+                    return;
+                }
+
+                m_connection.drainInput( PrefaceLength );
+                m_preface = true;
+            }
+
+            while ( !m_closed )
+            {
+                unsigned int available = m_connection.inputLength( );
+
+                if ( available < FrameHeaderLength )
+                {
+                    break;
+                }
+
+                const unsigned char* header = ( const unsigned char* ) m_connection.pullInput( FrameHeaderLength );
+                unsigned int length = ( header[ 0 ] << 16 ) | ( header[ 1 ] << 8 ) | header[ 2 ];
+
+                if ( length > DefaultFrameSize )
+                {
+                    //
+                    //  larger frames are not announced in settings
+                    //
+                    goAway( FrameSizeError );
+                    break;
+                }
+
+                if ( available < FrameHeaderLength + length )
+                {
+                    //
+                    //  wait for the whole frame
+                    //
+                    break;
+                }
+
+                unsigned int type = header[ 3 ];
+                unsigned int flags = header[ 4 ];
+                unsigned int id = readUint31( header + 5 );
+
+                m_connection.drainInput( FrameHeaderLength );
+
+                if ( !frame( type, flags, id, length ) )
+                {
+                    break;
+                }
+            }
+
+            flush( );
+        }
+
+        void Session::onWrite( )
+        {
+            pump( );
+            flush( );
+        }
+
+        bool Session::frame( unsigned int type, unsigned int flags, unsigned int id, unsigned int length )
+        {
+            if ( m_blockStream && ( type != Continuation || id != m_blockStream ) )
+            {
+                //
+                //  header block must not be interleaved with other frames
+                //
+                goAway( ProtocolError );
+                return false;
+            }
+
+            switch ( type )
+            {
+                case Data:
+                    return onData( flags, id, length );
+
+                case Headers:
+                    return onHeaders( flags, id, length );
+
+                case Continuation:
+                {
+                    if ( !m_blockStream || m_block.size( ) + length > Hpack::MaxListSize )
+                    {
+                        goAway( ProtocolError );
+                        return false;
+                    }
+
+                    if ( length )
+                    {
+                        m_block.append( m_connection.pullInput( length ), length );
+                        m_connection.drainInput( length );
+                    }
+
+                    return ( flags & EndHeaders ) ? onBlock( ) : true;
+                }
+
+                case Priority:
+                {
+                    //
+                    //  priorities are not used, streams are served round robin
+                    //
+                    if ( !id )
+                    {
+                        goAway( ProtocolError );
+                        return false;
+                    }
+
+                    m_connection.drainInput( length );
+
+                    if ( length != 5 )
+                    {
+                        reset( id, FrameSizeError );
+                    }
+
+                    return true;
+                }
+
+                case ResetStream:
+                {
+                    if ( !id || length != 4 || id > m_lastStream )
+                    {
+                        goAway( length != 4 ? FrameSizeError : ProtocolError );
+                        return false;
+                    }
+
+                    m_connection.drainInput( length );
+
+                    std::map< unsigned int, Stream* >::iterator found = m_streams.find( id );
+
+                    if ( found != m_streams.end( ) )
+                    {
+                        onReset( found->second );
+                    }
+
+                    return true;
+                }
+
+                case Settings:
+                {
+                    if ( id )
+                    {
+                        goAway( ProtocolError );
+                        return false;
+                    }
+
+                    return onSettings( flags, length );
+                }
+
+                case Ping:
+                {
+                    if ( id || length != 8 )
+                    {
+                        goAway( id ? ProtocolError : FrameSizeError );
+                        return false;
+                    }
+
+                    if ( !( flags & Ack ) )
+                    {
+                        writeHeader( Ping, Ack, 0, 8 );
+                        evbuffer_add( m_frames, m_connection.pullInput( 8 ), 8 );
+                    }
+
+                    m_connection.drainInput( 8 );
+
+                    return true;
+                }
+
+                case GoAway:
+                {
+                    if ( id )
+                    {
+                        goAway( ProtocolError );
+                        return false;
+                    }
+
+                    //
+                    //  client does not open new streams, those in progress are completed
+                    //
+                    TRACE( "GOAWAY received", "" );
+                    m_connection.drainInput( length );
+
+                    return true;
+                }
+
+                case WindowUpdate:
+                {
+                    if ( length != 4 )
+                    {
+                        goAway( FrameSizeError );
+                        return false;
+                    }
+
+                    unsigned int increment = readUint31( ( const unsigned char* ) m_connection.pullInput( 4 ) );
+                    m_connection.drainInput( 4 );
+
+                    if ( !id )
+                    {
+                        if ( !increment || ( long long ) m_sendWindow + increment > MaxWindowSize )
+                        {
+                            goAway( increment ? FlowControlError : ProtocolError );
+                            return false;
+                        }
+
+                        m_sendWindow += increment;
+                    }
+                    else
+                    {
+                        std::map< unsigned int, Stream* >::iterator found = m_streams.find( id );
+
+                        if ( found != m_streams.end( ) )
+                        {
+                            Stream* stream = found->second;
+
+                            if ( !increment || ( long long ) stream->sendWindow + increment > MaxWindowSize )
+                            {
+                                reset( stream, increment ? FlowControlError : ProtocolError );
+                                return true;
+                            }
+
+                            stream->sendWindow += increment;
+                        }
+                    }
+
+                    pump( );
+
+                    return true;
+                }
+
+                case PushPromise:
+                    goAway( ProtocolError );
+                    return false;
+
+                default:
+                    //
+                    //  unknown frame types are ignored
+                    //
+                    m_connection.drainInput( length );
+                    return true;
+            }
+        }
+
+        bool Session::onData( unsigned int flags, unsigned int id, unsigned int length )
+        {
+            if ( !id )
+            {
+                goAway( ProtocolError );
+                return false;
+            }
+
+            //
+            //  whole payload, padding included, counts against flow control windows
+            //
+            unsigned int consumed = length;
+            unsigned int padding = 0;
+
+            m_received += consumed;
+
+            if ( m_received > InitialWindowSize )
+            {
+                goAway( FlowControlError );
+                return false;
+            }
+
+            if ( flags & Padded )
+            {
+                if ( !length || ( padding = *( const unsigned char* ) m_connection.pullInput( 1 ) ) >= length )
+                {
+                    goAway( ProtocolError );
+                    return false;
+                }
+
+                m_connection.drainInput( 1 );
+                length -= padding + 1;
+            }
+
+            std::map< unsigned int, Stream* >::iterator found = m_streams.find( id );
+            Stream* stream = found != m_streams.end( ) ? found->second : NULL;
+
+            if ( !stream || stream->state != Stream::Receiving )
+            {
+                if ( id > m_lastStream )
+                {
+                    goAway( ProtocolError );
+                    return false;
+                }
+
+                m_connection.drainInput( length + padding );
+
+                if ( !stream )
+                {
+                    reset( id, StreamClosed );
+                }
+                else if ( stream->state == Stream::Processing )
+                {
+                    reset( stream, StreamClosed );
+                }
+            }
+            else
+            {
+                stream->received += consumed;
+
+                if ( stream->received > InitialWindowSize )
+                {
+                    m_connection.drainInput( length + padding );
+                    reset( stream, FlowControlError );
+                }
+                else if ( length > Body::maxLength( ) - stream->request->m_content.length( ) )
+                {
+                    //
+                    //  limit applies to all DATA frames of the stream, announced length is checked with request head
+                    //
+                    m_connection.drainInput( length + padding );
+                    reset( stream, Cancel );
+                }
+                else if ( !stream->request->m_content.receive( m_connection, length ) )
+                {
+                    m_connection.drainInput( length + padding );
+                    reset( stream, InternalError );
+                }
+                else
+                {
+                    m_connection.drainInput( padding );
+
+                    if ( flags & EndStream )
+                    {
+                        dispatch( stream );
+                    }
+                    else if ( stream->received >= InitialWindowSize / 2 )
+                    {
+                        writeWindowUpdate( id, stream->received );
+                        stream->received = 0;
+                    }
+                }
+            }
+
+            if ( m_received >= InitialWindowSize / 2 )
+            {
+                writeWindowUpdate( 0, m_received );
+                m_received = 0;
+            }
+
+            return true;
+        }
+
+        bool Session::onHeaders( unsigned int flags, unsigned int id, unsigned int length )
+        {
+            if ( !id || !( id & 1 ) )
+            {
+                goAway( ProtocolError );
+                return false;
+            }
+
+            unsigned int padding = 0;
+
+            if ( flags & Padded )
+            {
+                if ( !length )
+                {
+                    goAway( ProtocolError );
+                    return false;
+                }
+
+                padding = *( const unsigned char* ) m_connection.pullInput( 1 );
+                m_connection.drainInput( 1 );
+                length--;
+            }
+
+            if ( flags & PriorityFlag )
+            {
+                if ( length < 5 )
+                {
+                    goAway( ProtocolError );
+                    return false;
+                }
+
+                m_connection.drainInput( 5 );
+                length -= 5;
+            }
+
+            if ( padding > length )
+            {
+                goAway( ProtocolError );
+                return false;
+            }
+
+            length -= padding;
+
+            m_block.clear( );
+
+            if ( length )
+            {
+                m_block.append( m_connection.pullInput( length ), length );
+            }
+
+            m_connection.drainInput( length + padding );
+
+            m_blockStream = id;
+            m_blockFlags = flags;
+
+            return ( flags & EndHeaders ) ? onBlock( ) : true;
+        }
+
+        bool Session::onBlock( )
+        {
+            unsigned int id = m_blockStream;
+            unsigned int flags = m_blockFlags;
+
+            m_blockStream = 0;
+            m_headers.clear( );
+
+            //
+            //  block is decoded even if stream is refused, so dynamic table stays in sync
+            //
+            if ( !m_decoder.decode( ( const unsigned char* ) m_block.data( ), m_block.size( ), m_headers ) )
+            {
+                goAway( CompressionError );
+                return false;
+            }
+
+            std::map< unsigned int, Stream* >::iterator found = m_streams.find( id );
+
+            if ( found != m_streams.end( ) )
+            {
+                Stream* stream = found->second;
+
+                if ( stream->state != Stream::Receiving )
+                {
+                    if ( stream->state == Stream::Processing )
+                    {
+                        reset( stream, StreamClosed );
+                    }
+
+                    return true;
+                }
+
+                //
+                //  trailer fields end the request body, they are not passed to the handler
+                //
+                if ( !( flags & EndStream ) )
+                {
+                    reset( stream, ProtocolError );
+                    return true;
+                }
+
+                dispatch( stream );
+
+                return true;
+            }
+
+            if ( id <= m_lastStream )
+            {
+                goAway( ProtocolError );
+                return false;
+            }
+
+            m_lastStream = id;
+
+            if ( m_streams.size( ) >= MaxConcurrentStreams )
+            {
+                reset( id, RefusedStream );
+                return true;
+            }
+
+            Stream* stream = new Stream( id, m_initialWindow );
+            m_streams[ id ] = stream;
+
+            if ( !request( stream, m_headers ) )
+            {
+                reset( stream, ProtocolError );
+                return true;
+            }
+
+            if ( flags & EndStream )
+            {
+                dispatch( stream );
+            }
+
+            return true;
+        }
+
+        bool Session::onSettings( unsigned int flags, unsigned int length )
+        {
+            if ( flags & Ack )
+            {
+                if ( length )
+                {
+                    goAway( FrameSizeError );
+                    return false;
+                }
+
+                return true;
+            }
+
+            if ( length % 6 )
+            {
+                goAway( FrameSizeError );
+                return false;
+            }
+
+            const unsigned char* data = length ? ( const unsigned char* ) m_connection.pullInput( length ) : NULL;
+
+            for ( unsigned int offset = 0; offset < length; offset += 6 )
+            {
+                unsigned int setting = ( data[ offset ] << 8 ) | data[ offset + 1 ];
+                unsigned int value = ( data[ offset + 2 ] << 24 ) | ( data[ offset + 3 ] << 16 ) | ( data[ offset + 4 ] << 8 ) | data[ offset + 5 ];
+
+                switch ( setting )
+                {
+                    case HeaderTableSize:
+                        m_encoder.setMaxSize( value );
+                        break;
+
+                    case EnablePush:
+                        if ( value > 1 )
+                        {
+                            goAway( ProtocolError );
+                            return false;
+                        }
+
+                        break;
+
+                    case InitialWindowSizeSetting:
+                    {
+                        if ( value > MaxWindowSize )
+                        {
+                            goAway( FlowControlError );
+                            return false;
+                        }
+
+                        //
+                        //  change applies to windows of all open streams
+                        //
+                        int delta = ( int ) value - m_initialWindow;
+
+                        for ( std::map< unsigned int, Stream* >::iterator i = m_streams.begin( ); i != m_streams.end( ); i++ )
+                        {
+                            i->second->sendWindow += delta;
+                        }
+
+                        m_initialWindow = value;
+                        break;
+                    }
+
+                    case MaxFrameSize:
+                        if ( value < DefaultFrameSize || value > MaxFrameSizeLimit )
+                        {
+                            goAway( ProtocolError );
+                            return false;
+                        }
+
+                        m_maxFrameSize = value;
+                        break;
+
+                    default:
+                        break;
+                }
+            }
+
+            m_connection.drainInput( length );
+
+            writeHeader( Settings, Ack, 0, 0 );
+            pump( );
+
+            return true;
+        }
+
+        void Session::onReset( Stream* stream )
+        {
+            if ( stream->state == Stream::Receiving || stream->complete )
+            {
+                remove( stream );
+                return;
+            }
+
+            //
+            //  request is being processed, stream is removed when its response is complete
+            //
+            stream->state = Stream::Reset;
+            evbuffer_drain( stream->input, evbuffer_get_length( stream->input ) );
+            evbuffer_drain( stream->output, evbuffer_get_length( stream->output ) );
+        }
+
+        bool Session::request( Stream* stream, const Hpack::Headers& headers )
+        {
+            const std::string* method = NULL;
+            const std::string* path = NULL;
+            const std::string* authority = NULL;
+            bool host = false;
+            bool regular = false;
+
+            std::string fields;
+            std::string cookie;
+
+            for ( Hpack::Headers::const_iterator i = headers.begin( ); i != headers.end( ); i++ )
+            {
+                const std::string& name = i->first;
+                const std::string& value = i->second;
+
+                if ( name.empty( ) || value.find_first_of( "\r\n", 0, 3 ) != std::string::npos )
+                {
+                    return false;
+                }
+
+                if ( name[ 0 ] == ':' )
+                {
+                    //
+                    //  pseudo headers precede regular ones
+                    //
+                    if ( regular )
+                    {
+                        return false;
+                    }
+
+                    if ( name == ":method" )
+                    {
+                        method = &value;
+                    }
+                    else if ( name == ":path" )
+                    {
+                        path = &value;
+                    }
+                    else if ( name == ":authority" )
+                    {
+                        authority = &value;
+                    }
+                    else if ( name != ":scheme" )
+                    {
+                        return false;
+                    }
+
+                    continue;
+                }
+
+                regular = true;
+
+                for ( std::string::const_iterator c = name.begin( ); c != name.end( ); c++ )
+                {
+                    if ( ( *c >= 'A' && *c <= 'Z' ) || *c <= ' ' || *c == ':' || *c == 127 )
+                    {
+                        return false;
+                    }
+                }
+
+                //
+                //  connection specific headers are not allowed
+                //
+                if ( name == "connection" || name == "keep-alive" || name == "proxy-connection" || name == "transfer-encoding" || name == "upgrade" )
+                {
+                    return false;
+                }
+
+                if ( name == "cookie" )
+                {
+                    //
+                    //  cookie may be split into several fields
+                    //
+                    if ( !cookie.empty( ) )
+                    {
+                        cookie.append( "; " );
+                    }
+
+                    cookie.append( value );
+                    continue;
+                }
+
+                if ( name == "host" )
+                {
+                    host = true;
+                }
+
+                fields.append( name ).append( ": " ).append( value ).append( "\r\n" );
+            }
+
+            if ( !method || !path || method->empty( ) || path->empty( ) ||
+                 method->find( ' ' ) != std::string::npos || path->find( ' ' ) != std::string::npos )
+            {
+                return false;
+            }
+
+            //
+            //  request is passed to handler in the same form as HTTP/1.1 request
+            //
+            std::string head;
+            head.reserve( method->size( ) + path->size( ) + fields.size( ) + cookie.size( ) + 64 );
+            head.append( *method ).append( " " ).append( *path ).append( " HTTP/2\r\n" );
+
+            if ( authority && !host )
+            {
+                head.append( "host: " ).append( *authority ).append( "\r\n" );
+            }
+
+            head.append( fields );
+
+            if ( !cookie.empty( ) )
+            {
+                head.append( "cookie: " ).append( cookie ).append( "\r\n" );
+            }
+
+            head.append( "\r\n" );
+
+            if ( head.size( ) > Parser::MaxHeadLength )
+            {
+                return false;
+            }
+
+            stream->request = ( Request* ) m_connection.createRequest( );
+            stream->head = *method == "HEAD";
+
+            return stream->request->assign( head );
+        }
+
+        void Session::dispatch( Stream* stream )
+        {
+            TRACE_ENTERLEAVE( );
+
+            sys::General::interlockedIncrement( &s_streams );
+
+            Request* request = stream->request;
+            stream->request = NULL;
+            stream->state = Stream::Processing;
+
+            m_connection.ref( );
+
+            Response* response = ( Response* ) m_connection.createResponse( );
+            stream->sequence = response->sequence( );
+            m_sequences[ stream->sequence ] = stream;
+
+            //
+            //  stream may be complete and removed when this returns (cached response or file)
+            //
+            m_connection.process( request, response );
+        }
+
+        bool Session::commit( unsigned int sequence, evbuffer* buffer, bool complete )
+        {
+            TRACE_ENTERLEAVE( );
+
+            std::map< unsigned int, Stream* >::iterator found = m_sequences.find( sequence );
+
+            if ( found == m_sequences.end( ) )
+            {
+                return false;
+            }
+
+            Stream* stream = found->second;
+
+            if ( complete )
+            {
+                stream->complete = true;
+            }
+
+            if ( m_closed || stream->state == Stream::Reset )
+            {
+                //
+                //  nobody is waiting for the response
+                //
+                if ( buffer )
+                {
+                    evbuffer_drain( buffer, evbuffer_get_length( buffer ) );
+                }
+
+                if ( complete )
+                {
+                    remove( stream );
+                }
+
+                return false;
+            }
+
+            if ( buffer )
+            {
+                evbuffer_add_buffer( stream->input, buffer );
+            }
+
+            if ( !translate( stream ) )
+            {
+                reset( stream, InternalError );
+            }
+            else if ( stream->ended )
+            {
+                remove( stream );
+            }
+            else
+            {
+                pump( );
+            }
+
+            flush( );
+
+            return true;
+        }
+
+        bool Session::translate( Stream* stream )
+        {
+            if ( !stream->headersSent )
+            {
+                evbuffer_ptr end = evbuffer_search( stream->input, "\r\n\r\n", 4, NULL );
+
+                if ( end.pos == -1 )
+                {
+                    //
+                    //  head is always committed at once, incomplete response without head is an error
+                    //
+                    return !stream->complete;
+                }
+
+                unsigned int headLength = end.pos + 4;
+                const char* head = ( const char* ) evbuffer_pullup( stream->input, headLength );
+                const char* headEnd = head + headLength - 2;
+
+                //
+                //  status line
+                //
+                const char* line = ( const char* ) memchr( head, ' ', headLength );
+
+                if ( !line || headEnd - line < 4 )
+                {
+                    return false;
+                }
+
+                std::string block;
+                m_encoder.begin( block );
+                m_encoder.encode( ":status", std::string( line + 1, 3 ).c_str( ), block );
+
+                std::string name;
+                std::string value;
+
+                for ( line = ( const char* ) memchr( head, '\n', headLength ) + 1; line < headEnd; )
+                {
+                    const char* lineEnd = ( const char* ) memchr( line, '\n', headEnd - line );
+                    const char* separator = ( const char* ) memchr( line, ':', lineEnd - line );
+
+                    if ( !lineEnd || !separator )
+                    {
+                        return false;
+                    }
+
+                    name.assign( line, separator - line );
+
+                    for ( std::string::iterator c = name.begin( ); c != name.end( ); c++ )
+                    {
+                        if ( *c >= 'A' && *c <= 'Z' )
+                        {
+                            *c += 'a' - 'A';
+                        }
+                    }
+
+                    const char* valueBegin = separator + 1;
+                    const char* valueEnd = lineEnd[ -1 ] == '\r' ? lineEnd - 1 : lineEnd;
+
+                    while ( valueBegin < valueEnd && *valueBegin == ' ' )
+                    {
+                        valueBegin++;
+                    }
+
+                    value.assign( valueBegin, valueEnd - valueBegin );
+                    line = lineEnd + 1;
+
+                    if ( name == "transfer-encoding" )
+                    {
+                        //
+                        //  streamed response, chunks are unwrapped into DATA frames
+                        //
+                        stream->body = Stream::ChunkSize;
+                        continue;
+                    }
+
+                    if ( name == "connection" || name == "keep-alive" || name == "proxy-connection" || name == "upgrade" )
+                    {
+                        continue;
+                    }
+
+                    m_encoder.encode( name.c_str( ), value.c_str( ), block );
+                }
+
+                evbuffer_drain( stream->input, headLength );
+
+                bool ended = stream->complete && stream->body == Stream::Plain && ( stream->head || !evbuffer_get_length( stream->input ) );
+
+                //
+                //  header block is split into HEADERS and CONTINUATION frames by peer frame size
+                //
+                unsigned int offset = 0;
+
+                do
+                {
+                    unsigned int length = block.size( ) - offset < m_maxFrameSize ? block.size( ) - offset : m_maxFrameSize;
+                    unsigned int flags = offset + length == block.size( ) ? EndHeaders : 0;
+
+                    if ( !offset && ended )
+                    {
+                        flags |= EndStream;
+                    }
+
+                    writeHeader( offset ? Continuation : Headers, flags, stream->id, length );
+                    evbuffer_add( m_frames, block.data( ) + offset, length );
+
+                    offset += length;
+                }
+                while ( offset < block.size( ) );
+
+                stream->headersSent = true;
+                stream->ended = ended;
+            }
+
+            if ( stream->head )
+            {
+                //
+                //  response to HEAD has no body
+                //
+                evbuffer_drain( stream->input, evbuffer_get_length( stream->input ) );
+                return true;
+            }
+
+            if ( stream->body == Stream::Plain )
+            {
+                evbuffer_add_buffer( stream->output, stream->input );
+                return true;
+            }
+
+            if ( !decodeChunks( stream ) )
+            {
+                return false;
+            }
+
+            //
+            //  streamed response completed without the last chunk was aborted
+            //
+            return !stream->complete || stream->body == Stream::ChunksDone;
+        }
+
+        bool Session::decodeChunks( Stream* stream )
+        {
+            for ( ; ; )
+            {
+                switch ( stream->body )
+                {
+                    case Stream::ChunkSize:
+                    case Stream::ChunkTrailer:
+                    {
+                        char* line = evbuffer_readln( stream->input, NULL, EVBUFFER_EOL_CRLF );
+
+                        if ( !line )
+                        {
+                            return true;
+                        }
+
+                        if ( stream->body == Stream::ChunkSize )
+                        {
+                            char* end = NULL;
+                            stream->chunkRemaining = strtoul( line, &end, 16 );
+
+                            if ( end == line )
+                            {
+                                free( line );
+                                return false;
+                            }
+
+                            stream->body = stream->chunkRemaining ? Stream::ChunkData : Stream::ChunkTrailer;
+                        }
+                        else if ( !*line )
+                        {
+                            stream->body = Stream::ChunksDone;
+                        }
+
+                        free( line );
+                        break;
+                    }
+
+                    case Stream::ChunkData:
+                    {
+                        unsigned int length = evbuffer_get_length( stream->input );
+
+                        if ( !length )
+                        {
+                            return true;
+                        }
+
+                        if ( length > stream->chunkRemaining )
+                        {
+                            length = stream->chunkRemaining;
+                        }
+
+                        evbuffer_remove_buffer( stream->input, stream->output, length );
+                        stream->chunkRemaining -= length;
+
+                        if ( stream->chunkRemaining )
+                        {
+                            return true;
+                        }
+
+                        stream->body = Stream::ChunkEnd;
+                        break;
+                    }
+
+                    case Stream::ChunkEnd:
+                    {
+                        if ( evbuffer_get_length( stream->input ) < 2 )
+                        {
+                            return true;
+                        }
+
+                        evbuffer_drain( stream->input, 2 );
+                        stream->body = Stream::ChunkSize;
+                        break;
+                    }
+
+                    default:
+                        evbuffer_drain( stream->input, evbuffer_get_length( stream->input ) );
+                        return true;
+                }
+            }
+        }
+
+        void Session::pump( )
+        {
+            if ( m_closed )
+            {
+                return;
+            }
+
+            //
+            //  one DATA frame per stream in turn, so responses are interleaved
+            //
+            bool progress = true;
+
+            while ( progress )
+            {
+                progress = false;
+
+                for ( std::map< unsigned int, Stream* >::iterator i = m_streams.begin( ); i != m_streams.end( ); )
+                {
+                    Stream* stream = i->second;
+                    i++;
+
+                    if ( stream->state != Stream::Processing || !stream->headersSent || stream->ended )
+                    {
+                        continue;
+                    }
+
+                    if ( m_connection.outputLength( ) + evbuffer_get_length( m_frames ) >= OutputThreshold )
+                    {
+                        //
+                        //  resumed by onWrite
+                        //
+                        return;
+                    }
+
+                    bool last = stream->complete && ( stream->body == Stream::Plain || stream->body == Stream::ChunksDone || stream->head );
+                    unsigned int pending = evbuffer_get_length( stream->output );
+                    unsigned int length = 0;
+
+                    if ( pending )
+                    {
+                        int window = m_sendWindow < stream->sendWindow ? m_sendWindow : stream->sendWindow;
+
+                        if ( window <= 0 )
+                        {
+                            continue;
+                        }
+
+                        length = pending;
+
+                        if ( length > ( unsigned int ) window )
+                        {
+                            length = window;
+                        }
+
+                        if ( length > m_maxFrameSize )
+                        {
+                            length = m_maxFrameSize;
+                        }
+                    }
+                    else if ( !last )
+                    {
+                        continue;
+                    }
+
+                    bool end = last && length == pending;
+
+                    writeHeader( Data, end ? EndStream : 0, stream->id, length );
+                    evbuffer_remove_buffer( stream->output, m_frames, length );
+
+                    m_sendWindow -= length;
+                    stream->sendWindow -= length;
+                    progress = true;
+
+                    if ( end )
+                    {
+                        stream->ended = true;
+                        remove( stream );
+                    }
+                }
+            }
+        }
+
+        void Session::writeHeader( unsigned int type, unsigned int flags, unsigned int id, unsigned int length )
+        {
+            unsigned char header[ FrameHeaderLength ];
+
+            header[ 0 ] = length >> 16;
+            header[ 1 ] = length >> 8;
+            header[ 2 ] = length;
+            header[ 3 ] = type;
+            header[ 4 ] = flags;
+            writeUint32( header + 5, id & MaxWindowSize );
+
+            evbuffer_add( m_frames, header, sizeof( header ) );
+        }
+
+        void Session::writeSettings( )
+        {
+            static const unsigned int settings[][ 2 ] =
+            {
+                { MaxConcurrentStreamsSetting, MaxConcurrentStreams },
+                { InitialWindowSizeSetting, InitialWindowSize },
+                { MaxHeaderListSize, Parser::MaxHeadLength }
+            };
+
+            unsigned char payload[ sizeof( settings ) / sizeof( settings[ 0 ] ) * 6 ];
+
+            for ( unsigned int i = 0; i < sizeof( settings ) / sizeof( settings[ 0 ] ); i++ )
+            {
+                payload[ i * 6 ] = settings[ i ][ 0 ] >> 8;
+                payload[ i * 6 + 1 ] = settings[ i ][ 0 ];
+                writeUint32( payload + i * 6 + 2, settings[ i ][ 1 ] );
+            }
+
+            writeHeader( Settings, 0, 0, sizeof( payload ) );
+            evbuffer_add( m_frames, payload, sizeof( payload ) );
+        }
+
+        void Session::writeWindowUpdate( unsigned int id, unsigned int increment )
+        {
+            unsigned char payload[ 4 ];
+            writeUint32( payload, increment );
+
+            writeHeader( WindowUpdate, 0, id, sizeof( payload ) );
+            evbuffer_add( m_frames, payload, sizeof( payload ) );
+        }
+
+        void Session::reset( Stream* stream, Error error )
+        {
+            reset( stream->id, error );
+            onReset( stream );
+        }
+
+        void Session::reset( unsigned int id, Error error )
+        {
+            TRACE( "stream %u reset, error %d", id, error );
+
+            unsigned char payload[ 4 ];
+            writeUint32( payload, error );
+
+            writeHeader( ResetStream, 0, id, sizeof( payload ) );
+            evbuffer_add( m_frames, payload, sizeof( payload ) );
+        }
+
+        void Session::goAway( Error error )
+        {
+            if ( m_closed )
+            {
+                return;
+            }
+
+            TRACE( "GOAWAY, error %d", error );
+
+            unsigned char payload[ 8 ];
+            writeUint32( payload, m_lastStream );
+            writeUint32( payload + 4, error );
+
+            writeHeader( GoAway, 0, 0, sizeof( payload ) );
+            evbuffer_add( m_frames, payload, sizeof( payload ) );
+
+            //
+            //  connection is closed once frames are written, responses still in progress are discarded
+            //
+            m_closed = true;
+            m_connection.setClose( );
+            m_connection.write( m_frames, true );
+        }
+
+        void Session::remove( Stream* stream )
+        {
+            if ( stream->state != Stream::Receiving )
+            {
+                m_sequences.erase( stream->sequence );
+            }
+
+            m_streams.erase( stream->id );
+            delete stream;
+        }
+
+        void Session::flush( )
+        {
+            if ( !m_closed && evbuffer_get_length( m_frames ) )
+            {
+                m_connection.write( m_frames );
+            }
+        }
+
+        void Session::getMetrics( unsigned int& sessions, unsigned int& streams )
+        {
+            sessions = s_sessions;
+            streams = s_streams;
+        }
+    }
+}
@@ -0,0 +1,608 @@
+/*
+ * File:   HttpWebSocket.cpp
+ *
+ * WebSocket connection upgraded from HTTP/1.1 request
+ */
+
+#include "HttpWebSocket.h"
+#include "HttpServer.h"
+
+#include <string.h>
+#include <strings.h>
+
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+
+//
+//	Trace function
+//
+#include "trace.h"
+
+namespace propeller
+{
+    namespace http
+    {
+        static const char s_guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+        enum
+        {
+            MaxHeaderLength = 14,
+            MaxControlPayload = 125,
+
+            //
+            //  close codes
+            //
+            ProtocolError = 1002,
+            InvalidData = 1007,
+            MessageTooBig = 1009
+        };
+
+        unsigned int WebSocket::s_sockets = 0;
+        unsigned int WebSocket::s_messages = 0;
+
+        //
+        //  strict UTF-8 check: no overlong forms, surrogates or code points above U+10FFFF
+        //
+        static bool validUtf8( const unsigned char* data, size_t length )
+        {
+            const unsigned char* end = data + length;
+
+            while ( data < end )
+            {
+                unsigned char c = *data;
+
+                if ( c < 0x80 )
+                {
+                    data++;
+                    continue;
+                }
+
+                unsigned int count = 0;
+                unsigned int min = 0;
+                unsigned int code = 0;
+
+                if ( ( c & 0xe0 ) == 0xc0 )
+                {
+                    count = 1;
+                    min = 0x80;
+                    code = c & 0x1f;
+                }
+                else if ( ( c & 0xf0 ) == 0xe0 )
+                {
+                    count = 2;
+                    min = 0x800;
+                    code = c & 0x0f;
+                }
+                else if ( ( c & 0xf8 ) == 0xf0 )
+                {
+                    count = 3;
+                    min = 0x10000;
+                    code = c & 0x07;
+                }
+                else
+                {
+                    return false;
+                }
+
+                if ( ( size_t ) ( end - data ) <= count )
+                {
+                    return false;
+                }
+
+                for ( unsigned int i = 1; i <= count; i++ )
+                {
+                    if ( ( data[ i ] & 0xc0 ) != 0x80 )
+                    {
+                        return false;
+                    }
+
+                    code = ( code << 6 ) | ( data[ i ] & 0x3f );
+                }
+
+                if ( code < min || code > 0x10ffff || ( code >= 0xd800 && code <= 0xdfff ) )
+                {
+                    return false;
+                }
+
+                data += count + 1;
+            }
+
+            return true;
+        }
+
+        //
+        //  check if comma separated header value lists the token
+        //
+        static bool hasToken( const char* value, const char* token )
+        {
+            size_t length = strlen( token );
+
+            while ( value && *value )
+            {
+                while ( *value == ' ' || *value == '\t' || *value == ',' )
+                {
+                    value++;
+                }
+
+                const char* end = value;
+
+                while ( *end && *end != ',' && *end != ' ' && *end != '\t' )
+                {
+                    end++;
+                }
+
+                if ( ( size_t ) ( end - value ) == length && !strncasecmp( value, token, length ) )
+                {
+                    return true;
+                }
+
+                value = end;
+            }
+
+            return false;
+        }
+
+        //
+        //  write frame header, returns header length
+        //
+        static unsigned int frameHeader( unsigned char* header, unsigned int opcode, unsigned int length )
+        {
+            header[ 0 ] = 0x80 | opcode;
+
+            if ( length < 126 )
+            {
+                header[ 1 ] = length;
+                return 2;
+            }
+
+            if ( length <= 0xffff )
+            {
+                header[ 1 ] = 126;
+                header[ 2 ] = length >> 8;
+                header[ 3 ] = length;
+                return 4;
+            }
+
+            header[ 1 ] = 127;
+            memset( header + 2, 0, 4 );
+            header[ 6 ] = length >> 24;
+            header[ 7 ] = length >> 16;
+            header[ 8 ] = length >> 8;
+            header[ 9 ] = length;
+
+            return 10;
+        }
+
+        WebSocket::WebSocket( Connection& connection, Handler& handler, const std::string& endpoint, void* data )
+        : m_connection( connection ), m_handler( handler ), m_endpoint( endpoint ), m_data( data ), m_state( Open ), m_ref( 1 ), m_notified( false ),
+          m_opcode( Continuation )
+        {
+            TRACE_ENTERLEAVE( );
+
+            //
+            //  connection is not deleted while socket is referenced
+            //
+            m_connection.ref( );
+        }
+
+        WebSocket::~WebSocket( )
+        {
+            TRACE_ENTERLEAVE( );
+
+            m_connection.deref( );
+        }
+
+        bool WebSocket::handshake( const Request& request, std::string& accept )
+        {
+            const char* key = request.header( "sec-websocket-key" );
+            const char* version = request.header( "sec-websocket-version" );
+            const char* upgrade = request.header( "upgrade" );
+
+            if ( strcmp( request.method( ), "GET" ) || strcmp( request.protocol( ), "HTTP/1.1" ) || !upgrade || strcasecmp( upgrade, "websocket" ) ||
+                 !hasToken( request.header( "connection" ), "upgrade" ) || !version || strcmp( version, "13" ) || !key || strlen( key ) != 24 )
+            {
+                return false;
+            }
+
+            std::string value = key;
+            value.append( s_guid );
+
+            unsigned char digest[ SHA_DIGEST_LENGTH ];
+            SHA1( ( const unsigned char* ) value.data( ), value.size( ), digest );
+
+            unsigned char encoded[ 4 * ( ( SHA_DIGEST_LENGTH + 2 ) / 3 ) + 1 ];
+            int length = EVP_EncodeBlock( encoded, digest, SHA_DIGEST_LENGTH );
+
+            accept.assign( ( const char* ) encoded, length );
+
+            return true;
+        }
+
+        libevent::SharedBuffer* WebSocket::frame( const char* data, unsigned int length, bool binary )
+        {
+            unsigned char header[ MaxHeaderLength ];
+            unsigned int headerLength = frameHeader( header, binary ? Binary : Text, length );
+
+            libevent::SharedBuffer* frame = new libevent::SharedBuffer( headerLength + length );
+            memcpy( frame->data( ), header, headerLength );
+            memcpy( frame->data( ) + headerLength, data, length );
+
+            return frame;
+        }
+
+        bool WebSocket::current( ) const
+        {
+            return m_connection.thread( ).current( );
+        }
+
+        void WebSocket::post( Operation* operation )
+        {
+            m_connection.thread( ).post( operation );
+        }
+
+        void WebSocket::deref( )
+        {
+            if ( !current( ) )
+            {
+                //
+                //  operations posted before are delivered first, socket is still referenced by them
+                //
+                post( new Operation( *this, Operation::Deref ) );
+                return;
+            }
+
+            if ( --m_ref == 0 )
+            {
+                delete this;
+            }
+        }
+
+        void WebSocket::send( const char* data, unsigned int length, bool binary )
+        {
+            if ( !current( ) )
+            {
+                Operation* operation = new Operation( *this, Operation::Send );
+                operation->data.assign( data, length );
+                operation->binary = binary;
+
+                post( operation );
+                return;
+            }
+
+            if ( m_state == Open )
+            {
+                writeFrame( binary ? Binary : Text, data, length );
+            }
+        }
+
+        void WebSocket::subscribe( const std::string& channel )
+        {
+            if ( !current( ) )
+            {
+                Operation* operation = new Operation( *this, Operation::Subscribe );
+                operation->data = channel;
+
+                post( operation );
+                return;
+            }
+
+            if ( m_state == Open )
+            {
+                m_connection.subscribe( channel );
+            }
+        }
+
+        void WebSocket::unsubscribe( const std::string& channel )
+        {
+            if ( !current( ) )
+            {
+                Operation* operation = new Operation( *this, Operation::Unsubscribe );
+                operation->data = channel;
+
+                post( operation );
+                return;
+            }
+
+            m_connection.unsubscribe( channel );
+        }
+
+        void WebSocket::close( unsigned int code )
+        {
+            if ( !current( ) )
+            {
+                post( new Operation( *this, Operation::CloseSocket, code ) );
+                return;
+            }
+
+            if ( m_state != Open )
+            {
+                return;
+            }
+
+            //
+            //  connection is closed as soon as close frame is written, reply of the client is not awaited
+            //
+            unsigned char payload[ 2 ] = { ( unsigned char ) ( code >> 8 ), ( unsigned char ) code };
+
+            m_state = Closing;
+            writeFrame( Close, ( const char* ) payload, sizeof( payload ), true );
+
+            notify( );
+        }
+
+        void WebSocket::getMetrics( unsigned int& sockets, unsigned int& messages )
+        {
+            sockets = s_sockets;
+            messages = s_messages;
+        }
+
+        void WebSocket::onOpen( )
+        {
+            TRACE_ENTERLEAVE( );
+
+            sys::General::interlockedIncrement( &s_sockets );
+
+            m_handler.onOpen( *this );
+        }
+
+        void WebSocket::onRead( )
+        {
+            TRACE_ENTERLEAVE( );
+
+            while ( m_state == Open && parse( ) )
+            {
+            }
+
+            if ( m_state != Open )
+            {
+                //
+                //  anything after close frame is ignored
+                //
+                m_connection.drainInput( m_connection.inputLength( ) );
+            }
+        }
+
+        void WebSocket::onDisconnect( )
+        {
+            TRACE_ENTERLEAVE( );
+
+            m_state = Closed;
+            notify( );
+        }
+
+        void WebSocket::notify( )
+        {
+            if ( m_notified )
+            {
+                return;
+            }
+
+            m_notified = true;
+            m_handler.onClose( *this );
+        }
+
+        bool WebSocket::parse( )
+        {
+            unsigned int available = m_connection.inputLength( );
+
+            if ( available < 2 )
+            {
+                return false;
+            }
+
+            const unsigned char* header = ( const unsigned char* ) m_connection.pullInput( available < ( unsigned int ) MaxHeaderLength ? available : ( unsigned int ) MaxHeaderLength );
+
+            bool fin = header[ 0 ] & 0x80;
+            unsigned int opcode = header[ 0 ] & 0x0f;
+
+            if ( header[ 0 ] & 0x70 || !( header[ 1 ] & 0x80 ) )
+            {
+                //
+                //  no extension is negotiated, client frames must be masked
+                //
+                close( ProtocolError );
+                return false;
+            }
+
+            unsigned long long length = header[ 1 ] & 0x7f;
+            unsigned int headerLength = 2;
+
+            if ( length == 126 )
+            {
+                if ( available < 4 )
+                {
+                    return false;
+                }
+
+                length = ( header[ 2 ] << 8 ) | header[ 3 ];
+                headerLength = 4;
+            }
+            else if ( length == 127 )
+            {
+                if ( available < 10 )
+                {
+                    return false;
+                }
+
+                length = 0;
+
+                for ( unsigned int i = 2; i < 10; i++ )
+                {
+                    length = ( length << 8 ) | header[ i ];
+                }
+
+                headerLength = 10;
+
+                if ( length >> 63 )
+                {
+                    //
+                    //  most significant bit of 64-bit length must be 0
+                    //
+                    close( ProtocolError );
+                    return false;
+                }
+            }
+
+            bool control = opcode & 0x8;
+
+            if ( ( control && ( !fin || length > MaxControlPayload || opcode > Pong ) ) || ( !control && opcode > Binary ) ||
+                 ( opcode == Continuation && m_opcode == Continuation ) || ( opcode != Continuation && !control && m_opcode != Continuation ) )
+            {
+                close( ProtocolError );
+                return false;
+            }
+
+            //
+            //  reassembled message never exceeds the limit, so the subtraction does not wrap and the length is small
+            //  enough for the sums below (control frame payload has been limited above)
+            //
+            if ( !control && length > MaxMessageSize - m_message.size( ) )
+            {
+                close( MessageTooBig );
+                return false;
+            }
+
+            headerLength += 4;
+
+            if ( available < headerLength + length )
+            {
+                //
+                //  wait for the rest of the frame
+                //
+                return false;
+            }
+
+            const unsigned char* data = ( const unsigned char* ) m_connection.pullInput( headerLength + length );
+            const unsigned char* mask = data + headerLength - 4;
+            data += headerLength;
+
+            //
+            //  unmask data frames into the message being reassembled, control frames into local buffer
+            //
+            char buffer[ MaxControlPayload ];
+            char* payload = buffer;
+
+            if ( !control )
+            {
+                size_t offset = m_message.size( );
+                m_message.resize( offset + length );
+                payload = &m_message[ 0 ] + offset;
+            }
+
+            for ( unsigned long long i = 0; i < length; i++ )
+            {
+                payload[ i ] = data[ i ] ^ mask[ i & 3 ];
+            }
+
+            m_connection.drainInput( headerLength + length );
+
+            if ( !control && opcode != Continuation )
+            {
+                m_opcode = opcode;
+            }
+
+            return onFrame( opcode, fin, payload, length );
+        }
+
+        bool WebSocket::onFrame( unsigned int opcode, bool fin, const char* payload, unsigned int length )
+        {
+            switch ( opcode )
+            {
+                case Ping:
+                    writeFrame( Pong, payload, length );
+                    return true;
+
+                case Pong:
+                    return true;
+
+                case Close:
+                {
+                    if ( length == 1 || ( length > 2 && !validUtf8( ( const unsigned char* ) payload + 2, length - 2 ) ) )
+                    {
+                        close( ProtocolError );
+                        return false;
+                    }
+
+                    //
+                    //  echo status code and close connection once reply is written
+                    //
+                    m_state = Closing;
+                    writeFrame( Close, payload, length < 2 ? 0 : 2, true );
+
+                    notify( );
+                    return false;
+                }
+
+                default:
+                    break;
+            }
+
+            if ( !fin )
+            {
+                //
+                //  wait for following fragments
+                //
+                return true;
+            }
+
+            bool binary = m_opcode == Binary;
+            m_opcode = Continuation;
+
+            if ( !binary && !validUtf8( ( const unsigned char* ) m_message.data( ), m_message.size( ) ) )
+            {
+                close( InvalidData );
+                return false;
+            }
+
+            sys::General::interlockedIncrement( &s_messages );
+
+            m_handler.onMessage( *this, m_message, binary );
+            m_message.clear( );
+
+            return true;
+        }
+
+        void WebSocket::writeFrame( unsigned int opcode, const char* payload, unsigned int length, bool close )
+        {
+            unsigned char header[ MaxHeaderLength ];
+            unsigned int headerLength = frameHeader( header, opcode, length );
+
+            if ( !length )
+            {
+                m_connection.write( ( const char* ) header, headerLength, close );
+                return;
+            }
+
+            m_connection.write( ( const char* ) header, headerLength );
+            m_connection.write( payload, length, close );
+        }
+
+        void WebSocket::Operation::deliver( )
+        {
+            switch ( type )
+            {
+                case Send:
+                    socket.send( data.data( ), data.size( ), binary );
+                    break;
+
+                case Subscribe:
+                    socket.subscribe( data );
+                    break;
+
+                case Unsubscribe:
+                    socket.unsubscribe( data );
+                    break;
+
+                case CloseSocket:
+                    socket.close( code );
+                    break;
+
+                case Deref:
+                    socket.deref( );
+                    break;
+            }
+
+            delete this;
+        }
+    }
+}
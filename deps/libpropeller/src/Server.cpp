@@ -15,6 +15,7 @@ limitations under the License.
  */
 
 #include "Server.h"
+#include "Tls.h"
 
 //
 //	Trace function
@@ -23,8 +24,9 @@ limitations under the License.
 
 namespace propeller
 {
-    Connection::Connection( Server::ConnectionThread& thread, sys::Socket* socket )
-    : libevent::Connection( socket, thread.base( ) ), m_request( NULL ), m_thread( thread ), m_needClose( false ), m_initialized( false ), m_ref( 0 )
+    Connection::Connection( Server::ConnectionThread& thread, sys::Socket* socket, ssl_st* ssl )
+    : libevent::Connection( socket, thread.base( ), ssl ), m_request( NULL ), m_thread( thread ), m_needClose( false ), m_suspended( false ), m_paused( false ), m_initialized( false ), m_ref( 0 ), 
+      m_sequence( 0 ), m_written( 0 ), m_closing( false )
     {
         TRACE_ENTERLEAVE( );
         ref( );
@@ -37,12 +39,20 @@ namespace propeller
         
         m_thread.remove( this );
         
+        for ( std::set< std::string >::iterator i = m_channels.begin( ); i != m_channels.end( ); i++ )
+        {
+            m_thread.unsubscribe( *i, this );
+        }
+        
         if ( m_request )
         {
             delete m_request;
         }
         
-        
+        for ( std::map< unsigned int, Pending >::iterator i = m_pending.begin( ); i != m_pending.end( ); i++ )
+        {
+            evbuffer_free( i->second.buffer );
+        }
     }
     
     
@@ -82,75 +92,243 @@ namespace propeller
     {
         TRACE_ENTERLEAVE( );
 
-        try
+        //
+        //  parse and dispatch all complete (pipelined) requests available in input
+        //
+        while ( !m_needClose && !m_suspended )
         {
-            if ( !m_request )
+            if ( outstanding( ) >= MaxOutstanding )
             {
-                 m_request = createRequest();
+                //
+                //  client sends requests faster than it reads responses, socket is not read till some are written
+                //
+                if ( !m_paused )
+                {
+                    m_paused = true;
+                    pauseRead( );
+                }
+                
+                break;
             }
-               
+            
+            try
+            {
+                if ( !m_request )
+                {
+                    if ( !inputLength( ) )
+                    {
+                        break;
+                    }
+                    
+                    m_request = createRequest();
+                }
+
+
+                //
+                //  try to parse request
+                //
+                m_request->parse( );
+
+                //
+                //  dispatch request for processing
+                //
+                ref( );
+
+                Response* response = createResponse();
+                Request* request = m_request;
+                
+                m_request = NULL;
 
+                process( request, response );
+            }
+            catch ( const Exception& exception )
+            {
+                if ( exception.type() == Exception::RequestError )
+                {
+                    delete m_request;
+                    m_request = NULL;
+                    
+                    //
+                    //  stop reading from the connection, error response closes it
+                    //
+                    setClose( );
+                    
+                    ref( );
+                    
+                    Response* response = createResponse( &exception );
+                    delete response;
+                }
+                
+                break;
+            }
+        }
+    }
+    
+    void Connection::commit( unsigned int sequence, evbuffer* buffer, bool close, bool complete )
+    {
+        TRACE_ENTERLEAVE( );
+        
+        if ( close && complete )
+        {
             //
-            //  try to parse request
+            //  stop reading pipelined requests
             //
-            m_request->parse( );
-
+            m_needClose = true;
+        }
+        
+        if ( m_closing )
+        {
             //
-            //  dispatch request for processing
+            //  connection is closed after previous response
             //
-            ref( );
-
-            Response* response = createResponse();
-
-            process( m_request, response );
-
-            m_request = NULL;
+            return;
         }
-        catch ( const Exception& exception )
+        
+        if ( sequence != m_written )
         {
-            if ( exception.type() == Exception::RequestError )
+            //
+            //  preceding responses are not complete yet, hold this one (streamed parts are accumulated)
+            //
+            std::map< unsigned int, Pending >::iterator found = m_pending.find( sequence );
+            
+            if ( found == m_pending.end( ) )
             {
-                delete m_request;
-                m_request = NULL;
-
-                Response* response = createResponse( &exception );
-                delete response;
+                Pending pending;
+                pending.buffer = evbuffer_new( );
+                found = m_pending.insert( std::make_pair( sequence, pending ) ).first;
+            }
+            
+            found->second.close = close;
+            found->second.complete = complete;
+            
+            if ( buffer )
+            {
+                evbuffer_add_buffer( found->second.buffer, buffer );
+            }
+            
+            return;
+        }
+        
+        if ( buffer )
+        {
+            write( buffer, close );
+        }
+        else if ( close )
+        {
+            //
+            //  nothing to write, close once output is sent
+            //
+            m_close = true;
+        }
+        
+        if ( !complete )
+        {
+            //
+            //  response is being streamed, following parts are written directly
+            //
+            return;
+        }
+        
+        m_written++;
+        m_closing = close;
+        
+        //
+        //  write responses that were waiting for this one
+        //
+        std::map< unsigned int, Pending >::iterator next;
+        
+        while ( !m_closing && ( next = m_pending.find( m_written ) ) != m_pending.end( ) )
+        {
+            Pending pending = next->second;
+            m_pending.erase( next );
+            
+            write( pending.buffer, pending.close && pending.complete );
+            evbuffer_free( pending.buffer );
+            
+            if ( !pending.complete )
+            {
+                //
+                //  streamed response is still in progress, its following parts are written directly
+                //
+                break;
+            }
+            
+            m_closing = pending.close;
+            m_written++;
+        }
+        
+        if ( m_paused && !m_closing && !m_needClose && outstanding( ) < MaxOutstanding )
+        {
+            m_paused = false;
+            resumeRead( );
+            
+            //
+            //  requests received before reading stopped
+            //
+            if ( inputLength( ) )
+            {
+                onRead( );
             }
         }
     }
     
+    Connection::Commit::Commit( Connection& connection, unsigned int sequence, evbuffer* buffer, bool close )
+    : m_connection( connection ), m_sequence( sequence ), m_buffer( evbuffer_new( ) ), m_close( close )
+    {
+        evbuffer_add_buffer( m_buffer, buffer );
+    }
+    
+    Connection::Commit::~Commit( )
+    {
+        evbuffer_free( m_buffer );
+    }
+    
+    void Connection::Commit::deliver( )
+    {
+        m_connection.commit( m_sequence, m_buffer, m_close, false );
+        
+        delete this;
+    }
+    
                 
-    void Connection::process( Request* request, Response* response )
+    void Connection::resume( )
     {
-        m_thread.server().process( request, response );
+        m_suspended = false;
+        
+        if ( inputLength( ) )
+        {
+            onRead( );
+        }
     }
     
-    void Connection::ref( )
+    void Connection::subscribe( const std::string& channel )
     {
-        TRACE_ENTERLEAVE( );
-
-        sys::General::interlockedIncrement( &m_ref );
+        if ( m_channels.insert( channel ).second )
+        {
+            m_thread.subscribe( channel, this );
+        }
+    }
+    
+    void Connection::unsubscribe( const std::string& channel )
+    {
+        if ( m_channels.erase( channel ) )
+        {
+            m_thread.unsubscribe( channel, this );
+        }
+    }
+                
+    void Connection::process( Request* request, Response* response )
+    {
+        m_thread.server().process( request, response );
     }
     
-    void Connection::deref( bool threadsafe )
+    void Connection::deref( )
     {
         TRACE_ENTERLEAVE( );
 
-        unsigned int count = sys::General::interlockedDecrement( &m_ref );
-
-        if ( count == 1 )
+        if ( --m_ref == 0 )
         {
-            //
-            //  schedule deletion
-            //  
-            if ( threadsafe )
-            {
-                scheduleDelete( );
-            }
-            else
-            {
-                delete this;
-            }
+            delete this;
         }
     }
     
@@ -166,17 +344,20 @@ namespace propeller
         return new Request( *this );
     }
 
-    void Connection::checkDelete( )
-    {
-        TRACE_ENTERLEAVE( );
-
-        deref( true );
-    }
-
     void Connection::onClose( )
     {
         TRACE_ENTERLEAVE( );
 
+        //
+        //  closed connection does not receive broadcasts
+        //
+        for ( std::set< std::string >::iterator i = m_channels.begin( ); i != m_channels.end( ); i++ )
+        {
+            m_thread.unsubscribe( *i, this );
+        }
+        
+        m_channels.clear( );
+
         deref( );
     }
 
@@ -210,7 +391,7 @@ namespace propeller
     }
 
     Response::Response( Connection& connection )
-    : m_connection( connection )
+    : m_connection( connection ), m_sequence( connection.m_sequence++ ), m_close( false ), m_deferred( NULL ), m_completed( false ), m_detached( false ), m_task( NULL )
     {
         TRACE_ENTERLEAVE( );
     }
@@ -219,17 +400,74 @@ namespace propeller
     {
         TRACE_ENTERLEAVE( );
 
-        m_connection.checkDelete( );
+        //
+        //  responses are deleted in connection thread
+        //
+        m_connection.deref( );
     }
 
     void Response::write( const char* body, unsigned int length )
     {
-        m_connection.write( body, strlen( body ) );
+        evbuffer* buffer = evbuffer_new( );
+        evbuffer_add( buffer, body, length ? length : strlen( body ) );
+        
+        commit( buffer, false );
+        
+        evbuffer_free( buffer );
+    }
+    
+    void Response::commit( evbuffer* buffer, bool complete )
+    {
+        TRACE_ENTERLEAVE( );
+        
+        if ( m_connection.m_thread.current( ) )
+        {
+            m_connection.commit( m_sequence, buffer, m_close, complete );
+            m_completed = complete;
+            
+            return;
+        }
+        
+        if ( complete )
+        {
+            //
+            //  written when processed task is returned to connection thread
+            //
+            m_deferred = buffer;
+            return;
+        }
+        
+        m_connection.m_thread.post( new Connection::Commit( m_connection, m_sequence, buffer, m_close ) );
+    }
+    
+    void Response::finish( )
+    {
+        if ( m_connection.m_thread.current( ) )
+        {
+            m_task->deliver( );
+            return;
+        }
+        
+        m_connection.m_thread.post( m_task );
+    }
+    
+    void Response::complete( )
+    {
+        if ( m_completed )
+        {
+            return;
+        }
+        
+        //
+        //  response may be empty (for example if it was written in parts), connection still has to move to the next one
+        //
+        m_connection.commit( m_sequence, m_deferred, m_close, true );
+        m_completed = true;
     }
 
     Server::Server( unsigned int port, EventHandler& handler )
     : libevent::Listener( port ), m_connectionThreadCount( 10 ), m_connectionReadTimeout( 0 ), 
-      m_connectionWriteTimeout( 0 ),  m_poolThreadCount( 25 ),  m_eventHandler( handler ), m_timerThread( NULL ), m_storeConnections( false )
+      m_connectionWriteTimeout( 0 ),  m_poolThreadCount( 25 ), m_acceptBatchSize( 64 ), m_acceptWakeups( 0 ), m_accepted( 0 ), m_connectionThreadIndex( 0 ), m_eventHandler( handler ), m_timerThread( NULL ), m_storeConnections( false ), m_reusePort( false ), m_tls( NULL ), m_securePort( 0 ), m_secureListener( NULL ), m_allocator( new sys::Allocator( ) )
     {
         TRACE_ENTERLEAVE( );
 
@@ -280,16 +518,77 @@ namespace propeller
         {
             delete m_timerThread;
         }
+        
+        if ( m_secureListener )
+        {
+            delete m_secureListener;
+            m_secureListener = NULL;
+        }
+        
+        //
+        //  allocator is deleted once blocks still in use are released
+        //
+        m_allocator->retire( );
+        m_allocator = NULL;
     }
 
     void Server::start( )
     {
         TRACE_ENTERLEAVE( );
 
-        //
-        //  bind to port listening 
-        //
-        listen( m_base );
+#ifndef SO_REUSEPORT
+        if ( m_reusePort )
+        {
+            TRACE_ERROR( "SO_REUSEPORT is not supported, using single listener", "" );
+            m_reusePort = false;
+        }
+#endif
+        
+        if ( m_reusePort )
+        {
+            //
+            //  start all connection threads, each one listens on its own socket bound to the same port
+            //
+            unsigned int count = m_connectionThreadCount ? m_connectionThreadCount : 1;
+            
+            sys::LockEnterLeave lock( m_lock );
+            
+            while ( m_connectionThreads.size( ) < count )
+            {
+                ConnectionThread* thread = new ConnectionThread( *this );
+                m_connectionThreads.push_back( thread );
+                
+                thread->listen( );
+            }
+        }
+        else
+        {
+            if ( !m_poolThreadCount )
+            {
+                //
+                //  connection threads process requests, create them (and their workers) before timers can enumerate workers
+                //
+                unsigned int count = m_connectionThreadCount ? m_connectionThreadCount : 1;
+                
+                sys::LockEnterLeave lock( m_lock );
+                
+                while ( m_connectionThreads.size( ) < count )
+                {
+                    m_connectionThreads.push_back( new ConnectionThread( *this ) );
+                }
+            }
+            
+            //
+            //  bind to port listening 
+            //
+            listen( m_base );
+            
+            if ( m_tls )
+            {
+                m_secureListener = new SecureListener( *this );
+                m_secureListener->listen( m_base );
+            }
+        }
 
         //
         //  start thread pool
@@ -304,6 +603,7 @@ namespace propeller
         //
         //  start event base 
         //
+        m_allocator->attach( );
         m_base.start( );
     }
 
@@ -311,61 +611,153 @@ namespace propeller
     {
         TRACE_ENTERLEAVE( );
 
-        //
-        //  accept new connection and add it to connection thread
-        //
-        sys::Socket* socket = m_socket.accept( );
+        acceptConnections( m_socket, false );
+    }
+    
+    Server::SecureListener::SecureListener( Server& server )
+    : libevent::Listener( server.m_securePort ), m_server( server )
+    {
+    }
+    
+    void Server::SecureListener::onAccept( )
+    {
+        TRACE_ENTERLEAVE( );
         
-        if ( !socket )
-        {
-            TRACE_ERROR( "accept failed, error %d", sys::Socket::getLastError( ) );
-            return;
-        }
-
-        //
-        //  get first connection thread
-        //
-        ConnectionThread* thread;
+        m_server.acceptConnections( m_socket, true );
+    }
+    
+    void Server::acceptConnections( sys::Socket& listener, bool secure, ConnectionThread* thread )
+    {
+        TRACE_ENTERLEAVE( );
+        
+        unsigned int accepted = 0;
         
+        while ( accepted < m_acceptBatchSize )
         {
-            sys::LockEnterLeave lock( m_lock );
+            //
+            //  accept new connection (already in non blocking mode)
+            //
+            sys::Socket* socket = listener.accept( true );
+
+            if ( !socket )
+            {
+                unsigned int error = sys::Socket::getLastError( );
+                
+                if ( error != EAGAIN && error != EWOULDBLOCK && error != EINTR )
+                {
+                    TRACE_ERROR( "accept failed, error %d", error );
+                }
+                
+                break;
+            }
+            
+            accepted++;
             
-            if ( m_connectionThreads.size() < m_connectionThreadCount )
+            if ( thread )
             {
-                thread = new ConnectionThread( *this );
+                addConnection( *thread, socket, secure );
+                continue;
             }
-            else
+            
+            //
+            //  get first connection thread
+            //
+            ConnectionThread* next;
+
+            {
+                sys::LockEnterLeave lock( m_lock );
+
+                if ( m_connectionThreads.size() < m_connectionThreadCount )
+                {
+                    next = new ConnectionThread( *this );
+                }
+                else
+                {
+                    next = m_connectionThreads.front( );
+                    m_connectionThreads.pop_front( );
+                }
+            }
+
+            //
+            //  connection is created and used in its connection thread only
+            //
+            next->post( new ConnectionThread::Accept( *next, socket, secure ) );
+
+            //
+            //  add connection thread to back
+            //
             {
-                thread = m_connectionThreads.front( );
-                m_connectionThreads.pop_front( );
+                sys::LockEnterLeave lock( m_lock );
+                m_connectionThreads.push_back( next );
             }
         }
         
+        sys::General::interlockedIncrement( &m_acceptWakeups );
+        sys::General::interlockedAdd( &m_accepted, accepted );
+    }
+    
+    void Server::getAcceptMetrics( unsigned int& wakeups, unsigned int& accepted )
+    {
+        wakeups = sys::General::interlockedExchange( &m_acceptWakeups, 0 );
+        accepted = sys::General::interlockedExchange( &m_accepted, 0 );
+    }
+    
+    void Server::getAllocatorMetrics( unsigned int& hits, unsigned int& misses )
+    {
+        hits = 0;
+        misses = 0;
 
+        if ( m_allocator )
+        {
+            m_allocator->getMetrics( hits, misses );
+        }
+        
+        sys::LockEnterLeave lock( m_lock );
+        
+        for ( std::list< ConnectionThread* >::iterator i = m_connectionThreads.begin( ); i != m_connectionThreads.end( ); i++ )
+        {
+            unsigned int threadHits = 0;
+            unsigned int threadMisses = 0;
+            
+            ( *i )->m_allocator->getMetrics( threadHits, threadMisses );
+            
+            hits += threadHits;
+            misses += threadMisses;
+        }
+    }
+    
+    void Server::addConnection( ConnectionThread& thread, sys::Socket* socket, bool secure )
+    {
+        TRACE_ENTERLEAVE( );
+        
+        ssl_st* ssl = NULL;
+        
+        if ( secure )
+        {
+            ssl = m_tls->accept( );
+            
+            if ( !ssl )
+            {
+                delete socket;
+                return;
+            }
+        }
+        
         //
         //  create new connection  and assign it to connection thread. it mantains referencre count and will delete itself when no longer referenced
         //
 
-        Connection* connection = newConnection( *thread, socket );
+        Connection* connection = newConnection( thread, socket, ssl );
 
         if ( m_storeConnections )
         {
-            thread->add( connection );
+            thread.add( connection );
         }
 
         //
         //  enable events processing on this connection
         //  
         connection->enable( );
-        
-        //
-        //  add connection thread to back
-        //
-        {
-            sys::LockEnterLeave lock( m_lock );
-            m_connectionThreads.push_back( thread );
-        }
-        
     }
 
     void Server::broadcast( const Message& message )
@@ -377,20 +769,70 @@ namespace propeller
             return;
         }
         
+        //
+        //  message is copied once and shared by all connections
+        //
+        libevent::SharedBuffer* shared = new libevent::SharedBuffer( message.length );
+        memcpy( shared->data( ), message.contents, message.length );
+        
+        broadcast( "", *shared );
+        
+        shared->deref( );
+    }
+    
+    void Server::broadcast( const std::string& channel, libevent::SharedBuffer& message )
+    {
+        TRACE_ENTERLEAVE();
+        
         sys::LockEnterLeave lock( m_lock ); 
     
         for ( std::list< ConnectionThread* >::iterator i = m_connectionThreads.begin( ); i != m_connectionThreads.end( ); i++ )
         {
-            ( *i )->broadcast( message );
+            ( *i )->broadcast( message, channel );
         }
-        
     }
     
     void Server::process( Request* request, Response* response )
     {
         TRACE_ENTERLEAVE( );
 
-        queue( new Task( request, response ) );
+        ConnectionThread* thread = ConnectionThread::s_current;
+        
+        if ( thread && thread->m_worker )
+        {
+            //
+            //  process in connection thread, response is written right away. Task is assigned before the handler
+            //  runs, detached response may be finished by another thread before the handler returns
+            //
+            Task* task = new Task( request, response );
+            response->m_task = task;
+            
+            m_eventHandler.onRequest( *request, *response, *thread->m_worker );
+            
+            if ( response->m_detached )
+            {
+                //
+                //  handler finishes the response later
+                //
+                return;
+            }
+            
+            response->complete( );
+            
+            delete task;
+            
+            return;
+        }
+        
+        Task* task = new Task( request, response );
+        
+        if ( thread && getQueueType( ) == WorkStealingQueue )
+        {
+            queue( task, thread->nextWorker( ) );
+            return;
+        }
+        
+        queue( task );
     }
 
     void Server::addTimer( unsigned int interval, void* data )
@@ -408,16 +850,77 @@ namespace propeller
         m_timerThread->add( interval, data );
     }
 
+    THREAD_LOCAL Server::ConnectionThread* Server::ConnectionThread::s_current = NULL;
+    
     Server::ConnectionThread::ConnectionThread( Server& server )
-    : m_server( server )
+    : m_mailbox( m_base ), m_server( server ), m_listener( NULL ), m_secureListener( NULL ), m_allocator( new sys::Allocator( ) ), m_index( server.m_connectionThreadIndex++ ), m_workerCursor( 0 ), m_worker( NULL )
     {
         TRACE_ENTERLEAVE( );
+        
+        if ( !server.getPoolThreadCount( ) )
+        {
+            m_worker = new sys::ThreadPool::Worker( server );
+            server.attachWorker( m_worker );
+        }
 
         m_stackSize = 1024 * 1024 * 2;
 
         start( );
     }
 
+    void Server::ConnectionThread::listen( )
+    {
+        TRACE_ENTERLEAVE( );
+        
+        if ( m_listener )
+        {
+            return;
+        }
+        
+        m_listener = new Listener( *this, m_server.port( ), false );
+        m_listener->listen( m_base, true );
+        
+        if ( m_server.m_tls )
+        {
+            m_secureListener = new Listener( *this, m_server.m_securePort, true );
+            m_secureListener->listen( m_base, true );
+        }
+    }
+    
+    Server::ConnectionThread::Listener::Listener( ConnectionThread& thread, unsigned int port, bool secure )
+    : libevent::Listener( port ), m_thread( thread ), m_secure( secure )
+    {
+    }
+    
+    void Server::ConnectionThread::Listener::onAccept( )
+    {
+        TRACE_ENTERLEAVE( );
+        
+        //
+        //  accept new connections on this thread's socket, no handoff to other threads required
+        //
+        m_thread.server( ).acceptConnections( m_socket, m_secure, &m_thread );
+    }
+
+    unsigned int Server::ConnectionThread::nextWorker( )
+    {
+        unsigned int workers = m_server.workerCount( );
+        unsigned int threads = m_server.m_connectionThreadCount ? m_server.m_connectionThreadCount : 1;
+        unsigned int first = m_index % threads;
+        
+        if ( workers <= threads )
+        {
+            return workers ? first % workers : 0;
+        }
+        
+        //
+        //  workers of this thread are first, first + threads, first + 2 * threads...
+        //
+        unsigned int subset = ( workers - first + threads - 1 ) / threads;
+        
+        return first + ( m_workerCursor++ % subset ) * threads;
+    }
+
     void Server::ConnectionThread::add( Connection* connection )
     {
         TRACE_ENTERLEAVE( );
@@ -450,24 +953,97 @@ namespace propeller
         }
     }
 
-    void Server::ConnectionThread::broadcast( const Message& message )
+    void Server::ConnectionThread::broadcast( libevent::SharedBuffer& message, const std::string& channel )
     {
         TRACE_ENTERLEAVE();
         
-        sys::LockEnterLeave lock( m_lock );
+        //
+        //  connections are written in connection thread only
+        //
+        post( new Broadcast( *this, message, channel ) );
+    }
+    
+    void Server::ConnectionThread::subscribe( const std::string& channel, Connection* connection )
+    {
+        m_channels[ channel ].insert( connection );
+    }
+    
+    void Server::ConnectionThread::unsubscribe( const std::string& channel, Connection* connection )
+    {
+        std::map< std::string, std::set< Connection* > >::iterator found = m_channels.find( channel );
         
-        TRACE( "%d", m_connections.size() );
+        if ( found == m_channels.end( ) )
+        {
+            return;
+        }
         
-        for ( std::map< intptr_t, Connection* >::iterator i = m_connections.begin(); i != m_connections.end(); i++ )
+        found->second.erase( connection );
+        
+        if ( found->second.empty( ) )
         {
-            i->second->write( message.contents, message.length );
+            m_channels.erase( found );
         }
     }
     
+    void Server::ConnectionThread::Accept::deliver( )
+    {
+        m_thread.server( ).addConnection( m_thread, m_socket, m_secure );
+        
+        delete this;
+    }
+    
+    Server::ConnectionThread::Broadcast::Broadcast( ConnectionThread& thread, libevent::SharedBuffer& message, const std::string& channel )
+    : m_thread( thread ), m_message( message ), m_channel( channel )
+    {
+        m_message.ref( );
+    }
+    
+    void Server::ConnectionThread::Broadcast::deliver( )
+    {
+        if ( m_channel.empty( ) )
+        {
+            sys::LockEnterLeave lock( m_thread.m_lock );
+            
+            TRACE( "%d", m_thread.m_connections.size() );
+            
+            for ( std::map< intptr_t, Connection* >::iterator i = m_thread.m_connections.begin(); i != m_thread.m_connections.end(); i++ )
+            {
+                i->second->write( m_message );
+            }
+        }
+        else
+        {
+            std::map< std::string, std::set< Connection* > >::iterator found = m_thread.m_channels.find( m_channel );
+            
+            if ( found != m_thread.m_channels.end( ) )
+            {
+                //
+                //  subscriber may unsubscribe while message is written to it
+                //
+                std::vector< Connection* > subscribers( found->second.begin( ), found->second.end( ) );
+                
+                for ( std::vector< Connection* >::iterator i = subscribers.begin( ); i != subscribers.end( ); i++ )
+                {
+                    ( *i )->onBroadcast( m_message, m_channel );
+                }
+            }
+        }
+        
+        m_message.deref( );
+        
+        delete this;
+    }
+    
     void Server::ConnectionThread::routine( )
     {
         TRACE_ENTERLEAVE( );
 
+        //
+        //  objects created in this thread are recycled by its allocator
+        //
+        m_allocator->attach( );
+        s_current = this;
+        
         //
         //  start event loop
         //
@@ -479,11 +1055,33 @@ namespace propeller
         TRACE_ENTERLEAVE( );
 
         m_base.stop();
+        
+        //
+        //  wait for event loop to exit before releasing objects used by it
+        //
+        Thread::stop( );
+        
+        if ( m_listener )
+        {
+            delete m_listener;
+        }
+        
+        if ( m_secureListener )
+        {
+            delete m_secureListener;
+        }
 
         while ( !m_connections.empty( ) )
         {
             remove( m_connections.begin( )->second, true );
         }
+        
+        if ( m_worker )
+        {
+            delete m_worker;
+        }
+        
+        m_allocator->retire( );
     }
 
     Server::Task::Task( Request* _request, Response* _response )
@@ -496,18 +1094,45 @@ namespace propeller
         delete request;
         delete response;
     }
-
-    void Server::onTaskProcess( sys::ThreadPool::Task* task, sys::ThreadPool::Worker& thread )
+    
+    void Server::Task::deliver( )
     {
-        TRACE_ENTERLEAVE( );
-
-        Task* serverTask = ( Task* ) task; 
+        //
+        //  in connection thread, write the response and release the connection
+        //
+        response->complete( );
+        
+        delete this;
+    }
 
+    void Server::Task::run( sys::ThreadPool::Worker& worker )
+    {
+        response->m_task = this;
+        
         //
         //  invoke callback
         //
-        eventHandler().onRequest( *serverTask->request, *serverTask->response, thread );      
-        delete serverTask;
+        response->m_connection.m_thread.server( ).eventHandler( ).onRequest( *request, *response, worker );
+        
+        if ( response->m_detached )
+        {
+            //
+            //  returned to connection thread by Response::finish()
+            //
+            return;
+        }
+        
+        //
+        //  return task to connection thread, response is written there
+        //
+        response->m_connection.m_thread.post( this );
+    }
+
+    void Server::onTaskProcess( sys::ThreadPool::Task* task, sys::ThreadPool::Worker& thread )
+    {
+        TRACE_ENTERLEAVE( );
+
+        ( ( Job* ) task )->run( thread );
     }
     
     void Server::onThreadStart( sys::ThreadPool::Worker& thread )
@@ -538,8 +1163,8 @@ namespace propeller
         m_server.eventHandler().onTimer( interval, data );
     }
     
-    Connection* Server::newConnection( ConnectionThread& thread, sys::Socket* socket )
+    Connection* Server::newConnection( ConnectionThread& thread, sys::Socket* socket, ssl_st* ssl )
     {
-        return new Connection( thread, socket );
+        return new Connection( thread, socket, ssl );
     }
 }
\ No newline at end of file
@@ -0,0 +1,319 @@
+/*
+ * File:   Tls.cpp
+ *
+ * TLS settings of secure listener
+ */
+
+#include "Tls.h"
+
+#include <string.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+
+//
+//	Trace function
+//
+#include "trace.h"
+
+namespace propeller
+{
+    Tls::Tls( )
+    : m_context( NULL ), m_sessionTimeout( DefaultSessionTimeout ), m_handshakes( 0 ), m_resumed( 0 ), m_kernel( 0 )
+    {
+        TRACE_ENTERLEAVE( );
+
+        memset( &m_current, 0, sizeof( m_current ) );
+        memset( &m_previous, 0, sizeof( m_previous ) );
+
+        SSL_library_init( );
+        SSL_load_error_strings( );
+
+        m_context = SSL_CTX_new( SSLv23_server_method( ) );
+
+        if ( !m_context )
+        {
+            TRACE_ERROR( "failed to create TLS context, error %lu", ERR_get_error( ) );
+            return;
+        }
+
+        long options = SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_COMPRESSION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+
+#ifdef SSL_OP_NO_RENEGOTIATION
+        options |= SSL_OP_NO_RENEGOTIATION;
+#endif
+
+#ifdef SSL_OP_ENABLE_KTLS
+        //
+        //  OpenSSL switches socket to kernel TLS after handshake if kernel supports negotiated cipher
+        //
+        options |= SSL_OP_ENABLE_KTLS;
+#endif
+
+        SSL_CTX_set_options( m_context, options );
+
+        //
+        //  idle keep-alive connections do not hold read and write buffers
+        //
+        SSL_CTX_set_mode( m_context, SSL_MODE_RELEASE_BUFFERS );
+
+        //
+        //  sessions are cached in the context, so they can be resumed on any connection thread
+        //
+        static const unsigned char id[] = PROPELLER_NAME;
+
+        SSL_CTX_set_session_cache_mode( m_context, SSL_SESS_CACHE_SERVER );
+        SSL_CTX_sess_set_cache_size( m_context, DefaultSessionCacheSize );
+        SSL_CTX_set_session_id_context( m_context, id, sizeof( id ) - 1 );
+        SSL_CTX_set_timeout( m_context, m_sessionTimeout );
+
+        SSL_CTX_set_app_data( m_context, this );
+        SSL_CTX_set_info_callback( m_context, onInfoStatic );
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        //
+        //  both keys are random from the start, so no ticket can be sealed with a known key
+        //
+        if ( rotate( ) && rotate( ) )
+        {
+            SSL_CTX_set_tlsext_ticket_key_evp_cb( m_context, onTicketStatic );
+        }
+#endif
+    }
+
+    Tls::~Tls( )
+    {
+        if ( m_context )
+        {
+            SSL_CTX_free( m_context );
+        }
+
+        OPENSSL_cleanse( &m_current, sizeof( m_current ) );
+        OPENSSL_cleanse( &m_previous, sizeof( m_previous ) );
+    }
+
+    bool Tls::load( const char* certificate, const char* key )
+    {
+        if ( !m_context )
+        {
+            return false;
+        }
+
+        if ( SSL_CTX_use_certificate_chain_file( m_context, certificate ) != 1 )
+        {
+            TRACE_ERROR( "failed to load certificate %s, error %lu", certificate, ERR_get_error( ) );
+            return false;
+        }
+
+        if ( SSL_CTX_use_PrivateKey_file( m_context, key, SSL_FILETYPE_PEM ) != 1 || SSL_CTX_check_private_key( m_context ) != 1 )
+        {
+            TRACE_ERROR( "failed to load private key %s, error %lu", key, ERR_get_error( ) );
+            return false;
+        }
+
+        return true;
+    }
+
+    void Tls::setSessionTimeout( unsigned int seconds )
+    {
+        m_sessionTimeout = seconds ? seconds : 1;
+
+        if ( m_context )
+        {
+            SSL_CTX_set_timeout( m_context, m_sessionTimeout );
+        }
+    }
+
+    void Tls::setProtocols( const char* protocols )
+    {
+        m_protocols.clear( );
+
+        for ( const char* current = protocols; *current; )
+        {
+            const char* end = strchr( current, ',' );
+            unsigned int length = end ? end - current : strlen( current );
+
+            if ( length && length < 256 )
+            {
+                m_protocols.append( 1, ( char ) length ).append( current, length );
+            }
+
+            current += end ? length + 1 : length;
+        }
+
+        if ( m_context )
+        {
+            SSL_CTX_set_alpn_select_cb( m_context, m_protocols.empty( ) ? NULL : onSelectStatic, this );
+        }
+    }
+
+    ssl_st* Tls::accept( )
+    {
+        return m_context ? SSL_new( m_context ) : NULL;
+    }
+
+    void Tls::getMetrics( unsigned int& handshakes, unsigned int& resumed, unsigned int& kernel )
+    {
+        handshakes = m_handshakes;
+        resumed = m_resumed;
+        kernel = m_kernel;
+    }
+
+    bool Tls::rotate( )
+    {
+        TicketKey key;
+
+        if ( RAND_bytes( key.name, sizeof( key.name ) ) != 1 || RAND_bytes( key.aes, sizeof( key.aes ) ) != 1 ||
+             RAND_bytes( key.hmac, sizeof( key.hmac ) ) != 1 )
+        {
+            TRACE_ERROR( "failed to generate ticket key", "" );
+            return false;
+        }
+
+        key.created = sys::General::getMillisecondTimestamp( );
+
+        m_previous = m_current;
+        m_current = key;
+
+        OPENSSL_cleanse( &key, sizeof( key ) );
+
+        return true;
+    }
+
+    void Tls::onInfoStatic( const ssl_st* ssl, int where, int result )
+    {
+        if ( !( where & SSL_CB_HANDSHAKE_DONE ) )
+        {
+            return;
+        }
+
+        SSL* session = ( SSL* ) ssl;
+
+        //
+        //  with TLS 1.3 callback is invoked again after tickets are sent, count connection once
+        //
+        if ( SSL_get_app_data( session ) )
+        {
+            return;
+        }
+
+        SSL_set_app_data( session, session );
+
+        Tls* tls = ( Tls* ) SSL_CTX_get_app_data( SSL_get_SSL_CTX( session ) );
+
+        sys::General::interlockedIncrement( &tls->m_handshakes );
+
+        if ( SSL_session_reused( session ) )
+        {
+            sys::General::interlockedIncrement( &tls->m_resumed );
+        }
+
+#ifdef BIO_get_ktls_send
+        if ( BIO_get_ktls_send( SSL_get_wbio( session ) ) )
+        {
+            sys::General::interlockedIncrement( &tls->m_kernel );
+        }
+#endif
+    }
+
+    int Tls::onSelectStatic( ssl_st* ssl, const unsigned char** selected, unsigned char* selectedLength, const unsigned char* offered, unsigned int offeredLength, void* arg )
+    {
+        Tls* tls = ( Tls* ) arg;
+
+        //
+        //  server preference wins, client that offers nothing known continues without protocol
+        //
+        if ( SSL_select_next_proto( ( unsigned char** ) selected, selectedLength, ( const unsigned char* ) tls->m_protocols.data( ), tls->m_protocols.size( ),
+                                    offered, offeredLength ) != OPENSSL_NPN_NEGOTIATED )
+        {
+            return SSL_TLSEXT_ERR_NOACK;
+        }
+
+        return SSL_TLSEXT_ERR_OK;
+    }
+
+    int Tls::onTicketStatic( ssl_st* ssl, unsigned char* name, unsigned char* iv, evp_cipher_ctx_st* cipher, evp_mac_ctx_st* mac, int encrypt )
+    {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        Tls* tls = ( Tls* ) SSL_CTX_get_app_data( SSL_get_SSL_CTX( ssl ) );
+
+        TicketKey key;
+        int result = 1;
+
+        {
+            sys::LockEnterLeave lock( tls->m_lock );
+
+            if ( encrypt )
+            {
+                //
+                //  new tickets are sealed with current key, it is replaced once per session timeout
+                //
+                if ( sys::General::getMillisecondTimestamp( ) - tls->m_current.created >= tls->m_sessionTimeout * 1000 )
+                {
+                    tls->rotate( );
+                }
+
+                key = tls->m_current;
+            }
+            else if ( !memcmp( name, tls->m_current.name, sizeof( key.name ) ) )
+            {
+                key = tls->m_current;
+            }
+            else if ( !memcmp( name, tls->m_previous.name, sizeof( key.name ) ) )
+            {
+                //
+                //  ticket is still valid, client gets one sealed with current key
+                //
+                key = tls->m_previous;
+                result = 2;
+            }
+            else
+            {
+                //
+                //  unknown or expired key, full handshake
+                //
+                return 0;
+            }
+        }
+
+        OSSL_PARAM params[] =
+        {
+            OSSL_PARAM_construct_octet_string( OSSL_MAC_PARAM_KEY, key.hmac, sizeof( key.hmac ) ),
+            OSSL_PARAM_construct_utf8_string( OSSL_MAC_PARAM_DIGEST, ( char* ) "SHA256", 0 ),
+            OSSL_PARAM_construct_end( )
+        };
+
+        if ( encrypt )
+        {
+            memcpy( name, key.name, sizeof( key.name ) );
+
+            if ( RAND_bytes( iv, EVP_CIPHER_iv_length( EVP_aes_256_cbc( ) ) ) != 1 ||
+                 EVP_EncryptInit_ex( cipher, EVP_aes_256_cbc( ), NULL, key.aes, iv ) != 1 )
+            {
+                result = -1;
+            }
+        }
+        else if ( EVP_DecryptInit_ex( cipher, EVP_aes_256_cbc( ), NULL, key.aes, iv ) != 1 )
+        {
+            result = -1;
+        }
+
+        if ( result != -1 && EVP_MAC_CTX_set_params( mac, params ) != 1 )
+        {
+            result = -1;
+        }
+
+        OPENSSL_cleanse( &key, sizeof( key ) );
+
+        return result;
+#else
+        return 0;
+#endif
+    }
+}
@@ -16,6 +16,15 @@ limitations under the License.
 
 #include <event2/thread.h>
 
+#include <event2/bufferevent_ssl.h>
+
+#include <openssl/ssl.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
 #include "event.h"
 #include "common.h"
 
@@ -32,7 +41,13 @@ namespace libevent
 
     void General::setSocketNonBlocking( sys::Socket& socket )
     {
+        if ( socket.nonBlocking() )
+        {
+            return;
+        }
+        
         evutil_make_socket_nonblocking( socket.s() );
+        socket.setNonBlocking();
     }
 
     void General::initThreads()
@@ -92,19 +107,139 @@ namespace libevent
         }
     }
 
+    Mailbox::Mailbox( const Base& base )
+    : m_head( NULL ), m_event( NULL )
+    {
+#ifdef __linux__
+        m_fd[0] = m_fd[1] = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+        
+        if ( m_fd[0] == -1 )
+        {
+            TRACE_ERROR( "eventfd failed, error %d", sys::General::getLastError( ) );
+            throw GeneralError;
+        }
+#else
+        if ( evutil_socketpair( AF_UNIX, SOCK_STREAM, 0, m_fd ) == -1 )
+        {
+            TRACE_ERROR( "socketpair failed, error %d", sys::General::getLastError( ) );
+            throw GeneralError;
+        }
+        
+        evutil_make_socket_nonblocking( m_fd[0] );
+        evutil_make_socket_nonblocking( m_fd[1] );
+#endif
+        m_event = event_new( base, m_fd[0], EV_READ | EV_PERSIST, onWakeStatic, this );
+        event_add( m_event, NULL );
+    }
+    
+    Mailbox::~Mailbox( )
+    {
+        if ( m_event )
+        {
+            event_free( m_event );
+        }
+        
+        //
+        //  messages that were not delivered are dropped
+        //
+        Message* message = ( Message* ) sys::General::interlockedExchangePointer( ( void** ) &m_head, NULL );
+        
+        while ( message )
+        {
+            Message* next = message->m_next;
+            delete message;
+            message = next;
+        }
+        
+        evutil_closesocket( m_fd[0] );
+        
+        if ( m_fd[1] != m_fd[0] )
+        {
+            evutil_closesocket( m_fd[1] );
+        }
+    }
+    
+    void Mailbox::post( Message* message )
+    {
+        Message* head;
+        
+        do
+        {
+            head = m_head;
+            message->m_next = head;
+        }
+        while ( sys::General::interlockedCompareExchangePointer( ( void** ) &m_head, message, head ) != head );
+        
+        if ( head )
+        {
+            //
+            //  queue was not empty, event loop has been woken up already
+            //
+            return;
+        }
+        
+#ifdef __linux__
+        eventfd_write( m_fd[1], 1 );
+#else
+        char signal = 0;
+        send( m_fd[1], &signal, 1, 0 );
+#endif
+    }
+    
+    void Mailbox::onWakeStatic( evutil_socket_t fd, short what, void *arg )
+    {
+        ( ( Mailbox* ) arg )->onWake( );
+    }
+    
+    void Mailbox::onWake( )
+    {
+        //
+        //  reset wakeup signal before taking messages, so message posted after that wakes loop again
+        //
+#ifdef __linux__
+        eventfd_t value;
+        eventfd_read( m_fd[0], &value );
+#else
+        char signals[ 64 ];
+        while ( recv( m_fd[0], signals, sizeof( signals ), 0 ) > 0 );
+#endif
+        
+        Message* message = ( Message* ) sys::General::interlockedExchangePointer( ( void** ) &m_head, NULL );
+        
+        //
+        //  messages are linked in reverse order, restore posting order
+        //
+        Message* ordered = NULL;
+        
+        while ( message )
+        {
+            Message* next = message->m_next;
+            message->m_next = ordered;
+            ordered = message;
+            message = next;
+        }
+        
+        while ( ordered )
+        {
+            Message* next = ordered->m_next;
+            ordered->deliver( );
+            ordered = next;
+        }
+    }
+
     Listener::Listener( unsigned int port )
     : m_listenerEvent( NULL ), m_port( port )
     {
         
     }
 
-    void Listener::listen( const Base& base)
+    void Listener::listen( const Base& base, bool reusePort )
     {
         TRACE_ENTERLEAVE();
 
         General::setSocketNonBlocking( m_socket );
 
-        if ( m_socket.bind( m_port ) == sys::Socket::StatusFailed )
+        if ( m_socket.bind( m_port, reusePort ) == sys::Socket::StatusFailed )
         {
             TRACE_ERROR( "cannot bind to socket, error %d", sys::General::getLastError() );
             throw BindError;
@@ -138,13 +273,28 @@ namespace libevent
         (( Listener* ) arg)->onAccept();
     }
 
-    Connection::Connection( sys::Socket* socket, const Base& base )
-    : m_socket( socket ), m_handle( NULL ), m_close( false ), m_id( ( intptr_t ) this ),  m_deleteEvent( NULL ), m_base( base )
+    Connection::Connection( sys::Socket* socket, const Base& base, ssl_st* ssl )
+    : m_close( false ), m_handle( NULL ), m_socket( socket ), m_ssl( ssl ), m_id( ( intptr_t ) this ), m_base( base )
     {
         TRACE_ENTERLEAVE();
         General::setSocketNonBlocking( *socket );
         
-        m_handle = bufferevent_socket_new( m_base, m_socket->s(), BEV_OPT_THREADSAFE );
+        //
+        //  connection is used only by its event loop thread, no locking is needed. Socket and TLS session are not
+        //  owned by buffered event, they are released by the connection
+        //
+        if ( m_ssl )
+        {
+            //
+            //  TLS layer encrypts output as soon as it is written and would run write callback before write() returns,
+            //  i.e. before close flag is set, so callbacks are run from event loop
+            //
+            m_handle = bufferevent_openssl_socket_new( m_base, m_socket->s(), m_ssl, BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_DEFER_CALLBACKS );
+        }
+        else
+        {
+            m_handle = bufferevent_socket_new( m_base, m_socket->s(), 0 );
+        }
 
         if ( !m_handle )
         {
@@ -167,15 +317,16 @@ namespace libevent
             bufferevent_free( m_handle );
         }
         
-        if ( m_socket )
+        if ( m_ssl )
         {
-            delete m_socket;
+            SSL_free( m_ssl );
         }
         
-        if ( m_deleteEvent )
+        if ( m_socket )
         {
-            event_free( m_deleteEvent );
+            delete m_socket;
         }
+
     }
     
     void Connection::enable()
@@ -193,6 +344,26 @@ namespace libevent
         return bufferevent_read( m_handle, data, length );
     }
     
+    int Connection::readToFile( int fd, unsigned int length )
+    {
+        evbuffer* input = bufferevent_get_input( m_handle );
+        unsigned int written = 0;
+        
+        while ( written < length )
+        {
+            int result = evbuffer_write_atmost( input, fd, length - written );
+            
+            if ( result <= 0 )
+            {
+                return -1;
+            }
+            
+            written += result;
+        }
+        
+        return written;
+    }
+    
     void Connection::write( const char* data, unsigned int length, bool close )
     {
         TRACE("%s", data );
@@ -201,6 +372,41 @@ namespace libevent
         m_close = close;
     }
 
+    void Connection::write( evbuffer* buffer, bool close )
+    {
+        bufferevent_write_buffer( m_handle, buffer );
+        
+        m_close = close;
+    }
+
+    void Connection::write( SharedBuffer& buffer )
+    {
+        buffer.append( bufferevent_get_output( m_handle ) );
+    }
+
+    void SharedBuffer::append( evbuffer* buffer )
+    {
+        if ( !m_length )
+        {
+            return;
+        }
+
+        //
+        //  chain points to shared data, reference is dropped once it is sent or the buffer is freed
+        //
+        ref( );
+
+        if ( evbuffer_add_reference( buffer, m_data, m_length, onReleaseStatic, this ) != 0 )
+        {
+            deref( );
+        }
+    }
+
+    void SharedBuffer::onReleaseStatic( const void* data, size_t length, void* arg )
+    {
+        ( ( SharedBuffer* ) arg )->deref( );
+    }
+
     void Connection::send()
     {
         evbuffer_add_buffer( bufferevent_get_output( m_handle ), m_output );
@@ -275,6 +481,36 @@ namespace libevent
         return evbuffer_get_length( m_input );
     }
 
+    unsigned int Connection::outputLength()
+    {
+        return evbuffer_get_length( m_output );
+    }
+
+    bool Connection::negotiated( const char* protocol ) const
+    {
+        if ( !m_ssl )
+        {
+            return false;
+        }
+
+        const unsigned char* selected = NULL;
+        unsigned int length = 0;
+
+        SSL_get0_alpn_selected( m_ssl, &selected, &length );
+
+        return length == strlen( protocol ) && !memcmp( selected, protocol, length );
+    }
+
+    const char* Connection::pullInput( unsigned int length )
+    {
+        return ( const char* ) evbuffer_pullup( m_input, length );
+    }
+    
+    void Connection::drainInput( unsigned int length )
+    {
+        evbuffer_drain( m_input, length );
+    }
+
     unsigned int Connection::searchInput( const char* what, unsigned int length )
     {
         evbuffer_ptr found = evbuffer_search( m_input, what, length, NULL );
@@ -308,24 +544,6 @@ namespace libevent
     }
     
     
-    void Connection::scheduleDelete()
-    {
-        if ( !m_deleteEvent )
-        {
-            //
-            //  schedule deletion event
-            //
-            m_deleteEvent = evtimer_new( m_base, onDeleteStatic, this );
-            struct timeval timeout = { 0, 0 };
-            evtimer_add( m_deleteEvent, &timeout );
-        }
-    }
-    
-    void Connection::onDeleteStatic( evutil_socket_t fd, short what, void *arg )
-    {
-        ( ( Connection* ) arg )->onDelete();
-    }
-    
     bool Connection::enabled()
     {
         if ( bufferevent_get_enabled( m_handle ) == 0 )
@@ -337,19 +555,30 @@ namespace libevent
         
     }
     
+    void Connection::pauseRead( )
+    {
+        bufferevent_disable( m_handle, EV_READ );
+    }
+
+    void Connection::resumeRead( )
+    {
+        bufferevent_enable( m_handle, EV_READ );
+    }
+
     void Connection::disable()
     {
+        if ( m_ssl && SSL_is_init_finished( m_ssl ) )
+        {
+            //
+            //  send close_notify, so client can tell connection was not truncated
+            //
+            SSL_shutdown( m_ssl );
+        }
+        
         m_socket->shutdown();
         bufferevent_disable( m_handle, EV_READ | EV_WRITE );
     }
     
-    void Connection::onDelete()
-    {
-        TRACE_ENTERLEAVE();
-     
-        delete this;
-    }
-    
     Timer::Timer( const Base& base )
     :  m_base( base )
     {
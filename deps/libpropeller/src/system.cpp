@@ -15,8 +15,22 @@ limitations under the License.
  */
 
 #include "system.h"
+
+#include <stdlib.h>
+#include <limits.h>
+#include <new>
+#include <algorithm>
 #include "trace.h"
 
+#ifndef WIN32
+#include <sched.h>
+#endif
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
 namespace sys
 {
 
@@ -60,12 +74,20 @@ namespace sys
 #ifdef WIN32
         return InterlockedExchangePointer( target, value );
 #else
-        void* oldValue = __sync_fetch_and_add( target, 0 );
-        return __sync_val_compare_and_swap( target, oldValue, value );
+        return __sync_lock_test_and_set( target, value );
 #endif
 
     }
 
+    void* General::interlockedCompareExchangePointer( void** target, void* value, void* comparand )
+    {
+#ifdef WIN32
+        return InterlockedCompareExchangePointer( target, value, comparand );
+#else
+        return __sync_val_compare_and_swap( target, comparand, value );
+#endif
+    }
+
     unsigned int General::interlockedIncrement( unsigned int* target )
     {
 #ifdef WIN32
@@ -86,6 +108,60 @@ namespace sys
 
 
 
+    unsigned int General::interlockedAdd( unsigned int* target, unsigned int value )
+    {
+#ifdef WIN32
+        return InterlockedExchangeAdd( ( LONG* ) target, value );
+#else
+        return __sync_fetch_and_add( target, value );
+#endif
+    }
+
+    unsigned int General::interlockedExchange( unsigned int* target, unsigned int value )
+    {
+#ifdef WIN32
+        return InterlockedExchange( ( LONG* ) target, value );
+#else
+        return __sync_lock_test_and_set( target, value );
+#endif
+    }
+
+    unsigned int General::interlockedCompareExchange( unsigned int* target, unsigned int value, unsigned int comparand )
+    {
+#ifdef WIN32
+        return InterlockedCompareExchange( ( LONG* ) target, value, comparand );
+#else
+        return __sync_val_compare_and_swap( target, comparand, value );
+#endif
+    }
+
+    void General::memoryBarrier( )
+    {
+#ifdef WIN32
+        MemoryBarrier( );
+#else
+        __sync_synchronize( );
+#endif
+    }
+
+    void General::pause( )
+    {
+#if defined( __i386__ ) || defined( __x86_64__ )
+        __builtin_ia32_pause( );
+#elif defined( WIN32 )
+        YieldProcessor( );
+#endif
+    }
+
+    void General::yield( )
+    {
+#ifdef WIN32
+        SwitchToThread( );
+#else
+        sched_yield( );
+#endif
+    }
+
     void General::sleep ( unsigned int seconds )
     {
 #ifdef WIN32
@@ -95,6 +171,177 @@ namespace sys
 #endif
     }
 
+    //
+    //	Allocator
+    //
+    THREAD_LOCAL Allocator* Allocator::s_current = NULL;
+    Allocator::Node Allocator::s_retired;
+
+    Allocator::Allocator( )
+    : m_hits( 0 ), m_misses( 0 ), m_blocks( 1 )
+    {
+        memset( m_free, 0, sizeof( m_free ) );
+        memset( m_remote, 0, sizeof( m_remote ) );
+    }
+
+    void Allocator::attach( )
+    {
+        s_current = this;
+    }
+
+    void Allocator::retire( )
+    {
+        unsigned int freed = 0;
+
+        for ( unsigned int i = 0; i < SizeClasses; i++ )
+        {
+            //
+            //  remote list is closed in the same exchange that takes it, so no block released later is left there
+            //
+            Node* lists[] = { m_free[i], ( Node* ) General::interlockedExchangePointer( ( void** ) &m_remote[i], &s_retired ) };
+            m_free[i] = NULL;
+
+            for ( unsigned int j = 0; j < 2; j++ )
+            {
+                for ( Node* node = lists[j]; node; )
+                {
+                    Node* next = node->next;
+                    free( ( char* ) node - HeaderSize );
+                    node = next;
+                    freed++;
+                }
+            }
+        }
+
+        if ( s_current == this )
+        {
+            s_current = NULL;
+        }
+
+        unref( freed + 1 );
+    }
+
+    void Allocator::unref( unsigned int count )
+    {
+        if ( General::interlockedAdd( &m_blocks, ( unsigned int ) -count ) == count )
+        {
+            delete this;
+        }
+    }
+
+    void* Allocator::allocate( size_t size )
+    {
+        Allocator* allocator = s_current;
+        size_t sizeClass = ( size + HeaderSize + Granularity - 1 ) / Granularity - 1;
+
+        if ( allocator && sizeClass < SizeClasses )
+        {
+            return allocator->get( sizeClass );
+        }
+
+        Header* header = ( Header* ) malloc( size + HeaderSize );
+
+        if ( !header )
+        {
+            throw std::bad_alloc( );
+        }
+
+        header->owner = NULL;
+        header->sizeClass = 0;
+
+        return ( char* ) header + HeaderSize;
+    }
+
+    void* Allocator::get( unsigned int sizeClass )
+    {
+        Node* node = m_free[ sizeClass ];
+
+        if ( !node )
+        {
+            //
+            //  take all blocks released by other threads at once
+            //
+            node = ( Node* ) General::interlockedExchangePointer( ( void** ) &m_remote[ sizeClass ], NULL );
+        }
+
+        if ( node )
+        {
+            m_free[ sizeClass ] = node->next;
+            m_hits++;
+
+            return node;
+        }
+
+        m_misses++;
+
+        Header* header = ( Header* ) malloc( ( sizeClass + 1 ) * Granularity );
+
+        if ( !header )
+        {
+            throw std::bad_alloc( );
+        }
+
+        General::interlockedIncrement( &m_blocks );
+
+        header->owner = this;
+        header->sizeClass = sizeClass;
+
+        return ( char* ) header + HeaderSize;
+    }
+
+    void Allocator::release( void* block )
+    {
+        if ( !block )
+        {
+            return;
+        }
+
+        Header* header = ( Header* ) ( ( char* ) block - HeaderSize );
+
+        if ( !header->owner )
+        {
+            free( header );
+            return;
+        }
+
+        header->owner->put( ( Node* ) block, header->sizeClass );
+    }
+
+    void Allocator::put( Node* node, unsigned int sizeClass )
+    {
+        if ( s_current == this )
+        {
+            node->next = m_free[ sizeClass ];
+            m_free[ sizeClass ] = node;
+
+            return;
+        }
+
+        //
+        //  block is released by another thread, push it to lock free list (owner takes the whole list, so there is no ABA problem)
+        //
+        Node* head;
+
+        do
+        {
+            head = m_remote[ sizeClass ];
+
+            if ( head == &s_retired )
+            {
+                //
+                //  owner is retired, block holds a reference to the allocator till it is freed
+                //
+                free( ( char* ) node - HeaderSize );
+                unref( 1 );
+
+                return;
+            }
+
+            node->next = head;
+        }
+        while ( General::interlockedCompareExchangePointer( ( void** ) &m_remote[ sizeClass ], node, head ) != head );
+    }
+
     //
     //	Lock
     //
@@ -397,6 +644,7 @@ namespace sys
     }
 
     Socket::Socket ( )
+    : m_nonBlocking( false )
     {
 #ifdef WIN32
         m_socket = ::socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
@@ -408,10 +656,11 @@ namespace sys
     Socket::Socket ( const Socket& socket )
     {
         m_socket = socket.m_socket;
+        m_nonBlocking = socket.m_nonBlocking;
     }
 
     Socket::Socket ( const SOCKET& socket )
-    : m_socket ( socket )
+    : m_socket ( socket ), m_nonBlocking( false )
     {
     }
 
@@ -478,8 +727,27 @@ namespace sys
         return( result == 0 ) ? StatusSuccess : StatusFailed;
     }
 
-    Socket* Socket::accept ( )
+    Socket* Socket::accept ( bool nonBlocking )
     {
+#if defined( SOCK_NONBLOCK ) && defined( SOCK_CLOEXEC )
+        if ( nonBlocking )
+        {
+            //
+            //  accept and set flags in one system call
+            //
+            SOCKET connection = ::accept4( m_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+            
+            if ( connection != INVALID_SOCKET )
+            {
+                Socket* socket = new Socket( connection );
+                socket->setNonBlocking( );
+                
+                return socket;
+            }
+            
+            return NULL;
+        }
+#endif
         SOCKET connection = ::accept( m_socket, NULL, NULL );
 
         if ( connection != INVALID_SOCKET )
@@ -492,7 +760,7 @@ namespace sys
         return NULL;
     }
 
-    Socket::Status Socket::bind ( unsigned int port )
+    Socket::Status Socket::bind ( unsigned int port, bool reusePort )
     {
         struct sockaddr_in service;
         memset( &service, 0, sizeof(service) );
@@ -507,6 +775,23 @@ namespace sys
         int on = 1;
         int result = ::setsockopt( m_socket, SOL_SOCKET, SO_REUSEADDR, ( const char* ) & on, sizeof(on ) );
 
+        if ( reusePort )
+        {
+#ifdef SO_REUSEPORT
+            //
+            //  allow several sockets to bind to the same port, kernel balances incoming connections between them
+            //
+            result = ::setsockopt( m_socket, SOL_SOCKET, SO_REUSEPORT, ( const char* ) & on, sizeof( on ) );
+
+            if ( result != 0 )
+            {
+                return StatusFailed;
+            }
+#else
+            return StatusFailed;
+#endif
+        }
+
         result = ::bind( m_socket, ( struct sockaddr* ) & service, sizeof( service ) );
 
         return( result == 0 ) ? StatusSuccess : StatusFailed;
@@ -526,133 +811,869 @@ namespace sys
         return m_socket;
     }
         
-    ThreadPool::ThreadPool( )
-    : m_stop( false )
+#ifdef HAVE_EVENT_COUNT
+    //
+    //  EventCount
+    //
+    EventCount::EventCount( )
+    : m_epoch( 0 ), m_waiters( 0 )
     {
-        TRACE_ENTERLEAVE( );
+#ifndef __linux__
+        pthread_mutex_init( &m_lock, NULL );
+        pthread_cond_init( &m_condition, NULL );
+#endif
     }
 
-    ThreadPool::~ThreadPool( )
+    EventCount::~EventCount( )
     {
-        TRACE_ENTERLEAVE( );
-
-        stop( );
+#ifndef __linux__
+        pthread_cond_destroy( &m_condition );
+        pthread_mutex_destroy( &m_lock );
+#endif
     }
 
-    void ThreadPool::queue( Task* task )
+    unsigned int EventCount::prepareWait( )
     {
-        TRACE_ENTERLEAVE( );
-
-        if ( m_stop )
-        {
-            return;
-        }
-
-        {
-            LockEnterLeave lock( m_lock );
-            m_queue.push_back( task );
-        }
+        //
+        //  waiter count is published before the condition is checked again, so notifier either sees the waiter
+        //  or waiter sees the changed condition
+        //
+        General::interlockedIncrement( &m_waiters );
 
-        m_semaphore.post( );
+        return General::interlockedAdd( &m_epoch, 0 );
     }
 
-    void ThreadPool::start( unsigned int threads )
+    void EventCount::cancelWait( )
     {
-        TRACE_ENTERLEAVE( );
-        int i = 0;
+        General::interlockedDecrement( &m_waiters );
+    }
 
-        while ( i < threads )
+    void EventCount::wait( unsigned int key )
+    {
+#ifdef __linux__
+        while ( General::interlockedAdd( &m_epoch, 0 ) == key )
         {
-            
-            Worker* thread = new Worker( *this );
+            syscall( SYS_futex, &m_epoch, FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0 );
+        }
+#else
+        pthread_mutex_lock( &m_lock );
 
-            //
-            //  invoke callback
-            //
-            
-            onThreadStart( *thread );
-            m_threads.push_back( thread );
-            i++;
-            thread->start( );
+        while ( m_epoch == key )
+        {
+            pthread_cond_wait( &m_condition, &m_lock );
         }
+
+        pthread_mutex_unlock( &m_lock );
+#endif
+        General::interlockedDecrement( &m_waiters );
     }
 
-    void ThreadPool::stop( )
+    void EventCount::notify( bool all )
     {
-        TRACE_ENTERLEAVE( );
+        General::memoryBarrier( );
 
-        if ( m_stop )
+        if ( !m_waiters )
         {
             return;
         }
 
-        m_stop = true;
+#ifdef __linux__
+        General::interlockedIncrement( &m_epoch );
+        syscall( SYS_futex, &m_epoch, FUTEX_WAKE_PRIVATE, all ? INT_MAX : 1, NULL, NULL, 0 );
+#else
+        pthread_mutex_lock( &m_lock );
+        m_epoch++;
 
+        if ( all )
         {
-            sys::LockEnterLeave lock( m_lock );
-
-            while ( !m_queue.empty( ) )
-            {
-                Task* task = m_queue.front( );
-                delete task;
-                m_queue.pop_front( );
-            }
+            pthread_cond_broadcast( &m_condition );
         }
-
-        m_semaphore.setValue( m_threads.size( ) );
-
-        while ( !m_threads.empty( ) )
+        else
         {
-            Thread* thread = m_threads.front( );
-
-            delete thread;
-            m_threads.pop_front( );
+            pthread_cond_signal( &m_condition );
         }
+
+        pthread_mutex_unlock( &m_lock );
+#endif
     }
+#endif
 
-    ThreadPool::Task* ThreadPool::get( )
+    //
+    //  RingQueue
+    //
+    RingQueue::RingQueue( unsigned int capacity )
+    : m_cells( NULL ), m_mask( 0 ), m_enqueue( 0 ), m_dequeue( 0 )
     {
-        TRACE_ENTERLEAVE( );
-
-        //
-        //  wait for semaphore
-        //
-        m_semaphore.wait( );
+        unsigned int size = 2;
 
-        if ( m_stop )
+        while ( size < capacity )
         {
-            return NULL;
+            size <<= 1;
         }
 
-        //
-        //  return next context to process or NULL if the queue is empty
-        //
-        LockEnterLeave lock( m_lock );
+        m_cells = new Cell[ size ];
+        m_mask = size - 1;
 
-        if ( m_queue.empty( ) )
+        for ( unsigned int i = 0; i < size; i++ )
         {
-            return NULL;
+            m_cells[ i ].sequence = i;
+            m_cells[ i ].item = NULL;
         }
-
-
-        Task* task = m_queue.front( );
-        m_queue.pop_front( );
-
-        return task;
     }
-    
 
-    ThreadPool::Worker::Worker( ThreadPool& pool )
-    : m_pool( pool ), m_data( NULL )
+    RingQueue::~RingQueue( )
     {
-        TRACE_ENTERLEAVE( );
-
-        m_stackSize = 1024 * 1024 * 4;
+        delete[] m_cells;
     }
 
-    ThreadPool::Worker::~Worker( )
+    bool RingQueue::push( void* item )
+    {
+        unsigned int position = m_enqueue;
+
+        for ( ;; )
+        {
+            Cell* cell = &m_cells[ position & m_mask ];
+            unsigned int sequence = cell->sequence;
+            int difference = ( int ) ( sequence - position );
+
+            if ( difference == 0 )
+            {
+                //
+                //  cell is free, claim it
+                //
+                unsigned int current = General::interlockedCompareExchange( ( unsigned int* ) &m_enqueue, position + 1, position );
+
+                if ( current == position )
+                {
+                    cell->item = item;
+                    General::memoryBarrier( );
+                    cell->sequence = position + 1;
+
+                    return true;
+                }
+
+                position = current;
+            }
+            else if ( difference < 0 )
+            {
+                //
+                //  cell still holds item from previous lap
+                //
+                return false;
+            }
+            else
+            {
+                position = m_enqueue;
+            }
+        }
+    }
+
+    void* RingQueue::pop( )
+    {
+        unsigned int position = m_dequeue;
+
+        for ( ;; )
+        {
+            Cell* cell = &m_cells[ position & m_mask ];
+            unsigned int sequence = cell->sequence;
+            int difference = ( int ) ( sequence - ( position + 1 ) );
+
+            if ( difference == 0 )
+            {
+                unsigned int current = General::interlockedCompareExchange( ( unsigned int* ) &m_dequeue, position + 1, position );
+
+                if ( current == position )
+                {
+                    void* item = cell->item;
+                    General::memoryBarrier( );
+                    cell->sequence = position + m_mask + 1;
+
+                    return item;
+                }
+
+                position = current;
+            }
+            else if ( difference < 0 )
+            {
+                //
+                //  empty
+                //
+                return NULL;
+            }
+            else
+            {
+                position = m_dequeue;
+            }
+        }
+    }
+
+    ThreadPool::ThreadPool( )
+    : m_stop( false ), m_queueType( LockedQueue ), m_queueCapacity( 65536 ), m_spinCount( SpinCount ), m_ring( NULL ), m_nextWorker( 0 ), m_overflow( 0 )
+    {
+        TRACE_ENTERLEAVE( );
+    }
+
+    ThreadPool::~ThreadPool( )
+    {
+        TRACE_ENTERLEAVE( );
+
+        stop( );
+
+        if ( m_ring )
+        {
+            delete m_ring;
+        }
+    }
+
+    void ThreadPool::queue( Task* task )
+    {
+        TRACE_ENTERLEAVE( );
+
+        if ( m_stop )
+        {
+            delete task;
+            return;
+        }
+#ifdef HAVE_EVENT_COUNT
+        if ( m_ring )
+        {
+            push( m_ring, task );
+            wakeIdle( );
+            return;
+        }
+
+        if ( m_queueType == WorkStealingQueue && !m_workers.empty( ) )
+        {
+            //
+            //  spread tasks without preference
+            //
+            queue( task, General::interlockedIncrement( &m_nextWorker ) );
+            return;
+        }
+#endif
+        Worker* idle = NULL;
+
+        {
+            LockEnterLeave lock( m_lock );
+            m_queue.push_back( task );
+
+            if ( !m_idle.empty( ) )
+            {
+                idle = m_idle.back( );
+                idle->m_idle = false;
+                m_idle.pop_back( );
+            }
+        }
+
+        if ( idle )
+        {
+            idle->m_semaphore.post( );
+        }
+    }
+
+    void ThreadPool::queue( Task* task, unsigned int worker )
+    {
+#ifdef HAVE_EVENT_COUNT
+        if ( m_queueType != WorkStealingQueue || m_workers.empty( ) )
+        {
+            queue( task );
+            return;
+        }
+
+        if ( m_stop )
+        {
+            delete task;
+            return;
+        }
+
+        Worker* owner = m_workers[ worker % m_workers.size( ) ];
+        push( owner->m_local, task );
+
+        //
+        //  task is published before waiters are checked, owner registers as waiter before it checks its queue again
+        //
+        General::memoryBarrier( );
+
+        if ( owner->m_eventCount.waiting( ) )
+        {
+            owner->m_eventCount.notify( );
+            return;
+        }
+
+        //
+        //  owner is busy, wake idle worker to steal the task
+        //
+        for ( unsigned int i = 1; i < m_workers.size( ); i++ )
+        {
+            Worker* thief = m_workers[ ( owner->m_index + i ) % m_workers.size( ) ];
+
+            if ( thief->m_eventCount.waiting( ) )
+            {
+                thief->m_eventCount.notify( );
+                return;
+            }
+        }
+#else
+        queue( task );
+#endif
+    }
+
+    void ThreadPool::queue( Task* task, Worker& worker )
+    {
+        if ( m_stop )
+        {
+            delete task;
+            return;
+        }
+
+        Task* head;
+
+        do
+        {
+            head = worker.m_pinned;
+            task->m_next = head;
+        }
+        while ( General::interlockedCompareExchangePointer( ( void** ) &worker.m_pinned, task, head ) != head );
+
+        //
+        //  wake only the worker the task is pinned to, other workers have nothing to do with it
+        //
+#ifdef HAVE_EVENT_COUNT
+        if ( m_ring || worker.m_local )
+        {
+            worker.m_eventCount.notify( );
+            return;
+        }
+#endif
+        bool idle;
+
+        {
+            //
+            //  worker checks its pinned tasks under the lock before it registers as idle, so it either sees the task
+            //  or it is registered already
+            //
+            LockEnterLeave lock( m_lock );
+            idle = worker.m_idle;
+
+            if ( idle )
+            {
+                worker.m_idle = false;
+                m_idle.erase( std::find( m_idle.begin( ), m_idle.end( ), &worker ) );
+            }
+        }
+
+        if ( idle )
+        {
+            worker.m_semaphore.post( );
+        }
+    }
+
+    void ThreadPool::wakeIdle( )
+    {
+#ifdef HAVE_EVENT_COUNT
+        //
+        //  task is published before waiters are checked, worker registers as waiter before it checks the queue again.
+        //  System call is made only if some worker sleeps
+        //
+        General::memoryBarrier( );
+
+        for ( unsigned int i = 0; i < m_workers.size( ); i++ )
+        {
+            if ( m_workers[ i ]->m_eventCount.waiting( ) )
+            {
+                m_workers[ i ]->m_eventCount.notify( );
+                return;
+            }
+        }
+#endif
+    }
+
+    ThreadPool::Task* ThreadPool::getPinned( Worker& worker )
+    {
+        if ( !worker.m_taken && worker.m_pinned )
+        {
+            //
+            //  pinned tasks are linked in reverse order, restore queuing order
+            //
+            Task* task = ( Task* ) General::interlockedExchangePointer( ( void** ) &worker.m_pinned, NULL );
+
+            while ( task )
+            {
+                Task* next = task->m_next;
+                task->m_next = worker.m_taken;
+                worker.m_taken = task;
+                task = next;
+            }
+        }
+
+        Task* task = worker.m_taken;
+
+        if ( task )
+        {
+            worker.m_taken = task->m_next;
+        }
+
+        return task;
+    }
+
+    void ThreadPool::push( RingQueue* ring, Task* task )
+    {
+        for ( unsigned int i = 0; !ring->push( task ); i++ )
+        {
+            if ( m_stop )
+            {
+                delete task;
+                return;
+            }
+
+            if ( i == PushAttempts )
+            {
+                //
+                //  workers do not catch up, producer (usually connection thread) is not held any longer
+                //
+                LockEnterLeave lock( m_lock );
+                m_queue.push_back( task );
+                m_overflow++;
+
+                return;
+            }
+
+            //
+            //  queue is full, let workers catch up
+            //
+            General::yield( );
+        }
+    }
+
+    ThreadPool::Task* ThreadPool::getOverflow( )
+    {
+        if ( !m_overflow )
+        {
+            return NULL;
+        }
+
+        LockEnterLeave lock( m_lock );
+
+        if ( m_queue.empty( ) )
+        {
+            return NULL;
+        }
+
+        Task* task = m_queue.front( );
+        m_queue.pop_front( );
+        m_overflow--;
+
+        return task;
+    }
+
+    void ThreadPool::start( unsigned int threads )
+    {
+        TRACE_ENTERLEAVE( );
+        unsigned int i = 0;
+
+#ifdef HAVE_EVENT_COUNT
+        if ( m_queueType == LockFreeQueue && !m_ring )
+        {
+            m_ring = new RingQueue( m_queueCapacity );
+        }
+
+        //
+        //  spinning only delays producer on single processor
+        //
+        if ( sysconf( _SC_NPROCESSORS_ONLN ) < 2 )
+        {
+            m_spinCount = 1;
+        }
+#else
+        m_queueType = LockedQueue;
+#endif
+
+        unsigned int first = m_workers.size( );
+
+        while ( i < threads )
+        {
+            
+            Worker* thread = new Worker( *this );
+            thread->m_index = m_workers.size( );
+
+            if ( m_queueType == WorkStealingQueue )
+            {
+                thread->m_local = new RingQueue( m_queueCapacity );
+            }
+
+            //
+            //  invoke callback
+            //
+            
+            onThreadStart( *thread );
+            m_threads.push_back( thread );
+            m_workers.push_back( thread );
+            i++;
+        }
+
+        //
+        //  workers are started once all of them are registered, so other workers queues can be scanned without locking
+        //
+        for ( unsigned int j = first; j < m_workers.size( ); j++ )
+        {
+            m_workers[ j ]->start( );
+        }
+    }
+
+    void ThreadPool::stop( )
+    {
+        TRACE_ENTERLEAVE( );
+
+        if ( m_stop )
+        {
+            return;
+        }
+
+        m_stop = true;
+
+        {
+            sys::LockEnterLeave lock( m_lock );
+
+            while ( !m_queue.empty( ) )
+            {
+                Task* task = m_queue.front( );
+                delete task;
+                m_queue.pop_front( );
+            }
+
+            m_overflow = 0;
+        }
+
+        {
+            sys::LockEnterLeave lock( m_lock );
+
+            for ( unsigned int i = 0; i < m_idle.size( ); i++ )
+            {
+                m_idle[ i ]->m_idle = false;
+                m_idle[ i ]->m_semaphore.post( );
+            }
+
+            m_idle.clear( );
+        }
+#ifdef HAVE_EVENT_COUNT
+        for ( unsigned int i = 0; i < m_workers.size( ); i++ )
+        {
+            m_workers[ i ]->m_eventCount.notify( true );
+        }
+#endif
+
+        //
+        //  wait for all workers before deleting any, idle workers may steal from others until they stop
+        //
+        for ( WorkerList::iterator i = m_threads.begin( ); i != m_threads.end( ); i++ )
+        {
+            ( *i )->stop( );
+        }
+
+        while ( !m_threads.empty( ) )
+        {
+            Worker* thread = m_threads.front( );
+
+            if ( !thread->m_attached )
+            {
+                delete thread;
+            }
+
+            m_threads.pop_front( );
+        }
+
+        m_workers.clear( );
+
+        if ( m_ring )
+        {
+            while ( Task* task = ( Task* ) m_ring->pop( ) )
+            {
+                delete task;
+            }
+        }
+    }
+
+    void ThreadPool::attachWorker( Worker* worker )
     {
         TRACE_ENTERLEAVE( );
+
+        worker->m_attached = true;
+
+        onThreadStart( *worker );
+        m_threads.push_back( worker );
+    }
+
+    void ThreadPool::getSchedulerMetrics( unsigned int& localHits, unsigned int& steals )
+    {
+        localHits = 0;
+        steals = 0;
+
+        for ( unsigned int i = 0; i < m_workers.size( ); i++ )
+        {
+            localHits += m_workers[ i ]->m_localHits;
+            steals += m_workers[ i ]->m_steals;
+        }
+    }
+
+    ThreadPool::Task* ThreadPool::get( Worker& worker )
+    {
+        TRACE_ENTERLEAVE( );
+
+        if ( m_ring )
+        {
+            return getLockFree( worker );
+        }
+
+        if ( worker.m_local )
+        {
+            return getStealing( worker );
+        }
+
+        for ( ;; )
+        {
+            Task* task = getPinned( worker );
+
+            if ( task )
+            {
+                return task;
+            }
+
+            {
+                LockEnterLeave lock( m_lock );
+
+                if ( m_stop )
+                {
+                    return NULL;
+                }
+
+                if ( !m_queue.empty( ) )
+                {
+                    task = m_queue.front( );
+                    m_queue.pop_front( );
+
+                    return task;
+                }
+
+                //
+                //  producers of pinned tasks check idle flag under the lock after queueing
+                //
+                if ( worker.m_pinned )
+                {
+                    continue;
+                }
+
+                //
+                //  worker may be registered already if previous wait was interrupted
+                //
+                if ( !worker.m_idle )
+                {
+                    worker.m_idle = true;
+                    m_idle.push_back( &worker );
+                }
+            }
+
+            //
+            //  posted once by the producer that unregisters this worker
+            //
+            worker.m_semaphore.wait( );
+        }
+    }
+
+    ThreadPool::Task* ThreadPool::getLockFree( Worker& worker )
+    {
+#ifdef HAVE_EVENT_COUNT
+        for ( ;; )
+        {
+            Task* task = getPinned( worker );
+
+            if ( !task )
+            {
+                task = getOverflow( );
+            }
+
+            if ( task )
+            {
+                return task;
+            }
+
+            //
+            //  spin briefly, tasks usually arrive in bursts
+            //
+            for ( unsigned int i = 0; i < m_spinCount; i++ )
+            {
+                if ( m_stop )
+                {
+                    return NULL;
+                }
+
+                task = ( Task* ) m_ring->pop( );
+
+                if ( task )
+                {
+                    return task;
+                }
+
+                General::pause( );
+            }
+
+            unsigned int key = worker.m_eventCount.prepareWait( );
+
+            task = getPinned( worker );
+
+            if ( !task )
+            {
+                task = ( Task* ) m_ring->pop( );
+            }
+
+            if ( !task )
+            {
+                task = getOverflow( );
+            }
+
+            if ( task || m_stop )
+            {
+                worker.m_eventCount.cancelWait( );
+                return task;
+            }
+
+            worker.m_eventCount.wait( key );
+        }
+#else
+        return NULL;
+#endif
+    }
+
+    ThreadPool::Task* ThreadPool::getStealing( Worker& worker )
+    {
+#ifdef HAVE_EVENT_COUNT
+        for ( ;; )
+        {
+            Task* task = getPinned( worker );
+
+            if ( !task )
+            {
+                task = getOverflow( );
+            }
+
+            if ( task )
+            {
+                return task;
+            }
+
+            for ( unsigned int i = 0; i < m_spinCount; i++ )
+            {
+                if ( m_stop )
+                {
+                    return NULL;
+                }
+
+                task = ( Task* ) worker.m_local->pop( );
+
+                if ( task )
+                {
+                    worker.m_localHits++;
+                    return task;
+                }
+
+                task = steal( worker );
+
+                if ( task )
+                {
+                    return task;
+                }
+
+                General::pause( );
+            }
+
+            //
+            //  producers check waiters after queueing, so task queued after this check wakes this worker
+            //
+            unsigned int key = worker.m_eventCount.prepareWait( );
+
+            task = getPinned( worker );
+
+            if ( !task )
+            {
+                task = ( Task* ) worker.m_local->pop( );
+
+                if ( task )
+                {
+                    worker.m_localHits++;
+                }
+                else
+                {
+                    task = steal( worker );
+                }
+            }
+
+            if ( !task )
+            {
+                task = getOverflow( );
+            }
+
+            if ( task || m_stop )
+            {
+                worker.m_eventCount.cancelWait( );
+                return task;
+            }
+
+            worker.m_eventCount.wait( key );
+        }
+#else
+        return NULL;
+#endif
+    }
+
+    ThreadPool::Task* ThreadPool::steal( Worker& worker )
+    {
+        //
+        //  start with the next worker, so thieves do not all pick the same victim
+        //
+        for ( unsigned int i = 1; i < m_workers.size( ); i++ )
+        {
+            Worker* victim = m_workers[ ( worker.m_index + i ) % m_workers.size( ) ];
+            Task* task = ( Task* ) victim->m_local->pop( );
+
+            if ( task )
+            {
+                worker.m_steals++;
+                return task;
+            }
+        }
+
+        return NULL;
+    }
+    
+
+    ThreadPool::Worker::Worker( ThreadPool& pool )
+    : m_pool( pool ), m_data( NULL ), m_index( 0 ), m_attached( false ), m_pinned( NULL ), m_taken( NULL ), m_local( NULL ), m_localHits( 0 ), m_steals( 0 ), m_idle( false )
+    {
+        TRACE_ENTERLEAVE( );
+
+        m_stackSize = 1024 * 1024 * 4;
+    }
+
+    ThreadPool::Worker::~Worker( )
+    {
+        TRACE_ENTERLEAVE( );
+
+        while ( Task* task = m_pool.getPinned( *this ) )
+        {
+            delete task;
+        }
+
+        if ( m_local )
+        {
+            //
+            //  tasks left in the queue are dropped
+            //
+            while ( Task* task = ( Task* ) m_local->pop( ) )
+            {
+                delete task;
+            }
+
+            delete m_local;
+        }
     }
     
     void ThreadPool::Worker::routine( )
@@ -661,7 +1682,7 @@ namespace sys
 
         for ( ;; )
         {
-            Task* task = m_pool.get( );
+            Task* task = m_pool.get( *this );
 
             if ( task )
             {
@@ -677,5 +1698,3 @@ namespace sys
         }
     }
 }
-
-
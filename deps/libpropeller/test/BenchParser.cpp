@@ -0,0 +1,214 @@
+/*
+ * Request parser benchmark.
+ *
+ * Compares previous line based request parsing (evbuffer_readln, sscanf and std::map with lowercased names and values)
+ * with http::Parser working on evbuffer_pullup'd memory.
+ */
+
+#include <event2/buffer.h>
+
+#include <sys/time.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+#include <map>
+#include <algorithm>
+
+#include "HttpParser.h"
+
+static const char* s_request =
+    "GET /api/v1/users/12345/profile?fields=name,email,avatar&expand=true HTTP/1.1\r\n"
+    "Host: api.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark; tracking=off\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+static double now( )
+{
+    timeval time;
+    gettimeofday( &time, NULL );
+
+    return time.tv_sec + time.tv_usec / 1000000.0;
+}
+
+//
+//  previous implementation
+//
+static bool parseLegacy( evbuffer* input )
+{
+    char method[64];
+    char uri[128];
+    char protocol[64];
+    std::map< std::string, std::string > headers;
+
+    char* requestLine = evbuffer_readln( input, NULL, EVBUFFER_EOL_CRLF );
+
+    if ( !requestLine )
+    {
+        return false;
+    }
+
+    //
+    //  URIs longer than 128 bytes would overflow here
+    //
+    int read = sscanf( requestLine, "%63s %127s %63s", method, uri, protocol );
+    free( requestLine );
+
+    if ( read != 3 )
+    {
+        return false;
+    }
+
+    evbuffer_ptr found = evbuffer_search( input, "\r\n\r\n", 4, NULL );
+
+    if ( found.pos == -1 )
+    {
+        return false;
+    }
+
+    for ( ;; )
+    {
+        char* line = evbuffer_readln( input, NULL, EVBUFFER_EOL_CRLF );
+
+        if ( !line )
+        {
+            return false;
+        }
+
+        const char* separator = strstr( line, ": " );
+
+        if ( !separator )
+        {
+            free( line );
+            break;
+        }
+
+        std::string name( line, separator - line );
+        std::string value( separator + 2 );
+
+        std::transform( name.begin( ), name.end( ), name.begin( ), ::tolower );
+        std::transform( value.begin( ), value.end( ), value.begin( ), ::tolower );
+
+        headers[ name ] = value;
+        free( line );
+    }
+
+    return headers.find( "host" ) != headers.end( );
+}
+
+static bool parseCurrent( evbuffer* input )
+{
+    propeller::http::Parser parser;
+    char head[ 2048 ];
+
+    unsigned int length = evbuffer_get_length( input );
+    const char* data = ( const char* ) evbuffer_pullup( input, length );
+
+    if ( parser.scan( data, length ) != propeller::http::Parser::Complete )
+    {
+        return false;
+    }
+
+    unsigned int headLength = parser.headLength( );
+    memcpy( head, data, headLength );
+    evbuffer_drain( input, headLength );
+
+    if ( parser.parse( head, headLength ) != propeller::http::Parser::Complete )
+    {
+        return false;
+    }
+
+    return parser.find( head, "host" ) != NULL;
+}
+
+//
+//  request arrives in two reads, parser resumes scanning
+//
+static bool parseCurrentSplit( evbuffer* input )
+{
+    propeller::http::Parser parser;
+    char head[ 2048 ];
+
+    unsigned int total = evbuffer_get_length( input );
+    unsigned int first = total / 2;
+
+    const char* data = ( const char* ) evbuffer_pullup( input, total );
+
+    if ( parser.scan( data, first ) != propeller::http::Parser::Incomplete )
+    {
+        return false;
+    }
+
+    if ( parser.scan( data, total ) != propeller::http::Parser::Complete )
+    {
+        return false;
+    }
+
+    unsigned int headLength = parser.headLength( );
+    memcpy( head, data, headLength );
+    evbuffer_drain( input, headLength );
+
+    if ( parser.parse( head, headLength ) != propeller::http::Parser::Complete )
+    {
+        return false;
+    }
+
+    return parser.find( head, "host" ) != NULL;
+}
+
+struct Run
+{
+    const char* name;
+    bool ( *parse )( evbuffer* );
+};
+
+int main( int argc, char** argv )
+{
+    unsigned int requests = argc > 1 ? atoi( argv[1] ) : 500000;
+    size_t length = strlen( s_request );
+
+    Run runs[] = {
+        { "readln+sscanf", parseLegacy },
+        { "parser", parseCurrent },
+        { "parser (split)", parseCurrentSplit }
+    };
+
+    for ( unsigned int r = 0; r < sizeof( runs ) / sizeof( runs[0] ); r++ )
+    {
+        evbuffer* input = evbuffer_new( );
+        double elapsed = 0;
+
+        for ( unsigned int i = 0; i < requests; i++ )
+        {
+            //
+            //  request usually arrives in its own read, so it is not contiguous with previous one
+            //
+            evbuffer_add( input, s_request, length );
+
+            double start = now( );
+            bool parsed = runs[r].parse( input );
+            elapsed += now( ) - start;
+
+            if ( !parsed )
+            {
+                printf( "%s: failed to parse request\n", runs[r].name );
+                return 1;
+            }
+
+            evbuffer_drain( input, evbuffer_get_length( input ) );
+        }
+
+        printf( "%-16s %8.1f ns/request %8.1f MB/s\n", runs[r].name, elapsed * 1e9 / requests, length * requests / elapsed / 1e6 );
+
+        evbuffer_free( input );
+    }
+
+    return 0;
+}
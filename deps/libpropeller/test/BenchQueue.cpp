@@ -0,0 +1,154 @@
+/*
+ * Thread pool queue benchmark.
+ *
+ * Compares locked task queue (std::list, lock and semaphore post per task) with lock free ring queue and event count
+ * and with work stealing queues (ring per worker, each producer feeds one worker).
+ * Measures throughput with several producers and round trip latency of single task handed to idle pool.
+ */
+
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "system.h"
+
+static double now( )
+{
+    timeval time;
+    gettimeofday( &time, NULL );
+
+    return time.tv_sec + time.tv_usec / 1000000.0;
+}
+
+struct CountedTask : public sys::ThreadPool::Task
+{
+    CountedTask( volatile unsigned int* _done )
+    : done( _done )
+    {
+    }
+
+    volatile unsigned int* done;
+};
+
+class Pool : public sys::ThreadPool
+{
+public:
+    virtual void onTaskProcess( sys::ThreadPool::Task* task, Worker& thread )
+    {
+        sys::General::interlockedIncrement( ( unsigned int* ) ( ( CountedTask* ) task )->done );
+        delete task;
+    }
+};
+
+class Producer : public sys::Thread
+{
+public:
+    Producer( Pool& pool, unsigned int index, unsigned int tasks, volatile unsigned int* done )
+    : m_pool( pool ), m_index( index ), m_tasks( tasks ), m_done( done )
+    {
+    }
+
+    virtual void routine( )
+    {
+        for ( unsigned int i = 0; i < m_tasks; i++ )
+        {
+            m_pool.queue( new CountedTask( m_done ), m_index );
+        }
+    }
+
+private:
+    Pool& m_pool;
+    unsigned int m_index;
+    unsigned int m_tasks;
+    volatile unsigned int* m_done;
+};
+
+static void run( const char* name, sys::ThreadPool::QueueType type, unsigned int workers, unsigned int producers, unsigned int tasks, unsigned int trips )
+{
+    Pool pool;
+    pool.setQueueType( type );
+    pool.start( workers );
+
+    //
+    //  throughput
+    //
+    volatile unsigned int done = 0;
+    unsigned int total = producers * tasks;
+
+    double start = now( );
+
+    Producer** threads = new Producer*[ producers ];
+
+    for ( unsigned int i = 0; i < producers; i++ )
+    {
+        threads[i] = new Producer( pool, i, tasks, &done );
+        threads[i]->start( );
+    }
+
+    for ( unsigned int i = 0; i < producers; i++ )
+    {
+        threads[i]->join( );
+        delete threads[i];
+    }
+
+    delete[] threads;
+
+    while ( done != total )
+    {
+        sys::General::yield( );
+    }
+
+    double elapsed = now( ) - start;
+
+    //
+    //  round trip, pool is idle between tasks
+    //
+    done = 0;
+    double latency = 0;
+
+    for ( unsigned int i = 0; i < trips; i++ )
+    {
+        usleep( 200 );
+
+        start = now( );
+        pool.queue( new CountedTask( &done ) );
+
+        while ( done != i + 1 )
+        {
+            sys::General::pause( );
+        }
+
+        latency += now( ) - start;
+    }
+
+    unsigned int localHits = 0;
+    unsigned int steals = 0;
+    pool.getSchedulerMetrics( localHits, steals );
+
+    printf( "%-10s %10.0f tasks/s %8.1f us/round trip", name, total / elapsed, latency * 1e6 / trips );
+
+    if ( type == sys::ThreadPool::WorkStealingQueue )
+    {
+        printf( " %u local %u stolen", localHits, steals );
+    }
+
+    printf( "\n" );
+
+    pool.stop( );
+}
+
+int main( int argc, char** argv )
+{
+    unsigned int workers = argc > 1 ? atoi( argv[1] ) : 4;
+    unsigned int producers = argc > 2 ? atoi( argv[2] ) : 4;
+    unsigned int tasks = argc > 3 ? atoi( argv[3] ) : 250000;
+    unsigned int trips = 2000;
+
+    printf( "%u workers, %u producers, %u tasks each\n", workers, producers, tasks );
+
+    run( "locked", sys::ThreadPool::LockedQueue, workers, producers, tasks, trips );
+    run( "lockfree", sys::ThreadPool::LockFreeQueue, workers, producers, tasks, trips );
+    run( "stealing", sys::ThreadPool::WorkStealingQueue, workers, producers, tasks, trips );
+
+    return 0;
+}
@@ -0,0 +1,309 @@
+/*
+ * Response serialization benchmark.
+ *
+ * Compares writing response fragment by fragment into a thread safe bufferevent (as http::Response used to do)
+ * with assembling the response into private evbuffer and committing it with a single bufferevent_write_buffer call.
+ * Reports time, lock acquisitions and write system calls per response.
+ */
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/thread.h>
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+static unsigned long s_locks = 0;
+
+static void* lockAlloc( unsigned locktype )
+{
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init( &attributes );
+
+    if ( locktype & EVTHREAD_LOCKTYPE_RECURSIVE )
+    {
+        pthread_mutexattr_settype( &attributes, PTHREAD_MUTEX_RECURSIVE );
+    }
+
+    pthread_mutex_t* lock = ( pthread_mutex_t* ) malloc( sizeof( pthread_mutex_t ) );
+    pthread_mutex_init( lock, &attributes );
+
+    return lock;
+}
+
+static void lockFree( void* lock, unsigned locktype )
+{
+    pthread_mutex_destroy( ( pthread_mutex_t* ) lock );
+    free( lock );
+}
+
+static int lockLock( unsigned mode, void* lock )
+{
+    __sync_fetch_and_add( &s_locks, 1 );
+
+    return pthread_mutex_lock( ( pthread_mutex_t* ) lock );
+}
+
+static int lockUnlock( unsigned mode, void* lock )
+{
+    return pthread_mutex_unlock( ( pthread_mutex_t* ) lock );
+}
+
+static void* conditionAlloc( unsigned condtype )
+{
+    pthread_cond_t* condition = ( pthread_cond_t* ) malloc( sizeof( pthread_cond_t ) );
+    pthread_cond_init( condition, NULL );
+
+    return condition;
+}
+
+static void conditionFree( void* condition )
+{
+    pthread_cond_destroy( ( pthread_cond_t* ) condition );
+    free( condition );
+}
+
+static int conditionSignal( void* condition, int broadcast )
+{
+    return broadcast ? pthread_cond_broadcast( ( pthread_cond_t* ) condition ) : pthread_cond_signal( ( pthread_cond_t* ) condition );
+}
+
+static int conditionWait( void* condition, void* lock, const struct timeval* timeout )
+{
+    if ( timeout )
+    {
+        timeval now;
+        timespec until;
+        gettimeofday( &now, NULL );
+        until.tv_sec = now.tv_sec + timeout->tv_sec + ( now.tv_usec + timeout->tv_usec ) / 1000000;
+        until.tv_nsec = ( ( now.tv_usec + timeout->tv_usec ) % 1000000 ) * 1000;
+
+        int result = pthread_cond_timedwait( ( pthread_cond_t* ) condition, ( pthread_mutex_t* ) lock, &until );
+
+        return result == ETIMEDOUT ? 1 : ( result ? -1 : 0 );
+    }
+
+    return pthread_cond_wait( ( pthread_cond_t* ) condition, ( pthread_mutex_t* ) lock ) ? -1 : 0;
+}
+
+static unsigned long threadId( )
+{
+    return ( unsigned long ) pthread_self( );
+}
+
+static const char* s_headers[][2] = {
+    { "Server", "Propeller/0.5" },
+    { "Content-Type", "application/json" },
+    { "Cache-Control", "no-cache" },
+    { "X-Request-Id", "0123456789abcdef" }
+};
+
+static const char* s_body = "{\"hello\":\"world\"}";
+
+static void writeFragments( bufferevent* bev )
+{
+    char line[64];
+    sprintf( line, "HTTP/1.1 %u %s\r\n", 200, "OK" );
+    bufferevent_write( bev, line, strlen( line ) );
+
+    for ( unsigned int i = 0; i < sizeof( s_headers ) / sizeof( s_headers[0] ); i++ )
+    {
+        bufferevent_write( bev, s_headers[i][0], strlen( s_headers[i][0] ) );
+        bufferevent_write( bev, ": ", 2 );
+        bufferevent_write( bev, s_headers[i][1], strlen( s_headers[i][1] ) );
+        bufferevent_write( bev, "\r\n", 2 );
+    }
+
+    char length[16];
+    sprintf( length, "%u", ( unsigned int ) strlen( s_body ) );
+    bufferevent_write( bev, "Content-Length", 14 );
+    bufferevent_write( bev, ": ", 2 );
+    bufferevent_write( bev, length, strlen( length ) );
+    bufferevent_write( bev, "\r\n", 2 );
+    bufferevent_write( bev, "\r\n", 2 );
+    bufferevent_write( bev, s_body, strlen( s_body ) );
+}
+
+static void writeBuffer( bufferevent* bev )
+{
+    evbuffer* buffer = evbuffer_new( );
+
+    evbuffer_add_printf( buffer, "HTTP/1.1 %u %s\r\n", 200, "OK" );
+
+    for ( unsigned int i = 0; i < sizeof( s_headers ) / sizeof( s_headers[0] ); i++ )
+    {
+        evbuffer_add( buffer, s_headers[i][0], strlen( s_headers[i][0] ) );
+        evbuffer_add( buffer, ": ", 2 );
+        evbuffer_add( buffer, s_headers[i][1], strlen( s_headers[i][1] ) );
+        evbuffer_add( buffer, "\r\n", 2 );
+    }
+
+    evbuffer_add_printf( buffer, "Content-Length: %u\r\n\r\n", ( unsigned int ) strlen( s_body ) );
+    evbuffer_add( buffer, s_body, strlen( s_body ) );
+
+    bufferevent_write_buffer( bev, buffer );
+    evbuffer_free( buffer );
+}
+
+struct Run
+{
+    const char* name;
+    void ( *write )( bufferevent* );
+};
+
+static double now( )
+{
+    timeval time;
+    gettimeofday( &time, NULL );
+
+    return time.tv_sec + time.tv_usec / 1000000.0;
+}
+
+//
+//  number of write system calls issued by the process so far
+//
+static unsigned long writeSyscalls( )
+{
+    unsigned long count = 0;
+    char line[128];
+    FILE* file = fopen( "/proc/self/io", "r" );
+
+    if ( !file )
+    {
+        return 0;
+    }
+
+    while ( fgets( line, sizeof( line ), file ) )
+    {
+        if ( sscanf( line, "syscw: %lu", &count ) == 1 )
+        {
+            break;
+        }
+    }
+
+    fclose( file );
+
+    return count;
+}
+
+static void* loopRoutine( void* base )
+{
+    event_base_loop( ( event_base* ) base, EVLOOP_NO_EXIT_ON_EMPTY );
+
+    return NULL;
+}
+
+static volatile bool s_stop = false;
+
+static void* drainRoutine( void* data )
+{
+    int fd = *( int* ) data;
+    char sink[65536];
+
+    while ( !s_stop )
+    {
+        if ( read( fd, sink, sizeof( sink ) ) <= 0 )
+        {
+            usleep( 100 );
+        }
+    }
+
+    return NULL;
+}
+
+int main( int argc, char** argv )
+{
+    unsigned int responses = argc > 1 ? atoi( argv[1] ) : 200000;
+
+    evthread_lock_callbacks callbacks = {
+        EVTHREAD_LOCK_API_VERSION, EVTHREAD_LOCKTYPE_RECURSIVE, lockAlloc, lockFree, lockLock, lockUnlock
+    };
+
+    evthread_condition_callbacks conditions = {
+        EVTHREAD_CONDITION_API_VERSION, conditionAlloc, conditionFree, conditionSignal, conditionWait
+    };
+
+    evthread_set_lock_callbacks( &callbacks );
+    evthread_set_condition_callbacks( &conditions );
+    evthread_set_id_callback( threadId );
+
+    Run runs[] = {
+        { "fragments", writeFragments },
+        { "single buffer", writeBuffer }
+    };
+
+    for ( unsigned int r = 0; r < sizeof( runs ) / sizeof( runs[0] ); r++ )
+    {
+        //
+        //  event loop runs in its own thread (connection thread), responses are written from main thread (pool worker)
+        //
+        event_base* base = event_base_new( );
+        evthread_make_base_notifiable( base );
+
+        int pair[2];
+        socketpair( AF_UNIX, SOCK_STREAM, 0, pair );
+        evutil_make_socket_nonblocking( pair[0] );
+        evutil_make_socket_nonblocking( pair[1] );
+
+        bufferevent* bev = bufferevent_socket_new( base, pair[0], BEV_OPT_THREADSAFE | BEV_OPT_CLOSE_ON_FREE );
+        bufferevent_enable( bev, EV_WRITE );
+
+        s_stop = false;
+        pthread_t loop;
+        pthread_t drain;
+        pthread_create( &loop, NULL, loopRoutine, base );
+        pthread_create( &drain, NULL, drainRoutine, &pair[1] );
+
+        unsigned long syscalls = writeSyscalls( );
+        s_locks = 0;
+        double start = now( );
+
+        for ( unsigned int i = 0; i < responses; i++ )
+        {
+            runs[r].write( bev );
+        }
+
+        double elapsed = now( ) - start;
+        unsigned long locks = s_locks;
+
+        //
+        //  wait till everything is sent
+        //
+        for ( ;; )
+        {
+            bufferevent_lock( bev );
+            size_t pending = evbuffer_get_length( bufferevent_get_output( bev ) );
+            bufferevent_unlock( bev );
+
+            if ( !pending )
+            {
+                break;
+            }
+
+            usleep( 1000 );
+        }
+
+        syscalls = writeSyscalls( ) - syscalls;
+
+        printf( "%-14s %8.1f ns/response %6.2f locks/response %6.3f write syscalls/response\n",
+            runs[r].name, elapsed * 1e9 / responses, ( double ) locks / responses, ( double ) syscalls / responses );
+
+        s_stop = true;
+        event_base_loopbreak( base );
+        pthread_join( loop, NULL );
+        pthread_join( drain, NULL );
+
+        bufferevent_free( bev );
+        close( pair[1] );
+        event_base_free( base );
+    }
+
+    return 0;
+}
@@ -0,0 +1,251 @@
+/*
+ * Request router benchmark.
+ *
+ * Compares linear route matching (what lua dispatch did: split request path and every route pattern into segments and
+ * compare them route by route, probe handler paths prefix by prefix) with http::Router radix tree.
+ * Route table has 50 resources with 12 routes each (600 routes) and prefix handler per resource.
+ */
+
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "HttpRouter.h"
+
+static double now( )
+{
+    timeval time;
+    gettimeofday( &time, NULL );
+
+    return time.tv_sec + time.tv_usec / 1000000.0;
+}
+
+static void split( const std::string& path, std::vector< std::string >& tokens )
+{
+    tokens.clear( );
+    std::string::size_type start = 0;
+
+    for ( ; ; )
+    {
+        std::string::size_type end = path.find( '/', start );
+        tokens.push_back( path.substr( start, end == std::string::npos ? std::string::npos : end - start ) );
+
+        if ( end == std::string::npos )
+        {
+            break;
+        }
+
+        start = end + 1;
+    }
+}
+
+struct Route
+{
+    std::string method;
+    std::string pattern;
+    int value;
+};
+
+//
+//  linear matching
+//
+class LinearRouter
+{
+public:
+    void addRoute( const std::string& method, const std::string& pattern, int value )
+    {
+        Route route = { method, pattern, value };
+        m_routes.push_back( route );
+    }
+
+    void addPrefix( const std::string& path, int value )
+    {
+        m_prefixes[ path ] = value;
+    }
+
+    int match( const char* method, const std::string& path, std::map< std::string, std::string >& params )
+    {
+        params.clear( );
+
+        std::vector< std::string > pathTokens;
+        std::vector< std::string > patternTokens;
+        split( path, pathTokens );
+
+        for ( std::vector< Route >::iterator route = m_routes.begin( ); route != m_routes.end( ); route++ )
+        {
+            if ( route->method != method )
+            {
+                continue;
+            }
+
+            split( route->pattern, patternTokens );
+
+            if ( patternTokens.size( ) != pathTokens.size( ) )
+            {
+                continue;
+            }
+
+            bool matched = true;
+
+            for ( unsigned int i = 0; i < patternTokens.size( ) && matched; i++ )
+            {
+                if ( patternTokens[ i ].size( ) && patternTokens[ i ][ 0 ] == ':' )
+                {
+                    params[ patternTokens[ i ].substr( 1 ) ] = pathTokens[ i ];
+                }
+                else
+                {
+                    matched = patternTokens[ i ] == pathTokens[ i ];
+                }
+            }
+
+            if ( matched )
+            {
+                return route->value;
+            }
+
+            params.clear( );
+        }
+
+        //
+        //  probe handler paths removing last segment
+        //
+        std::string prefix = path;
+
+        for ( ; ; )
+        {
+            std::map< std::string, int >::iterator found = m_prefixes.find( prefix );
+
+            if ( found != m_prefixes.end( ) )
+            {
+                return found->second;
+            }
+
+            std::string::size_type slash = prefix.rfind( '/' );
+
+            if ( slash == std::string::npos || prefix == "/" )
+            {
+                return -1;
+            }
+
+            prefix.erase( slash ? slash : 1 );
+        }
+    }
+
+private:
+    std::vector< Route > m_routes;
+    std::map< std::string, int > m_prefixes;
+};
+
+int main( int argc, char** argv )
+{
+    unsigned int resources = argc > 1 ? atoi( argv[1] ) : 50;
+    unsigned int iterations = argc > 2 ? atoi( argv[2] ) : 200000;
+
+    static const char* templates[][2] =
+    {
+        { "GET", "/api/v1/%s" },
+        { "POST", "/api/v1/%s" },
+        { "GET", "/api/v1/%s/:id" },
+        { "PUT", "/api/v1/%s/:id" },
+        { "DELETE", "/api/v1/%s/:id" },
+        { "GET", "/api/v1/%s/:id/comments" },
+        { "POST", "/api/v1/%s/:id/comments" },
+        { "GET", "/api/v1/%s/:id/comments/:comment" },
+        { "DELETE", "/api/v1/%s/:id/comments/:comment" },
+        { "GET", "/api/v1/%s/search/recent" },
+        { "GET", "/api/v2/%s/:id/history/:version" },
+        { "GET", "/admin/%s/:id/audit" }
+    };
+
+    unsigned int count = sizeof( templates ) / sizeof( templates[0] );
+
+    propeller::http::Router router;
+    LinearRouter linear;
+    std::vector< std::pair< std::string, std::string > > requests;
+
+    char buffer[ 256 ];
+    int value = 0;
+
+    for ( unsigned int i = 0; i < resources; i++ )
+    {
+        char resource[ 32 ];
+        snprintf( resource, sizeof( resource ), "resource%u", i );
+
+        for ( unsigned int j = 0; j < count; j++ )
+        {
+            snprintf( buffer, sizeof( buffer ), templates[j][1], resource );
+            router.addRoute( templates[j][0], buffer, value );
+            linear.addRoute( templates[j][0], buffer, value );
+            value++;
+        }
+
+        snprintf( buffer, sizeof( buffer ), "/static/%s", resource );
+        router.addPrefix( buffer, value );
+        linear.addPrefix( buffer, value );
+        value++;
+
+        //
+        //  requests hitting routes and prefix handlers
+        //
+        snprintf( buffer, sizeof( buffer ), "/api/v1/%s/%u", resource, i * 7 );
+        requests.push_back( std::make_pair( "GET", buffer ) );
+        snprintf( buffer, sizeof( buffer ), "/api/v1/%s/%u/comments/%u", resource, i, i + 1 );
+        requests.push_back( std::make_pair( "DELETE", buffer ) );
+        snprintf( buffer, sizeof( buffer ), "/api/v1/%s/search/recent", resource );
+        requests.push_back( std::make_pair( "GET", buffer ) );
+        snprintf( buffer, sizeof( buffer ), "/static/%s/css/site.css", resource );
+        requests.push_back( std::make_pair( "GET", buffer ) );
+    }
+
+    printf( "%u routes, %u prefix handlers, %u requests\n", value - resources, resources, ( unsigned int ) requests.size( ) );
+
+    //
+    //  check both routers agree
+    //
+    propeller::http::Router::Params params;
+    std::map< std::string, std::string > linearParams;
+
+    for ( unsigned int i = 0; i < requests.size( ); i++ )
+    {
+        int expected = linear.match( requests[i].first.c_str( ), requests[i].second, linearParams );
+        int result = router.match( requests[i].first.c_str( ), requests[i].second.data( ), requests[i].second.size( ), params );
+
+        if ( expected != result || params.size( ) != linearParams.size( ) )
+        {
+            printf( "mismatch %s %s: %d != %d\n", requests[i].first.c_str( ), requests[i].second.c_str( ), result, expected );
+            return 1;
+        }
+    }
+
+    unsigned int linearIterations = iterations / 100 + 1;
+    double start = now( );
+
+    for ( unsigned int i = 0; i < linearIterations; i++ )
+    {
+        const std::pair< std::string, std::string >& request = requests[ i % requests.size( ) ];
+        linear.match( request.first.c_str( ), request.second, linearParams );
+    }
+
+    double linearTime = ( now( ) - start ) / linearIterations;
+
+    start = now( );
+    unsigned int matched = 0;
+
+    for ( unsigned int i = 0; i < iterations; i++ )
+    {
+        const std::pair< std::string, std::string >& request = requests[ i % requests.size( ) ];
+        matched += router.match( request.first.c_str( ), request.second.data( ), request.second.size( ), params ) != -1;
+    }
+
+    double radixTime = ( now( ) - start ) / iterations;
+
+    printf( "linear %10.0f ns/match\n", linearTime * 1e9 );
+    printf( "radix  %10.0f ns/match (%u matched)\n", radixTime * 1e9, matched );
+
+    return 0;
+}
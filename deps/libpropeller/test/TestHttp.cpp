@@ -0,0 +1,805 @@
+/*
+ * HTTP server protocol tests.
+ *
+ * Server is started on a local port in background thread, every test talks to it over a plain socket and checks raw
+ * protocol output. Exit status is the number of failed tests.
+ *
+ * Usage: TestHttp [port]
+ */
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+
+#include "HttpServer.h"
+
+using namespace propeller;
+
+static unsigned int s_port = 8195;
+static unsigned int s_failed = 0;
+
+//
+//  /block waits till the test releases it, /fast requests are counted
+//
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_released = PTHREAD_COND_INITIALIZER;
+static bool s_blocked = true;
+static unsigned int s_fast = 0;
+
+static http::Server* s_server = NULL;
+
+static void check( bool condition, const char* name )
+{
+    printf( "%s %s\n", condition ? "ok  " : "FAIL", name );
+
+    if ( !condition )
+    {
+        s_failed++;
+    }
+}
+
+//
+//  echoes WebSocket messages, /ws upgrades, /events is event stream of topic "news"
+//
+class Handler : public Server::EventHandler, public http::WebSocket::Handler
+{
+public:
+    virtual void onRequest( const propeller::Request& request, propeller::Response& response, sys::ThreadPool::Worker& thread )
+    {
+        const http::Request& httpRequest = ( const http::Request& ) request;
+        http::Response& httpResponse = ( http::Response& ) response;
+
+        std::string accept;
+
+        if ( !strcmp( httpRequest.uri( ), "/ws" ) && http::WebSocket::handshake( httpRequest, accept ) &&
+             httpResponse.upgrade( *this, "/ws", NULL ) )
+        {
+            httpResponse.setStatus( HttpProtocol::SwitchingProtocols );
+            httpResponse.addHeader( "Upgrade", "websocket" );
+            httpResponse.addHeader( "Connection", "Upgrade" );
+            httpResponse.addHeader( "Sec-WebSocket-Accept", accept.c_str( ) );
+            httpResponse.setBody( );
+
+            return;
+        }
+
+        if ( !strcmp( httpRequest.uri( ), "/events" ) && httpResponse.eventStream( std::vector< std::string >( 1, "news" ) ) )
+        {
+            httpResponse.addHeader( "Content-Type", "text/event-stream" );
+            httpResponse.setBody( ": open\n\n" );
+
+            return;
+        }
+
+        if ( !strcmp( httpRequest.uri( ), "/block" ) )
+        {
+            pthread_mutex_lock( &s_lock );
+
+            while ( s_blocked )
+            {
+                pthread_cond_wait( &s_released, &s_lock );
+            }
+
+            pthread_mutex_unlock( &s_lock );
+        }
+        else if ( !strcmp( httpRequest.uri( ), "/fast" ) )
+        {
+            __sync_fetch_and_add( &s_fast, 1 );
+        }
+        else if ( !strcmp( httpRequest.uri( ), "/body" ) )
+        {
+            //
+            //  echo request body, spilled bodies are mapped
+            //
+            std::string body( httpRequest.body( ) ? httpRequest.body( ) : "", httpRequest.bodyLength( ) );
+            httpResponse.setBody( ( "body:" + body ).c_str( ), body.size( ) + 5 );
+
+            return;
+        }
+
+        httpResponse.setBody( httpRequest.uri( ) );
+    }
+
+    virtual void onOpen( http::WebSocket& socket )
+    {
+    }
+
+    virtual void onMessage( http::WebSocket& socket, std::string& message, bool binary )
+    {
+        socket.send( message.data( ), message.size( ), binary );
+    }
+
+    virtual void onClose( http::WebSocket& socket )
+    {
+    }
+};
+
+static void* serverRoutine( void* arg )
+{
+    ( ( http::Server* ) arg )->start( );
+
+    return NULL;
+}
+
+static int connectServer( )
+{
+    int fd = socket( AF_INET, SOCK_STREAM, 0 );
+
+    sockaddr_in address;
+    memset( &address, 0, sizeof( address ) );
+    address.sin_family = AF_INET;
+    address.sin_port = htons( s_port );
+    address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+    timeval timeout = { 5, 0 };
+    setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+
+    for ( int i = 0; i < 50; i++ )
+    {
+        if ( connect( fd, ( sockaddr* ) &address, sizeof( address ) ) == 0 )
+        {
+            return fd;
+        }
+
+        //
+        //  server may be still starting
+        //
+        usleep( 100000 );
+    }
+
+    return -1;
+}
+
+static void sendAll( int fd, const void* data, size_t length )
+{
+    const char* position = ( const char* ) data;
+
+    while ( length )
+    {
+        ssize_t sent = send( fd, position, length, MSG_NOSIGNAL );
+
+        if ( sent <= 0 )
+        {
+            return;
+        }
+
+        position += sent;
+        length -= sent;
+    }
+}
+
+//
+//  read till the marker is received, connection is closed or timeout expires
+//
+static std::string receive( int fd, const char* marker = NULL )
+{
+    std::string data;
+    char buffer[ 4096 ];
+
+    while ( !marker || data.find( marker ) == std::string::npos )
+    {
+        ssize_t received = recv( fd, buffer, sizeof( buffer ), 0 );
+
+        if ( received <= 0 )
+        {
+            break;
+        }
+
+        data.append( buffer, received );
+    }
+
+    return data;
+}
+
+static unsigned int count( const std::string& data, const char* what )
+{
+    unsigned int count = 0;
+
+    for ( size_t position = data.find( what ); position != std::string::npos; position = data.find( what, position + 1 ) )
+    {
+        count++;
+    }
+
+    return count;
+}
+
+//
+//  send data on new connection and read the reply till the server closes the connection
+//
+static std::string exchange( const std::string& data )
+{
+    int fd = connectServer( );
+
+    sendAll( fd, data.data( ), data.size( ) );
+    std::string reply = receive( fd );
+
+    close( fd );
+
+    return reply;
+}
+
+static bool status( const std::string& reply, const char* code )
+{
+    return reply.compare( 0, 9, "HTTP/1.1 " ) == 0 && reply.compare( 9, 3, code ) == 0;
+}
+
+static int openWebSocket( )
+{
+    int fd = connectServer( );
+
+    const char* handshake = "GET /ws HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                            "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+
+    sendAll( fd, handshake, strlen( handshake ) );
+    receive( fd, "\r\n\r\n" );
+
+    return fd;
+}
+
+static void testWebSocketEcho( const char* name )
+{
+    int fd = openWebSocket( );
+
+    //
+    //  masked "hi" with zero mask
+    //
+    const unsigned char frame[] = { 0x81, 0x82, 0, 0, 0, 0, 'h', 'i' };
+    sendAll( fd, frame, sizeof( frame ) );
+
+    std::string reply = receive( fd, "hi" );
+    check( reply == std::string( "\x81\x02hi", 4 ), name );
+
+    close( fd );
+}
+
+static void testWebSocketLength( )
+{
+    testWebSocketEcho( "websocket echo" );
+
+    //
+    //  continuation with 64-bit length that has the most significant bit set, sums with the message size would wrap
+    //
+    int fd = openWebSocket( );
+
+    const unsigned char wrapped[] =
+    {
+        0x01, 0x81, 0, 0, 0, 0, 'x',
+        0x80, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0, 0, 0, 0
+    };
+
+    sendAll( fd, wrapped, sizeof( wrapped ) );
+    check( receive( fd ) == std::string( "\x88\x02\x03\xea", 4 ), "websocket length with most significant bit set is protocol error" );
+    close( fd );
+
+    //
+    //  valid 64-bit length above the message limit
+    //
+    fd = openWebSocket( );
+
+    const unsigned char large[] = { 0x81, 0xff, 0x7f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0, 0, 0, 0 };
+
+    sendAll( fd, large, sizeof( large ) );
+    check( receive( fd ) == std::string( "\x88\x02\x03\xf1", 4 ), "websocket length above limit is too big" );
+    close( fd );
+
+    testWebSocketEcho( "websocket echo after malformed frames" );
+}
+
+static void testPipelineBound( )
+{
+    //
+    //  first request holds the connection, responses to the following ones can not be written before its response
+    //
+    int fd = connectServer( );
+
+    std::string requests = "GET /block HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+    for ( int i = 0; i < 200; i++ )
+    {
+        requests.append( "GET /fast HTTP/1.1\r\nHost: localhost\r\n\r\n" );
+    }
+
+    sendAll( fd, requests.data( ), requests.size( ) );
+
+    //
+    //  let the server dispatch whatever it is going to
+    //
+    usleep( 500000 );
+
+    check( s_fast < Connection::MaxOutstanding, "pipelined requests are not dispatched beyond the limit" );
+
+    pthread_mutex_lock( &s_lock );
+    s_blocked = false;
+    pthread_cond_broadcast( &s_released );
+    pthread_mutex_unlock( &s_lock );
+
+    std::string responses;
+    char buffer[ 4096 ];
+
+    while ( count( responses, "HTTP/1.1 200" ) < 201 )
+    {
+        ssize_t received = recv( fd, buffer, sizeof( buffer ), 0 );
+
+        if ( received <= 0 )
+        {
+            break;
+        }
+
+        responses.append( buffer, received );
+    }
+
+    check( count( responses, "HTTP/1.1 200" ) == 201 && s_fast == 200 && responses.find( "/block" ) < responses.find( "/fast" ),
+           "pipelined requests are answered in order once reading resumes" );
+
+    close( fd );
+}
+
+static void testBodyLimits( )
+{
+    const char* post = "POST /body HTTP/1.1\r\nHost: localhost\r\n";
+
+    check( status( exchange( std::string( post ) + "Content-Length: 4294967296\r\n\r\n" ), "413" ),
+           "content length that wraps unsigned int is too large" );
+    check( status( exchange( std::string( post ) + "Content-Length: 18446744073709551616\r\n\r\n" ), "413" ),
+           "content length that overflows 64 bits is too large" );
+    check( status( exchange( std::string( post ) + "Content-Length: 1048577\r\n\r\n" ), "413" ),
+           "content length above maximum body length is too large" );
+    check( status( exchange( std::string( post ) + "Content-Length: -1\r\n\r\n" ), "400" ), "negative content length is bad request" );
+
+    //
+    //  chunk size that wraps to zero would end the body, the rest would be parsed as next request
+    //
+    std::string reply = exchange( std::string( post ) + "Transfer-Encoding: chunked\r\n\r\n100000000\r\n"
+                                  "GET /fast HTTP/1.1\r\nHost: localhost\r\n\r\n" );
+
+    check( status( reply, "413" ) && reply.find( "/fast" ) == std::string::npos, "chunk size that wraps unsigned int is too large" );
+    check( status( exchange( std::string( post ) + "Transfer-Encoding: chunked\r\n\r\n10000000000000000\r\n" ), "413" ),
+           "chunk size that overflows 64 bits is too large" );
+    check( status( exchange( std::string( post ) + "Transfer-Encoding: chunked\r\n\r\n0x10\r\n" ), "400" ),
+           "chunk size with 0x prefix is bad request" );
+
+    //
+    //  each chunk is below the limit, their total is not
+    //
+    std::string chunks = std::string( post ) + "Transfer-Encoding: chunked\r\n\r\n80000\r\n";
+    chunks.append( 0x80000, 'a' ).append( "\r\n80001\r\n" );
+
+    check( status( exchange( chunks ), "413" ), "total of chunks above maximum body length is too large" );
+}
+
+static void testChunkedBody( )
+{
+    //
+    //  chunk lines and data are split across reads
+    //
+    const char* parts[] =
+    {
+        "POST /body HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n5\r\nhel",
+        "lo\r\n",
+        "6",
+        "\r\n wor",
+        "ld\r\n0\r\n",
+        "\r\n"
+    };
+
+    int fd = connectServer( );
+
+    for ( unsigned int i = 0; i < sizeof( parts ) / sizeof( parts[0] ); i++ )
+    {
+        sendAll( fd, parts[i], strlen( parts[i] ) );
+        usleep( 50000 );
+    }
+
+    std::string reply = receive( fd );
+    close( fd );
+
+    check( status( reply, "200" ) && reply.find( "\r\n\r\nbody:hello world" ) != std::string::npos, "chunked body split across reads" );
+
+    //
+    //  body above spill threshold goes to temporary file while chunks arrive
+    //
+    std::string expected;
+    fd = connectServer( );
+
+    const char* head = "POST /body HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n";
+    sendAll( fd, head, strlen( head ) );
+
+    for ( char c = 'a'; c < 'd'; c++ )
+    {
+        std::string chunk = "32\r\n" + std::string( 50, c ) + "\r\n";
+        expected.append( 50, c );
+
+        sendAll( fd, chunk.data( ), chunk.size( ) );
+        usleep( 50000 );
+    }
+
+    sendAll( fd, "0\r\n\r\n", 5 );
+
+    reply = receive( fd );
+    close( fd );
+
+    check( status( reply, "200" ) && reply.find( "\r\n\r\nbody:" + expected ) != std::string::npos, "spilled chunked body split across reads" );
+}
+
+static void testEventFields( )
+{
+    int fd = connectServer( );
+
+    const char* request = "GET /events HTTP/1.1\r\nHost: localhost\r\nAccept: text/event-stream\r\n\r\n";
+    sendAll( fd, request, strlen( request ) );
+    receive( fd, ": open\n\n\r\n" );
+
+    //
+    //  stream subscribes once the handler returns
+    //
+    usleep( 200000 );
+
+    libevent::SharedBuffer* event = http::Response::event( "one\ntwo", 7, "update\ndata: injected", "1\r\nevent: injected" );
+    s_server->broadcast( "news", *event );
+    event->deref( );
+
+    std::string stream = receive( fd, "two\n\n\r\n" );
+
+    check( stream.find( "event: updatedata: injected\nid: 1event: injected\ndata: one\ndata: two\n\n" ) != std::string::npos &&
+           stream.find( "\ndata: injected" ) == std::string::npos && stream.find( "\nevent: injected" ) == std::string::npos,
+           "line breaks in event name and id do not start new fields" );
+
+    close( fd );
+}
+
+static std::string header( const std::string& reply, const char* name )
+{
+    size_t position = reply.find( std::string( "\r\n" ) + name + ": " );
+
+    if ( position == std::string::npos )
+    {
+        return "";
+    }
+
+    position += strlen( name ) + 4;
+
+    return reply.substr( position, reply.find( "\r\n", position ) - position );
+}
+
+static std::string body( const std::string& reply )
+{
+    size_t position = reply.find( "\r\n\r\n" );
+
+    return position == std::string::npos ? "" : reply.substr( position + 4 );
+}
+
+//
+//  /static is mounted on temporary directory with data.txt (20 bytes) and big.bin (larger than socket buffers)
+//
+static std::string s_big;
+
+static void writeFile( const std::string& path, const std::string& data )
+{
+    FILE* file = fopen( path.c_str( ), "wb" );
+    fwrite( data.data( ), 1, data.size( ), file );
+    fclose( file );
+}
+
+static void mountFiles( http::Server& server )
+{
+    char root[] = "/tmp/TestHttpXXXXXX";
+
+    if ( !mkdtemp( root ) )
+    {
+        return;
+    }
+
+    std::string directory = std::string( root ) + "/static";
+    mkdir( directory.c_str( ), 0700 );
+
+    for ( unsigned int i = 0; i < 1000000; i++ )
+    {
+        s_big.push_back( ( char ) ( 'a' + i % 26 ) );
+    }
+
+    writeFile( directory + "/data.txt", "0123456789abcdefghij" );
+    writeFile( directory + "/big.bin", s_big );
+
+    server.files( ).addPath( "/static", root );
+}
+
+static void testFiles( )
+{
+    const char* get = "GET /static/data.txt HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n";
+
+    std::string reply = exchange( std::string( get ) + "\r\n" );
+    std::string modified = header( reply, "Last-Modified" );
+
+    check( status( reply, "200" ) && header( reply, "Content-Length" ) == "20" && body( reply ) == "0123456789abcdefghij" &&
+           !modified.empty( ), "file is sent whole" );
+
+    reply = exchange( std::string( get ) + "Range: bytes=2-5\r\n\r\n" );
+    check( status( reply, "206" ) && header( reply, "Content-Range" ) == "bytes 2-5/20" && body( reply ) == "2345",
+           "byte range is partial content" );
+
+    reply = exchange( std::string( get ) + "Range: bytes=-3\r\n\r\n" );
+    check( status( reply, "206" ) && header( reply, "Content-Range" ) == "bytes 17-19/20" && body( reply ) == "hij",
+           "suffix range is partial content" );
+
+    reply = exchange( std::string( get ) + "Range: bytes=20-\r\n\r\n" );
+    check( status( reply, "416" ) && header( reply, "Content-Range" ) == "bytes */20" && body( reply ).empty( ),
+           "range past end of file is not satisfiable" );
+
+    reply = exchange( std::string( get ) + "Range: bytes=10-\r\nIf-Range: " + modified + "\r\n\r\n" );
+    check( status( reply, "206" ) && body( reply ) == "abcdefghij", "range with matching If-Range is partial content" );
+
+    reply = exchange( std::string( get ) + "Range: bytes=10-\r\nIf-Range: Thu, 01 Jan 1970 00:00:00 GMT\r\n\r\n" );
+    check( status( reply, "200" ) && body( reply ) == "0123456789abcdefghij", "range with stale If-Range sends whole file" );
+
+    reply = exchange( std::string( get ) + "If-Modified-Since: " + modified + "\r\n\r\n" );
+    check( status( reply, "304" ) && body( reply ).empty( ), "file not modified since is not sent" );
+
+    reply = exchange( std::string( get ) + "If-Modified-Since: Thu, 01 Jan 1970 00:00:00 GMT\r\n\r\n" );
+    check( status( reply, "200" ) && body( reply ) == "0123456789abcdefghij", "file modified since is sent" );
+
+    reply = exchange( "HEAD /static/data.txt HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n" );
+    check( status( reply, "200" ) && header( reply, "Content-Length" ) == "20" && body( reply ).empty( ), "HEAD sends headers only" );
+
+    reply = exchange( "GET /static/big.bin HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n" );
+    check( status( reply, "200" ) && body( reply ) == s_big, "file larger than socket buffers is sent whole" );
+
+    //
+    //  file response is ready before the preceding handler response, it waits for it
+    //
+    reply = exchange( "GET /fast HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                      "GET /static/data.txt HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n" );
+
+    size_t fast = reply.find( "\r\n\r\n/fast" );
+    size_t file = reply.find( "\r\n\r\n0123456789abcdefghij" );
+
+    check( fast != std::string::npos && file != std::string::npos && fast < file, "pipelined file response keeps its order" );
+}
+
+//
+//  decode header block given in hex (spaces ignored), headers are returned as "name: value" lines
+//
+static bool decode( http::Hpack::Decoder& decoder, const char* hex, std::string& lines )
+{
+    std::string block;
+
+    for ( const char* current = hex; *current; current++ )
+    {
+        if ( *current != ' ' )
+        {
+            block.push_back( ( char ) strtoul( std::string( current, 2 ).c_str( ), NULL, 16 ) );
+            current++;
+        }
+    }
+
+    http::Hpack::Headers headers;
+    lines.clear( );
+
+    if ( !decoder.decode( ( const unsigned char* ) block.data( ), block.size( ), headers ) )
+    {
+        return false;
+    }
+
+    for ( http::Hpack::Headers::const_iterator i = headers.begin( ); i != headers.end( ); i++ )
+    {
+        lines.append( i->first ).append( ": " ).append( i->second ).append( "\n" );
+    }
+
+    return true;
+}
+
+//
+//  dynamic table contents, read back with indexed fields till the first index past its end
+//
+static std::string table( http::Hpack::Decoder& decoder )
+{
+    std::string entries;
+    std::string lines;
+    char hex[ 3 ];
+
+    for ( unsigned int index = 62; index < 127; index++ )
+    {
+        snprintf( hex, sizeof( hex ), "%02x", 0x80 | index );
+
+        if ( !decode( decoder, hex, lines ) )
+        {
+            break;
+        }
+
+        entries.append( lines );
+    }
+
+    return entries;
+}
+
+static void testHpackRequests( const char* name, const char* blocks[ 3 ] )
+{
+    //
+    //  RFC 7541 C.3 and C.4, three requests on one connection
+    //
+    http::Hpack::Decoder decoder;
+    std::string lines;
+
+    bool first = decode( decoder, blocks[0], lines ) &&
+                 lines == ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n" &&
+                 table( decoder ) == ":authority: www.example.com\n";
+
+    bool second = decode( decoder, blocks[1], lines ) &&
+                  lines == ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n" &&
+                  table( decoder ) == "cache-control: no-cache\n:authority: www.example.com\n";
+
+    bool third = decode( decoder, blocks[2], lines ) &&
+                 lines == ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n" &&
+                 table( decoder ) == "custom-key: custom-value\ncache-control: no-cache\n:authority: www.example.com\n";
+
+    check( first && second && third, name );
+}
+
+static void testHpack( )
+{
+    const char* plain[ 3 ] =
+    {
+        "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+        "8286 84be 5808 6e6f 2d63 6163 6865",
+        "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65"
+    };
+
+    const char* huffman[ 3 ] =
+    {
+        "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+        "8286 84be 5886 a8eb 1064 9cbf",
+        "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf"
+    };
+
+    testHpackRequests( "hpack requests without Huffman coding", plain );
+    testHpackRequests( "hpack requests with Huffman coding", huffman );
+
+    //
+    //  RFC 7541 C.6 responses with 256 byte table set by size update (multi-byte integer), entries are evicted
+    //
+    http::Hpack::Decoder decoder;
+    std::string lines;
+
+    bool first = decode( decoder, "3fe1 01"
+                         "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6 2d1b ff6e 919d 29ad"
+                         "1718 63c7 8f0b 97c8 e9ae 82ae 43d3", lines ) &&
+                 lines == ":status: 302\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\n"
+                          "location: https://www.example.com\n" &&
+                 table( decoder ) == "location: https://www.example.com\ndate: Mon, 21 Oct 2013 20:13:21 GMT\n"
+                                     "cache-control: private\n:status: 302\n";
+
+    bool second = decode( decoder, "4883 640e ffc1 c0bf", lines ) &&
+                  lines == ":status: 307\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\n"
+                           "location: https://www.example.com\n" &&
+                  table( decoder ) == ":status: 307\nlocation: https://www.example.com\ndate: Mon, 21 Oct 2013 20:13:21 GMT\n"
+                                      "cache-control: private\n";
+
+    bool third = decode( decoder, "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab 77ad 94e7"
+                         "821d d7f2 e6c7 b335 dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed 4ee5 b106"
+                         "3d50 07", lines ) &&
+                 lines == ":status: 200\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:22 GMT\n"
+                          "location: https://www.example.com\ncontent-encoding: gzip\n"
+                          "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\n" &&
+                 table( decoder ) == "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\n"
+                                     "content-encoding: gzip\ndate: Mon, 21 Oct 2013 20:13:22 GMT\n";
+
+    check( first && second && third, "hpack responses evict entries from table resized by size update" );
+
+    //
+    //  shrinking the table evicts oldest entries, size update after a header or above the settings limit is malformed
+    //
+    bool shrunk = decode( decoder, "3f45", lines ) && lines.empty( ) &&
+                  table( decoder ) == "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\n";
+
+    check( shrunk, "hpack size update evicts entries above new size" );
+
+    http::Hpack::Decoder late;
+    check( !decode( late, "82 3f e1 01", lines ), "hpack size update after header is malformed" );
+
+    http::Hpack::Decoder large;
+    check( !decode( large, "3f e2 1f", lines ), "hpack size update above settings limit is malformed" );
+}
+
+static void testHeadSplit( const char* name, const std::string& request )
+{
+    //
+    //  head arrives in two reads split at every position, end of head may be split between them
+    //
+    unsigned int answered = 0;
+
+    for ( size_t split = 1; split < request.size( ); split++ )
+    {
+        int fd = connectServer( );
+
+        sendAll( fd, request.data( ), split );
+        usleep( 10000 );
+        sendAll( fd, request.data( ) + split, request.size( ) - split );
+
+        std::string reply = receive( fd );
+        close( fd );
+
+        if ( status( reply, "200" ) && body( reply ) == "/split" )
+        {
+            answered++;
+        }
+    }
+
+    check( answered == request.size( ) - 1, name );
+}
+
+static void testHead( )
+{
+    testHeadSplit( "head split at every position", "GET /split HTTP/1.1\r\nHost: localhost\r\nX-Test: 1\r\nConnection: close\r\n\r\n" );
+    testHeadSplit( "head with bare LF split at every position", "GET /split HTTP/1.1\nHost: localhost\nX-Test: 1\nConnection: close\n\n" );
+
+    std::string request = "GET /fast HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n";
+
+    for ( unsigned int i = 2; i < http::Parser::MaxHeaders; i++ )
+    {
+        char line[ 32 ];
+        snprintf( line, sizeof( line ), "X-Header-%u: %u\r\n", i, i );
+        request.append( line );
+    }
+
+    check( status( exchange( request + "\r\n" ), "200" ), "head with maximum number of headers is accepted" );
+    check( status( exchange( request + "X-Extra: 1\r\n\r\n" ), "413" ), "head with too many headers is too large" );
+
+    request = "GET /fast HTTP/1.1\r\nHost: localhost\r\nX-Long: ";
+    request.append( http::Parser::MaxHeadLength, 'a' ).append( "\r\n\r\n" );
+
+    check( status( exchange( request ), "413" ), "head longer than maximum head length is too large" );
+
+    check( status( exchange( "GET /fast HTTP/1.1\nHost: localhost\nConnection: close\n\n" ), "200" ), "head with bare LF line ends is accepted" );
+    check( status( exchange( "GET /fast HTTP/1.1\r\nHost: localhost\r\nX-Folded: one\r\n two\r\nConnection: close\r\n\r\n" ), "400" ),
+           "head with folded header line is bad request" );
+    check( status( exchange( "GET /fast HTTP/1.1\r\nHost: localhost\r\nX-Folded: one\r\n\tX-Injected: two\r\nConnection: close\r\n\r\n" ), "400" ),
+           "head with folded line that looks like header is bad request" );
+}
+
+int main( int argc, char** argv )
+{
+    if ( argc > 1 )
+    {
+        s_port = atoi( argv[ 1 ] );
+    }
+
+    Handler handler;
+    http::Server server( s_port, handler );
+
+    http::Body::setMaxLength( 1048576 );
+    http::Body::setSpillThreshold( 64 );
+
+    server.setConnectionThreadCount( 2 );
+    server.setPoolThreadCount( 2 );
+
+    s_server = &server;
+    mountFiles( server );
+
+    pthread_t thread;
+    pthread_create( &thread, NULL, serverRoutine, &server );
+
+    testWebSocketLength( );
+    testPipelineBound( );
+    testEventFields( );
+    testBodyLimits( );
+    testChunkedBody( );
+    testFiles( );
+    testHpack( );
+    testHead( );
+
+    printf( "%u failed\n", s_failed );
+    fflush( stdout );
+
+    //
+    //  server runs till the process exits
+    //
+    _exit( s_failed );
+}
@@ -5,11 +5,12 @@ if not breeze.environment then
     breeze.environment = breezeApi.environment
 
     __onRequest = breeze.onRequest
+    __onWebSocket = breeze.onWebSocket
 
     -- /metrics
     MetricsHandler = class('MetricsHandler', Handler)
     function MetricsHandler:get()
-        response.body = breezeApi.metrics or {}
+        response.body = breezeApi.getMetrics()
     end 
 
     breeze.addHandler{path='/metrics', handler=MetricsHandler}
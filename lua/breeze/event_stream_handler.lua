@@ -0,0 +1,25 @@
+--- Server-Sent Events endpoint.
+-- GET request that accepts text/event-stream is answered with a stream that stays open after the handler returns, events
+-- published with breeze.publish to its topics are written to it by connection thread without involving workers.
+-- Subclasses override topics() to choose what the client receives and may set response.body to initial events
+EventStreamHandler = class('EventStreamHandler', Handler)
+
+function EventStreamHandler:get()
+    local topics = self:topics()
+
+    if not (breezeApi and breezeApi.eventStream and breezeApi.eventStream(topics)) then
+        response.status = 406
+        response.body = 'text/event-stream expected'
+        return
+    end
+
+    response.type = nil
+    response.headers['Content-Type'] = 'text/event-stream'
+    response.headers['Cache-Control'] = 'no-cache'
+end
+
+--- Topics the stream of request being handled is subscribed to, the path handler is registered at by default
+-- @return list of topic names
+function EventStreamHandler:topics()
+    return {request.route and request.route.path or request.url}
+end
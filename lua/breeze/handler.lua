@@ -43,6 +43,11 @@ end
 
 function Handler:_send()
 
+    if response.streaming then
+        -- status, headers and body have been sent by response:write()
+        return
+    end
+
 	if type(response.body) == 'table' then
 	    -- encode table to json
 	    response.body = json.encode(response.body)
@@ -59,13 +64,40 @@ function Handler:_handle(url)
     response.status = 200
     response.type = 'text'
     
+    local methodHandler = nil
+    
+    if request.route then
+        -- route has been matched by native router
+        for name, value in pairs(request.route.params) do request.params[name] = value end
+        if request.route.action then methodHandler = self[request.route.action] end
+    else
+        methodHandler = self:_match(url)
+    end
+    
+    if not table.empty(request.params) then
+        breeze.logger:debug("request params " .. tostring(request.params))
+    end  
+    
+  -- handle
+    if type(methodHandler) ~= 'function' then methodHandler = self[request.method:lower()] end
+    
+    if type(methodHandler) == 'function' then 
+        methodHandler(self) 
+    else
+        breeze.logger:warn("could not find handler for %s %s", request.method, request.url)
+        response.status = 501
+        response.body = 'Not implemented'
+    end
+end
+
+--- Match url against routes of handler class (used when request has not been routed natively)
+function Handler:_match(url)
     local match, slashes = url.path:gsub("/", "/")
     
     local methodHandler = nil
     
-    
     -- handle url pattern
-    for index, route in ipairs(Handler.routes) do 
+    for index, route in ipairs(rawget(self.class.static, 'routes') or {}) do 
         if slashes == route.slashes and request.method == route.method then
             
             local pathTokens = url.path:split("/")
@@ -85,28 +117,21 @@ function Handler:_handle(url)
         end
     end
     
-    if not table.empty(request.params) then
-        breeze.logger:debug("request params " .. tostring(request.params))
-    end  
-    
-  -- handle
-    local methodHandler = methodHandler or self[request.method:lower()]
-    
-    if type(methodHandler) == 'function' then 
-        methodHandler(self) 
-    else
-        breeze.logger:warn("could not find handler for %s %s", request.method, request.url)
-        response.status = 501
-        response.body = 'Not implemented'
-    end
+    return methodHandler
 end
 
-function Handler.static.addRoute(route)
+--- Add route to handler class, each class keeps its own routes
+function Handler.static:addRoute(route)
     
     local match, slashes = route.pattern:gsub("/", "/")
     route.slashes = slashes
-    table.insert(Handler.static.routes, route)
+    
+    local routes = rawget(self.static, 'routes')
+    if not routes then
+        routes = {}
+        self.static.routes = routes
+    end
+    
+    table.insert(routes, route)
 end
 
-Handler.static.routes = {}
-
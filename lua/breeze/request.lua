@@ -3,13 +3,59 @@ Request = class('Request')
 function Request:initialize(request)
     
     self.url = request.url
-    self.body = request.body
     self.method = request.method
+    -- route matched by native router: handler path, action and params (nil in test environment)
+    self.route = request.route
     self.headers = request.headers
+    -- true if request was received over TLS
+    self.secure = request.secure == true
+    self.bodyLength = request.bodyLength or #(request.body or '')
+    
+    -- body passed as string (test environment), otherwise it is loaded on first access
+    self._body = request.body
     
     local contentType = self.headers['content-type']
     self.type = ''
-    if contentType then self.type = contentType:sub(contentType:find("/") + 1, -1) end
+    if contentType then self.type = contentType:sub(contentType:find("/") + 1, -1):lower() end
+    
+end
+
+--- Read part of the request body
+-- @param offset offset from the beginning of the body
+-- @param size maximum number of bytes to read
+-- @return string or nil if there is no more data
+function Request:readBody(offset, size)
+    if self._body then
+        if offset >= #self._body then return nil end
+        return self._body:sub(offset + 1, offset + size)
+    end
+    
+    return breezeApi.readBody(offset, size)
+end
+
+--- Get iterator over request body, use it to process large bodies without loading them to memory at once
+-- @param size chunk size, 64KB by default
+-- @usage for chunk in request:bodyReader() do file:write(chunk) end
+function Request:bodyReader(size)
+    size = size or 65536
+    local offset = 0
     
+    return function()
+        local chunk = self:readBody(offset, size)
+        if chunk then offset = offset + #chunk end
+        return chunk
+    end
 end
 
+-- request.body is loaded when accessed for the first time
+local methods = Request.__instanceDict
+
+methods.__index = function(self, key)
+    if key == 'body' then
+        local body = self._body or breezeApi.body()
+        rawset(self, 'body', body)
+        return body
+    end
+    
+    return methods[key]
+end
@@ -10,10 +10,40 @@ function Response:setContentType(contentType)
     self.headers['Content-Type'] = contentType
 end
 
+--- Send part of the response body to the client. Status and headers are sent with the first chunk
+-- and can not be changed afterwards, body is sent using chunked transfer encoding
+-- @param chunk string to send
+function Response:write(chunk)
+    if not breezeApi or not breezeApi.write then
+        -- test environment, accumulate body
+        self.body = self.body .. chunk
+        return
+    end
+
+    if not self.streaming then
+        if not self.headers['Content-Type'] and self.type == 'text' then
+            self:setContentType('text/plain')
+        end
+
+        breezeApi.writeHead(self.status or 200, self.headers)
+        self.streaming = true
+    end
+
+    breezeApi.write(chunk)
+end
+
+--- Send chunks written so far without waiting for more data
+function Response:flush()
+    if self.streaming then
+        breezeApi.flush()
+    end
+end
+
 function Response:finish()
     self._response.status = self.status
     self._response.body = self.body
     self._response.headers = self.headers
+    self._response.cache = self.cache
 end
 
 
@@ -11,7 +11,8 @@ end
 function StaticHandler:onRequest(url)
     
     local path = self.options.path..url.path
-    local file = io.open(path, "rb")
+    -- files are served natively, this handler responds to requests the file server declined
+    local file = not url.path:find('/../', 1, true) and url.path:sub(-3) ~= '/..' and io.open(path, "rb")
 
     if not file then 
         response.body = url.path..' not found'
@@ -0,0 +1,61 @@
+--- WebSocket endpoint.
+-- GET request with valid opening handshake is answered with 101 Switching Protocols and the connection is then used for messages.
+-- Subclasses override onOpen(socket), onMessage(socket, message, binary) and onClose(socket). Events of a socket are handled
+-- in order by the worker that accepted it, socket object is the same in all of them
+WebSocketHandler = class('WebSocketHandler', Handler)
+
+function WebSocketHandler:get()
+    -- endpoint is the path handler is registered at
+    local accept = breezeApi and breezeApi.upgrade and request.route and breezeApi.upgrade(request.route.path)
+    
+    if not accept then
+        response.status = 400
+        response.body = 'WebSocket handshake expected'
+        return
+    end
+    
+    response.status = 101
+    response.type = nil
+    response.headers['Upgrade'] = 'websocket'
+    response.headers['Connection'] = 'Upgrade'
+    response.headers['Sec-WebSocket-Accept'] = accept
+end
+
+function WebSocketHandler:onOpen(socket)
+end
+
+function WebSocketHandler:onMessage(socket, message, binary)
+end
+
+function WebSocketHandler:onClose(socket)
+end
+
+
+WebSocket = class('WebSocket')
+
+function WebSocket:initialize(id, path)
+    self.id = id
+    self.path = path
+end
+
+--- Send message to this socket
+-- @param message string
+-- @param binary true to send binary message, text otherwise
+function WebSocket:send(message, binary)
+    breezeApi.webSocketSend(self.id, message, binary)
+end
+
+--- Receive messages sent to channel with breeze.broadcast
+function WebSocket:subscribe(channel)
+    breezeApi.webSocketSubscribe(self.id, channel)
+end
+
+function WebSocket:unsubscribe(channel)
+    breezeApi.webSocketUnsubscribe(self.id, channel)
+end
+
+--- Close socket
+-- @param code status code, 1000 (normal closure) by default
+function WebSocket:close(code)
+    breezeApi.webSocketClose(self.id, code)
+end
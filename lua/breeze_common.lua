@@ -6,6 +6,8 @@ require 'breeze.request'
 require 'breeze.response'
 require 'breeze.handler'
 require 'breeze.static_handler'
+require 'breeze.websocket_handler'
+require 'breeze.event_stream_handler'
 
 --- lua std lib
 require 'std'
@@ -32,6 +34,8 @@ end
 --- Add route.
 -- @param route definition as a table {route="GET /hello/:id", handler=HandlerClass action="id"}
 -- route is specified as HTTP method combined with relative url. parts of url prefixed with ":" will get passed to action method of handler instance as request paramaters
+-- with coalesce=true identical GET and HEAD requests arriving while one of them is handled wait for it and receive a copy of its response,
+-- coalesce can also list request headers that make requests to the same url different, e.g. coalesce={"Accept-Language"}
 function breeze.addRoute(definition)
         
         
@@ -47,9 +51,10 @@ function breeze.addRoute(definition)
     local path = pattern
     
     -- get base path
-    if pattern:find(":") > 1 then
+    local colon = pattern:find(":")
+    if colon and colon > 1 then
        -- get base path
-        path = pattern:sub(1, pattern:find(":") - 1)
+        path = pattern:sub(1, colon - 1)
     end
     
     if #path > 1 then
@@ -64,16 +69,123 @@ function breeze.addRoute(definition)
        -- check if there is a handler for this path
     if not breeze.handlers[path] then
         breeze.handlers[path] = definition
+        if breezeApi then breezeApi.addHandler(path) end
     end
 
-    definition.handler.addRoute{method = method, pattern = pattern, action = definition.action}
+    -- routes are matched by native router, handler keeps them for test environment
+    definition.handler:addRoute{method = method, pattern = pattern, action = definition.action}
+    if breezeApi then breezeApi.addRoute(method, pattern, path, definition.action, definition.coalesce) end
 end
 
 --- Add Handler
 -- @param handler definition as a table {path="/hello", handler=HandlerClass}
 -- any request to the url containing path specified in handler definition will be passed to instance of handler class. If exists method corresponding to HTTP method is called
+-- coalesce option is the same as for routes
 function breeze.addHandler(definition)
     breeze.handlers[definition.path] = {handler=definition.handler, options=definition.options}
+    if breezeApi then breezeApi.addHandler(definition.path, definition.coalesce) end
+    if breezeApi and definition.handler == StaticHandler and definition.options then
+        -- files are served by connection threads, handler only responds to requests for missing files
+        breezeApi.addStaticPath(definition.path, definition.options.path)
+    end
+end
+
+--- Suspend request handler.
+-- Worker handles other requests while handler sleeps. In test mode it returns at once
+-- @param seconds time to sleep, fractions of second are allowed
+function breeze.sleep(seconds)
+    if breeze.environment ~= 'test' then
+        breezeApi.sleep(seconds)
+    end
+end
+
+breeze.http = {}
+
+--- Make HTTP request.
+-- Request handler is suspended until response is received, worker handles other requests meanwhile.
+-- Connections are kept alive and reused for subsequent requests to the same host
+-- @param options table {url="http://host:port/path", method="GET", headers={}, body="", timeout=30}
+-- @return response table {status=200, headers={}, body=""} or nil and error message
+function breeze.http.request(options)
+    if breeze.environment == 'test' then
+        return nil, 'http requests are not available in test mode'
+    end
+    return breezeApi.httpRequest(options)
+end
+
+--- Make GET request.
+-- @see breeze.http.request
+function breeze.http.get(url, headers)
+    return breeze.http.request{url=url, headers=headers}
+end
+
+--- Make POST request.
+-- @see breeze.http.request
+function breeze.http.post(url, body, headers)
+    return breeze.http.request{url=url, method='POST', body=body, headers=headers}
+end
+
+breeze.socket = {}
+
+--- Create non-blocking socket.
+-- Socket methods (connect, send, receive, receiveuntil, settimeout, setkeepalive, getreusedtimes, close) suspend
+-- request handler instead of blocking the worker. Socket can only be used by request that created it, it is closed
+-- when request is completed unless it is returned to connection pool with setkeepalive
+-- @return socket object
+function breeze.socket.tcp()
+    if breeze.environment == 'test' then
+        error('sockets are not available in test mode')
+    end
+    return breezeApi.socketTcp()
+end
+
+--- Send message to all WebSockets subscribed to the channel.
+-- Message is framed once and queued once per connection thread, it can be sent from any handler
+-- @param channel channel name
+-- @param message string
+-- @param binary true to send binary message, text otherwise
+function breeze.broadcast(channel, message, binary)
+    if breeze.environment ~= 'test' then
+        breezeApi.broadcast(channel, message, binary)
+    end
+end
+
+--- Send event to all Server-Sent Events streams subscribed to the topic (see EventStreamHandler).
+-- Event is serialized once and queued once per connection thread, it can be published from any handler
+-- @param topic topic name
+-- @param data event data
+-- @param event event type, message by default
+-- @param id event id
+function breeze.publish(topic, data, event, id)
+    if breeze.environment ~= 'test' then
+        breezeApi.publishEvent(topic, data, event, id)
+    end
+end
+
+-- socket objects by native socket, events of a socket are handled by the same lua state
+local sockets = {}
+
+function breeze.onWebSocket(event, path, id, message, binary)
+    local socket = sockets[id]
+    
+    if not socket then
+        socket = WebSocket:new(id, path)
+        sockets[id] = socket
+    end
+    
+    if event == 'Close' then sockets[id] = nil end
+    
+    local definition = breeze.handlers[path]
+    if not definition then return end
+    
+    local handler = definition.handler
+    
+    if rawget(handler, 'class') == nil then
+        handler = handler:new(definition.options)
+        definition.handler = handler
+    end
+    
+    handler['on' .. event](handler, socket, message, binary)
 end
 
 function breeze.onRequest()
@@ -86,15 +198,21 @@ function breeze.onRequest()
     breeze.logger:info("request: %s %s", request.method, request.url)
     
     -- look for handler
-    local urlinfo = url.parse(request.url)
+    local urlinfo, definition
+    
+    if __req.route ~= nil then
+        -- request has been routed by native router
+        urlinfo = {path = __req.path, query = __req.query}
+        definition = __req.route and breeze.handlers[__req.route.path]
+    else
+        urlinfo = url.parse(request.url)
+        definition = breeze.handlers[urlinfo.path]
+    end
     
     local path = urlinfo.path
-    -- get url base path
-
-    local definition = breeze.handlers[path]
     
     -- look for closest match
-    if not definition then
+    if definition == nil then
         local parts = list.reverse(request.url:split('/'))
         for i, part in ipairs(parts) do 
             path = path:sub(1, #path - #part)
@@ -114,8 +232,8 @@ function breeze.onRequest()
         local handler = definition.handler
         
         
-        if not instanceOf(Handler, handler) then
-            --create handler instance
+        if rawget(handler, 'class') == nil then
+            --create handler instance (handlers are not necessarily Handler subclasses, e.g. StaticHandler)
             handler = handler:new(definition.options)
             definition.handler = handler
         end
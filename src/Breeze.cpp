@@ -15,13 +15,15 @@ limitations under the License.
  */
 
 #include "Breeze.h"
+#include "Cosocket.h"
 #include "trace.h"
 #include <lua_cjson.h>
 
 Breeze* Breeze::m_instance = NULL;
+THREAD_LOCAL propeller::http::Client* Breeze::HttpCall::s_client = NULL;
 
 Breeze::Breeze( unsigned int port )
-: m_development( false ), m_dataCollectTimeout( 5 ), m_server( port, ( propeller::Server::EventHandler& ) *this ), m_connectionThreads( 10 ), m_poolThreads( 30 )
+: m_development( false ), m_acceptsPerWakeup( 0 ), m_poolHits( 0 ), m_poolMisses( 0 ), m_poolHitRate( 0 ), m_localHitsTotal( 0 ), m_stealsTotal( 0 ), m_localHits( 0 ), m_steals( 0 ), m_cacheHitsTotal( 0 ), m_cacheMissesTotal( 0 ), m_compressedTotal( 0 ), m_compressionInputTotal( 0 ), m_compressionOutputTotal( 0 ), m_compressionTimeTotal( 0 ), m_tlsHandshakesTotal( 0 ), m_tlsResumedTotal( 0 ), m_tlsKernelTotal( 0 ), m_http2ConnectionsTotal( 0 ), m_http2StreamsTotal( 0 ), m_webSocketsTotal( 0 ), m_webSocketMessagesTotal( 0 ), m_eventStreamsTotal( 0 ), m_snapshotSequence( 0 ), m_dataCollectTimeout( 5 ), m_server( port, ( propeller::Server::EventHandler& ) *this ), m_connectionThreads( 10 ), m_poolThreads( 30 )
 {
     
 }
@@ -46,17 +48,28 @@ Breeze* Breeze::create( unsigned int port )
     return m_instance;
 }
 
+bool Breeze::setTls( unsigned int port, const char* certificate, const char* key )
+{
+    if ( !m_tls.load( certificate, key ) )
+    {
+        return false;
+    }
+    
+    //
+    //  clients that support HTTP/2 select it during handshake
+    //
+    m_tls.setProtocols( m_server.http2( ) ? "h2,http/1.1" : "http/1.1" );
+    m_server.setTls( port, m_tls );
+    
+    return true;
+}
+
 void Breeze::onRequest( const propeller::Request& req, propeller::Response& res, sys::ThreadPool::Worker& thread )
 {
     ThreadState* state = ( ThreadState* ) thread.data();
     
     lua_State* lua = state->lua;
     
-    //
-    //  obtain the lock (since metrics are collected from the other thread)
-    //
-    sys::LockEnterLeave lock( thread.lock() );
-    
     const propeller::http::Request& request = ( const propeller::http::Request& ) req;
     propeller::http::Response& response = ( propeller::http::Response& ) res;
     
@@ -70,212 +83,1341 @@ void Breeze::onRequest( const propeller::Request& req, propeller::Response& res,
         //
         luaL_dostring( lua, "for key, value in pairs(package.loaded) do package.loaded[key] = nil end" );
         loadLibraries( lua );
+        state->router.clear();
+        state->targets.clear();
         if ( !loadScript( lua ) )
         {
-            //
-            //  error executing lua
-            //
-            response.setStatus( 500 );
-            response.setBody( lua_tostring( lua, -1 ) );
+            //
+            //  error executing lua
+            //
+            response.setStatus( 500 );
+            response.setBody( lua_tostring( lua, -1 ) );
+            lua_pop( lua, 1 );
+            return;
+        }
+    }
+
+    
+    //
+    //  route request before entering lua, handler is looked up by path (key of breeze.handlers) 
+    //
+    const char* uri = request.uri();
+    const char* query = strchr( uri, '?' );
+    unsigned int pathLength = query ? query - uri : strlen( uri );
+    
+    int route = state->router.match( request.method(), uri, pathLength, state->params );
+    Flight* flight = NULL;
+    
+    if ( route != -1 && state->targets[ route ].coalesce && coalesce( state->targets[ route ], request, response, thread, flight ) )
+    {
+        //
+        //  identical request is being handled, its response is copied to this one
+        //
+        return;
+    }
+    
+    //
+    //  handler runs as coroutine, so it can be suspended while waiting for timer or I/O
+    //
+    Coroutine* coroutine = new Coroutine( state, thread, request, response );
+    coroutine->flight = flight;
+    coroutine->lua = lua_newthread( lua );
+    coroutine->reference = luaL_ref( lua, LUA_REGISTRYINDEX );
+    
+    lua_getglobal( coroutine->lua, "__onRequest" );
+    
+    //
+    //  export request to lua
+    //
+    lua_newtable( lua );
+         
+    //
+    //  body is not copied, it is loaded by lua on demand
+    //
+    lua_pushunsigned( lua, request.bodyLength() );
+    lua_setfield( lua, -2, "bodyLength" );
+    
+    lua_pushstring( lua, request.uri() );
+    lua_setfield( lua, -2, "url" );
+    
+    lua_pushstring( lua, request.method() );
+    lua_setfield( lua, -2, "method" );
+    
+    if ( request.connection().secure() )
+    {
+        lua_pushboolean( lua, 1 );
+        lua_setfield( lua, -2, "secure" );
+    }
+    
+    lua_newtable( lua );
+    
+    for ( unsigned int i = 0; i < request.headerCount(); i++ )
+    {
+        lua_pushstring( lua, request.headerValue( i ) );
+        lua_setfield( lua, -2, request.headerName( i ) );
+    }
+    
+    lua_setfield( lua, -2, "headers" );
+    
+    lua_pushlstring( lua, uri, pathLength );
+    lua_setfield( lua, -2, "path" );
+    
+    if ( query )
+    {
+        lua_pushstring( lua, query + 1 );
+        lua_setfield( lua, -2, "query" );
+    }
+    
+    if ( route == -1 )
+    {
+        lua_pushboolean( lua, 0 );
+    }
+    else
+    {
+        const RouteTarget& target = state->targets[ route ];
+        
+        lua_createtable( lua, 0, 3 );
+        
+        lua_pushstring( lua, target.path.c_str() );
+        lua_setfield( lua, -2, "path" );
+        
+        if ( target.action.size() )
+        {
+            lua_pushstring( lua, target.action.c_str() );
+            lua_setfield( lua, -2, "action" );
+        }
+        
+        lua_createtable( lua, 0, state->params.size() );
+        
+        for ( propeller::http::Router::Params::const_iterator i = state->params.begin(); i != state->params.end(); i++ )
+        {
+            lua_pushlstring( lua, i->value, i->length );
+            lua_setfield( lua, -2, i->name->c_str() );
+        }
+        
+        lua_setfield( lua, -2, "params" );
+    }
+    
+    lua_setfield( lua, -2, "route" );
+    
+    lua_setglobal( lua, "__req" );
+    
+    //
+    //  call lua 
+    //
+    resume( coroutine );
+}
+
+//
+//  globals that belong to request being handled, they are saved while coroutine is suspended because other requests
+//  handled by the same lua state overwrite them
+//
+static const char* requestGlobals[] = { "__req", "__res", "request", "response" };
+
+void Breeze::resume( Coroutine* coroutine, int arguments )
+{
+    ThreadState* state = coroutine->state;
+    lua_State* lua = state->lua;
+    
+    if ( coroutine->globals != LUA_NOREF )
+    {
+        lua_rawgeti( lua, LUA_REGISTRYINDEX, coroutine->globals );
+        
+        for ( unsigned int i = 0; i < sizeof( requestGlobals ) / sizeof( requestGlobals[0] ); i++ )
+        {
+            lua_getfield( lua, -1, requestGlobals[i] );
+            lua_setglobal( lua, requestGlobals[i] );
+        }
+        
+        lua_pop( lua, 1 );
+        
+        luaL_unref( lua, LUA_REGISTRYINDEX, coroutine->globals );
+        coroutine->globals = LUA_NOREF;
+    }
+    
+    state->coroutine = coroutine;
+    state->request = &coroutine->request;
+    state->response = &coroutine->response;
+    
+    if ( coroutine->operation )
+    {
+        arguments = coroutine->operation->results( coroutine->lua );
+        delete coroutine->operation;
+        coroutine->operation = NULL;
+    }
+    
+    coroutine->suspended = false;
+    int result = lua_resume( coroutine->lua, lua, arguments );
+    
+    state->coroutine = NULL;
+    state->request = NULL;
+    state->response = NULL;
+    
+    if ( result == LUA_YIELD )
+    {
+        if ( !coroutine->suspended )
+        {
+            //
+            //  nothing is going to resume coroutine
+            //
+            lua_settop( coroutine->lua, 0 );
+            lua_pushstring( coroutine->lua, "attempt to yield from request handler" );
+            complete( coroutine, LUA_ERRRUN );
+            return;
+        }
+        
+        lua_newtable( lua );
+        
+        for ( unsigned int i = 0; i < sizeof( requestGlobals ) / sizeof( requestGlobals[0] ); i++ )
+        {
+            lua_getglobal( lua, requestGlobals[i] );
+            lua_setfield( lua, -2, requestGlobals[i] );
+        }
+        
+        coroutine->globals = luaL_ref( lua, LUA_REGISTRYINDEX );
+        
+        //
+        //  worker is released, response is finished when coroutine completes
+        //
+        if ( !coroutine->response.detached() )
+        {
+            coroutine->response.detach();
+        }
+        
+        return;
+    }
+    
+    complete( coroutine, result );
+}
+
+void Breeze::complete( Coroutine* coroutine, int result )
+{
+    ThreadState* state = coroutine->state;
+    lua_State* lua = state->lua;
+    
+    const propeller::http::Request& request = coroutine->request;
+    propeller::http::Response& response = coroutine->response;
+
+    if ( result != LUA_OK )
+    {
+        //
+        //  error executing lua
+        //
+        luaL_traceback( lua, coroutine->lua, lua_tostring( coroutine->lua, -1 ), 0 );
+        TRACE_ERROR( "%s", lua_tostring( lua, -1 ) );
+        
+        if ( coroutine->flight )
+        {
+            coroutine->flight->status = 500;
+            coroutine->flight->headers.clear();
+            coroutine->flight->body = m_development ? lua_tostring( lua, -1 ) : "";
+        }
+
+        if ( response.chunked() )
+        {
+            //
+            //  part of the body has been sent already, let client know that response is incomplete
+            //
+            response.abort();
+        }
+        else
+        {
+            response.setStatus( 500 );
+            response.setBody( m_development ? lua_tostring( lua, -1 ) : NULL );
+        }
+         
+        lua_pop( lua, 1 );
+    }
+    else
+    {
+        //
+        //  load response from lua
+        //
+        lua_getglobal( lua, "__res" );
+
+        if ( response.chunked() )
+        {
+            //
+            //  status and headers have been sent with the first chunk, send the rest of the body
+            //
+            lua_getfield( lua, -1, "body" );
+            size_t length = 0;
+            const char* body = lua_tolstring( lua, -1, &length );
+
+            if ( coroutine->flight && length )
+            {
+                coroutine->flight->body.append( body, length );
+            }
+            
+            response.setBody( length ? body : NULL, length );
+            lua_pop( lua, 1 );
+        }
+        else
+        {
+            lua_getfield( lua, -1, "status" );
+            response.setStatus( lua_tounsigned( lua, -1 ) );
+            lua_pop( lua, 1 );
+            
+            cache( lua, request, response );
+
+            lua_getfield( lua, -1, "headers" );
+
+            lua_pushnil( lua );
+            while ( lua_next( lua, -2 ) != 0 )
+            {
+                const char* name = lua_tostring( lua, -2 );
+                const char* value = lua_tostring( lua, -1 );
+
+                response.addHeader( name, value );
+                
+                if ( coroutine->flight )
+                {
+                    coroutine->flight->headers.push_back( std::make_pair( name, value ) );
+                }
+
+                lua_pop( lua, 1 );
+            }
+
+            lua_pop( lua, 1 );
+
+            lua_getfield( lua, -1, "body" );
+            size_t length = 0;
+            const char* body = lua_tolstring( lua, -1, &length );
+
+            if ( coroutine->flight )
+            {
+                coroutine->flight->status = response.status();
+                coroutine->flight->body.assign( body ? body : "", length );
+            }
+            
+            response.setBody( body, length );
+            lua_pop( lua, 1 );
+        }
+        
+        lua_pop( lua, 1 );
+    }
+    
+    collect( state, request, response );
+    Cosocket::release( coroutine );
+    
+    if ( coroutine->flight )
+    {
+        land( coroutine->flight, state );
+    }
+    
+    luaL_unref( lua, LUA_REGISTRYINDEX, coroutine->reference );
+    bool detached = response.detached();
+    delete coroutine;
+    
+    if ( detached )
+    {
+        //
+        //  return response to connection thread, it may be deleted there at once
+        //
+        response.finish();
+    }
+}
+
+void Breeze::wakeup( Coroutine* coroutine )
+{
+    if ( coroutine->worker.attached() )
+    {
+        //
+        //  inline mode, worker belongs to this connection thread
+        //
+        resume( coroutine );
+    }
+    else
+    {
+        m_server.queue( new Resume( coroutine ), coroutine->worker );
+    }
+}
+
+void Breeze::Resume::run( sys::ThreadPool::Worker& worker )
+{
+    Breeze::instance()->resume( coroutine );
+    delete this;
+}
+
+void Breeze::onWakeupStatic( evutil_socket_t fd, short what, void* arg )
+{
+    Coroutine* coroutine = ( Coroutine* ) arg;
+    
+    event_free( coroutine->timer );
+    coroutine->timer = NULL;
+    
+    Breeze::instance()->wakeup( coroutine );
+}
+
+void Breeze::onOpen( propeller::http::WebSocket& socket )
+{
+    dispatch( new SocketEvent( socket, "Open" ) );
+}
+
+void Breeze::onMessage( propeller::http::WebSocket& socket, std::string& message, bool binary )
+{
+    SocketEvent* event = new SocketEvent( socket, "Message" );
+    event->message.swap( message );
+    event->binary = binary;
+    
+    dispatch( event );
+}
+
+void Breeze::onClose( propeller::http::WebSocket& socket )
+{
+    dispatch( new SocketEvent( socket, "Close" ) );
+}
+
+void Breeze::dispatch( SocketEvent* event )
+{
+    //
+    //  events of a socket are handled in order by the worker that accepted it, so lua sees the same socket object
+    //
+    event->socket.ref();
+    sys::ThreadPool::Worker& worker = *( sys::ThreadPool::Worker* ) event->socket.data();
+    
+    if ( worker.attached() )
+    {
+        //
+        //  inline mode, worker belongs to this connection thread
+        //
+        event->run( worker );
+    }
+    else
+    {
+        m_server.queue( event, worker );
+    }
+}
+
+void Breeze::SocketEvent::run( sys::ThreadPool::Worker& worker )
+{
+    ThreadState* state = ( ThreadState* ) worker.data();
+    lua_State* lua = state->lua;
+    
+    lua_getglobal( lua, "__onWebSocket" );
+    lua_pushstring( lua, event );
+    lua_pushstring( lua, socket.endpoint().c_str() );
+    lua_pushlightuserdata( lua, &socket );
+    lua_pushlstring( lua, message.data(), message.size() );
+    lua_pushboolean( lua, binary );
+    
+    //
+    //  event may be handled while another one is (inline mode, socket closed by callback)
+    //
+    propeller::http::WebSocket* previous = state->webSocket;
+    state->webSocket = &socket;
+    
+    if ( lua_pcall( lua, 5, 0, 0 ) != LUA_OK )
+    {
+        TRACE_ERROR( "%s", lua_tostring( lua, -1 ) );
+        lua_pop( lua, 1 );
+    }
+    
+    state->webSocket = previous;
+    socket.deref();
+    
+    delete this;
+}
+
+void Breeze::headerNames( lua_State* lua, int index, std::vector< std::string >& names )
+{
+    //
+    //  table of header names or string with comma separated names
+    //
+    index = lua_absindex( lua, index );
+    
+    if ( lua_istable( lua, index ) )
+    {
+        for ( int i = 1; ; i++ )
+        {
+            lua_rawgeti( lua, index, i );
+            const char* name = lua_tostring( lua, -1 );
+            
+            if ( !name )
+            {
+                lua_pop( lua, 1 );
+                break;
+            }
+            
+            names.push_back( name );
+            lua_pop( lua, 1 );
+        }
+    }
+    else if ( lua_isstring( lua, index ) )
+    {
+        std::string list = lua_tostring( lua, index );
+        std::string::size_type start = 0;
+        
+        while ( start < list.size() )
+        {
+            std::string::size_type end = list.find( ',', start );
+            
+            if ( end == std::string::npos )
+            {
+                end = list.size();
+            }
+            
+            std::string::size_type first = list.find_first_not_of( " \t", start );
+            std::string::size_type last = list.find_last_not_of( " \t", end - 1 );
+            
+            if ( first < end && last != std::string::npos && last >= first )
+            {
+                names.push_back( list.substr( first, last - first + 1 ) );
+            }
+            
+            start = end + 1;
+        }
+    }
+}
+
+void Breeze::cache( lua_State* lua, const propeller::http::Request& request, propeller::http::Response& response )
+{
+    //
+    //  response.cache = { ttl = seconds, vary = { header names } or "comma separated names" }
+    //
+    lua_getfield( lua, -1, "cache" );
+    
+    if ( lua_istable( lua, -1 ) )
+    {
+        lua_getfield( lua, -1, "ttl" );
+        lua_Number ttl = lua_tonumber( lua, -1 );
+        lua_pop( lua, 1 );
+        
+        std::vector< std::string > vary;
+        lua_getfield( lua, -1, "vary" );
+        headerNames( lua, -1, vary );
+        lua_pop( lua, 1 );
+        
+        if ( ttl > 0 )
+        {
+            response.setCache( m_server.cache(), request, ( unsigned int ) ( ttl * 1000 ), vary );
+        }
+    }
+    
+    lua_pop( lua, 1 );
+}
+
+bool Breeze::coalesce( const RouteTarget& target, const propeller::http::Request& request, propeller::http::Response& response, sys::ThreadPool::Worker& worker, Flight*& flight )
+{
+    const char* method = request.method();
+    
+    if ( strcmp( method, "GET" ) && strcmp( method, "HEAD" ) )
+    {
+        return false;
+    }
+    
+    std::string key = method;
+    key += ' ';
+    key += request.uri();
+    
+    for ( std::vector< std::string >::const_iterator i = target.vary.begin(); i != target.vary.end(); i++ )
+    {
+        const char* value = request.header( i->c_str() );
+        
+        key += '\n';
+        key += value ? value : "";
+    }
+    
+    sys::LockEnterLeave lock( m_flightsLock );
+    
+    std::map< std::string, Flight* >::iterator found = m_flights.find( key );
+    
+    if ( found == m_flights.end() )
+    {
+        flight = new Flight( key );
+        m_flights[ key ] = flight;
+        
+        return false;
+    }
+    
+    //
+    //  response is finished when the leading request completes
+    //
+    response.detach();
+    
+    Flight::Follower follower;
+    follower.request = &request;
+    follower.response = &response;
+    follower.worker = &worker;
+    
+    found->second->followers.push_back( follower );
+    
+    return true;
+}
+
+void Breeze::land( Flight* flight, ThreadState* state )
+{
+    std::list< Flight::Follower > followers;
+    
+    {
+        sys::LockEnterLeave lock( m_flightsLock );
+        
+        //
+        //  requests arriving from now on start new execution
+        //
+        m_flights.erase( flight->key );
+        followers.swap( flight->followers );
+    }
+    
+    if ( followers.empty() )
+    {
+        delete flight;
+        return;
+    }
+    
+    flight->pending = followers.size();
+    
+    for ( std::list< Flight::Follower >::iterator i = followers.begin(); i != followers.end(); i++ )
+    {
+        if ( i->worker->attached() )
+        {
+            //
+            //  inline mode, response can be finished from any connection thread
+            //
+            respond( flight, *i, state );
+        }
+        else
+        {
+            //
+            //  waiting request is finished by the worker that received it, after its handler call has returned
+            //
+            m_server.queue( new Deliver( flight, *i ), *i->worker );
+        }
+    }
+}
+
+void Breeze::respond( Flight* flight, const Flight::Follower& follower, ThreadState* state )
+{
+    propeller::http::Response& response = *follower.response;
+    
+    response.setStatus( flight->status );
+    
+    for ( std::vector< std::pair< std::string, std::string > >::const_iterator i = flight->headers.begin(); i != flight->headers.end(); i++ )
+    {
+        response.addHeader( i->first.c_str(), i->second.c_str() );
+    }
+    
+    response.setBody( flight->body.size() ? flight->body.data() : NULL, flight->body.size() );
+    
+    collect( state, *follower.request, response );
+    response.finish();
+    
+    //
+    //  interlockedAdd returns previous value
+    //
+    if ( sys::General::interlockedAdd( &flight->pending, ( unsigned int ) -1 ) == 1 )
+    {
+        delete flight;
+    }
+}
+
+void Breeze::Deliver::run( sys::ThreadPool::Worker& worker )
+{
+    Breeze::instance()->respond( flight, follower, ( ThreadState* ) worker.data() );
+    delete this;
+}
+
+void Breeze::collect( ThreadState* state, const propeller::http::Request& request, const propeller::http::Response& response )
+{
+    state->request = NULL;
+    state->response = NULL;
+    
+    unsigned int responseTime = sys::General::getMillisecondTimestamp() - request.timestamp();
+    
+    //
+    //  collect high level metrics
+    //
+    state->metrics.collect( 
+        responseTime, 
+        response.status() > 500
+    );
+}
+
+ void Breeze::onThreadStarted( sys::ThreadPool::Worker& thread )
+ {
+     TRACE_ENTERLEAVE();
+
+     //
+     // create new lua environment
+     //
+     lua_State* lua = luaL_newstate();
+
+     loadLibraries( lua );
+
+     //
+     // register environment
+     //
+     lua_getglobal( lua, "breezeApi" );
+     lua_pushstring( lua, m_environment.c_str() );
+     lua_setfield( lua, -2, "environment" );
+     lua_pop( lua, 1 );
+     
+         
+     ThreadState* state = new ThreadState( lua );
+     
+     //
+     //  make thread state accessible from C functions called by lua
+     //
+     lua_pushlightuserdata( lua, state );
+     lua_setfield( lua, LUA_REGISTRYINDEX, "breeze.state" );
+     
+     thread.setData( state );
+     
+     if ( !loadScript( lua ) )
+     {
+         throw std::exception();
+     }
+ }
+
+ void Breeze::setEnvironment( const char* environment )
+ {
+     if ( environment )
+     {
+        m_environment = environment;
+     }
+
+     if ( !m_environment.size() )
+     {
+         m_environment = "development";
+     }
+
+     if ( m_environment == "development")
+     {
+         m_development = true;
+     }
+ }
+
+void Breeze::loadLibraries( lua_State* lua )
+{
+    luaL_openlibs( lua );
+
+    //
+    //  create api table
+    //
+    lua_newtable( lua );
+    
+    lua_pushcfunction( lua, writeHead );
+    lua_setfield( lua, -2, "writeHead" );
+    lua_pushcfunction( lua, write );
+    lua_setfield( lua, -2, "write" );
+    lua_pushcfunction( lua, flush );
+    lua_setfield( lua, -2, "flush" );
+    lua_pushcfunction( lua, body );
+    lua_setfield( lua, -2, "body" );
+    lua_pushcfunction( lua, readBody );
+    lua_setfield( lua, -2, "readBody" );
+    lua_pushcfunction( lua, getMetrics );
+    lua_setfield( lua, -2, "getMetrics" );
+    lua_pushcfunction( lua, sleep );
+    lua_setfield( lua, -2, "sleep" );
+    lua_pushcfunction( lua, httpRequest );
+    lua_setfield( lua, -2, "httpRequest" );
+    lua_pushcfunction( lua, addHandler );
+    lua_setfield( lua, -2, "addHandler" );
+    lua_pushcfunction( lua, addRoute );
+    lua_setfield( lua, -2, "addRoute" );
+    lua_pushcfunction( lua, addStaticPath );
+    lua_setfield( lua, -2, "addStaticPath" );
+    lua_pushcfunction( lua, upgrade );
+    lua_setfield( lua, -2, "upgrade" );
+    lua_pushcfunction( lua, webSocketSend );
+    lua_setfield( lua, -2, "webSocketSend" );
+    lua_pushcfunction( lua, webSocketSubscribe );
+    lua_setfield( lua, -2, "webSocketSubscribe" );
+    lua_pushcfunction( lua, webSocketUnsubscribe );
+    lua_setfield( lua, -2, "webSocketUnsubscribe" );
+    lua_pushcfunction( lua, webSocketClose );
+    lua_setfield( lua, -2, "webSocketClose" );
+    lua_pushcfunction( lua, broadcast );
+    lua_setfield( lua, -2, "broadcast" );
+    lua_pushcfunction( lua, eventStream );
+    lua_setfield( lua, -2, "eventStream" );
+    lua_pushcfunction( lua, publishEvent );
+    lua_setfield( lua, -2, "publishEvent" );
+    Cosocket::registerApi( lua );
+    
+    lua_setglobal( lua, "breezeApi" );
+
+    //
+    //  cjson library
+    //
+    luaopen_cjson( lua );
+
+    //
+    // modify package search path
+    //
+    lua_getglobal( lua, "package" );
+    lua_getfield( lua, -1, "path" );
+    std::string path = lua_tostring( lua, -1 );
+
+    for ( std::list< std::string >::iterator i = m_paths.begin( ); i != m_paths.end( ); i++ )
+    {
+        path.append( ";" );
+        path.append( i->c_str( ) );
+        path.append( "/?.lua" );
+        
+        path.append( ";" );
+        path.append( i->c_str( ) );
+        path.append( "/?/init.lua" );
+    }
+
+    TRACE( "%s", path.c_str( ) );
+
+    lua_pop( lua, 1 );
+    lua_pushstring( lua, path.c_str( ) );
+    lua_setfield( lua, -2, "path" );
+    lua_pop( lua, 1 );
+}
+
+
+ThreadState* Breeze::threadState( lua_State* lua, bool request )
+{
+    lua_getfield( lua, LUA_REGISTRYINDEX, "breeze.state" );
+    ThreadState* state = ( ThreadState* ) lua_touserdata( lua, -1 );
+    lua_pop( lua, 1 );
+    
+    if ( !state || ( request && !state->response ) )
+    {
+        luaL_error( lua, "request api is available only while handling request" );
+    }
+    
+    return state;
+}
+
+int Breeze::writeHead( lua_State* lua )
+{
+    ThreadState* state = threadState( lua );
+    
+    if ( state->response->chunked() )
+    {
+        return luaL_error( lua, "response head has been sent already" );
+    }
+    
+    //
+    //  breezeApi.writeHead( status, headers )
+    //
+    state->response->setStatus( luaL_checkunsigned( lua, 1 ) );
+    
+    Flight* flight = state->coroutine ? state->coroutine->flight : NULL;
+    
+    if ( flight )
+    {
+        flight->status = state->response->status();
+    }
+    
+    if ( lua_istable( lua, 2 ) )
+    {
+        lua_pushnil( lua );
+        while ( lua_next( lua, 2 ) != 0 )
+        {
+            state->response->addHeader( lua_tostring( lua, -2 ), lua_tostring( lua, -1 ) );
+            
+            if ( flight )
+            {
+                flight->headers.push_back( std::make_pair( lua_tostring( lua, -2 ), lua_tostring( lua, -1 ) ) );
+            }
+            
+            lua_pop( lua, 1 );
+        }
+    }
+    
+    return 0;
+}
+
+int Breeze::write( lua_State* lua )
+{
+    ThreadState* state = threadState( lua );
+    
+    //
+    //  breezeApi.write( chunk )
+    //
+    size_t length = 0;
+    const char* chunk = luaL_checklstring( lua, 1, &length );
+    
+    if ( length )
+    {
+        state->response->write( chunk, length );
+        
+        if ( state->coroutine && state->coroutine->flight )
+        {
+            //
+            //  waiting requests receive the whole body at once
+            //
+            state->coroutine->flight->body.append( chunk, length );
+        }
+    }
+    
+    return 0;
+}
+
+int Breeze::flush( lua_State* lua )
+{
+    threadState( lua )->response->flush();
+    
+    return 0;
+}
+
+int Breeze::body( lua_State* lua )
+{
+    const propeller::http::Request* request = threadState( lua )->request;
+    
+    //
+    //  breezeApi.body( ) returns whole body as string
+    //
+    const char* body = request->body();
+    
+    if ( !body && request->bodyLength() )
+    {
+        return luaL_error( lua, "failed to load request body" );
+    }
+    
+    lua_pushlstring( lua, body ? body : "", request->bodyLength() );
+    
+    return 1;
+}
+
+int Breeze::readBody( lua_State* lua )
+{
+    const propeller::http::Request* request = threadState( lua )->request;
+    
+    //
+    //  breezeApi.readBody( offset, length ) returns part of the body or nil when there is no more data
+    //
+    unsigned int offset = luaL_checkunsigned( lua, 1 );
+    unsigned int length = luaL_optunsigned( lua, 2, 65536 );
+    
+    if ( offset >= request->bodyLength() || !length )
+    {
+        lua_pushnil( lua );
+        return 1;
+    }
+    
+    if ( length > request->bodyLength() - offset )
+    {
+        length = request->bodyLength() - offset;
+    }
+    
+    luaL_Buffer buffer;
+    char* data = luaL_buffinitsize( lua, &buffer, length );
+    luaL_pushresultsize( &buffer, request->readBody( offset, data, length ) );
+    
+    return 1;
+}
+
+void Breeze::coalesceOption( lua_State* lua, int index, RouteTarget& target )
+{
+    //
+    //  true or names of headers that make requests to the same URI different (table or comma separated string)
+    //
+    if ( lua_isnoneornil( lua, index ) || ( lua_isboolean( lua, index ) && !lua_toboolean( lua, index ) ) )
+    {
+        return;
+    }
+    
+    target.coalesce = true;
+    headerNames( lua, index, target.vary );
+}
+
+int Breeze::addHandler( lua_State* lua )
+{
+    //
+    //  breezeApi.addHandler( path, coalesce ) routes path and everything below it to handler registered at path
+    //
+    ThreadState* state = threadState( lua, false );
+    
+    RouteTarget target;
+    target.path = luaL_checkstring( lua, 1 );
+    coalesceOption( lua, 2, target );
+    
+    state->router.addPrefix( target.path, state->targets.size() );
+    state->targets.push_back( target );
+    
+    return 0;
+}
+
+int Breeze::addRoute( lua_State* lua )
+{
+    //
+    //  breezeApi.addRoute( method, pattern, path, action, coalesce ) routes requests matching method and pattern to
+    //  action of handler registered at path
+    //
+    ThreadState* state = threadState( lua, false );
+    
+    const char* method = luaL_checkstring( lua, 1 );
+    const char* pattern = luaL_checkstring( lua, 2 );
+    
+    RouteTarget target;
+    target.path = luaL_checkstring( lua, 3 );
+    target.action = luaL_optstring( lua, 4, "" );
+    coalesceOption( lua, 5, target );
+    
+    state->router.addRoute( method, pattern, state->targets.size() );
+    state->targets.push_back( target );
+    
+    return 0;
+}
+
+int Breeze::addStaticPath( lua_State* lua )
+{
+    //
+    //  breezeApi.addStaticPath( prefix, root ) serves files below prefix from root directory in connection threads,
+    //  requests for missing files are passed to handler registered at prefix
+    //
+    const char* prefix = luaL_checkstring( lua, 1 );
+    const char* root = luaL_checkstring( lua, 2 );
+    
+    instance()->m_server.files().addPath( prefix, root );
+    
+    return 0;
+}
+
+propeller::http::WebSocket* Breeze::webSocket( lua_State* lua )
+{
+    ThreadState* state = threadState( lua, false );
+    
+    if ( !state->webSocket || lua_touserdata( lua, 1 ) != state->webSocket )
+    {
+        luaL_error( lua, "websocket api is available only while handling event of the socket" );
+    }
+    
+    return state->webSocket;
+}
+
+int Breeze::upgrade( lua_State* lua )
+{
+    //
+    //  breezeApi.upgrade( endpoint ) checks handshake of request being handled and switches connection to WebSocket
+    //  once 101 response is sent, returns value of Sec-WebSocket-Accept header or nil
+    //
+    ThreadState* state = threadState( lua );
+    const char* endpoint = luaL_checkstring( lua, 1 );
+    
+    std::string accept;
+    
+    if ( !propeller::http::WebSocket::handshake( *state->request, accept ) ||
+         !state->response->upgrade( *instance(), endpoint, &state->coroutine->worker ) )
+    {
+        lua_pushnil( lua );
+        return 1;
+    }
+    
+    lua_pushlstring( lua, accept.data(), accept.size() );
+    
+    return 1;
+}
+
+int Breeze::webSocketSend( lua_State* lua )
+{
+    propeller::http::WebSocket* socket = webSocket( lua );
+    
+    size_t length = 0;
+    const char* message = luaL_checklstring( lua, 2, &length );
+    
+    socket->send( message, length, lua_toboolean( lua, 3 ) );
+    
+    return 0;
+}
+
+int Breeze::webSocketSubscribe( lua_State* lua )
+{
+    webSocket( lua )->subscribe( luaL_checkstring( lua, 2 ) );
+    
+    return 0;
+}
+
+int Breeze::webSocketUnsubscribe( lua_State* lua )
+{
+    webSocket( lua )->unsubscribe( luaL_checkstring( lua, 2 ) );
+    
+    return 0;
+}
+
+int Breeze::webSocketClose( lua_State* lua )
+{
+    propeller::http::WebSocket* socket = webSocket( lua );
+    
+    socket->close( luaL_optunsigned( lua, 2, 1000 ) );
+    
+    return 0;
+}
+
+int Breeze::broadcast( lua_State* lua )
+{
+    //
+    //  breezeApi.broadcast( channel, message, binary ) frames message once, frame is shared by all subscribed sockets
+    //
+    const char* channel = luaL_checkstring( lua, 1 );
+    
+    size_t length = 0;
+    const char* message = luaL_checklstring( lua, 2, &length );
+    
+    libevent::SharedBuffer* frame = propeller::http::WebSocket::frame( message, length, lua_toboolean( lua, 3 ) );
+    instance()->m_server.broadcast( channel, *frame );
+    frame->deref();
+    
+    return 0;
+}
+
+int Breeze::eventStream( lua_State* lua )
+{
+    //
+    //  breezeApi.eventStream( topics ) keeps connection of request being handled open as event stream subscribed to
+    //  the topics once response is sent, returns false if connection can not be kept
+    //
+    ThreadState* state = threadState( lua );
+    luaL_checktype( lua, 1, LUA_TTABLE );
+    
+    std::vector< std::string > topics;
+    
+    for ( int i = 1; ; i++ )
+    {
+        lua_rawgeti( lua, 1, i );
+        
+        if ( lua_isnil( lua, -1 ) )
+        {
             lua_pop( lua, 1 );
-            return;
+            break;
         }
+        
+        topics.push_back( luaL_checkstring( lua, -1 ) );
+        lua_pop( lua, 1 );
     }
-
-    
-    lua_getglobal( lua, "debug");
-    lua_getfield( lua, -1, "traceback");
     
-    lua_getglobal( lua, "__onRequest" );
+    lua_pushboolean( lua, state->response->eventStream( topics ) );
     
+    return 1;
+}
+
+int Breeze::publishEvent( lua_State* lua )
+{
     //
-    //  export request to lua
+    //  breezeApi.publishEvent( topic, data, event, id ) serializes event once, it is shared by all subscribed streams
     //
-    lua_newtable( lua );
-         
-    lua_pushstring( lua, request.body() );
-    lua_setfield( lua, -2, "body" );
+    const char* topic = luaL_checkstring( lua, 1 );
     
-    lua_pushstring( lua, request.uri() );
-    lua_setfield( lua, -2, "url" );
+    size_t length = 0;
+    const char* data = luaL_checklstring( lua, 2, &length );
     
-    lua_pushstring( lua, request.method() );
-    lua_setfield( lua, -2, "method" );
+    libevent::SharedBuffer* event = propeller::http::Response::event( data, length, luaL_optstring( lua, 3, NULL ), luaL_optstring( lua, 4, NULL ) );
+    instance()->m_server.broadcast( topic, *event );
+    event->deref();
+    
+    return 0;
+}
+
+int Breeze::getMetrics( lua_State* lua )
+{
+    MetricsSnapshot metrics;
+    instance()->snapshot( metrics );
     
     lua_newtable( lua );
     
-    for ( propeller::http::Request::HeaderMap::const_iterator i = request.headers().begin(); i != request.headers().end(); i++ )
+    lua_pushnumber( lua, metrics.averageResponseTime );
+    lua_setfield( lua, -2, "averageResponseTime" );
+    lua_pushnumber( lua, metrics.throughput );
+    lua_setfield( lua, -2, "throughput" );
+    lua_pushnumber( lua, metrics.errorRate );
+    lua_setfield( lua, -2, "errorRate" );
+    lua_pushnumber( lua, metrics.acceptsPerWakeup );
+    lua_setfield( lua, -2, "acceptsPerWakeup" );
+    lua_pushnumber( lua, metrics.poolHitRate );
+    lua_setfield( lua, -2, "poolHitRate" );
+    lua_pushnumber( lua, metrics.localHits );
+    lua_setfield( lua, -2, "localHits" );
+    lua_pushnumber( lua, metrics.steals );
+    lua_setfield( lua, -2, "steals" );
+    lua_pushnumber( lua, metrics.cacheHits );
+    lua_setfield( lua, -2, "cacheHits" );
+    lua_pushnumber( lua, metrics.cacheMisses );
+    lua_setfield( lua, -2, "cacheMisses" );
+    lua_pushnumber( lua, metrics.cacheEntries );
+    lua_setfield( lua, -2, "cacheEntries" );
+    lua_pushnumber( lua, metrics.cacheSize );
+    lua_setfield( lua, -2, "cacheSize" );
+    lua_pushnumber( lua, metrics.compressedResponses );
+    lua_setfield( lua, -2, "compressedResponses" );
+    lua_pushnumber( lua, metrics.compressionSaved );
+    lua_setfield( lua, -2, "compressionSaved" );
+    lua_pushnumber( lua, metrics.compressionTime );
+    lua_setfield( lua, -2, "compressionTime" );
+    lua_pushnumber( lua, metrics.tlsHandshakes );
+    lua_setfield( lua, -2, "tlsHandshakes" );
+    lua_pushnumber( lua, metrics.tlsResumed );
+    lua_setfield( lua, -2, "tlsResumed" );
+    lua_pushnumber( lua, metrics.tlsKernel );
+    lua_setfield( lua, -2, "tlsKernel" );
+    lua_pushnumber( lua, metrics.http2Connections );
+    lua_setfield( lua, -2, "http2Connections" );
+    lua_pushnumber( lua, metrics.http2Streams );
+    lua_setfield( lua, -2, "http2Streams" );
+    lua_pushnumber( lua, metrics.webSockets );
+    lua_setfield( lua, -2, "webSockets" );
+    lua_pushnumber( lua, metrics.webSocketMessages );
+    lua_setfield( lua, -2, "webSocketMessages" );
+    lua_pushnumber( lua, metrics.eventStreams );
+    lua_setfield( lua, -2, "eventStreams" );
+    
+    return 1;
+}
+
+int Breeze::sleep( lua_State* lua )
+{
+    ThreadState* state = threadState( lua );
+    Coroutine* coroutine = state->coroutine;
+    
+    //
+    //  breezeApi.sleep( seconds ) suspends request handler, worker handles other requests meanwhile
+    //
+    if ( !coroutine || coroutine->lua != lua )
     {
-        lua_pushstring( lua, i->second.c_str() );
-        lua_setfield( lua, -2, i->first.c_str() );
+        return luaL_error( lua, "sleep can only be called from request handler" );
     }
     
-    lua_setfield( lua, -2, "headers" );
+    lua_Number seconds = luaL_checknumber( lua, 1 );
     
-    lua_setglobal( lua, "__req" );
+    if ( seconds < 0 )
+    {
+        seconds = 0;
+    }
     
+    timeval timeout;
+    timeout.tv_sec = ( long ) seconds;
+    timeout.tv_usec = ( long ) ( ( seconds - timeout.tv_sec ) * 1000000 );
     
     //
-    //  call lua 
+    //  timer fires in connection thread of the request
     //
-    int result = lua_pcall( lua, 0, 0, -2 );
-
-    if (result > 0)
-    {
-        //
-        //  error executing lua
-        //
-        TRACE_ERROR("%s", lua_tostring( lua, -1 ));
+    coroutine->timer = evtimer_new( coroutine->request.connection().thread().base(), onWakeupStatic, coroutine );
+    evtimer_add( coroutine->timer, &timeout );
+    coroutine->suspended = true;
+    
+    return lua_yield( lua, 0 );
+}
 
-        response.setStatus( 500 );
-        if ( m_development )
-        {
-            response.setBody( lua_tostring( lua, -1 ) );
-        }
-         
-        lua_pop( lua, 1 );
-    }
+int Breeze::httpRequest( lua_State* lua )
+{
+    ThreadState* state = threadState( lua );
+    Coroutine* coroutine = state->coroutine;
     
     //
-    //  remove debug.traceback from stack
+    //  breezeApi.httpRequest{ url = url, method = method, headers = {}, body = body, timeout = seconds } suspends
+    //  request handler until response is received, returns response table or nil and error message
     //
-    lua_remove( lua, -1 );
-    lua_remove( lua, -2 );
+    if ( !coroutine || coroutine->lua != lua )
+    {
+        return luaL_error( lua, "http request can only be made from request handler" );
+    }
     
-    //
-    //  load response from lua
-    //
-    lua_getglobal( lua, "__res" );
-
-    lua_getfield( lua, -1, "status" );
-    response.setStatus( lua_tounsigned( lua, -1 ) );
-    lua_pop( lua, 1 );
+    luaL_checktype( lua, 1, LUA_TTABLE );
     
-    lua_getfield( lua, -1, "headers" );
-
-    lua_pushnil( lua );
-    while ( lua_next( lua, -2 ) != 0 )
+    HttpCall* call = new HttpCall( coroutine );
+    
+    lua_getfield( lua, 1, "url" );
+    const char* url = lua_tostring( lua, -1 );
+    
+    if ( !url )
     {
-        const char* name = lua_tostring( lua, -2 );
-        const char* value = lua_tostring( lua, -1 );
-
-        response.addHeader( name, value );
-
-        lua_pop( lua, 1 );
+        delete call;
+        return luaL_error( lua, "url is required" );
     }
     
+    call->setUrl( url );
     lua_pop( lua, 1 );
     
-    lua_getfield( lua, -1, "body" );
-    size_t length = 0;
-    const char* body = lua_tolstring( lua, -1, &length );
-
-    response.setBody( body, length );
+    lua_getfield( lua, 1, "method" );
+    if ( lua_isstring( lua, -1 ) )
+    {
+        call->setMethod( lua_tostring( lua, -1 ) );
+    }
     lua_pop( lua, 1 );
     
+    lua_getfield( lua, 1, "body" );
+    if ( lua_isstring( lua, -1 ) )
+    {
+        size_t length = 0;
+        const char* body = lua_tolstring( lua, -1, &length );
+        call->setBody( body, length );
+    }
     lua_pop( lua, 1 );
     
+    lua_getfield( lua, 1, "timeout" );
+    if ( lua_isnumber( lua, -1 ) )
+    {
+        call->setTimeout( lua_tonumber( lua, -1 ) );
+    }
+    lua_pop( lua, 1 );
     
-    unsigned int responseTime = sys::General::getMillisecondTimestamp() - request.timestamp();
+    lua_getfield( lua, 1, "headers" );
+    if ( lua_istable( lua, -1 ) )
+    {
+        lua_pushnil( lua );
+        while ( lua_next( lua, -2 ) != 0 )
+        {
+            if ( lua_type( lua, -2 ) == LUA_TSTRING && lua_isstring( lua, -1 ) )
+            {
+                call->addHeader( lua_tostring( lua, -2 ), lua_tostring( lua, -1 ) );
+            }
+            
+            lua_pop( lua, 1 );
+        }
+    }
+    lua_pop( lua, 1 );
     
     //
-    //  collect high level metrics
+    //  request is sent from connection thread, its event loop delivers the response
     //
-    state->metrics.collect( 
-        responseTime, 
-        response.status() > 500,    
-        request.uri()
-    );
- }
-
- void Breeze::onThreadStarted( sys::ThreadPool::Worker& thread )
- {
-     TRACE_ENTERLEAVE();
-
-     //
-     // create new lua environment
-     //
-     lua_State* lua = luaL_newstate();
-
-     loadLibraries( lua );
-
-     //
-     // register environment
-     //
-     lua_getglobal( lua, "breezeApi" );
-     lua_pushstring( lua, m_environment.c_str() );
-     lua_setfield( lua, -2, "environment" );
-     lua_pop( lua, 1 );
-     
-         
-     thread.setData( new ThreadState( lua ) );
-     
-     if ( !loadScript( lua ) )
-     {
-         throw std::exception();
-     }
- }
-
- void Breeze::setEnvironment( const char* environment )
- {
-     if ( environment )
-     {
-        m_environment = environment;
-     }
-
-     if ( !m_environment.size() )
-     {
-         m_environment = "development";
-     }
+    coroutine->suspended = true;
+    coroutine->request.connection().thread().post( call );
+    
+    return lua_yield( lua, 0 );
+}
 
-     if ( m_environment == "development")
-     {
-         m_development = true;
-     }
- }
+void Breeze::HttpCall::deliver( )
+{
+    if ( !s_client )
+    {
+        s_client = new propeller::http::Client( coroutine->request.connection().thread().base() );
+    }
+    
+    s_client->send( this );
+}
 
-void Breeze::loadLibraries( lua_State* lua )
+void Breeze::HttpCall::onComplete( )
 {
-    luaL_openlibs( lua );
+    coroutine->operation = this;
+    Breeze::instance()->wakeup( coroutine );
+}
 
-    //
-    //  create empty table
-    //
+int Breeze::HttpCall::results( lua_State* lua )
+{
+    if ( !status() )
+    {
+        lua_pushnil( lua );
+        lua_pushstring( lua, error().c_str() );
+        return 2;
+    }
+    
     lua_newtable( lua );
-    lua_setglobal( lua, "breezeApi" );
-
-    //
-    //  cjson library
-    //
-    luaopen_cjson( lua );
-
-    //
-    // modify package search path
-    //
-    lua_getglobal( lua, "package" );
-    lua_getfield( lua, -1, "path" );
-    std::string path = lua_tostring( lua, -1 );
-
-    for ( std::list< std::string >::iterator i = m_paths.begin( ); i != m_paths.end( ); i++ )
+    
+    lua_pushinteger( lua, status() );
+    lua_setfield( lua, -2, "status" );
+    
+    lua_newtable( lua );
+    
+    for ( propeller::http::Client::Headers::const_iterator i = headers().begin(); i != headers().end(); i++ )
     {
-        path.append( ";" );
-        path.append( i->c_str( ) );
-        path.append( "/?.lua" );
-        
-        path.append( ";" );
-        path.append( i->c_str( ) );
-        path.append( "/?/init.lua" );
+        lua_pushstring( lua, i->second.c_str() );
+        lua_setfield( lua, -2, i->first.c_str() );
     }
-
-    TRACE( "%s", path.c_str( ) );
-
-    lua_pop( lua, 1 );
-    lua_pushstring( lua, path.c_str( ) );
-    lua_setfield( lua, -2, "path" );
-    lua_pop( lua, 1 );
+    
+    lua_setfield( lua, -2, "headers" );
+    
+    lua_pushlstring( lua, body().data(), body().size() );
+    lua_setfield( lua, -2, "body" );
+    
+    return 1;
 }
 
-
  bool Breeze::loadScript( lua_State* lua )
  {
     TRACE_ENTERLEAVE();
@@ -315,8 +1457,13 @@ void Breeze::loadLibraries( lua_State* lua )
          //
          // limit number of threads in development mode
          //
-         m_server.setPoolThreadCount( 1 );
+         m_server.setPoolThreadCount( m_poolThreads ? 1 : 0 );
          m_server.setConnectionThreadCount( 1 );
+         
+         //
+         // cached responses would be served without reloading the script
+         //
+         m_server.cache().setBudget( 0 );
      }
      else
      {
@@ -341,36 +1488,185 @@ void Breeze::loadLibraries( lua_State* lua )
          sys::ThreadPool::Worker* worker = *i;
          ThreadState* state = ( ThreadState* ) worker->data();
          
-         sys::LockEnterLeave lock( worker->lock() );
-         
-         m_metrics.add( state->metrics, i == threads.begin() ? m_dataCollectTimeout : 0 );
-         state->metrics.reset();
+         //
+         // counters are read without stopping the thread
+         //
+         state->metrics.addTo( m_metrics, i == threads.begin() ? m_dataCollectTimeout : 0 );
      }
      
      //
-     // export stats to lua
+     // collect listener statistics
      //
-     for ( sys::ThreadPool::WorkerList::iterator i = threads.begin(); i != threads.end(); i++ )
+     unsigned int wakeups = 0;
+     unsigned int accepted = 0;
+     
+     m_server.getAcceptMetrics( wakeups, accepted );
+     
+     if ( wakeups )
      {
-         sys::ThreadPool::Worker* worker = *i;
-         ThreadState* state = ( ThreadState* ) worker->data();
-         
-         sys::LockEnterLeave lock( worker->lock() );
-         
-         lua_getglobal( state->lua, "breezeApi" );
-         
-         lua_newtable( state->lua );
+         m_acceptsPerWakeup = ( double ) accepted / ( double ) wakeups;
+     }
+     
+     //
+     // collect object pool statistics
+     //
+     unsigned int hits = 0;
+     unsigned int misses = 0;
+     
+     m_server.getAllocatorMetrics( hits, misses );
+     
+     if ( hits + misses != m_poolHits + m_poolMisses )
+     {
+         m_poolHitRate = ( double ) ( hits - m_poolHits ) / ( double ) ( hits - m_poolHits + misses - m_poolMisses );
+     }
+     
+     m_poolHits = hits;
+     m_poolMisses = misses;
+     
+     //
+     // collect work stealing statistics
+     //
+     unsigned int localHits = 0;
+     unsigned int steals = 0;
+     
+     m_server.getSchedulerMetrics( localHits, steals );
+     
+     m_localHits = localHits - m_localHitsTotal;
+     m_steals = steals - m_stealsTotal;
+     m_localHitsTotal = localHits;
+     m_stealsTotal = steals;
+     
+     //
+     // collect response cache statistics
+     //
+     unsigned int cacheHits = 0;
+     unsigned int cacheMisses = 0;
+     unsigned int cacheEntries = 0;
+     size_t cacheSize = 0;
+     
+     m_server.cache().getMetrics( cacheHits, cacheMisses, cacheEntries, cacheSize );
+     
+     //
+     // collect compression statistics, counters wrap around so only differences are meaningful
+     //
+     unsigned int compressed = 0;
+     unsigned int compressionInput = 0;
+     unsigned int compressionOutput = 0;
+     unsigned int compressionTime = 0;
+     
+     propeller::http::Compression::getMetrics( compressed, compressionInput, compressionOutput, compressionTime );
+     
+     //
+     // collect TLS statistics
+     //
+     unsigned int tlsHandshakes = 0;
+     unsigned int tlsResumed = 0;
+     unsigned int tlsKernel = 0;
+     
+     m_tls.getMetrics( tlsHandshakes, tlsResumed, tlsKernel );
+     
+     //
+     // collect HTTP/2 statistics
+     //
+     unsigned int http2Connections = 0;
+     unsigned int http2Streams = 0;
+     
+     propeller::http::Session::getMetrics( http2Connections, http2Streams );
+     
+     //
+     // collect WebSocket statistics
+     //
+     unsigned int webSockets = 0;
+     unsigned int webSocketMessages = 0;
+     
+     propeller::http::WebSocket::getMetrics( webSockets, webSocketMessages );
+     
+     //
+     // collect event stream statistics
+     //
+     unsigned int eventStreams = 0;
+     
+     propeller::http::Connection::getMetrics( eventStreams );
+     
+     //
+     // publish stats, lua reads them with breezeApi.getMetrics()
+     //
+     MetricsSnapshot snapshot;
+     
+     snapshot.averageResponseTime = m_metrics.averageResponseTime();
+     snapshot.throughput = m_metrics.throughput();
+     snapshot.errorRate = m_metrics.errorRate();
+     snapshot.acceptsPerWakeup = m_acceptsPerWakeup;
+     snapshot.poolHitRate = m_poolHitRate;
+     snapshot.localHits = m_localHits;
+     snapshot.steals = m_steals;
+     snapshot.cacheHits = cacheHits - m_cacheHitsTotal;
+     snapshot.cacheMisses = cacheMisses - m_cacheMissesTotal;
+     snapshot.cacheEntries = cacheEntries;
+     snapshot.cacheSize = cacheSize;
+     snapshot.compressedResponses = compressed - m_compressedTotal;
+     snapshot.compressionSaved = ( double ) ( compressionInput - m_compressionInputTotal ) - ( double ) ( compressionOutput - m_compressionOutputTotal );
+     snapshot.compressionTime = ( compressionTime - m_compressionTimeTotal ) / 1000.0;
+     snapshot.tlsHandshakes = tlsHandshakes - m_tlsHandshakesTotal;
+     snapshot.tlsResumed = tlsResumed - m_tlsResumedTotal;
+     snapshot.tlsKernel = tlsKernel - m_tlsKernelTotal;
+     snapshot.http2Connections = http2Connections - m_http2ConnectionsTotal;
+     snapshot.http2Streams = http2Streams - m_http2StreamsTotal;
+     snapshot.webSockets = webSockets - m_webSocketsTotal;
+     snapshot.webSocketMessages = webSocketMessages - m_webSocketMessagesTotal;
+     snapshot.eventStreams = eventStreams - m_eventStreamsTotal;
+     
+     m_cacheHitsTotal = cacheHits;
+     m_cacheMissesTotal = cacheMisses;
+     m_compressedTotal = compressed;
+     m_compressionInputTotal = compressionInput;
+     m_compressionOutputTotal = compressionOutput;
+     m_compressionTimeTotal = compressionTime;
+     m_tlsHandshakesTotal = tlsHandshakes;
+     m_tlsResumedTotal = tlsResumed;
+     m_tlsKernelTotal = tlsKernel;
+     m_http2ConnectionsTotal = http2Connections;
+     m_http2StreamsTotal = http2Streams;
+     m_webSocketsTotal = webSockets;
+     m_webSocketMessagesTotal = webSocketMessages;
+     m_eventStreamsTotal = eventStreams;
+     
+     publish( snapshot );
+ }
+
+ void Breeze::publish( const MetricsSnapshot& snapshot )
+ {
+     m_snapshotSequence = m_snapshotSequence + 1;
+     sys::General::memoryBarrier();
+     
+     m_snapshot = snapshot;
+     
+     sys::General::memoryBarrier();
+     m_snapshotSequence = m_snapshotSequence + 1;
+ }
+ 
+ void Breeze::snapshot( MetricsSnapshot& snapshot ) const
+ {
+     for ( ;; )
+     {
+         unsigned int sequence = m_snapshotSequence;
          
-         lua_pushnumber( state->lua, m_metrics.averageResponseTime() );
-         lua_setfield( state->lua, -2, "averageResponseTime" );
-         lua_pushnumber( state->lua, m_metrics.throughput() );
-         lua_setfield( state->lua, -2, "throughput" );
-         lua_pushnumber( state->lua, m_metrics.errorRate() );
-         lua_setfield( state->lua, -2, "errorRate" );
+         if ( sequence & 1 )
+         {
+             //
+             // snapshot is being written
+             //
+             sys::General::yield();
+             continue;
+         }
          
-         lua_setfield( state->lua, -2, "metrics" );
+         sys::General::memoryBarrier();
+         snapshot = m_snapshot;
+         sys::General::memoryBarrier();
          
-         lua_pop( state->lua, 1 );
+         if ( m_snapshotSequence == sequence )
+         {
+             return;
+         }
      }
  }
- 
\ No newline at end of file
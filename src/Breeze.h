@@ -20,6 +20,9 @@ limitations under the License.
 #include "common.h"
 
 #include <propeller/HttpServer.h>
+#include <propeller/HttpClient.h>
+#include <propeller/HttpRouter.h>
+#include <propeller/Tls.h>
 
 //
 //  include lua
@@ -29,19 +32,197 @@ limitations under the License.
 #include "Metrics.h"
 
 
+struct Coroutine;
+class Cosocket;
+
+//
+//  handler path (key of breeze.handlers) and handler method of route registered by lua
+//
+struct RouteTarget
+{
+    RouteTarget( )
+    : coalesce( false )
+    {
+    }
+    
+    std::string path;
+    std::string action;
+    
+    //
+    //  identical GET and HEAD requests (same URI and values of vary headers) share one handler execution
+    //
+    bool coalesce;
+    std::vector< std::string > vary;
+};
+
+//
+//  coalesced handler execution. Requests that arrive while the first one is handled wait for it and receive
+//  a copy of its response, which is recorded as it is produced
+//
+struct Flight
+{
+    struct Follower
+    {
+        const propeller::http::Request* request;
+        propeller::http::Response* response;
+        sys::ThreadPool::Worker* worker;
+    };
+    
+    Flight( const std::string& _key )
+    : key( _key ), status( 0 ), pending( 0 )
+    {
+    }
+    
+    std::string key;
+    std::list< Follower > followers;
+    
+    unsigned int status;
+    std::vector< std::pair< std::string, std::string > > headers;
+    std::string body;
+    
+    //
+    //  followers that have not received the response yet
+    //
+    unsigned int pending;
+};
+
+//
+//  operation coroutine waits for, its results are passed to coroutine when it is resumed
+//
+struct Operation
+{
+    virtual ~Operation( )
+    {
+    }
+    
+    //
+    //  push results to coroutine stack (called in worker thread), returns number of results
+    //
+    virtual int results( lua_State* lua ) = 0;
+};
+
 struct ThreadState
 {
     ThreadState( lua_State* _lua )
-    : lua( _lua )
+    : lua( _lua ), request( NULL ), response( NULL ), coroutine( NULL ), webSocket( NULL )
+    {
+    }
+    
+    lua_State* lua;
+    ThreadMetrics metrics;
+    
+    //
+    //  request and response being handled (used by body and streaming api)
+    //
+    const propeller::http::Request* request;
+    propeller::http::Response* response;
+    
+    //
+    //  handler coroutine being run
+    //
+    Coroutine* coroutine;
+    
+    //
+    //  socket whose event is being handled (used by websocket api)
+    //
+    propeller::http::WebSocket* webSocket;
+    
+    //
+    //  routes registered by script, router values are indexes of targets
+    //
+    propeller::http::Router router;
+    std::vector< RouteTarget > targets;
+    propeller::http::Router::Params params;
+};
+
+//
+//  request handler running as lua coroutine in worker's lua state. Suspended handler does not occupy the worker,
+//  it is resumed in the same worker when the event it waits for is dispatched by connection thread
+//
+struct Coroutine
+{
+    Coroutine( ThreadState* _state, sys::ThreadPool::Worker& _worker, const propeller::http::Request& _request, propeller::http::Response& _response )
+    : lua( NULL ), reference( LUA_NOREF ), globals( LUA_NOREF ), state( _state ), worker( _worker ), request( _request ), response( _response ), timer( NULL ), operation( NULL ), flight( NULL ), suspended( false )
     {
     }
     
     lua_State* lua;
-    Metrics metrics;
+    
+    //
+    //  registry references to coroutine thread and to request globals saved while coroutine is suspended
+    //
+    int reference;
+    int globals;
+    
+    ThreadState* state;
+    sys::ThreadPool::Worker& worker;
+    const propeller::http::Request& request;
+    propeller::http::Response& response;
+    
+    //
+    //  pending breeze.sleep timer
+    //
+    event* timer;
+    
+    //
+    //  pending operation, deleted once its results are passed to coroutine
+    //
+    Operation* operation;
+    
+    //
+    //  sockets created by handler, closed when it completes
+    //
+    std::list< Cosocket* > sockets;
+    
+    //
+    //  coalesced execution led by this handler, its response is copied to waiting requests
+    //
+    Flight* flight;
+    
+    //
+    //  set by api function that yields, coroutine is resumed when the event it waits for happens
+    //
+    bool suspended;
+};
+
+//
+//  metrics published by the timer thread and read by lua through breezeApi.getMetrics()
+//
+struct MetricsSnapshot
+{
+    MetricsSnapshot( )
+    : averageResponseTime( 0 ), throughput( 0 ), errorRate( 0 ), acceptsPerWakeup( 0 ), poolHitRate( 0 ), localHits( 0 ), steals( 0 ), cacheHits( 0 ), cacheMisses( 0 ), cacheEntries( 0 ), cacheSize( 0 ), compressedResponses( 0 ), compressionSaved( 0 ), compressionTime( 0 ), tlsHandshakes( 0 ), tlsResumed( 0 ), tlsKernel( 0 ), http2Connections( 0 ), http2Streams( 0 ), webSockets( 0 ), webSocketMessages( 0 ), eventStreams( 0 )
+    {
+    }
+    
+    double averageResponseTime;
+    double throughput;
+    double errorRate;
+    double acceptsPerWakeup;
+    double poolHitRate;
+    unsigned int localHits;
+    unsigned int steals;
+    unsigned int cacheHits;
+    unsigned int cacheMisses;
+    unsigned int cacheEntries;
+    double cacheSize;
+    unsigned int compressedResponses;
+    double compressionSaved;
+    double compressionTime;
+    unsigned int tlsHandshakes;
+    unsigned int tlsResumed;
+    unsigned int tlsKernel;
+    unsigned int http2Connections;
+    unsigned int http2Streams;
+    unsigned int webSockets;
+    unsigned int webSocketMessages;
+    unsigned int eventStreams;
 };
 
-class Breeze : public propeller::Server::EventHandler
+class Breeze : public propeller::Server::EventHandler, public propeller::http::WebSocket::Handler
 {
+    friend class Cosocket;
+    
 public:
     
     virtual ~Breeze();
@@ -60,6 +241,46 @@ public:
     {
         m_script = script;
     }
+    
+    void setReusePort( bool reusePort )
+    {
+        m_server.setReusePort( reusePort );
+    }
+    
+    void setAcceptBatchSize( unsigned int acceptBatchSize )
+    {
+        m_server.setAcceptBatchSize( acceptBatchSize );
+    }
+    
+    void setQueueType( sys::ThreadPool::QueueType queueType )
+    {
+        m_server.setQueueType( queueType );
+    }
+    
+    void setConnectionThreads( unsigned int connectionThreads )
+    {
+        m_connectionThreads = connectionThreads;
+    }
+    
+    void setPoolThreads( unsigned int poolThreads )
+    {
+        m_poolThreads = poolThreads;
+    }
+    
+    void setCacheSize( size_t cacheSize )
+    {
+        m_server.cache().setBudget( cacheSize );
+    }
+    
+    void setHttp2( bool enabled )
+    {
+        m_server.setHttp2( enabled );
+    }
+    
+    //
+    //  accept HTTPS on secure port, returns false if certificate or key could not be loaded
+    //
+    bool setTls( unsigned int port, const char* certificate, const char* key );
 
 private:
     Breeze( unsigned int port );
@@ -68,18 +289,142 @@ private:
     virtual void onThreadStarted( sys::ThreadPool::Worker& thread );
     virtual void onTimer( unsigned int interval, void* data );
     
+    //
+    //  websocket events are passed to lua in the worker that accepted the socket
+    //
+    virtual void onOpen( propeller::http::WebSocket& socket );
+    virtual void onMessage( propeller::http::WebSocket& socket, std::string& message, bool binary );
+    virtual void onClose( propeller::http::WebSocket& socket );
+    
     bool loadScript( lua_State* lua );
     void loadLibraries( lua_State* lua );
+    void collect( ThreadState* state, const propeller::http::Request& request, const propeller::http::Response& response );
+    void cache( lua_State* lua, const propeller::http::Request& request, propeller::http::Response& response );
+    static void headerNames( lua_State* lua, int index, std::vector< std::string >& names );
+    static void coalesceOption( lua_State* lua, int index, RouteTarget& target );
     
-    void setConnectionThreads( unsigned int connectionThreads )
+    //
+    //  request coalescing
+    //
+    bool coalesce( const RouteTarget& target, const propeller::http::Request& request, propeller::http::Response& response, sys::ThreadPool::Worker& worker, Flight*& flight );
+    void land( Flight* flight, ThreadState* state );
+    void respond( Flight* flight, const Flight::Follower& follower, ThreadState* state );
+    
+    //
+    //  streaming api exported to lua
+    //
+    static ThreadState* threadState( lua_State* lua, bool request = true );
+    static int writeHead( lua_State* lua );
+    static int write( lua_State* lua );
+    static int flush( lua_State* lua );
+    static int body( lua_State* lua );
+    static int readBody( lua_State* lua );
+    static int getMetrics( lua_State* lua );
+    static int sleep( lua_State* lua );
+    static int httpRequest( lua_State* lua );
+    static int addHandler( lua_State* lua );
+    static int addRoute( lua_State* lua );
+    static int addStaticPath( lua_State* lua );
+    
+    //
+    //  websocket api exported to lua
+    //
+    static propeller::http::WebSocket* webSocket( lua_State* lua );
+    static int upgrade( lua_State* lua );
+    static int webSocketSend( lua_State* lua );
+    static int webSocketSubscribe( lua_State* lua );
+    static int webSocketUnsubscribe( lua_State* lua );
+    static int webSocketClose( lua_State* lua );
+    static int broadcast( lua_State* lua );
+    static int eventStream( lua_State* lua );
+    static int publishEvent( lua_State* lua );
+    
+    //
+    //  coroutine scheduling
+    //
+    void resume( Coroutine* coroutine, int arguments = 0 );
+    void complete( Coroutine* coroutine, int result );
+    void wakeup( Coroutine* coroutine );
+    static void onWakeupStatic( evutil_socket_t fd, short what, void* arg );
+    
+    //
+    //  resumes suspended coroutine in its worker
+    //
+    struct Resume : public propeller::Server::Job
     {
-        m_connectionThreads = connectionThreads;
-    }
+        Resume( Coroutine* _coroutine )
+        : coroutine( _coroutine )
+        {
+        }
+        
+        virtual void run( sys::ThreadPool::Worker& worker );
+        
+        Coroutine* coroutine;
+    };
     
-    void setPoolThreads( unsigned int poolThreads )
+    //
+    //  passes response of coalesced execution to waiting request in its worker
+    //
+    struct Deliver : public propeller::Server::Job
     {
-        m_poolThreads = poolThreads;
-    }
+        Deliver( Flight* _flight, const Flight::Follower& _follower )
+        : flight( _flight ), follower( _follower )
+        {
+        }
+        
+        virtual void run( sys::ThreadPool::Worker& worker );
+        
+        Flight* flight;
+        Flight::Follower follower;
+    };
+    
+    //
+    //  websocket event, socket is referenced till lua has handled it
+    //
+    struct SocketEvent : public propeller::Server::Job
+    {
+        SocketEvent( propeller::http::WebSocket& _socket, const char* _event )
+        : socket( _socket ), event( _event ), binary( false )
+        {
+        }
+        
+        virtual void run( sys::ThreadPool::Worker& worker );
+        
+        propeller::http::WebSocket& socket;
+        const char* event;
+        std::string message;
+        bool binary;
+    };
+    
+    void dispatch( SocketEvent* event );
+    
+    //
+    //  outbound http request, sent by http client of connection thread the coroutine belongs to
+    //
+    struct HttpCall : public propeller::http::Client::Request, public libevent::Mailbox::Message, public Operation
+    {
+        HttpCall( Coroutine* _coroutine )
+        : coroutine( _coroutine )
+        {
+        }
+        
+        virtual void deliver( );
+        virtual void onComplete( );
+        virtual int results( lua_State* lua );
+        
+        Coroutine* coroutine;
+        
+        //
+        //  http client of the connection thread, created on first use
+        //
+        static THREAD_LOCAL propeller::http::Client* s_client;
+    };
+    
+    //
+    //  publish and read metrics snapshot (seqlock, single writer)
+    //
+    void publish( const MetricsSnapshot& snapshot );
+    void snapshot( MetricsSnapshot& snapshot ) const;
     
     
 private:
@@ -89,9 +434,73 @@ private:
     bool m_development;
     std::string m_environment;
     Metrics m_metrics;
+    double m_acceptsPerWakeup;
+    
+    //
+    //  allocator counters at previous collection and hit rate since then
+    //
+    unsigned int m_poolHits;
+    unsigned int m_poolMisses;
+    double m_poolHitRate;
+    
+    //
+    //  scheduler counters at previous collection and number of tasks taken locally and stolen since then
+    //
+    unsigned int m_localHitsTotal;
+    unsigned int m_stealsTotal;
+    unsigned int m_localHits;
+    unsigned int m_steals;
+    
+    //
+    //  response cache counters at previous collection
+    //
+    unsigned int m_cacheHitsTotal;
+    unsigned int m_cacheMissesTotal;
+    unsigned int m_compressedTotal;
+    unsigned int m_compressionInputTotal;
+    unsigned int m_compressionOutputTotal;
+    unsigned int m_compressionTimeTotal;
+    
+    //
+    //  TLS counters at previous collection
+    //
+    unsigned int m_tlsHandshakesTotal;
+    unsigned int m_tlsResumedTotal;
+    unsigned int m_tlsKernelTotal;
+    
+    //
+    //  HTTP/2 counters at previous collection
+    //
+    unsigned int m_http2ConnectionsTotal;
+    unsigned int m_http2StreamsTotal;
+    
+    //
+    //  WebSocket counters at previous collection
+    //
+    unsigned int m_webSocketsTotal;
+    unsigned int m_webSocketMessagesTotal;
+    
+    //
+    //  event streams opened till previous collection
+    //
+    unsigned int m_eventStreamsTotal;
+    
+    //
+    //  latest published metrics, sequence is odd while snapshot is being written
+    //
+    MetricsSnapshot m_snapshot;
+    volatile unsigned int m_snapshotSequence;
     unsigned int m_dataCollectTimeout;
     std::list< std::string > m_paths;
+    propeller::Tls m_tls;
     propeller::http::Server m_server;
+    
+    //
+    //  coalesced executions in progress by request key
+    //
+    std::map< std::string, Flight* > m_flights;
+    sys::Lock m_flightsLock;
+    
     unsigned int m_connectionThreads;
     unsigned int m_poolThreads;
     
@@ -0,0 +1,800 @@
+/*
+ * File:   Cosocket.cpp
+ *
+ * Non-blocking TCP and unix sockets for lua request handlers
+ */
+
+#include "Cosocket.h"
+#include "trace.h"
+
+#include <event2/buffer.h>
+#include <event2/dns.h>
+#include <event2/util.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string.h>
+#include <stdlib.h>
+
+THREAD_LOCAL Cosocket::Pool* Cosocket::Pool::s_pool = NULL;
+
+static const char* metatable = "breeze.socket";
+
+static void setTimeouts( bufferevent* bev, unsigned int timeout )
+{
+    if ( !timeout )
+    {
+        bufferevent_set_timeouts( bev, NULL, NULL );
+        return;
+    }
+
+    timeval value;
+    value.tv_sec = timeout / 1000;
+    value.tv_usec = ( timeout % 1000 ) * 1000;
+
+    bufferevent_set_timeouts( bev, &value, &value );
+}
+
+Cosocket::Cosocket( Coroutine* owner )
+: m_bev( NULL ), m_thread( &owner->request.connection().thread() ), m_owner( owner ), m_timeout( DefaultTimeout ), m_reused( 0 )
+{
+}
+
+Cosocket::Pool::Pool( event_base* base )
+{
+    dns = evdns_base_new( base, 1 );
+
+    if ( !dns )
+    {
+        dns = evdns_base_new( base, 0 );
+    }
+}
+
+void Cosocket::disconnect( )
+{
+    if ( m_bev )
+    {
+        //
+        //  bufferevent belongs to connection thread
+        //
+        m_thread->post( new Close( m_bev ) );
+        m_bev = NULL;
+    }
+}
+
+void Cosocket::release( Coroutine* coroutine )
+{
+    for ( std::list< Cosocket* >::iterator i = coroutine->sockets.begin(); i != coroutine->sockets.end(); i++ )
+    {
+        ( *i )->disconnect();
+        ( *i )->m_owner = NULL;
+    }
+
+    coroutine->sockets.clear();
+}
+
+void Cosocket::Close::deliver( )
+{
+    bufferevent_free( bev );
+    delete this;
+}
+
+void Cosocket::Call::deliver( )
+{
+    if ( !Pool::s_pool )
+    {
+        Pool::s_pool = new Pool( socket->m_thread->base() );
+    }
+
+    switch ( type )
+    {
+        case Connect:
+            connect();
+            break;
+
+        case Send:
+            bufferevent_setcb( socket->m_bev, NULL, onWriteStatic, onEventStatic, this );
+            setTimeouts( socket->m_bev, socket->m_timeout );
+            bufferevent_write( socket->m_bev, data.data(), data.size() );
+            bufferevent_enable( socket->m_bev, EV_WRITE );
+            break;
+
+        case KeepAlive:
+            keepAlive();
+            break;
+
+        default:
+            receive();
+            break;
+    }
+}
+
+void Cosocket::Call::connect( )
+{
+    if ( socket->m_bev )
+    {
+        bufferevent_free( socket->m_bev );
+        socket->m_bev = NULL;
+    }
+
+    char key[ 512 ];
+    snprintf( key, sizeof( key ), port ? "%s:%d" : "unix:%s", host.c_str(), port );
+    socket->m_key = key;
+
+    //
+    //  reuse idle connection
+    //
+    std::list< Idle* >& idle = Pool::s_pool->idle[ socket->m_key ];
+
+    if ( !idle.empty() )
+    {
+        Idle* connection = idle.back();
+        idle.pop_back();
+
+        socket->m_bev = connection->bev;
+        socket->m_reused = connection->reused + 1;
+        delete connection;
+
+        complete( true );
+        return;
+    }
+
+    //
+    //  callbacks are deferred, so failures reported by connect itself are not delivered before it returns
+    //
+    bufferevent* bev = bufferevent_socket_new( socket->m_thread->base(), -1, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS );
+    socket->m_bev = bev;
+    socket->m_reused = 0;
+
+    bufferevent_setcb( bev, NULL, NULL, onEventStatic, this );
+    setTimeouts( bev, socket->m_timeout );
+
+    int result = -1;
+
+    if ( port )
+    {
+        result = bufferevent_socket_connect_hostname( bev, Pool::s_pool->dns, AF_UNSPEC, host.c_str(), port );
+    }
+    else
+    {
+        sockaddr_un address;
+        memset( &address, 0, sizeof( address ) );
+        address.sun_family = AF_UNIX;
+
+        if ( host.size() < sizeof( address.sun_path ) )
+        {
+            memcpy( address.sun_path, host.c_str(), host.size() );
+            result = bufferevent_socket_connect( bev, ( sockaddr* ) &address, sizeof( address ) );
+        }
+    }
+
+    if ( result < 0 )
+    {
+        bufferevent_setcb( bev, NULL, NULL, NULL, NULL );
+        bufferevent_free( bev );
+        socket->m_bev = NULL;
+
+        complete( false, "failed to connect" );
+    }
+}
+
+void Cosocket::Call::receive( )
+{
+    evbuffer* input = bufferevent_get_input( socket->m_bev );
+
+    switch ( type )
+    {
+        case ReceiveSize:
+            if ( evbuffer_get_length( input ) >= size )
+            {
+                result.resize( size );
+                evbuffer_remove( input, &result[ 0 ], size );
+                complete( true );
+                return;
+            }
+            break;
+
+        case ReceiveLine:
+        {
+            size_t length = 0;
+            char* line = evbuffer_readln( input, &length, EVBUFFER_EOL_CRLF );
+
+            if ( line )
+            {
+                result.assign( line, length );
+                free( line );
+                complete( true );
+                return;
+            }
+            break;
+        }
+
+        case ReceiveUntil:
+        {
+            evbuffer_ptr position = evbuffer_search( input, data.data(), data.size(), NULL );
+
+            if ( position.pos != -1 )
+            {
+                result.resize( position.pos );
+
+                if ( position.pos )
+                {
+                    evbuffer_remove( input, &result[ 0 ], position.pos );
+                }
+
+                evbuffer_drain( input, data.size() );
+                complete( true );
+                return;
+            }
+            break;
+        }
+
+        default:
+            //
+            //  whole stream is returned when connection is closed
+            //
+            break;
+    }
+
+    //
+    //  wait for more data
+    //
+    bufferevent_setcb( socket->m_bev, onReadStatic, NULL, onEventStatic, this );
+    setTimeouts( socket->m_bev, socket->m_timeout );
+    bufferevent_enable( socket->m_bev, EV_READ );
+}
+
+void Cosocket::Call::keepAlive( )
+{
+    bufferevent* bev = socket->m_bev;
+    socket->m_bev = NULL;
+
+    if ( evbuffer_get_length( bufferevent_get_input( bev ) ) || evbuffer_get_length( bufferevent_get_output( bev ) ) )
+    {
+        //
+        //  response was not read completely or request was not sent, connection can not be reused
+        //
+        bufferevent_free( bev );
+        complete( false, "unread data in buffer" );
+        return;
+    }
+
+    std::list< Idle* >& idle = Pool::s_pool->idle[ socket->m_key ];
+
+    if ( idle.size() >= size )
+    {
+        Idle* oldest = idle.front();
+        idle.pop_front();
+
+        bufferevent_free( oldest->bev );
+        delete oldest;
+    }
+
+    if ( !size )
+    {
+        bufferevent_free( bev );
+        complete( true );
+        return;
+    }
+
+    Idle* connection = new Idle;
+    connection->bev = bev;
+    connection->key = socket->m_key;
+    connection->reused = socket->m_reused;
+    idle.push_back( connection );
+
+    //
+    //  idle connection is closed if server closes it, sends unexpected data or timeout elapses
+    //
+    bufferevent_setcb( bev, Idle::onReadStatic, NULL, Idle::onEventStatic, connection );
+
+    if ( timeout )
+    {
+        timeval value;
+        value.tv_sec = timeout / 1000;
+        value.tv_usec = ( timeout % 1000 ) * 1000;
+        bufferevent_set_timeouts( bev, &value, NULL );
+    }
+    else
+    {
+        bufferevent_set_timeouts( bev, NULL, NULL );
+    }
+
+    bufferevent_enable( bev, EV_READ );
+
+    complete( true );
+}
+
+void Cosocket::Call::complete( bool success, const char* message )
+{
+    if ( socket->m_bev )
+    {
+        bufferevent_disable( socket->m_bev, EV_READ );
+        bufferevent_setcb( socket->m_bev, NULL, NULL, NULL, NULL );
+    }
+
+    ok = success;
+
+    if ( message )
+    {
+        error = message;
+    }
+
+    //
+    //  results are passed to coroutine when it is resumed in its worker
+    //
+    coroutine->operation = this;
+    Breeze::instance()->wakeup( coroutine );
+}
+
+void Cosocket::Call::fail( short what )
+{
+    bufferevent* bev = socket->m_bev;
+    evbuffer* input = bufferevent_get_input( bev );
+    bool receiving = type >= ReceiveSize && type <= ReceiveUntil;
+
+    if ( receiving )
+    {
+        //
+        //  return received data as partial result (or as result if reading until connection is closed)
+        //
+        size_t length = evbuffer_get_length( input );
+        result.resize( length );
+
+        if ( length )
+        {
+            evbuffer_remove( input, &result[ 0 ], length );
+        }
+    }
+
+    if ( ( what & BEV_EVENT_TIMEOUT ) && receiving )
+    {
+        //
+        //  connection stays open after receive timeout
+        //
+        complete( false, "timeout" );
+        return;
+    }
+
+    const char* message = "closed";
+
+    if ( what & BEV_EVENT_TIMEOUT )
+    {
+        message = "timeout";
+    }
+    else if ( what & BEV_EVENT_ERROR )
+    {
+        int dnsError = bufferevent_socket_get_dns_error( bev );
+        message = dnsError ? evutil_gai_strerror( dnsError ) : evutil_socket_error_to_string( EVUTIL_SOCKET_ERROR() );
+    }
+
+    error = message;
+
+    bufferevent_setcb( bev, NULL, NULL, NULL, NULL );
+    bufferevent_free( bev );
+    socket->m_bev = NULL;
+
+    complete( type == ReceiveAll && ( what & BEV_EVENT_EOF ) );
+}
+
+void Cosocket::Call::onReadStatic( bufferevent* bev, void* arg )
+{
+    ( ( Call* ) arg )->receive();
+}
+
+void Cosocket::Call::onWriteStatic( bufferevent* bev, void* arg )
+{
+    //
+    //  called when output buffer is flushed
+    //
+    ( ( Call* ) arg )->complete( true );
+}
+
+void Cosocket::Call::onEventStatic( bufferevent* bev, short what, void* arg )
+{
+    Call* call = ( Call* ) arg;
+
+    if ( what & BEV_EVENT_CONNECTED )
+    {
+        call->complete( true );
+        return;
+    }
+
+    call->fail( what );
+}
+
+int Cosocket::Call::results( lua_State* lua )
+{
+    switch ( type )
+    {
+        case Connect:
+        case KeepAlive:
+            if ( ok )
+            {
+                lua_pushinteger( lua, 1 );
+                return 1;
+            }
+
+            lua_pushnil( lua );
+            lua_pushstring( lua, error.c_str() );
+            return 2;
+
+        case Send:
+            if ( ok )
+            {
+                lua_pushinteger( lua, data.size() );
+                return 1;
+            }
+
+            lua_pushnil( lua );
+            lua_pushstring( lua, error.c_str() );
+            return 2;
+
+        default:
+            if ( ok )
+            {
+                lua_pushlstring( lua, result.data(), result.size() );
+                return 1;
+            }
+
+            lua_pushnil( lua );
+            lua_pushstring( lua, error.c_str() );
+            lua_pushlstring( lua, result.data(), result.size() );
+            return 3;
+    }
+}
+
+void Cosocket::Idle::onReadStatic( bufferevent* bev, void* arg )
+{
+    ( ( Idle* ) arg )->remove();
+}
+
+void Cosocket::Idle::onEventStatic( bufferevent* bev, short what, void* arg )
+{
+    ( ( Idle* ) arg )->remove();
+}
+
+void Cosocket::Idle::remove( )
+{
+    Pool::s_pool->idle[ key ].remove( this );
+    bufferevent_free( bev );
+    delete this;
+}
+
+void Cosocket::registerApi( lua_State* lua )
+{
+    if ( luaL_newmetatable( lua, metatable ) )
+    {
+        lua_newtable( lua );
+
+        lua_pushcfunction( lua, connect );
+        lua_setfield( lua, -2, "connect" );
+        lua_pushcfunction( lua, send );
+        lua_setfield( lua, -2, "send" );
+        lua_pushcfunction( lua, receive );
+        lua_setfield( lua, -2, "receive" );
+        lua_pushcfunction( lua, receiveUntil );
+        lua_setfield( lua, -2, "receiveuntil" );
+        lua_pushcfunction( lua, setTimeout );
+        lua_setfield( lua, -2, "settimeout" );
+        lua_pushcfunction( lua, setKeepAlive );
+        lua_setfield( lua, -2, "setkeepalive" );
+        lua_pushcfunction( lua, getReusedTimes );
+        lua_setfield( lua, -2, "getreusedtimes" );
+        lua_pushcfunction( lua, close );
+        lua_setfield( lua, -2, "close" );
+
+        lua_setfield( lua, -2, "__index" );
+
+        lua_pushcfunction( lua, collect );
+        lua_setfield( lua, -2, "__gc" );
+    }
+
+    lua_pop( lua, 1 );
+
+    //
+    //  api table is on top of the stack
+    //
+    lua_pushcfunction( lua, create );
+    lua_setfield( lua, -2, "socketTcp" );
+}
+
+Cosocket* Cosocket::check( lua_State* lua, int index )
+{
+    Cosocket* socket = *( Cosocket** ) luaL_checkudata( lua, index, metatable );
+    ThreadState* state = Breeze::threadState( lua );
+
+    if ( !socket->m_owner )
+    {
+        return socket;
+    }
+
+    if ( state->coroutine != socket->m_owner || state->coroutine->lua != lua )
+    {
+        luaL_error( lua, "socket can only be used by request handler that created it" );
+    }
+
+    return socket;
+}
+
+int Cosocket::start( lua_State* lua, Call* call )
+{
+    call->coroutine->suspended = true;
+    call->socket->m_thread->post( call );
+
+    return lua_yield( lua, 0 );
+}
+
+int Cosocket::create( lua_State* lua )
+{
+    ThreadState* state = Breeze::threadState( lua );
+
+    if ( !state->coroutine || state->coroutine->lua != lua )
+    {
+        return luaL_error( lua, "socket can only be created by request handler" );
+    }
+
+    Cosocket** socket = ( Cosocket** ) lua_newuserdata( lua, sizeof( Cosocket* ) );
+    *socket = new Cosocket( state->coroutine );
+    state->coroutine->sockets.push_back( *socket );
+
+    luaL_setmetatable( lua, metatable );
+
+    return 1;
+}
+
+int Cosocket::connect( lua_State* lua )
+{
+    //
+    //  sock:connect( host, port ) or sock:connect( "unix:/path/to/socket" )
+    //
+    Cosocket* socket = check( lua, 1 );
+    std::string host = luaL_checkstring( lua, 2 );
+    int port = 0;
+
+    if ( host.compare( 0, 5, "unix:" ) == 0 )
+    {
+        host.erase( 0, 5 );
+    }
+    else
+    {
+        port = luaL_checkinteger( lua, 3 );
+    }
+
+    if ( !socket->m_owner )
+    {
+        lua_pushnil( lua );
+        lua_pushstring( lua, "request is completed" );
+        return 2;
+    }
+
+    Call* call = new Call( socket, Call::Connect );
+    call->host = host;
+    call->port = port;
+
+    return start( lua, call );
+}
+
+int Cosocket::send( lua_State* lua )
+{
+    //
+    //  sock:send( data ), data is string or array of strings
+    //
+    Cosocket* socket = check( lua, 1 );
+
+    if ( !socket->m_bev )
+    {
+        lua_pushnil( lua );
+        lua_pushstring( lua, "closed" );
+        return 2;
+    }
+
+    Call* call = new Call( socket, Call::Send );
+
+    if ( lua_istable( lua, 2 ) )
+    {
+        for ( int i = 1; ; i++ )
+        {
+            lua_rawgeti( lua, 2, i );
+
+            if ( lua_isnil( lua, -1 ) )
+            {
+                lua_pop( lua, 1 );
+                break;
+            }
+
+            size_t length = 0;
+            const char* part = lua_tolstring( lua, -1, &length );
+
+            if ( part )
+            {
+                call->data.append( part, length );
+            }
+
+            lua_pop( lua, 1 );
+        }
+    }
+    else
+    {
+        size_t length = 0;
+        const char* data = luaL_checklstring( lua, 2, &length );
+        call->data.assign( data, length );
+    }
+
+    if ( call->data.empty() )
+    {
+        delete call;
+        lua_pushinteger( lua, 0 );
+        return 1;
+    }
+
+    return start( lua, call );
+}
+
+int Cosocket::receive( lua_State* lua )
+{
+    //
+    //  sock:receive( size ), sock:receive( "*l" ) (line, default) or sock:receive( "*a" ) (until connection is closed)
+    //
+    Cosocket* socket = check( lua, 1 );
+
+    if ( !socket->m_bev )
+    {
+        lua_pushnil( lua );
+        lua_pushstring( lua, "closed" );
+        lua_pushstring( lua, "" );
+        return 3;
+    }
+
+    Call::Type type = Call::ReceiveLine;
+    size_t size = 0;
+
+    if ( lua_type( lua, 2 ) == LUA_TNUMBER )
+    {
+        type = Call::ReceiveSize;
+        size = lua_tounsigned( lua, 2 );
+
+        if ( !size )
+        {
+            lua_pushstring( lua, "" );
+            return 1;
+        }
+    }
+    else if ( !lua_isnoneornil( lua, 2 ) )
+    {
+        const char* pattern = luaL_checkstring( lua, 2 );
+
+        if ( !strcmp( pattern, "*a" ) )
+        {
+            type = Call::ReceiveAll;
+        }
+        else if ( strcmp( pattern, "*l" ) )
+        {
+            return luaL_argerror( lua, 2, "size, \"*l\" or \"*a\" expected" );
+        }
+    }
+
+    Call* call = new Call( socket, type );
+    call->size = size;
+
+    return start( lua, call );
+}
+
+int Cosocket::receiveUntil( lua_State* lua )
+{
+    //
+    //  sock:receiveuntil( pattern ) returns iterator that reads data until pattern (pattern is consumed)
+    //
+    check( lua, 1 );
+    size_t length = 0;
+    luaL_checklstring( lua, 2, &length );
+
+    if ( !length )
+    {
+        return luaL_argerror( lua, 2, "pattern is empty" );
+    }
+
+    lua_pushvalue( lua, 1 );
+    lua_pushvalue( lua, 2 );
+    lua_pushcclosure( lua, readUntil, 2 );
+
+    return 1;
+}
+
+int Cosocket::readUntil( lua_State* lua )
+{
+    Cosocket* socket = check( lua, lua_upvalueindex( 1 ) );
+
+    if ( !socket->m_bev )
+    {
+        lua_pushnil( lua );
+        lua_pushstring( lua, "closed" );
+        lua_pushstring( lua, "" );
+        return 3;
+    }
+
+    size_t length = 0;
+    const char* pattern = lua_tolstring( lua, lua_upvalueindex( 2 ), &length );
+
+    Call* call = new Call( socket, Call::ReceiveUntil );
+    call->data.assign( pattern, length );
+
+    return start( lua, call );
+}
+
+int Cosocket::setTimeout( lua_State* lua )
+{
+    //
+    //  sock:settimeout( milliseconds ), 0 disables timeout
+    //
+    Cosocket* socket = check( lua, 1 );
+    socket->m_timeout = luaL_checkunsigned( lua, 2 );
+
+    return 0;
+}
+
+int Cosocket::setKeepAlive( lua_State* lua )
+{
+    //
+    //  sock:setkeepalive( idle timeout in milliseconds, pool size ) puts connection to pool of connection thread
+    //
+    Cosocket* socket = check( lua, 1 );
+
+    if ( !socket->m_bev )
+    {
+        lua_pushnil( lua );
+        lua_pushstring( lua, "closed" );
+        return 2;
+    }
+
+    Call* call = new Call( socket, Call::KeepAlive );
+    call->timeout = luaL_optunsigned( lua, 2, DefaultKeepAliveTimeout );
+    call->size = luaL_optunsigned( lua, 3, DefaultPoolSize );
+
+    return start( lua, call );
+}
+
+int Cosocket::getReusedTimes( lua_State* lua )
+{
+    Cosocket* socket = check( lua, 1 );
+    lua_pushunsigned( lua, socket->m_reused );
+
+    return 1;
+}
+
+int Cosocket::close( lua_State* lua )
+{
+    Cosocket* socket = check( lua, 1 );
+
+    if ( !socket->m_bev )
+    {
+        lua_pushnil( lua );
+        lua_pushstring( lua, "closed" );
+        return 2;
+    }
+
+    socket->disconnect();
+    lua_pushinteger( lua, 1 );
+
+    return 1;
+}
+
+int Cosocket::collect( lua_State* lua )
+{
+    Cosocket** pointer = ( Cosocket** ) lua_touserdata( lua, 1 );
+    Cosocket* socket = *pointer;
+
+    if ( socket )
+    {
+        socket->disconnect();
+
+        if ( socket->m_owner )
+        {
+            socket->m_owner->sockets.remove( socket );
+        }
+
+        delete socket;
+        *pointer = NULL;
+    }
+
+    return 0;
+}
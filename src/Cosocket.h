@@ -0,0 +1,177 @@
+/*
+ * File:   Cosocket.h
+ *
+ * Non-blocking TCP and unix sockets for lua request handlers
+ */
+
+#ifndef COSOCKET_H
+#define	COSOCKET_H
+
+#include "common.h"
+#include "Breeze.h"
+
+#include <event2/bufferevent.h>
+
+struct evdns_base;
+
+//
+//  socket object exported to lua as breeze.socket.tcp(). Socket belongs to request handler coroutine that created it,
+//  all I/O is done by connection thread of the request, handler is suspended until operation completes.
+//  Connections returned with setkeepalive() are pooled per connection thread by host and port (or unix socket path)
+//
+class Cosocket
+{
+public:
+    enum
+    {
+        DefaultTimeout = 60000,
+        DefaultKeepAliveTimeout = 60000,
+        DefaultPoolSize = 30
+    };
+
+    //
+    //  register socket api in lua state
+    //
+    static void registerApi( lua_State* lua );
+
+    //
+    //  close sockets left open by completed coroutine
+    //
+    static void release( Coroutine* coroutine );
+
+private:
+    Cosocket( Coroutine* owner );
+
+    //
+    //  operation done in connection thread
+    //
+    struct Call : public libevent::Mailbox::Message, public Operation
+    {
+        enum Type
+        {
+            Connect,
+            Send,
+            ReceiveSize,
+            ReceiveLine,
+            ReceiveAll,
+            ReceiveUntil,
+            KeepAlive
+        };
+
+        Call( Cosocket* _socket, Type _type )
+        : socket( _socket ), coroutine( _socket->m_owner ), type( _type ), port( 0 ), size( 0 ), timeout( 0 ), ok( false )
+        {
+        }
+
+        virtual void deliver( );
+        virtual int results( lua_State* lua );
+
+        void connect( );
+        void receive( );
+        void keepAlive( );
+        void complete( bool success, const char* error = NULL );
+        void fail( short what );
+
+        static void onReadStatic( bufferevent* bev, void* arg );
+        static void onWriteStatic( bufferevent* bev, void* arg );
+        static void onEventStatic( bufferevent* bev, short what, void* arg );
+
+        Cosocket* socket;
+        Coroutine* coroutine;
+        Type type;
+
+        //
+        //  arguments: host or unix socket path and port, data to send or pattern to receive until, size to receive
+        //  or pool size and keep alive timeout
+        //
+        std::string host;
+        int port;
+        std::string data;
+        size_t size;
+        unsigned int timeout;
+
+        //
+        //  results
+        //
+        bool ok;
+        std::string result;
+        std::string error;
+    };
+
+    //
+    //  close connection (in connection thread)
+    //
+    struct Close : public libevent::Mailbox::Message
+    {
+        Close( bufferevent* _bev )
+        : bev( _bev )
+        {
+        }
+
+        virtual void deliver( );
+
+        bufferevent* bev;
+    };
+
+    //
+    //  idle connection kept in pool of connection thread
+    //
+    struct Idle
+    {
+        bufferevent* bev;
+        std::string key;
+        unsigned int reused;
+
+        static void onReadStatic( bufferevent* bev, void* arg );
+        static void onEventStatic( bufferevent* bev, short what, void* arg );
+        void remove( );
+    };
+
+    struct Pool
+    {
+        Pool( event_base* base );
+
+        evdns_base* dns;
+        std::map< std::string, std::list< Idle* > > idle;
+
+        static THREAD_LOCAL Pool* s_pool;
+    };
+
+    void disconnect( );
+
+    static Cosocket* check( lua_State* lua, int index );
+    static int start( lua_State* lua, Call* call );
+
+    //
+    //  lua methods
+    //
+    static int create( lua_State* lua );
+    static int connect( lua_State* lua );
+    static int send( lua_State* lua );
+    static int receive( lua_State* lua );
+    static int receiveUntil( lua_State* lua );
+    static int readUntil( lua_State* lua );
+    static int setTimeout( lua_State* lua );
+    static int setKeepAlive( lua_State* lua );
+    static int getReusedTimes( lua_State* lua );
+    static int close( lua_State* lua );
+    static int collect( lua_State* lua );
+
+private:
+    //
+    //  connection, accessed by connection thread while operation is in progress and by worker otherwise
+    //
+    bufferevent* m_bev;
+    propeller::Server::ConnectionThread* m_thread;
+    Coroutine* m_owner;
+
+    unsigned int m_timeout;
+    unsigned int m_reused;
+
+    //
+    //  pool key, host and port or unix socket path
+    //
+    std::string m_key;
+};
+
+#endif	/* COSOCKET_H */
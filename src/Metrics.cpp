@@ -29,15 +29,20 @@ void Metrics::reset()
 }
 
 void Metrics::add( const Metrics& metrics, unsigned int time )
+{
+    add( metrics.responseTime(), metrics.requestCount(), metrics.errorCount(), time );
+}
+
+void Metrics::add( unsigned int responseTime, unsigned int requestCount, unsigned int errorCount, unsigned int time )
 {
     if ( time )
     {
         m_time += time;
     }
     
-    m_responseTime += metrics.responseTime();
-    m_requestCount += metrics.requestCount();
-    m_errorCount += metrics.errorCount();
+    m_responseTime += responseTime;
+    m_requestCount += requestCount;
+    m_errorCount += errorCount;
     
     if ( m_time > STATS_REFRESH_TIMEOUT )
     {
@@ -68,4 +73,39 @@ void Metrics::collect( unsigned int responseTime, bool error, const char* url )
     {
         m_errorCount += 1;
     }
-}
\ No newline at end of file
+}
+
+ThreadMetrics::ThreadMetrics( )
+: m_responseTime( 0 ), m_requestCount( 0 ), m_errorCount( 0 ), m_collectedResponseTime( 0 ), m_collectedRequestCount( 0 ), m_collectedErrorCount( 0 )
+{
+}
+
+void ThreadMetrics::collect( unsigned int responseTime, bool error )
+{
+    //
+    //  single writer, request count is published last so collector does not count request without its response time
+    //
+    m_responseTime = m_responseTime + responseTime;
+    
+    if ( error )
+    {
+        m_errorCount = m_errorCount + 1;
+    }
+    
+    sys::General::memoryBarrier( );
+    m_requestCount = m_requestCount + 1;
+}
+
+void ThreadMetrics::addTo( Metrics& metrics, unsigned int time )
+{
+    unsigned int requestCount = m_requestCount;
+    sys::General::memoryBarrier( );
+    unsigned int responseTime = m_responseTime;
+    unsigned int errorCount = m_errorCount;
+    
+    metrics.add( responseTime - m_collectedResponseTime, requestCount - m_collectedRequestCount, errorCount - m_collectedErrorCount, time );
+    
+    m_collectedResponseTime = responseTime;
+    m_collectedRequestCount = requestCount;
+    m_collectedErrorCount = errorCount;
+}
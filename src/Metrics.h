@@ -9,6 +9,7 @@
 #define	METRICS_H
 
 #include "common.h"
+#include <propeller/system.h>
 
 class Metrics
 {
@@ -18,6 +19,7 @@ public:
     virtual ~Metrics( );
     void reset();
     void add( const Metrics& metrics, unsigned int time = 0 );
+    void add( unsigned int responseTime, unsigned int requestCount, unsigned int errorCount, unsigned int time = 0 );
     
     unsigned int responseTime() const
     {
@@ -67,5 +69,45 @@ private:
     unsigned int m_time;
 };
 
+/**
+ * Metrics of one thread. Counters only grow, they are written by the owning thread and read by the collecting thread without locking
+ */
+class ThreadMetrics
+{
+public:
+    ThreadMetrics();
+    
+    void collect( unsigned int responseTime, bool error );
+    
+    /**
+     * Add changes since previous call to total metrics (called by collecting thread only)
+     * @param metrics total metrics
+     * @param time collection interval (in seconds)
+     */
+    void addTo( Metrics& metrics, unsigned int time = 0 );
+    
+private:
+    enum
+    {
+        CacheLine = 64
+    };
+    
+    //
+    //  counters are kept on their own cache line, so writes of different threads do not collide
+    //
+    char m_padding0[ CacheLine ];
+    volatile unsigned int m_responseTime;
+    volatile unsigned int m_requestCount;
+    volatile unsigned int m_errorCount;
+    char m_padding1[ CacheLine ];
+    
+    //
+    //  values seen by collecting thread
+    //
+    unsigned int m_collectedResponseTime;
+    unsigned int m_collectedRequestCount;
+    unsigned int m_collectedErrorCount;
+};
+
 #endif	/* METRICS_H */
 
@@ -160,7 +160,19 @@ int main( int argc, char** argv )
     options.push_back( CmdOption( "-h", "--help", "\t\tprints help", "help" ) );
     options.push_back( CmdOption( "-v", "--version", "\t\tprints version", "version" ) );
     options.push_back( CmdOption( "", "--connectionThreads", "\tconnection threads", "connectionThreads", true ) );
-    options.push_back( CmdOption( "", "--poolThreads", "\tpool threads", "poolThreads", true ) );
+    options.push_back( CmdOption( "", "--poolThreads", "\tpool threads (0 to run handlers in connection threads)", "poolThreads", true ) );
+    options.push_back( CmdOption( "", "--acceptBatch", "\tmaximum connections accepted per listener wakeup", "acceptBatch", true ) );
+    options.push_back( CmdOption( "", "--reusePort", "\tlisten on SO_REUSEPORT socket in each connection thread", "reusePort" ) );
+    options.push_back( CmdOption( "", "--bodySpill", "\trequest bodies larger than this many bytes are stored in temporary files", "bodySpill", true ) );
+    options.push_back( CmdOption( "", "--bodyMax", "\trequests with bodies larger than this many bytes are rejected with 413", "bodyMax", true ) );
+    options.push_back( CmdOption( "", "--cacheSize", "\tresponse cache size in megabytes (0 to disable)", "cacheSize", true ) );
+    options.push_back( CmdOption( "", "--compression", "\tresponse compression level 1-9 (0 to disable)", "compression", true ) );
+    options.push_back( CmdOption( "", "--compressMin", "\tresponse bodies shorter than this many bytes are not compressed", "compressMin", true ) );
+    options.push_back( CmdOption( "", "--tlsPort", "\t\tHTTPS listening port", "tlsPort", true ) );
+    options.push_back( CmdOption( "", "--tlsCertificate", "\tPEM file with server certificate and intermediates", "tlsCertificate", true ) );
+    options.push_back( CmdOption( "", "--tlsKey", "\t\tPEM file with private key", "tlsKey", true ) );
+    options.push_back( CmdOption( "", "--noHttp2", "\tserve HTTP/1.x only (no ALPN h2 or prior knowledge h2c)", "noHttp2" ) );
+    options.push_back( CmdOption( "", "--queue", "\t\tpool task queue: locked (default), lockfree or stealing (queue per pool thread)", "queue", true ) );
     
     //
     //  parse command line
@@ -168,7 +180,19 @@ int main( int argc, char** argv )
     std::string script;
     unsigned int port = 8080;
     unsigned int connectionThreads = 0;
-    unsigned int poolThreads = 0;
+    int poolThreads = -1;
+    bool reusePort = false;
+    unsigned int acceptBatch = 0;
+    unsigned int bodySpill = 0;
+    unsigned int bodyMax = 0;
+    int cacheSize = -1;
+    int compression = -1;
+    int compressMin = -1;
+    unsigned int tlsPort = 0;
+    std::string tlsCertificate;
+    std::string tlsKey;
+    bool http2 = true;
+    std::string queue;
     
     try
     {
@@ -205,6 +229,76 @@ int main( int argc, char** argv )
                     connectionThreads = atoi( option->value( ) );
                 }
                 
+                if ( option->name( ) == "poolThreads" )
+                {
+                    poolThreads = atoi( option->value( ) );
+                }
+                
+                if ( option->name( ) == "acceptBatch" )
+                {
+                    acceptBatch = atoi( option->value( ) );
+                }
+                
+                if ( option->name( ) == "reusePort" )
+                {
+                    reusePort = true;
+                }
+                
+                if ( option->name( ) == "bodySpill" )
+                {
+                    bodySpill = atoi( option->value( ) );
+                }
+                
+                if ( option->name( ) == "bodyMax" )
+                {
+                    bodyMax = atoi( option->value( ) );
+                }
+                
+                if ( option->name( ) == "cacheSize" )
+                {
+                    cacheSize = atoi( option->value( ) );
+                }
+                
+                if ( option->name( ) == "compression" )
+                {
+                    compression = atoi( option->value( ) );
+                }
+                
+                if ( option->name( ) == "compressMin" )
+                {
+                    compressMin = atoi( option->value( ) );
+                }
+                
+                if ( option->name( ) == "tlsPort" )
+                {
+                    tlsPort = atoi( option->value( ) );
+                }
+                
+                if ( option->name( ) == "tlsCertificate" )
+                {
+                    tlsCertificate = option->value( );
+                }
+                
+                if ( option->name( ) == "tlsKey" )
+                {
+                    tlsKey = option->value( );
+                }
+                
+                if ( option->name( ) == "noHttp2" )
+                {
+                    http2 = false;
+                }
+                
+                if ( option->name( ) == "queue" )
+                {
+                    queue = option->value( );
+                    
+                    if ( queue != "locked" && queue != "lockfree" && queue != "stealing" )
+                    {
+                        throw argv[i];
+                    }
+                }
+                
                 
              }
             else
@@ -228,6 +322,77 @@ int main( int argc, char** argv )
     Breeze* breeze = Breeze::create( port );
     
     breeze->setEnvironment( getenv("BREEZE_ENV") );
+    breeze->setReusePort( reusePort );
+    
+    if ( connectionThreads )
+    {
+        breeze->setConnectionThreads( connectionThreads );
+    }
+    
+    if ( poolThreads >= 0 )
+    {
+        breeze->setPoolThreads( poolThreads );
+    }
+    
+    if ( acceptBatch )
+    {
+        breeze->setAcceptBatchSize( acceptBatch );
+    }
+    
+    if ( bodySpill )
+    {
+        propeller::http::Body::setSpillThreshold( bodySpill );
+    }
+    
+    if ( bodyMax )
+    {
+        propeller::http::Body::setMaxLength( bodyMax );
+    }
+    
+    if ( cacheSize >= 0 )
+    {
+        breeze->setCacheSize( ( size_t ) cacheSize * 1024 * 1024 );
+    }
+    
+    if ( compression >= 0 )
+    {
+        propeller::http::Compression::setLevel( compression );
+    }
+    
+    if ( compressMin >= 0 )
+    {
+        propeller::http::Compression::setMinLength( compressMin );
+    }
+    
+    breeze->setHttp2( http2 );
+    
+    if ( tlsPort )
+    {
+        //
+        //  key may be stored in the certificate file
+        //
+        if ( !tlsCertificate.size() )
+        {
+            printf( "--tlsCertificate is required with --tlsPort \n" );
+            exit( 1 );
+        }
+        
+        if ( !breeze->setTls( tlsPort, tlsCertificate.c_str(), tlsKey.size() ? tlsKey.c_str() : tlsCertificate.c_str() ) )
+        {
+            printf( "Failed to load TLS certificate %s \n", tlsCertificate.c_str() );
+            exit( 1 );
+        }
+    }
+    
+    if ( queue == "lockfree" )
+    {
+        breeze->setQueueType( sys::ThreadPool::LockFreeQueue );
+    }
+    
+    if ( queue == "stealing" )
+    {
+        breeze->setQueueType( sys::ThreadPool::WorkStealingQueue );
+    }
     
     
     //      